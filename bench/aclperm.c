@@ -0,0 +1,67 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- aclperm.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Helper for aclperm.sh. Switches to the given uid and then
+ * calls access() or open()/close() on every file named, "loops"
+ * times over, and prints the average time of one call in ns.
+ *
+ * usage: aclperm uid access|open loops file...
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+main(int argc, char **argv)
+{
+        struct timespec         t0, t1;
+        long long               ns;
+        int                     uid, loops, nfiles, do_open, i, j, fd;
+        int                     errors = 0;
+
+        if (argc < 5) {
+                fprintf(stderr, "usage: aclperm uid access|open loops "
+                        "file...\n");
+                exit(1);
+        }
+        uid = atoi(argv[1]);
+        do_open = !strcmp(argv[2], "open");
+        loops = atoi(argv[3]);
+        nfiles = argc - 4;
+
+        if (setgid(uid) < 0 || setuid(uid) < 0) {
+                perror("aclperm: setuid");
+                exit(1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < loops; i++) {
+                for (j = 4; j < argc; j++) {
+                        if (!do_open) {
+                                if (access(argv[j], R_OK) < 0) {
+                                        errors++;
+                                }
+                                continue;
+                        }
+                        fd = open(argv[j], O_RDONLY);
+                        if (fd < 0) {
+                                errors++;
+                                continue;
+                        }
+                        close(fd);
+                }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+             (t1.tv_nsec - t0.tv_nsec);
+        printf("%lld %d\n", ns / ((long long)loops * nfiles), errors);
+        return 0;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Cost of permission checks on files that carry POSIX ACLs, on a
+# loop-backed uxfs image. Run it as root with the uxfs module
+# loaded and setfacl installed, once per kernel module build you
+# want to compare.
+#
+# usage: bench/aclperm.sh [files] [loops]
+#
+# Three sets of files are made: ones with no ACL, ones whose ACL
+# fits in the inode and ones whose ACL needs an ACL block. The
+# files belong to another user and are checked as uid 1000, so
+# every check goes through the ACL. For each set and for both
+# access() and open() it prints
+#
+#   aclperm kind=<set> op=<call> cache=<cold|warm> ns_per_op=<n> errors=<n>
+#
+# "cold" is a single pass straight after dropping the caches, so
+# it includes reading the inodes back in; "warm" is the average
+# over "loops" further passes.
+
+FILES=${1:-1000}
+LOOPS=${2:-100}
+IMG=${IMG:-/tmp/uxfs-bench.img}
+MNT=${MNT:-/tmp/uxfs-bench.mnt}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+HELPER=$(mktemp /tmp/aclperm.XXXXXX)
+
+set -e
+
+cleanup() {
+        umount "$MNT" 2>/dev/null || true
+        rmdir "$MNT" 2>/dev/null || true
+        rm -f "$IMG" "$HELPER"
+}
+trap cleanup EXIT
+
+cc -O2 -o "$HELPER" "$TOP"/bench/aclperm.c
+
+dd if=/dev/zero of="$IMG" bs=1M count=64 2>/dev/null
+"$TOP"/cmds/mkfs "$IMG" >/dev/null
+mkdir -p "$MNT"
+mount -o loop -t uxfs "$IMG" "$MNT"
+
+for kind in none inline block; do
+        mkdir "$MNT"/$kind
+        i=0
+        while [ "$i" -lt "$FILES" ]; do
+                : > "$MNT"/$kind/f$i
+                i=$((i + 1))
+        done
+        chown -R 2000:2000 "$MNT"/$kind
+        chmod 755 "$MNT"/$kind
+        chmod 644 "$MNT"/$kind/*
+done
+setfacl -m u:1000:r "$MNT"/inline/*
+setfacl -m u:1000:r,u:1001:r,u:1002:rw,g:1003:r "$MNT"/block/*
+sync
+
+for kind in none inline block; do
+        for op in access open; do
+                echo 3 > /proc/sys/vm/drop_caches
+                set -- $("$HELPER" 1000 $op 1 "$MNT"/$kind/*)
+                echo "aclperm kind=$kind op=$op cache=cold" \
+                     "ns_per_op=$1 errors=$2"
+                set -- $("$HELPER" 1000 $op "$LOOPS" "$MNT"/$kind/*)
+                echo "aclperm kind=$kind op=$op cache=warm" \
+                     "ns_per_op=$1 errors=$2"
+        done
+done
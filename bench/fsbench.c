@@ -0,0 +1,380 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- fsbench.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Workload driver for run.sh. Runs one workload in directory
+ * "dir", timing every operation on its own, and prints
+ *
+ *   fsbench workload=<w> ops=<n> ops_per_s=<n> mb_per_s=<n>
+ *           p50_ns=<n> p99_ns=<n> errors=<n>
+ *
+ * on one line. mb_per_s is 0 for workloads that move no data.
+ * Random choices come from a fixed seed, so two runs do the
+ * same operations in the same order.
+ *
+ * usage: fsbench [-n count] [-s file-MB] [-u uid] workload dir
+ *
+ *   create      create "count" empty files f0, f1, ...
+ *   unlink      unlink them again
+ *   lookup      stat() existing names in random order
+ *   lookup-miss stat() names that do not exist
+ *   readdir     read the whole directory, "count" times
+ *   seqwrite    write a file of "file-MB" in 4K writes
+ *   seqread     read it back in 4K reads
+ *   randwrite   "count" 4K writes at random aligned offsets
+ *   randread    "count" 4K reads at random aligned offsets
+ *   append      "count" 4K appends to a new file, each fsync'd
+ *   perm        access(R_OK) on every file in the directory,
+ *               "count" times over, as "uid" if given
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IOSIZE  4096
+
+static long long        *lat;
+static long             nlat, maxlat;
+static long             errors;
+static long long        bytes;
+static unsigned long    seed = 0x9e3779b9;
+
+static long long
+now(void)
+{
+        struct timespec         ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long
+rnd(void)
+{
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+}
+
+/*
+ * Record the latency of one operation started at "t0", and
+ * whether it failed.
+ */
+
+static void
+done(long long t0, int failed)
+{
+        long long               t = now() - t0;
+
+        if (nlat == maxlat) {
+                maxlat = maxlat ? maxlat * 2 : 4096;
+                lat = realloc(lat, maxlat * sizeof(long long));
+                if (!lat) {
+                        fprintf(stderr, "fsbench: Out of memory\n");
+                        exit(1);
+                }
+        }
+        lat[nlat++] = t;
+        if (failed) {
+                errors++;
+        }
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+        long long               x = *(const long long *)a;
+        long long               y = *(const long long *)b;
+
+        return (x > y) - (x < y);
+}
+
+static long long
+pct(int p)
+{
+        long                    i = nlat * p / 100;
+
+        return nlat ? lat[i < nlat ? i : nlat - 1] : 0;
+}
+
+static void
+name(char *buf, const char *dir, const char *prefix, long i)
+{
+        sprintf(buf, "%s/%s%ld", dir, prefix, i);
+}
+
+static void
+create(const char *dir, long count)
+{
+        char                    path[4096];
+        long long               t0;
+        long                    i;
+        int                     fd;
+
+        for (i = 0; i < count; i++) {
+                name(path, dir, "f", i);
+                t0 = now();
+                fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                done(t0, fd < 0);
+        }
+}
+
+static void
+unlink_all(const char *dir, long count)
+{
+        char                    path[4096];
+        long long               t0;
+        long                    i;
+        int                     error;
+
+        for (i = 0; i < count; i++) {
+                name(path, dir, "f", i);
+                t0 = now();
+                error = unlink(path);
+                done(t0, error < 0);
+        }
+}
+
+/*
+ * "hit" says whether the names looked up should exist, which
+ * decides whether a failure is an error.
+ */
+
+static void
+lookup(const char *dir, long count, int hit)
+{
+        char                    path[4096];
+        struct stat             st;
+        long long               t0;
+        long                    i;
+        int                     error;
+
+        for (i = 0; i < count; i++) {
+                name(path, dir, hit ? "f" : "missing", rnd() % count);
+                t0 = now();
+                error = stat(path, &st);
+                done(t0, hit ? error < 0 : error == 0);
+        }
+}
+
+static void
+scan(const char *dir, long count)
+{
+        struct dirent           *de;
+        long long               t0;
+        long                    i, n;
+        DIR                     *d;
+
+        for (i = 0; i < count; i++) {
+                t0 = now();
+                d = opendir(dir);
+                n = 0;
+                if (d) {
+                        while ((de = readdir(d)) != NULL) {
+                                n++;
+                        }
+                        closedir(d);
+                }
+                done(t0, !d || n < 2);
+        }
+}
+
+static int
+open_file(const char *dir, const char *file, int flags)
+{
+        char                    path[4096];
+        int                     fd;
+
+        sprintf(path, "%s/%s", dir, file);
+        fd = open(path, flags, 0644);
+        if (fd < 0) {
+                perror(path);
+                exit(1);
+        }
+        return fd;
+}
+
+/*
+ * 4K I/O on "file": "count" operations, sequential from offset
+ * 0 or at random 4K-aligned offsets below "size".
+ */
+
+static void
+io(const char *dir, const char *file, long count, long long size,
+   int write, int random)
+{
+        static char             buf[IOSIZE];
+        long long               t0;
+        ssize_t                 n;
+        off_t                   off;
+        long                    i;
+        int                     fd;
+
+        fd = open_file(dir, file, write ? O_WRONLY | O_CREAT : O_RDONLY);
+        memset(buf, 0x5a, sizeof(buf));
+        for (i = 0; i < count; i++) {
+                off = random ? (off_t)(rnd() % (size / IOSIZE)) * IOSIZE :
+                               (off_t)i * IOSIZE;
+                t0 = now();
+                n = write ? pwrite(fd, buf, IOSIZE, off) :
+                            pread(fd, buf, IOSIZE, off);
+                done(t0, n != IOSIZE);
+                if (n > 0) {
+                        bytes += n;
+                }
+        }
+        if (write && fsync(fd) < 0) {
+                errors++;
+        }
+        close(fd);
+}
+
+static void
+append(const char *dir, long count)
+{
+        static char             buf[IOSIZE];
+        long long               t0;
+        long                    i;
+        int                     fd, failed;
+
+        fd = open_file(dir, "append", O_WRONLY | O_CREAT | O_TRUNC |
+                       O_APPEND);
+        for (i = 0; i < count; i++) {
+                t0 = now();
+                failed = write(fd, buf, IOSIZE) != IOSIZE || fsync(fd) < 0;
+                done(t0, failed);
+                bytes += IOSIZE;
+        }
+        close(fd);
+}
+
+static void
+perm(const char *dir, long count)
+{
+        char                    **names = NULL;
+        struct dirent           *de;
+        long long               t0;
+        long                    i, j, n = 0;
+        DIR                     *d;
+
+        d = opendir(dir);
+        if (!d) {
+                perror(dir);
+                exit(1);
+        }
+        while ((de = readdir(d)) != NULL) {
+                if (de->d_name[0] == '.') {
+                        continue;
+                }
+                names = realloc(names, (n + 1) * sizeof(char *));
+                if (!names) {
+                        fprintf(stderr, "fsbench: Out of memory\n");
+                        exit(1);
+                }
+                names[n] = malloc(strlen(dir) + strlen(de->d_name) + 2);
+                sprintf(names[n++], "%s/%s", dir, de->d_name);
+        }
+        closedir(d);
+
+        for (i = 0; i < count; i++) {
+                for (j = 0; j < n; j++) {
+                        t0 = now();
+                        done(t0, access(names[j], R_OK) < 0);
+                }
+        }
+}
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: fsbench [-n count] [-s file-MB] [-u uid] "
+                "workload dir\n");
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        long long               t0, t1, size;
+        long                    count = 10000, mb = 64;
+        char                    *w, *dir;
+        int                     c, uid = -1;
+
+        while ((c = getopt(argc, argv, "n:s:u:")) != -1) {
+                switch (c) {
+                case 'n':
+                        count = atol(optarg);
+                        break;
+                case 's':
+                        mb = atol(optarg);
+                        break;
+                case 'u':
+                        uid = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (argc - optind != 2 || count <= 0 || mb <= 0) {
+                usage();
+        }
+        w = argv[optind];
+        dir = argv[optind + 1];
+        size = mb * 1024 * 1024;
+
+        if (uid >= 0 && (setgid(uid) < 0 || setuid(uid) < 0)) {
+                perror("fsbench: setuid");
+                exit(1);
+        }
+
+        t0 = now();
+        if (!strcmp(w, "create")) {
+                create(dir, count);
+        } else if (!strcmp(w, "unlink")) {
+                unlink_all(dir, count);
+        } else if (!strcmp(w, "lookup")) {
+                lookup(dir, count, 1);
+        } else if (!strcmp(w, "lookup-miss")) {
+                lookup(dir, count, 0);
+        } else if (!strcmp(w, "readdir")) {
+                scan(dir, count);
+        } else if (!strcmp(w, "seqwrite")) {
+                io(dir, "data", size / IOSIZE, size, 1, 0);
+        } else if (!strcmp(w, "seqread")) {
+                io(dir, "data", size / IOSIZE, size, 0, 0);
+        } else if (!strcmp(w, "randwrite")) {
+                io(dir, "data", count, size, 1, 1);
+        } else if (!strcmp(w, "randread")) {
+                io(dir, "data", count, size, 0, 1);
+        } else if (!strcmp(w, "append")) {
+                append(dir, count);
+        } else if (!strcmp(w, "perm")) {
+                perm(dir, count);
+        } else {
+                usage();
+        }
+        t1 = now();
+        if (t1 == t0) {
+                t1++;
+        }
+
+        qsort(lat, nlat, sizeof(long long), cmp);
+        printf("fsbench workload=%s ops=%ld ops_per_s=%lld mb_per_s=%lld "
+               "p50_ns=%lld p99_ns=%lld errors=%ld\n", w, nlat,
+               nlat * 1000000000LL / (t1 - t0),
+               bytes * 1000000000LL / (t1 - t0) / (1024 * 1024),
+               pct(50), pct(99), errors);
+        return 0;
+}
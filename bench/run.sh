@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# The fixed benchmark set behind "make bench". Makes a fresh
+# loop-backed uxfs image with cmds/mkfs, mounts it and runs each
+# fsbench workload in turn. Run it as root with the uxfs module
+# loaded and setfacl installed, once per build you want to
+# compare. With MOUNT=fuse the image is served by uxfs-fuse
+# instead of the kernel module.
+#
+# usage: bench/run.sh [files] [file-MB]
+#
+# Every workload prints one line of the form
+#
+#   fsbench workload=<w> ops=<n> ops_per_s=<n> mb_per_s=<n> p50_ns=<n> p99_ns=<n> errors=<n>
+#
+# with "cache=cold" appended for workloads run straight after
+# dropping the caches. The set is
+#
+#   create, lookup, lookup-miss, readdir, unlink
+#               "files" files in one directory
+#   seqwrite, seqread, randwrite, randread
+#               4K I/O on one file of "file-MB"
+#   append      4K appends each followed by fsync
+#   perm        access() through inline and block ACLs
+#
+# readdir reads the full directory 100 times and perm checks
+# every file 10 times over.
+
+FILES=${1:-10000}
+SIZE=${2:-256}
+IMG=${IMG:-/tmp/uxfs-bench.img}
+MNT=${MNT:-/tmp/uxfs-bench.mnt}
+MOUNT=${MOUNT:-kernel}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+FSBENCH=$(mktemp /tmp/fsbench.XXXXXX)
+
+set -e
+
+cleanup() {
+        umount "$MNT" 2>/dev/null || true
+        rmdir "$MNT" 2>/dev/null || true
+        rm -f "$IMG" "$FSBENCH"
+}
+trap cleanup EXIT
+
+drop() {
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+}
+
+bench() {
+        "$FSBENCH" "$@"
+}
+
+cold() {
+        drop
+        echo "$("$FSBENCH" "$@") cache=cold"
+}
+
+cc -O2 -o "$FSBENCH" "$TOP"/bench/fsbench.c
+
+dd if=/dev/zero of="$IMG" bs=1M count=$((SIZE * 2 + FILES / 64 + 64)) \
+   2>/dev/null
+"$TOP"/cmds/mkfs -N $((FILES * 2 + 1024)) "$IMG" >/dev/null
+mkdir -p "$MNT"
+if [ "$MOUNT" = fuse ]; then
+        "$TOP"/cmds/uxfs-fuse "$IMG" "$MNT"
+else
+        mount -o loop,acl -t uxfs "$IMG" "$MNT"
+fi
+
+mkdir "$MNT"/dir "$MNT"/io "$MNT"/acl
+bench -n "$FILES" create "$MNT"/dir
+cold -n "$FILES" lookup "$MNT"/dir
+bench -n "$FILES" lookup "$MNT"/dir
+bench -n "$FILES" lookup-miss "$MNT"/dir
+cold -n 1 readdir "$MNT"/dir
+bench -n 100 readdir "$MNT"/dir
+bench -n "$FILES" unlink "$MNT"/dir
+
+bench -s "$SIZE" seqwrite "$MNT"/io
+cold -s "$SIZE" seqread "$MNT"/io
+bench -s "$SIZE" -n "$FILES" randwrite "$MNT"/io
+cold -s "$SIZE" -n "$FILES" randread "$MNT"/io
+bench -n $((FILES / 10)) append "$MNT"/io
+
+#
+# Files owned by someone else and checked as uid 1000, so that
+# every check has to go through the ACL: half with an ACL small
+# enough for the inode, half with one that needs an ACL block.
+#
+
+i=0
+while [ "$i" -lt "$FILES" ]; do
+        : > "$MNT"/acl/f$i
+        i=$((i + 1))
+done
+chown -R 2000:2000 "$MNT"/acl
+chmod 755 "$MNT"/acl
+chmod 600 "$MNT"/acl/*
+i=0
+while [ "$i" -lt "$FILES" ]; do
+        if [ $((i % 2)) -eq 0 ]; then
+                setfacl -m u:1000:r "$MNT"/acl/f$i
+        else
+                setfacl -m u:1000:r,u:1001:r,u:1002:rw,g:1003:r \
+                        "$MNT"/acl/f$i
+        fi
+        i=$((i + 1))
+done
+cold -u 1000 -n 1 perm "$MNT"/acl
+bench -u 1000 -n 10 perm "$MNT"/acl
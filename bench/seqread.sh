@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Sequential read throughput of a single large file on a
+# loop-backed uxfs image. Run it as root with the uxfs module
+# loaded, once per kernel module build you want to compare.
+#
+# usage: bench/seqread.sh [file-MB] [runs]
+#
+# For every run it prints one line:
+#
+#   seqread mb=<file size> run=<n> mb_per_s=<rate> reads=<n> avg_kb=<n>
+#
+# where reads and avg_kb are the number of read requests the
+# loop device saw and their average size.
+
+SIZE=${1:-256}
+RUNS=${2:-3}
+IMG=${IMG:-/tmp/uxfs-bench.img}
+MNT=${MNT:-/tmp/uxfs-bench.mnt}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+
+set -e
+
+cleanup() {
+        umount "$MNT" 2>/dev/null || true
+        rmdir "$MNT" 2>/dev/null || true
+        rm -f "$IMG"
+}
+trap cleanup EXIT
+
+dd if=/dev/zero of="$IMG" bs=1M count=$((SIZE + SIZE / 8 + 16)) 2>/dev/null
+"$TOP"/cmds/mkfs "$IMG" >/dev/null
+mkdir -p "$MNT"
+mount -o loop -t uxfs "$IMG" "$MNT"
+
+LOOP=$(basename "$(findmnt -no SOURCE "$MNT")")
+dd if=/dev/urandom of="$MNT"/seq bs=1M count="$SIZE" conv=fsync 2>/dev/null
+
+run=1
+while [ "$run" -le "$RUNS" ]; do
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+        set -- $(cat /sys/block/"$LOOP"/stat)
+        ios0=$1
+        sect0=$3
+
+        t0=$(date +%s%N)
+        dd if="$MNT"/seq of=/dev/null bs=1M 2>/dev/null
+        t1=$(date +%s%N)
+
+        set -- $(cat /sys/block/"$LOOP"/stat)
+        ios=$(($1 - ios0))
+        kb=$((($3 - sect0) / 2))
+        [ "$ios" -gt 0 ] || ios=1
+
+        echo "seqread mb=$SIZE run=$run" \
+             "mb_per_s=$((SIZE * 1000000000 / (t1 - t0)))" \
+             "reads=$ios avg_kb=$((kb / ios))"
+        run=$((run + 1))
+done
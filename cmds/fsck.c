@@ -0,0 +1,1757 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- fsck.c --------------------------*/
+/*--------------------------------------------------------------*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kern/ux_fs.h"
+
+/*
+ * fsck.uxfs checks an unmounted filesystem and rebuilds its
+ * allocation state. The whole device is mapped, so the inode
+ * table and directories are read straight from the page cache
+ * with no copying. The work is done in passes:
+ *
+ *   1. Every inode is read, in parallel chunks of the inode
+ *      table. Its extents are checked and its blocks claimed
+ *      in a new block bitmap; a block claimed twice is noted.
+ *   2. Every directory is read, in parallel. Entries naming
+ *      free inodes are removed and the rest counted, giving
+ *      each inode's link count and each directory's parent.
+ *   3. Inodes that look valid but are not in the inode bitmap
+ *      are kept if a directory names them, unless they lie in
+ *      the part of the table that mkfs -L left unwritten. Then
+ *      ACL blocks are checked, shared blocks are copied,
+ *      detached directories and unreferenced inodes are moved
+ *      to lost+found and link counts, ".." entries, both bitmaps
+ *      and the free counts are rewritten.
+ *
+ * With -n the mapping is private, so every repair is made in
+ * memory only and nothing is written back.
+ */
+
+#define FSCK_OK         0
+#define FSCK_FIXED      1
+#define FSCK_UNFIXED    4
+#define FSCK_ERROR      8
+
+#define MAX_THREADS     64
+#define CHUNK_BLOCKS    64      /* inode table blocks per work item */
+
+#define JBD2_MAGIC 0xc03b3998
+
+/*
+ * Per-inode state built up by the passes.
+ */
+
+#define F_FILE          0x1     /* regular file */
+#define F_DIR           0x2     /* directory */
+#define F_UNMARKED      0x4     /* looks valid but is not in the bitmap */
+
+#define KEPT(ino)       ((flags[ino] & (F_FILE | F_DIR)) && \
+                         !(flags[ino] & F_UNMARKED))
+
+struct ux_superblock       *sb;
+char                       *image;         /* the device, mapped */
+size_t                     image_size;
+int                        bsize;
+int                        nthreads;
+int                        repair = 1;
+
+unsigned char              *imap;          /* on-disk bitmaps */
+unsigned char              *bmap;
+unsigned char              *claimed;       /* rebuilt block bitmap */
+unsigned char              *dups;          /* blocks claimed twice */
+unsigned char              *flags;
+__u32                      *refs;          /* entries naming a file */
+__u32                      *parent;        /* entry naming a directory */
+__u32                      *dotdot;        /* what ".." says */
+__u32                      *subdirs;       /* subdirectories of a dir */
+
+unsigned long              next_work;
+unsigned long              nwork;
+unsigned long              ndups;
+unsigned long long         scanned;        /* bytes read */
+unsigned long              nfixed;
+unsigned long              nunfixed;
+pthread_mutex_t            report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Directory entries naming inodes whose fate is decided after
+ * pass 2, and inodes that refer to an ACL block.
+ */
+
+struct pending
+{
+        __u32                   dir;
+        struct ux_dirent        *de;
+};
+
+struct acl_ref
+{
+        __u32                   blk;
+        __u32                   ino;
+};
+
+struct pending             *pending;
+unsigned long              npending, maxpending;
+struct acl_ref             *acl_refs;
+unsigned long              nacl_refs, maxacl_refs;
+pthread_mutex_t            list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: fsck.uxfs [-n] [-j threads] device\n");
+        exit(FSCK_ERROR);
+}
+
+/*
+ * Report a problem. Ones that can be repaired are counted as
+ * fixed unless this is a -n run.
+ */
+
+static void
+problem(int fixable, const char *fmt, ...)
+{
+        va_list                 ap;
+
+        pthread_mutex_lock(&report_lock);
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        if (fixable && repair) {
+                printf(", fixed\n");
+                nfixed++;
+        } else {
+                printf("\n");
+                nunfixed++;
+        }
+        pthread_mutex_unlock(&report_lock);
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+        void                    *p = calloc(n, size);
+
+        if (p == NULL) {
+                fprintf(stderr, "fsck.uxfs: Out of memory\n");
+                exit(FSCK_ERROR);
+        }
+        return p;
+}
+
+/*
+ * Append to one of the growable lists under list_lock.
+ */
+
+static void *
+list_add(void **list, unsigned long *n, unsigned long *max, size_t size)
+{
+        void                    *p;
+
+        if (*n == *max) {
+                *max = *max ? *max * 2 : 64;
+                *list = realloc(*list, *max * size);
+                if (*list == NULL) {
+                        fprintf(stderr, "fsck.uxfs: Out of memory\n");
+                        exit(FSCK_ERROR);
+                }
+        }
+        p = (char *)*list + (*n)++ * size;
+        return p;
+}
+
+/*
+ * Bit n of an on-disk bitmap is bit (n % 8) of byte (n / 8).
+ */
+
+static int
+testbit(unsigned char *map, __u32 n)
+{
+        return (map[n >> 3] >> (n & 7)) & 1;
+}
+
+static void
+setbit(unsigned char *map, __u32 n)
+{
+        map[n >> 3] |= 1 << (n & 7);
+}
+
+static void *
+block_ptr(__u32 blk)
+{
+        return image + (size_t)blk * bsize;
+}
+
+static struct ux_inode *
+inode_ptr(__u32 ino)
+{
+        int                     ipb = UX_INODES_PER_BLOCK(bsize);
+
+        return (struct ux_inode *)((char *)block_ptr(sb->s_itable_start +
+                                                     ino / ipb) +
+                                   (ino % ipb) * UX_INODE_SIZE);
+}
+
+static int
+data_block(__u32 blk)
+{
+        return blk >= sb->s_data_start &&
+               blk - sb->s_data_start < sb->s_nblocks;
+}
+
+/*
+ * Claim a data block for an inode. Passes 1 and 2 run in
+ * parallel, so the bitmaps are updated atomically.
+ */
+
+static void
+claim(__u32 blk)
+{
+        __u32                   n = blk - sb->s_data_start;
+        unsigned char           bit = 1 << (n & 7);
+
+        if (__atomic_fetch_or(&claimed[n >> 3], bit, __ATOMIC_RELAXED) &
+            bit) {
+                __atomic_fetch_or(&dups[n >> 3], bit, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&ndups, 1, __ATOMIC_RELAXED);
+        }
+}
+
+static int
+claimed_block(__u32 blk)
+{
+        return testbit(claimed, blk - sb->s_data_start);
+}
+
+/*
+ * The extents of an inode in order, gathered from the inode or
+ * from its extent tree, and the blocks of the tree.
+ */
+
+struct extent_list
+{
+        struct ux_extent        *ex;
+        unsigned long           n, max;
+        __u32                   *nodes;
+        unsigned long           nnodes, maxnodes;
+};
+
+static void
+free_extents(struct extent_list *el)
+{
+        free(el->ex);
+        free(el->nodes);
+}
+
+static int
+extent_ok(struct ux_extent *e, __u64 lo, __u64 hi)
+{
+        return e->e_len != 0 && data_block(e->e_pblk) &&
+               data_block(e->e_pblk + e->e_len - 1) &&
+               e->e_pblk + e->e_len > e->e_pblk &&
+               e->e_lblk >= lo && e->e_lblk + (__u64)e->e_len <= hi;
+}
+
+static int
+extent_block_ok(__u32 blk, int depth)
+{
+        struct ux_extent_header *eh;
+        int                     max;
+
+        if (!data_block(blk)) {
+                return 0;
+        }
+        eh = block_ptr(blk);
+        max = eh->eh_depth ? UX_EXTENT_IDX_PER_BLOCK(bsize) :
+                             UX_EXTENTS_PER_BLOCK(bsize);
+        return eh->eh_magic == UX_EXTENT_MAGIC &&
+               eh->eh_depth <= UX_EXTENT_MAX_DEPTH &&
+               eh->eh_entries <= max &&
+               (depth < 0 || (eh->eh_depth == depth && eh->eh_entries)) &&
+               (eh->eh_entries || !eh->eh_depth);
+}
+
+/*
+ * Gather the extents under extent block "blk". They must start
+ * at or after *lo, which is moved past each one, and end by
+ * "hi". At the first bad extent or block, this block and every
+ * one above it are cut short, which truncates the file; 1 is
+ * returned if that happened.
+ */
+
+static int
+walk_extents(__u32 ino, __u32 blk, struct extent_list *el, __u64 *lo,
+             __u64 hi)
+{
+        struct ux_extent_header *eh = block_ptr(blk);
+        struct ux_extent        *ex = (struct ux_extent *)(eh + 1);
+        struct ux_extent_idx    *ei = (struct ux_extent_idx *)(eh + 1);
+        __u64                   next;
+        int                     j;
+
+        for (j = 0; j < eh->eh_entries; j++) {
+                if (eh->eh_depth == 0) {
+                        if (!extent_ok(&ex[j], *lo, hi)) {
+                                problem(1, "inode %u: bad extent (lblk %u "
+                                        "pblk %u len %u), truncated", ino,
+                                        ex[j].e_lblk, ex[j].e_pblk,
+                                        ex[j].e_len);
+                                eh->eh_entries = j;
+                                return 1;
+                        }
+                        *(struct ux_extent *)list_add((void **)&el->ex,
+                                &el->n, &el->max,
+                                sizeof(struct ux_extent)) = ex[j];
+                        *lo = ex[j].e_lblk + (__u64)ex[j].e_len;
+                        continue;
+                }
+
+                next = (j + 1 < eh->eh_entries) ? ei[j + 1].ei_lblk : hi;
+                if (!extent_block_ok(ei[j].ei_blk, eh->eh_depth - 1) ||
+                    next > hi || (j > 0 && (ei[j].ei_lblk < *lo ||
+                                            ei[j].ei_lblk >= next))) {
+                        problem(1, "inode %u: bad extent block %u, "
+                                "truncated", ino, ei[j].ei_blk);
+                        eh->eh_entries = j;
+                        return 1;
+                }
+                if (j > 0) {
+                        *lo = ei[j].ei_lblk;
+                }
+                if (walk_extents(ino, ei[j].ei_blk, el, lo, next)) {
+                        eh->eh_entries = j;
+                        if (((struct ux_extent_header *)
+                             block_ptr(ei[j].ei_blk))->eh_entries) {
+                                eh->eh_entries++;
+                                *(__u32 *)list_add((void **)&el->nodes,
+                                        &el->nnodes, &el->maxnodes,
+                                        sizeof(__u32)) = ei[j].ei_blk;
+                        }
+                        return 1;
+                }
+                *(__u32 *)list_add((void **)&el->nodes, &el->nnodes,
+                                   &el->maxnodes, sizeof(__u32)) =
+                        ei[j].ei_blk;
+        }
+        return 0;
+}
+
+/*
+ * Gather the extents of inode "ino", truncating it at the
+ * first bad one. The caller frees the list.
+ */
+
+static void
+inode_extents(__u32 ino, struct ux_inode *uip, struct extent_list *el)
+{
+        struct ux_extent_header *eh;
+        __u64                   lo = 0;
+        __u32                   i, n;
+
+        memset(el, 0, sizeof(struct extent_list));
+        if (uip->i_extent_blk && !extent_block_ok(uip->i_extent_blk, -1)) {
+                problem(1, "inode %u: bad extent block %u, blocks dropped",
+                        ino, uip->i_extent_blk);
+                uip->i_extent_blk = 0;
+                uip->i_nextents = 0;
+                memset(uip->i_extents, 0, sizeof(uip->i_extents));
+        }
+
+        if (uip->i_extent_blk) {
+                eh = block_ptr(uip->i_extent_blk);
+                walk_extents(ino, uip->i_extent_blk, el, &lo, 1ULL << 32);
+                if (eh->eh_entries == 0) {
+                        eh->eh_depth = 0;
+                }
+                *(__u32 *)list_add((void **)&el->nodes, &el->nnodes,
+                                   &el->maxnodes, sizeof(__u32)) =
+                        uip->i_extent_blk;
+                if (uip->i_nextents != el->n) {
+                        problem(1, "inode %u: i_nextents is %u, should "
+                                "be %lu", ino, uip->i_nextents, el->n);
+                        uip->i_nextents = el->n;
+                }
+                return;
+        }
+
+        n = uip->i_nextents;
+        if (n > UX_INLINE_EXTENTS) {
+                problem(1, "inode %u: %u extents, only room for %d",
+                        ino, n, UX_INLINE_EXTENTS);
+                n = UX_INLINE_EXTENTS;
+        }
+        for (i = 0; i < n; i++) {
+                if (!extent_ok(&uip->i_extents[i], lo, 1ULL << 32)) {
+                        problem(1, "inode %u: bad extent %u (lblk %u "
+                                "pblk %u len %u), truncated", ino, i,
+                                uip->i_extents[i].e_lblk,
+                                uip->i_extents[i].e_pblk,
+                                uip->i_extents[i].e_len);
+                        break;
+                }
+                *(struct ux_extent *)list_add((void **)&el->ex, &el->n,
+                        &el->max, sizeof(struct ux_extent)) =
+                        uip->i_extents[i];
+                lo = uip->i_extents[i].e_lblk +
+                     (__u64)uip->i_extents[i].e_len;
+        }
+        uip->i_nextents = el->n;
+}
+
+/*
+ * Check the extents of inode "ino", truncating at the first bad
+ * one, and claim its blocks. With "trial" set nothing is claimed
+ * unless every block is still free, and -1 is returned if one
+ * is not. A directory left with no blocks cannot be kept.
+ */
+
+static int
+check_blocks(__u32 ino, struct ux_inode *uip, int trial)
+{
+        struct extent_list      el;
+        struct ux_extent        *ex;
+        __u32                   count = 0, j;
+        unsigned long           i;
+
+        inode_extents(ino, uip, &el);
+        ex = el.ex;
+        __atomic_fetch_add(&scanned, (unsigned long long)el.nnodes * bsize,
+                           __ATOMIC_RELAXED);
+
+        if (trial) {
+                for (i = 0; i < el.nnodes; i++) {
+                        if (claimed_block(el.nodes[i])) {
+                                free_extents(&el);
+                                return -1;
+                        }
+                }
+                for (i = 0; i < el.n; i++) {
+                        for (j = 0; j < ex[i].e_len; j++) {
+                                if (claimed_block(ex[i].e_pblk + j)) {
+                                        free_extents(&el);
+                                        return -1;
+                                }
+                        }
+                }
+        }
+
+        for (i = 0; i < el.nnodes; i++) {
+                claim(el.nodes[i]);
+        }
+        for (i = 0; i < el.n; i++) {
+                for (j = 0; j < ex[i].e_len; j++) {
+                        claim(ex[i].e_pblk + j);
+                }
+                count += ex[i].e_len;
+        }
+        free_extents(&el);
+
+        if (uip->i_blocks != count) {
+                problem(1, "inode %u: i_blocks is %u, should be %u",
+                        ino, uip->i_blocks, count);
+                uip->i_blocks = count;
+        }
+        if (S_ISDIR(uip->i_mode)) {
+                if (count == 0) {
+                        return -1;
+                }
+                if (uip->i_size != count * bsize) {
+                        problem(1, "directory %u: i_size is %u, should "
+                                "be %u", ino, uip->i_size, count * bsize);
+                        uip->i_size = count * bsize;
+                }
+        }
+
+        if (uip->i_acl_blk) {
+                struct acl_ref  *r;
+
+                pthread_mutex_lock(&list_lock);
+                r = list_add((void **)&acl_refs, &nacl_refs, &maxacl_refs,
+                             sizeof(struct acl_ref));
+                r->blk = uip->i_acl_blk;
+                r->ino = ino;
+                pthread_mutex_unlock(&list_lock);
+        }
+        return 0;
+}
+
+/*
+ * Pass 1: classify one inode and claim its blocks.
+ */
+
+static void
+check_inode(__u32 ino)
+{
+        struct ux_inode         *uip = inode_ptr(ino);
+        int                     marked = testbit(imap, ino);
+        int                     type = 0;
+
+        if (uip->i_nlink > 0) {
+                if (S_ISDIR(uip->i_mode)) {
+                        type = F_DIR;
+                } else if (S_ISREG(uip->i_mode)) {
+                        type = F_FILE;
+                }
+        }
+
+        if (!type) {
+                if (marked) {
+                        problem(1, "inode %u: marked in use but free "
+                                "(mode 0%o, %u links)", ino,
+                                uip->i_mode, uip->i_nlink);
+                }
+                return;
+        }
+        if (!marked) {
+                /*
+                 * Slots past the lazy init mark may hold
+                 * anything mkfs found on the device.
+                 */
+
+                if (sb->s_itable_lazy && ino / UX_INODES_PER_BLOCK(bsize) >=
+                    sb->s_itable_lazy) {
+                        return;
+                }
+                flags[ino] = type | F_UNMARKED;
+                return;
+        }
+        if (check_blocks(ino, uip, 0) < 0) {
+                problem(1, "directory %u: no blocks, cleared", ino);
+                return;
+        }
+        flags[ino] = type;
+}
+
+static void *
+inode_worker(void *arg)
+{
+        int                     ipb = UX_INODES_PER_BLOCK(bsize);
+        unsigned long           w;
+        __u32                   ino, first, last;
+
+        while ((w = __atomic_fetch_add(&next_work, 1,
+                                       __ATOMIC_RELAXED)) < nwork) {
+                first = w * CHUNK_BLOCKS * ipb;
+                last = first + CHUNK_BLOCKS * ipb;
+                if (last > sb->s_ninodes || last < first) {
+                        last = sb->s_ninodes;
+                }
+                __atomic_fetch_add(&scanned, (unsigned long long)
+                                   (last - first) * UX_INODE_SIZE,
+                                   __ATOMIC_RELAXED);
+                if (first < UX_ROOT_INO) {
+                        first = UX_ROOT_INO;
+                }
+                for (ino = first; ino < last; ino++) {
+                        check_inode(ino);
+                }
+        }
+        return arg;
+}
+
+static void
+clear_entry(struct ux_dirent *de)
+{
+        memset(de, 0, sizeof(struct ux_dirent));
+}
+
+/*
+ * Count a directory entry that names a kept inode.
+ */
+
+static void
+accept_entry(__u32 dir, struct ux_dirent *de)
+{
+        __u32                   ino = de->d_ino;
+        __u32                   zero = 0;
+        int                     dt;
+
+        dt = (flags[ino] & F_DIR) ? UX_DT(S_IFDIR) : UX_DT(S_IFREG);
+        if (de->d_type != dt) {
+                problem(1, "directory %u: entry \"%s\" has type %d, "
+                        "should be %d", dir, de->d_name, de->d_type, dt);
+                de->d_type = dt;
+        }
+
+        if (!(flags[ino] & F_DIR)) {
+                __atomic_fetch_add(&refs[ino], 1, __ATOMIC_RELAXED);
+                return;
+        }
+        if (ino == UX_ROOT_INO ||
+            !__atomic_compare_exchange_n(&parent[ino], &zero, dir, 0,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+                problem(1, "directory %u: extra link \"%s\" to directory "
+                        "%u removed", dir, de->d_name, ino);
+                clear_entry(de);
+                return;
+        }
+        subdirs[dir]++;
+}
+
+static void
+check_entry(__u32 dir, struct ux_dirent *de)
+{
+        struct pending          *p;
+        __u32                   ino = de->d_ino;
+
+        if (ino == 0) {
+                return;
+        }
+        if (memchr(de->d_name, 0, UX_NAMELEN + 1) == NULL) {
+                problem(1, "directory %u: entry for inode %u has an "
+                        "unterminated name", dir, ino);
+                de->d_name[UX_NAMELEN] = '\0';
+        }
+        if (!strcmp(de->d_name, ".")) {
+                if (ino != dir) {
+                        problem(1, "directory %u: \".\" names inode %u",
+                                dir, ino);
+                        de->d_ino = dir;
+                }
+                return;
+        }
+        if (!strcmp(de->d_name, "..")) {
+                dotdot[dir] = ino;
+                return;
+        }
+
+        if (ino < UX_ROOT_INO || ino >= sb->s_ninodes ||
+            !(flags[ino] & (F_FILE | F_DIR))) {
+                problem(1, "directory %u: entry \"%s\" names free inode "
+                        "%u, removed", dir, de->d_name, ino);
+                clear_entry(de);
+                return;
+        }
+        if (flags[ino] & F_UNMARKED) {
+                pthread_mutex_lock(&list_lock);
+                p = list_add((void **)&pending, &npending, &maxpending,
+                             sizeof(struct pending));
+                p->dir = dir;
+                p->de = de;
+                pthread_mutex_unlock(&list_lock);
+                return;
+        }
+        accept_entry(dir, de);
+}
+
+/*
+ * Return block "lblk" of the directory whose extents are "el",
+ * or NULL if it has none.
+ */
+
+static void *
+dir_block(struct extent_list *el, __u32 lblk)
+{
+        unsigned long           i;
+
+        for (i = 0; i < el->n; i++) {
+                if (lblk >= el->ex[i].e_lblk &&
+                    lblk - el->ex[i].e_lblk < el->ex[i].e_len) {
+                        return block_ptr(el->ex[i].e_pblk +
+                                         (lblk - el->ex[i].e_lblk));
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Check "count" index entries found "level" levels below the root
+ * of an index "levels" deep. They must be in hash order and name
+ * blocks the directory has: index nodes above the last level and
+ * leaves at it.
+ */
+
+static int
+check_index_entries(__u32 dir, struct extent_list *el,
+                    struct ux_dx_entry *entries, __u32 count, int level,
+                    int levels)
+{
+        struct ux_dx_node       *node;
+        __u32                   k, lblk;
+        void                    *b;
+
+        for (k = 0; k < count; k++) {
+                lblk = entries[k].de_lblk;
+                if (k > 0 && entries[k].de_hash <= entries[k - 1].de_hash) {
+                        problem(0, "directory %u: index entries out of "
+                                "order at level %d", dir, level);
+                        return -1;
+                }
+                b = (lblk == 0) ? NULL : dir_block(el, lblk);
+                if (!b) {
+                        problem(0, "directory %u: index names block %u, "
+                                "which it does not have", dir, lblk);
+                        return -1;
+                }
+                if (level == levels) {
+                        if (ux_dx_is_node(b)) {
+                                problem(0, "directory %u: index names node "
+                                        "%u as a leaf", dir, lblk);
+                                return -1;
+                        }
+                        continue;
+                }
+                node = b;
+                if (!ux_dx_is_node(node) || node->dn_count == 0 ||
+                    node->dn_count > UX_DX_NODE_LIMIT(bsize)) {
+                        problem(0, "directory %u: bad index node %u",
+                                dir, lblk);
+                        return -1;
+                }
+                if (check_index_entries(dir, el, node->dn_entries,
+                                        node->dn_count, level + 1,
+                                        levels) < 0) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/*
+ * The root block of an indexed directory, and the index nodes
+ * below it, must name leaves that the directory has.
+ */
+
+static void
+check_index(__u32 dir, struct extent_list *el, struct ux_dx_root *root)
+{
+        if (root->dr_magic != UX_DX_MAGIC || root->dr_count == 0 ||
+            root->dr_count > UX_DX_LIMIT(bsize) ||
+            root->dr_levels > UX_DX_MAX_LEVELS) {
+                problem(0, "directory %u: bad index root", dir);
+                return;
+        }
+        check_index_entries(dir, el, root->dr_entries, root->dr_count, 0,
+                            root->dr_levels);
+}
+
+/*
+ * Pass 2: check every entry of directory "dir". Only the thread
+ * handling a directory changes its blocks.
+ */
+
+static void
+check_dir(__u32 dir)
+{
+        struct ux_inode         *uip = inode_ptr(dir);
+        struct extent_list      el;
+        struct ux_extent        *ex;
+        struct ux_dirent        *de;
+        unsigned long           i;
+        __u32                   j, k, lblk, nslots;
+
+        inode_extents(dir, uip, &el);
+        ex = el.ex;
+        for (i = 0; i < el.n; i++) {
+                for (j = 0; j < ex[i].e_len; j++) {
+                        de = block_ptr(ex[i].e_pblk + j);
+                        lblk = ex[i].e_lblk + j;
+                        if ((uip->i_flags & UX_INDEX_FL) && lblk == 0) {
+                                check_index(dir, &el,
+                                            (struct ux_dx_root *)de);
+                        }
+                        nslots = ux_dir_nslots(de, lblk, uip->i_flags,
+                                               bsize);
+                        for (k = 0; k < nslots; k++) {
+                                check_entry(dir, &de[k]);
+                        }
+                }
+        }
+        free_extents(&el);
+        __atomic_fetch_add(&scanned,
+                           (unsigned long long)uip->i_blocks * bsize,
+                           __ATOMIC_RELAXED);
+}
+
+static void *
+dir_worker(void *arg)
+{
+        int                     ipb = UX_INODES_PER_BLOCK(bsize);
+        unsigned long           w;
+        __u32                   ino, first, last;
+
+        while ((w = __atomic_fetch_add(&next_work, 1,
+                                       __ATOMIC_RELAXED)) < nwork) {
+                first = w * CHUNK_BLOCKS * ipb;
+                last = first + CHUNK_BLOCKS * ipb;
+                if (last > sb->s_ninodes || last < first) {
+                        last = sb->s_ninodes;
+                }
+                for (ino = first; ino < last; ino++) {
+                        if (flags[ino] == F_DIR) {
+                                check_dir(ino);
+                        }
+                }
+        }
+        return arg;
+}
+
+/*
+ * Run "fn" on every thread until the work items run out.
+ */
+
+static void
+run_pass(void *(*fn)(void *), unsigned long items)
+{
+        pthread_t               tid[MAX_THREADS];
+        int                     i;
+
+        next_work = 0;
+        nwork = items;
+        for (i = 0; i < nthreads; i++) {
+                if (pthread_create(&tid[i], NULL, fn, NULL) != 0) {
+                        fprintf(stderr, "fsck.uxfs: Cannot create "
+                                "thread\n");
+                        exit(FSCK_ERROR);
+                }
+        }
+        for (i = 0; i < nthreads; i++) {
+                pthread_join(tid[i], NULL);
+        }
+}
+
+/*
+ * Pass 3a: entries naming inodes that are not in the bitmap.
+ * An inode that still looks whole and whose blocks are all
+ * free is taken back, and if it is a directory its own entries
+ * are checked in turn. Otherwise the entry goes.
+ */
+
+static void
+resolve_pending(void)
+{
+        struct pending          p;
+        __u32                   ino;
+
+        while (npending) {
+                p = pending[--npending];
+                ino = p.de->d_ino;
+                if (ino == 0) {
+                        continue;
+                }
+                if (flags[ino] & F_UNMARKED) {
+                        if (check_blocks(ino, inode_ptr(ino), 1) < 0) {
+                                flags[ino] = 0;
+                        } else {
+                                problem(1, "inode %u: in use but not "
+                                        "marked in the bitmap", ino);
+                                flags[ino] &= ~F_UNMARKED;
+                                if (flags[ino] & F_DIR) {
+                                        check_dir(ino);
+                                }
+                        }
+                }
+                if (!flags[ino]) {
+                        problem(1, "directory %u: entry \"%s\" names free "
+                                "inode %u, removed", p.dir, p.de->d_name,
+                                ino);
+                        clear_entry(p.de);
+                        continue;
+                }
+                accept_entry(p.dir, p.de);
+        }
+        for (ino = 0; ino < sb->s_ninodes; ino++) {
+                if (flags[ino] & F_UNMARKED) {
+                        flags[ino] = 0;
+                }
+        }
+}
+
+static int
+acl_ref_cmp(const void *a, const void *b)
+{
+        const struct acl_ref    *x = a, *y = b;
+
+        if (x->blk != y->blk) {
+                return x->blk < y->blk ? -1 : 1;
+        }
+        return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Pass 3b: shared ACL blocks. Each must be a valid ACL block no
+ * inode uses for data, and its reference count must match the
+ * number of inodes naming it.
+ */
+
+static void
+check_acls(void)
+{
+        struct ux_acl_block     *ab;
+        unsigned long           i, j, k;
+        __u32                   blk, count;
+        int                     ok;
+
+        qsort(acl_refs, nacl_refs, sizeof(struct acl_ref), acl_ref_cmp);
+        for (i = 0; i < nacl_refs; i = j) {
+                blk = acl_refs[i].blk;
+                count = 0;
+                for (j = i; j < nacl_refs && acl_refs[j].blk == blk; j++) {
+                        if (KEPT(acl_refs[j].ino)) {
+                                count++;
+                        }
+                }
+                if (count == 0) {
+                        continue;
+                }
+
+                ab = data_block(blk) ? block_ptr(blk) : NULL;
+                ok = ab && !claimed_block(blk) &&
+                     ab->ab_magic == UX_ACL_MAGIC &&
+                     ab->ab_size <= UX_ACL_MAX_RECORD(bsize);
+                if (!ok) {
+                        for (k = i; k < j; k++) {
+                                if (!KEPT(acl_refs[k].ino)) {
+                                        continue;
+                                }
+                                problem(1, "inode %u: bad ACL block %u, "
+                                        "ACLs dropped", acl_refs[k].ino,
+                                        blk);
+                                inode_ptr(acl_refs[k].ino)->i_acl_blk = 0;
+                        }
+                        continue;
+                }
+
+                claim(blk);
+                __atomic_fetch_add(&scanned, bsize, __ATOMIC_RELAXED);
+                if (ab->ab_refcount != count) {
+                        problem(1, "ACL block %u: %u references, should "
+                                "be %u", blk, ab->ab_refcount, count);
+                        ab->ab_refcount = count;
+                }
+        }
+}
+
+/*
+ * Take the first run of "len" free data blocks.
+ */
+
+static __u32
+alloc_run(__u32 len)
+{
+        static __u32            hint;
+        __u32                   n, run = 0;
+
+        for (n = hint; n < sb->s_nblocks; n++) {
+                if (testbit(claimed, n)) {
+                        run = 0;
+                        continue;
+                }
+                if (++run < len) {
+                        continue;
+                }
+                for (n = n + 1 - len; run; run--, n++) {
+                        setbit(claimed, n);
+                }
+                if (len == 1) {
+                        hint = n;
+                }
+                return sb->s_data_start + n - len;
+        }
+        return 0;
+}
+
+static __u32
+alloc_block(void)
+{
+        __u32                   blk = alloc_run(1);
+
+        if (blk) {
+                memset(block_ptr(blk), 0, bsize);
+        }
+        return blk;
+}
+
+static int
+dup_block(__u32 blk)
+{
+        return testbit(dups, blk - sb->s_data_start);
+}
+
+/*
+ * Pass 3c: blocks claimed by more than one inode. The first
+ * inode to claim a block keeps it and every later one gets its
+ * own copy of the extent or extent block holding it, so no data
+ * is lost even though some of it is bound to be wrong.
+ */
+
+static void
+own_extents(__u32 ino, struct ux_extent *ex, __u32 nextents,
+            unsigned char *owned)
+{
+        __u32                   i, j, blk, n;
+        int                     shared;
+
+        for (i = 0; i < nextents; i++) {
+                shared = 0;
+                for (j = 0; j < ex[i].e_len; j++) {
+                        n = ex[i].e_pblk + j - sb->s_data_start;
+                        shared |= testbit(dups, n) && testbit(owned, n);
+                }
+                if (!shared) {
+                        for (j = 0; j < ex[i].e_len; j++) {
+                                n = ex[i].e_pblk + j - sb->s_data_start;
+                                if (testbit(dups, n)) {
+                                        setbit(owned, n);
+                                }
+                        }
+                        continue;
+                }
+
+                blk = alloc_run(ex[i].e_len);
+                if (!blk) {
+                        problem(0, "inode %u: blocks %u-%u are shared, "
+                                "no space to copy them", ino, ex[i].e_pblk,
+                                ex[i].e_pblk + ex[i].e_len - 1);
+                        continue;
+                }
+                problem(1, "inode %u: blocks %u-%u are shared, copied "
+                        "to %u", ino, ex[i].e_pblk,
+                        ex[i].e_pblk + ex[i].e_len - 1, blk);
+                for (j = 0; j < ex[i].e_len; j++) {
+                        n = ex[i].e_pblk + j - sb->s_data_start;
+                        memcpy(block_ptr(blk + j),
+                               block_ptr(ex[i].e_pblk + j), bsize);
+                        if (!testbit(dups, n)) {
+                                claimed[n >> 3] &= ~(1 << (n & 7));
+                        }
+                }
+                ex[i].e_pblk = blk;
+        }
+}
+
+/*
+ * The same for the extent block *blkp and everything below it.
+ */
+
+static void
+own_extent_block(__u32 ino, __u32 *blkp, unsigned char *owned)
+{
+        struct ux_extent_header *eh;
+        struct ux_extent_idx    *ei;
+        __u32                   j, blk, n = *blkp - sb->s_data_start;
+
+        if (dup_block(*blkp)) {
+                if (!testbit(owned, n)) {
+                        setbit(owned, n);
+                } else if ((blk = alloc_run(1)) != 0) {
+                        problem(1, "inode %u: extent block %u is shared, "
+                                "copied to %u", ino, *blkp, blk);
+                        memcpy(block_ptr(blk), block_ptr(*blkp), bsize);
+                        *blkp = blk;
+                } else {
+                        problem(0, "inode %u: extent block %u is shared, "
+                                "no space to copy it", ino, *blkp);
+                }
+        }
+
+        eh = block_ptr(*blkp);
+        if (eh->eh_depth == 0) {
+                own_extents(ino, (struct ux_extent *)(eh + 1),
+                            eh->eh_entries, owned);
+                return;
+        }
+        ei = (struct ux_extent_idx *)(eh + 1);
+        for (j = 0; j < eh->eh_entries; j++) {
+                own_extent_block(ino, &ei[j].ei_blk, owned);
+        }
+}
+
+static void
+fix_dups(void)
+{
+        unsigned char           *owned;
+        struct ux_inode         *uip;
+        __u32                   ino;
+
+        owned = xcalloc(sb->s_bmap_blocks, bsize);
+        for (ino = UX_ROOT_INO; ino < sb->s_ninodes; ino++) {
+                if (!KEPT(ino)) {
+                        continue;
+                }
+                uip = inode_ptr(ino);
+                if (uip->i_extent_blk) {
+                        own_extent_block(ino, &uip->i_extent_blk, owned);
+                } else {
+                        own_extents(ino, uip->i_extents, uip->i_nextents,
+                                    owned);
+                }
+        }
+        free(owned);
+}
+
+/*
+ * Add block "pblk" at logical block "lblk", past the end of an
+ * inode. The extents move to an extent block when the inode is
+ * full, and when the last leaf is full a new one is hung off
+ * the right-hand edge of the tree, along with whatever index
+ * blocks it needs.
+ */
+
+static int
+append_extent(struct ux_inode *uip, __u32 lblk, __u32 pblk)
+{
+        struct ux_extent_header *path[UX_EXTENT_MAX_DEPTH + 1], *eh;
+        struct ux_extent_idx    *ei;
+        struct ux_extent        *ex;
+        __u32                   blks[UX_EXTENT_MAX_DEPTH + 1], n;
+        int                     depth, l, k;
+
+        if (!uip->i_extent_blk) {
+                ex = uip->i_extents;
+                n = uip->i_nextents;
+                if (n > 0 && ex[n - 1].e_lblk + ex[n - 1].e_len == lblk &&
+                    ex[n - 1].e_pblk + ex[n - 1].e_len == pblk) {
+                        ex[n - 1].e_len++;
+                        return 0;
+                }
+                if (n < UX_INLINE_EXTENTS) {
+                        ex[n].e_lblk = lblk;
+                        ex[n].e_pblk = pblk;
+                        ex[n].e_len = 1;
+                        uip->i_nextents++;
+                        return 0;
+                }
+                blks[0] = alloc_block();
+                if (!blks[0]) {
+                        return -1;
+                }
+                eh = block_ptr(blks[0]);
+                eh->eh_magic = UX_EXTENT_MAGIC;
+                eh->eh_entries = n;
+                memcpy(eh + 1, ex, n * sizeof(struct ux_extent));
+                memset(uip->i_extents, 0, sizeof(uip->i_extents));
+                uip->i_extent_blk = blks[0];
+        }
+
+        path[0] = block_ptr(uip->i_extent_blk);
+        depth = path[0]->eh_depth;
+        for (l = 0; l < depth; l++) {
+                ei = (struct ux_extent_idx *)(path[l] + 1);
+                path[l + 1] = block_ptr(ei[path[l]->eh_entries - 1].ei_blk);
+        }
+        ex = (struct ux_extent *)(path[depth] + 1);
+        n = path[depth]->eh_entries;
+        if (n > 0 && ex[n - 1].e_lblk + ex[n - 1].e_len == lblk &&
+            ex[n - 1].e_pblk + ex[n - 1].e_len == pblk) {
+                ex[n - 1].e_len++;
+                return 0;
+        }
+        if (n < UX_EXTENTS_PER_BLOCK(bsize)) {
+                ex[n].e_lblk = lblk;
+                ex[n].e_pblk = pblk;
+                ex[n].e_len = 1;
+                path[depth]->eh_entries++;
+                uip->i_nextents++;
+                return 0;
+        }
+
+        for (l = depth - 1; l >= 0; l--) {
+                if (path[l]->eh_entries < UX_EXTENT_IDX_PER_BLOCK(bsize)) {
+                        break;
+                }
+        }
+        if (l < 0) {
+                if (depth == UX_EXTENT_MAX_DEPTH ||
+                    (blks[0] = alloc_block()) == 0) {
+                        return -1;
+                }
+                /*
+                 * Extents and index entries both start with
+                 * their logical block, so ei[0].ei_lblk is
+                 * already the key of the block moved down.
+                 */
+
+                memcpy(block_ptr(blks[0]), path[0], bsize);
+                ei = (struct ux_extent_idx *)(path[0] + 1);
+                ei[0].ei_blk = blks[0];
+                memset(&ei[1], 0, bsize - sizeof(struct ux_extent_header) -
+                       sizeof(struct ux_extent_idx));
+                path[0]->eh_depth++;
+                path[0]->eh_entries = 1;
+                return append_extent(uip, lblk, pblk);
+        }
+
+        for (k = 0; k < depth - l; k++) {
+                blks[k] = alloc_block();
+                if (!blks[k]) {
+                        while (k-- > 0) {
+                                n = blks[k] - sb->s_data_start;
+                                claimed[n >> 3] &= ~(1 << (n & 7));
+                        }
+                        return -1;
+                }
+        }
+        for (k = 0; k < depth - l; k++) {
+                eh = block_ptr(blks[k]);
+                eh->eh_magic = UX_EXTENT_MAGIC;
+                eh->eh_entries = 1;
+                eh->eh_depth = depth - l - 1 - k;
+                if (eh->eh_depth) {
+                        ei = (struct ux_extent_idx *)(eh + 1);
+                        ei[0].ei_lblk = lblk;
+                        ei[0].ei_blk = blks[k + 1];
+                } else {
+                        ex = (struct ux_extent *)(eh + 1);
+                        ex[0].e_lblk = lblk;
+                        ex[0].e_pblk = pblk;
+                        ex[0].e_len = 1;
+                }
+        }
+        ei = (struct ux_extent_idx *)(path[l] + 1);
+        ei[path[l]->eh_entries].ei_lblk = lblk;
+        ei[path[l]->eh_entries].ei_blk = blks[0];
+        path[l]->eh_entries++;
+        uip->i_nextents++;
+        return 0;
+}
+
+/*
+ * Add an entry to a linear directory, growing it by a block if
+ * every slot is taken.
+ */
+
+static int
+add_entry(__u32 dir, const char *name, __u32 ino, int dt)
+{
+        struct ux_inode         *uip = inode_ptr(dir);
+        int                     dpb = UX_DIRS_PER_BLOCK(bsize);
+        struct extent_list      el;
+        struct ux_extent        *ex;
+        struct ux_dirent        *de;
+        unsigned long           i;
+        __u32                   j, blk;
+        int                     k;
+
+        if (uip->i_flags & UX_INDEX_FL) {
+                return -1;
+        }
+
+        inode_extents(dir, uip, &el);
+        ex = el.ex;
+        for (i = 0; i < el.n; i++) {
+                for (j = 0; j < ex[i].e_len; j++) {
+                        de = block_ptr(ex[i].e_pblk + j);
+                        for (k = 0; k < dpb; k++) {
+                                if (de[k].d_ino == 0) {
+                                        free_extents(&el);
+                                        goto found;
+                                }
+                        }
+                }
+        }
+        free_extents(&el);
+
+        blk = alloc_block();
+        if (!blk || append_extent(uip, uip->i_blocks, blk) < 0) {
+                return -1;
+        }
+        uip->i_blocks++;
+        uip->i_size += bsize;
+        de = block_ptr(blk);
+        k = 0;
+
+found:
+        memset(&de[k], 0, sizeof(struct ux_dirent));
+        de[k].d_ino = ino;
+        de[k].d_type = dt;
+        strcpy(de[k].d_name, name);
+        return 0;
+}
+
+/*
+ * Remove the entry naming "ino" from directory "dir".
+ */
+
+static void
+remove_entry(__u32 dir, __u32 ino)
+{
+        struct ux_inode         *uip = inode_ptr(dir);
+        struct extent_list      el;
+        struct ux_extent        *ex;
+        struct ux_dirent        *de;
+        unsigned long           i;
+        __u32                   j;
+        int                     k, nslots;
+
+        inode_extents(dir, uip, &el);
+        ex = el.ex;
+        for (i = 0; i < el.n; i++) {
+                for (j = 0; j < ex[i].e_len; j++) {
+                        de = block_ptr(ex[i].e_pblk + j);
+                        nslots = ux_dir_nslots(de, ex[i].e_lblk + j,
+                                               uip->i_flags, bsize);
+                        for (k = 0; k < nslots; k++) {
+                                if (de[k].d_ino == ino &&
+                                    strcmp(de[k].d_name, ".") &&
+                                    strcmp(de[k].d_name, "..")) {
+                                        clear_entry(&de[k]);
+                                        free_extents(&el);
+                                        return;
+                                }
+                        }
+                }
+        }
+        free_extents(&el);
+}
+
+static void
+reconnect(__u32 ino)
+{
+        __u32                   lf = UX_ROOT_INO + 1;
+        char                    name[UX_NAMELEN + 1];
+        int                     dir = flags[ino] & F_DIR;
+
+        snprintf(name, sizeof(name), "#%u", ino);
+        if (!KEPT(lf) || !(flags[lf] & F_DIR) ||
+            add_entry(lf, name, ino,
+                      dir ? UX_DT(S_IFDIR) : UX_DT(S_IFREG)) < 0) {
+                problem(0, "inode %u: unattached, cannot add it to "
+                        "lost+found", ino);
+                return;
+        }
+        problem(1, "inode %u: unattached, moved to lost+found as %s",
+                ino, name);
+        if (dir) {
+                parent[ino] = lf;
+                subdirs[lf]++;
+        } else {
+                refs[ino]++;
+        }
+}
+
+/*
+ * Pass 3d: every directory must lead back to the root through
+ * its parents. Walking up from each one finds directories with
+ * no parent and cycles; either way the directory where the walk
+ * stopped is moved to lost+found.
+ */
+
+#define C_UNKNOWN       0
+#define C_WALKING       1
+#define C_DONE          2
+
+static void
+check_connectivity(void)
+{
+        unsigned char           *state;
+        __u32                   *path;
+        __u32                   ino, x, n, i;
+
+        state = xcalloc(sb->s_ninodes, 1);
+        path = xcalloc(sb->s_ninodes, sizeof(__u32));
+        state[UX_ROOT_INO] = C_DONE;
+
+        for (ino = UX_ROOT_INO; ino < sb->s_ninodes; ino++) {
+                if (!KEPT(ino) || !(flags[ino] & F_DIR) ||
+                    state[ino] != C_UNKNOWN) {
+                        continue;
+                }
+                n = 0;
+                x = ino;
+                while (state[x] == C_UNKNOWN) {
+                        state[x] = C_WALKING;
+                        path[n++] = x;
+                        if (parent[x] == 0) {
+                                break;
+                        }
+                        x = parent[x];
+                }
+                if (state[x] == C_WALKING) {
+                        if (parent[x]) {
+                                remove_entry(parent[x], x);
+                                subdirs[parent[x]]--;
+                                parent[x] = 0;
+                        }
+                        reconnect(x);
+                }
+                for (i = 0; i < n; i++) {
+                        state[path[i]] = C_DONE;
+                }
+        }
+
+        for (ino = UX_ROOT_INO; ino < sb->s_ninodes; ino++) {
+                if (KEPT(ino) && (flags[ino] & F_FILE) && refs[ino] == 0) {
+                        reconnect(ino);
+                }
+        }
+        free(state);
+        free(path);
+}
+
+/*
+ * Point ".." of "dir" at "p". It is always slot 1 of block 0,
+ * for both linear and indexed directories.
+ */
+
+static void
+fix_dotdot(__u32 dir, __u32 p)
+{
+        struct ux_inode         *uip = inode_ptr(dir);
+        struct extent_list      el;
+        struct ux_dirent        *de;
+
+        inode_extents(dir, uip, &el);
+        if (el.n == 0 || el.ex[0].e_lblk != 0) {
+                problem(0, "directory %u: no block 0 for \"..\"", dir);
+                free_extents(&el);
+                return;
+        }
+        de = (struct ux_dirent *)block_ptr(el.ex[0].e_pblk) + 1;
+        free_extents(&el);
+        if (de->d_ino && strcmp(de->d_name, "..")) {
+                problem(0, "directory %u: no room for \"..\"", dir);
+                return;
+        }
+        problem(1, "directory %u: \"..\" is %u, should be %u", dir,
+                dotdot[dir], p);
+        memset(de, 0, sizeof(struct ux_dirent));
+        de->d_ino = p;
+        de->d_type = UX_DT(S_IFDIR);
+        strcpy(de->d_name, "..");
+}
+
+/*
+ * Pass 3e: link counts and "..".
+ */
+
+static void
+check_links(void)
+{
+        struct ux_inode         *uip;
+        __u32                   ino, want, p;
+
+        for (ino = UX_ROOT_INO; ino < sb->s_ninodes; ino++) {
+                if (!KEPT(ino)) {
+                        continue;
+                }
+                uip = inode_ptr(ino);
+                if (flags[ino] & F_DIR) {
+                        want = 2 + subdirs[ino];
+                        p = (ino == UX_ROOT_INO) ? ino : parent[ino];
+                        if (p && dotdot[ino] != p) {
+                                fix_dotdot(ino, p);
+                        }
+                } else {
+                        want = refs[ino];
+                }
+                if (uip->i_nlink != want) {
+                        problem(1, "inode %u: %u links, should be %u",
+                                ino, uip->i_nlink, want);
+                        uip->i_nlink = want;
+                }
+        }
+}
+
+/*
+ * Pass 3f: write the rebuilt bitmaps and free counts.
+ */
+
+/*
+ * Bits that differ between two bitmaps, and bits set in one,
+ * over the first "nbits" bits.
+ */
+
+static unsigned long
+map_diff(unsigned char *a, unsigned char *b, __u32 nbits)
+{
+        unsigned long           diff = 0;
+        __u32                   i;
+
+        for (i = 0; i < nbits / 8; i++) {
+                diff += __builtin_popcount(a[i] ^ b[i]);
+        }
+        if (nbits % 8) {
+                diff += __builtin_popcount((a[i] ^ b[i]) &
+                                           ((1 << (nbits % 8)) - 1));
+        }
+        return diff;
+}
+
+static __u32
+map_count(unsigned char *map, __u32 nbits)
+{
+        __u32                   i, count = 0;
+
+        for (i = 0; i < nbits / 8; i++) {
+                count += __builtin_popcount(map[i]);
+        }
+        if (nbits % 8) {
+                count += __builtin_popcount(map[i] &
+                                            ((1 << (nbits % 8)) - 1));
+        }
+        return count;
+}
+
+static void
+write_maps(void)
+{
+        unsigned char           *nimap;
+        unsigned long           diff;
+        __u32                   ino, ifree, bfree;
+
+        nimap = xcalloc(sb->s_imap_blocks, bsize);
+        for (ino = 0; ino < sb->s_ninodes; ino++) {
+                if (ino < UX_FIRST_INO || KEPT(ino)) {
+                        setbit(nimap, ino);
+                }
+        }
+
+        diff = map_diff(imap, nimap, sb->s_ninodes);
+        if (diff) {
+                problem(1, "inode bitmap: %lu bits wrong", diff);
+                memcpy(imap, nimap, (size_t)sb->s_imap_blocks * bsize);
+        }
+        diff = map_diff(bmap, claimed, sb->s_nblocks);
+        if (diff) {
+                problem(1, "block bitmap: %lu bits wrong", diff);
+                memcpy(bmap, claimed, (size_t)sb->s_bmap_blocks * bsize);
+        }
+
+        ifree = sb->s_ninodes - map_count(nimap, sb->s_ninodes);
+        bfree = sb->s_nblocks - map_count(claimed, sb->s_nblocks);
+        if (sb->s_nifree != ifree || sb->s_nbfree != bfree) {
+                problem(1, "superblock: free counts %u/%u, should be "
+                        "%u/%u", sb->s_nifree, sb->s_nbfree, ifree, bfree);
+                sb->s_nifree = ifree;
+                sb->s_nbfree = bfree;
+        }
+        free(nimap);
+}
+
+/*
+ * Sanity check the superblock before trusting any of it.
+ */
+
+static int
+check_super(off_t devsize)
+{
+        unsigned long           bpb = UX_BITS_PER_BLOCK(bsize);
+
+        if (sb->s_magic != UX_MAGIC || sb->s_inode_size != UX_INODE_SIZE ||
+            sb->s_ninodes <= UX_FIRST_INO || sb->s_nblocks < 2) {
+                return 0;
+        }
+        if ((off_t)sb->s_imap_blocks * bpb < sb->s_ninodes ||
+            (off_t)sb->s_bmap_blocks * bpb < sb->s_nblocks ||
+            (off_t)sb->s_itable_blocks * UX_INODES_PER_BLOCK(bsize) <
+            sb->s_ninodes) {
+                return 0;
+        }
+        if (sb->s_imap_start < 1 ||
+            sb->s_bmap_start < sb->s_imap_start + sb->s_imap_blocks ||
+            sb->s_itable_start < sb->s_bmap_start + sb->s_bmap_blocks ||
+            sb->s_data_start < sb->s_itable_start + sb->s_itable_blocks ||
+            (sb->s_journal_blocks &&
+             sb->s_data_start < (off_t)sb->s_journal_start +
+                                sb->s_journal_blocks)) {
+                return 0;
+        }
+        return ((off_t)sb->s_data_start + sb->s_nblocks) * bsize <= devsize;
+}
+
+/*
+ * A journal that still holds committed transactions has to be
+ * replayed by mounting before the filesystem can be checked.
+ */
+
+static int
+journal_dirty(void)
+{
+        __u32                   *js;
+
+        if (!sb->s_journal_blocks) {
+                return 0;
+        }
+        js = block_ptr(sb->s_journal_start);
+        if (ntohl(js[0]) != JBD2_MAGIC) {
+                problem(0, "journal at %u: bad superblock",
+                        sb->s_journal_start);
+                return 0;
+        }
+        return ntohl(js[7]) != 0;       /* s_start */
+}
+
+static off_t
+device_size(int fd)
+{
+        struct stat             st;
+        unsigned long long      bytes;
+
+        if (fstat(fd, &st) < 0) {
+                return -1;
+        }
+        if (S_ISBLK(st.st_mode)) {
+                if (ioctl(fd, BLKGETSIZE64, &bytes) < 0) {
+                        return -1;
+                }
+                return bytes;
+        }
+        return st.st_size;
+}
+
+static double
+now(void)
+{
+        struct timeval          tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct ux_superblock    first;
+        off_t                   devsize;
+        double                  start, secs;
+        int                     fd, c, ipb, dirty;
+
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        while ((c = getopt(argc, argv, "nj:")) != -1) {
+                switch (c) {
+                case 'n':
+                        repair = 0;
+                        break;
+                case 'j':
+                        nthreads = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind != argc - 1) {
+                usage();
+        }
+        if (nthreads < 1) {
+                nthreads = 1;
+        }
+        if (nthreads > MAX_THREADS) {
+                nthreads = MAX_THREADS;
+        }
+
+        fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "fsck.uxfs: Failed to open %s\n",
+                        argv[optind]);
+                exit(FSCK_ERROR);
+        }
+        devsize = device_size(fd);
+        if (devsize < (off_t)sizeof(first) ||
+            pread(fd, &first, sizeof(first), 0) != sizeof(first)) {
+                fprintf(stderr, "fsck.uxfs: Cannot read superblock\n");
+                exit(FSCK_ERROR);
+        }
+        bsize = first.s_bsize;
+        if (first.s_magic != UX_MAGIC || bsize < UX_MIN_BSIZE ||
+            bsize > UX_MAX_BSIZE || (bsize & (bsize - 1))) {
+                fprintf(stderr, "fsck.uxfs: Not a uxfs filesystem\n");
+                exit(FSCK_ERROR);
+        }
+
+        image_size = devsize;
+        image = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+                     repair ? MAP_SHARED : MAP_PRIVATE | MAP_NORESERVE,
+                     fd, 0);
+        if (image == MAP_FAILED) {
+                fprintf(stderr, "fsck.uxfs: Cannot map %s\n", argv[optind]);
+                exit(FSCK_ERROR);
+        }
+        sb = (struct ux_superblock *)image;
+        if (!check_super(devsize)) {
+                fprintf(stderr, "fsck.uxfs: Bad superblock geometry\n");
+                exit(FSCK_ERROR);
+        }
+        if (journal_dirty()) {
+                fprintf(stderr, "fsck.uxfs: The journal needs recovery; "
+                        "mount and unmount the filesystem first\n");
+                if (repair) {
+                        exit(FSCK_ERROR);
+                }
+        }
+        dirty = sb->s_mod != UX_FSCLEAN;
+        if (sb->s_itable_lazy >= sb->s_itable_blocks) {
+                problem(1, "superblock: lazy inode table mark %u is "
+                        "past the table", sb->s_itable_lazy);
+                sb->s_itable_lazy = 0;
+        }
+
+        start = now();
+        imap = block_ptr(sb->s_imap_start);
+        bmap = block_ptr(sb->s_bmap_start);
+        claimed = xcalloc(sb->s_bmap_blocks, bsize);
+        dups = xcalloc(sb->s_bmap_blocks, bsize);
+        flags = xcalloc(sb->s_ninodes, 1);
+        refs = xcalloc(sb->s_ninodes, sizeof(__u32));
+        parent = xcalloc(sb->s_ninodes, sizeof(__u32));
+        dotdot = xcalloc(sb->s_ninodes, sizeof(__u32));
+        subdirs = xcalloc(sb->s_ninodes, sizeof(__u32));
+        madvise(block_ptr(sb->s_itable_start),
+                (size_t)sb->s_itable_blocks * bsize, MADV_WILLNEED);
+
+        ipb = UX_INODES_PER_BLOCK(bsize);
+        nwork = ((unsigned long)sb->s_ninodes + CHUNK_BLOCKS * ipb - 1) /
+                (CHUNK_BLOCKS * ipb);
+        run_pass(inode_worker, nwork);
+        if (!KEPT(UX_ROOT_INO) || !(flags[UX_ROOT_INO] & F_DIR)) {
+                fprintf(stderr, "fsck.uxfs: The root directory is "
+                        "lost; cannot continue\n");
+                exit(FSCK_UNFIXED);
+        }
+        run_pass(dir_worker, nwork);
+
+        resolve_pending();
+        check_acls();
+        if (ndups) {
+                fix_dups();
+        }
+        check_connectivity();
+        check_links();
+        write_maps();
+        if (dirty) {
+                printf("fsck.uxfs: Filesystem was not cleanly unmounted\n");
+                if (!nunfixed) {
+                        sb->s_mod = UX_FSCLEAN;
+                }
+        }
+        secs = now() - start;
+
+        if (repair) {
+                msync(image, image_size, MS_SYNC);
+                fsync(fd);
+        }
+
+        printf("fsck.uxfs: %s: %u/%u inodes, %u/%u blocks used\n",
+               argv[optind], sb->s_ninodes - sb->s_nifree, sb->s_ninodes,
+               sb->s_nblocks - sb->s_nbfree, sb->s_nblocks);
+        printf("fsck.uxfs: checked %.1f MB in %.3f s (%.1f MB/s, "
+               "%d threads)\n", scanned / 1048576.0, secs,
+               secs > 0 ? scanned / 1048576.0 / secs : 0.0, nthreads);
+        if (nfixed || nunfixed) {
+                printf("fsck.uxfs: %lu problems fixed, %lu left\n",
+                       nfixed, nunfixed);
+        }
+
+        munmap(image, image_size);
+        close(fd);
+        if (nunfixed) {
+                return FSCK_UNFIXED;
+        }
+        return (nfixed || (dirty && repair)) ? FSCK_FIXED : FSCK_OK;
+}
@@ -4,23 +4,232 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
 #include <linux/fs.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include "../kern/ux_fs.h"
 
 struct ux_superblock       sb;
+unsigned char              *imap;
+unsigned char              *bmap;
+int                        bsize;
 int                        devfd;
+char                       *image;      /* the whole device, mapped */
+off_t                      image_size;
+
+/*
+ * Bit n of an on-disk bitmap is bit (n % 8) of byte (n / 8).
+ */
+
+int
+testbit(unsigned char *map, int n)
+{
+        return (map[n >> 3] >> (n & 7)) & 1;
+}
+
+/*
+ * Return a pointer to block "blk" of the mapped device. Blocks
+ * past the end of the device read as zeroes, so that a corrupt
+ * block number cannot take us outside the mapping.
+ */
+
+char *
+block(__u32 blk)
+{
+        static char             zero[UX_MAX_BSIZE];
+
+        if ((off_t)blk * bsize + bsize > image_size) {
+                return zero;
+        }
+        return image + (off_t)blk * bsize;
+}
+
+/*
+ * Find one of the allocation bitmaps in the mapping.
+ */
+
+unsigned char *
+read_map(__u32 start, __u32 nblocks)
+{
+        if (((off_t)start + nblocks) * bsize > image_size) {
+                fprintf(stderr, "uxfsdb: Bitmap at %d lies beyond the "
+                        "end of the device\n", start);
+                exit(1);
+        }
+        return (unsigned char *)image + (off_t)start * bsize;
+}
+
+/*
+ * Print the bitmap as runs of allocated entries.
+ */
+
+void
+print_map(char *name, unsigned char *map, int size, int base)
+{
+        int                     i, start;
+
+        printf("  %s in use:", name);
+        for (i = 0 ; i < size ; i++) {
+                if (!testbit(map, i)) {
+                        continue;
+                }
+                start = i;
+                while (i + 1 < size && testbit(map, i + 1)) {
+                        i++;
+                }
+                if (start == i) {
+                        printf(" %d", base + start);
+                } else {
+                        printf(" %d-%d", base + start, base + i);
+                }
+        }
+        printf("\n");
+}
+
+/*
+ * Append the extents under extent block "blk", which should be
+ * at "depth" in its tree, to the array *extentsp holding *np of
+ * them in room for *maxp. A bad block is reported and skipped.
+ */
+
+void
+walk_extents(__u32 blk, int depth, struct ux_extent **extentsp, int *np,
+             int *maxp)
+{
+        struct ux_extent_header *eh;
+        struct ux_extent_idx    *ei;
+        int                     i, max;
+
+        eh = (struct ux_extent_header *)block(blk);
+        max = eh->eh_depth ? (int)UX_EXTENT_IDX_PER_BLOCK(bsize) :
+                             (int)UX_EXTENTS_PER_BLOCK(bsize);
+        if (eh->eh_magic != UX_EXTENT_MAGIC || eh->eh_depth != depth ||
+            eh->eh_entries > max) {
+                printf("  bad extent block %d\n", blk);
+                return;
+        }
+        if (depth > 0) {
+                ei = (struct ux_extent_idx *)(eh + 1);
+                for (i = 0 ; i < eh->eh_entries ; i++) {
+                        walk_extents(ei[i].ei_blk, depth - 1, extentsp,
+                                     np, maxp);
+                }
+                return;
+        }
+        if (*np + eh->eh_entries > *maxp) {
+                *maxp = (*np + eh->eh_entries) * 2;
+                *extentsp = realloc(*extentsp,
+                                    *maxp * sizeof(struct ux_extent));
+                if (*extentsp == NULL) {
+                        fprintf(stderr, "uxfsdb: Out of memory\n");
+                        exit(1);
+                }
+        }
+        memcpy(*extentsp + *np, eh + 1,
+               eh->eh_entries * sizeof(struct ux_extent));
+        *np += eh->eh_entries;
+}
+
+/*
+ * Fetch the extents of an inode, either from the inode itself
+ * or from its extent tree, into a new array that the caller
+ * frees. Returns the number of extents.
+ */
+
+int
+read_extents(struct ux_inode *uip, struct ux_extent **extentsp)
+{
+        struct ux_extent_header *eh;
+        int                     n = 0, max = UX_INLINE_EXTENTS;
+
+        *extentsp = malloc(max * sizeof(struct ux_extent));
+        if (*extentsp == NULL) {
+                fprintf(stderr, "uxfsdb: Out of memory\n");
+                exit(1);
+        }
+        if (!uip->i_extent_blk) {
+                n = uip->i_nextents;
+                if (n > UX_INLINE_EXTENTS) {
+                        n = UX_INLINE_EXTENTS;
+                }
+                memcpy(*extentsp, uip->i_extents,
+                       n * sizeof(struct ux_extent));
+                return n;
+        }
+
+        eh = (struct ux_extent_header *)block(uip->i_extent_blk);
+        walk_extents(uip->i_extent_blk,
+                     eh->eh_depth <= UX_EXTENT_MAX_DEPTH ? eh->eh_depth : 0,
+                     extentsp, &n, &max);
+        return n;
+}
+
+/*
+ * Say how many access and default ACL entries the inode has and
+ * where the record lives.
+ */
+
+void
+print_acl(struct ux_inode *uip)
+{
+        struct ux_acl_block     *ab = NULL;
+        struct ux_acl_header    *hdr = (struct ux_acl_header *)uip->i_acl;
+
+        if (uip->i_acl_blk) {
+                ab = (struct ux_acl_block *)block(uip->i_acl_blk);
+                if (ab->ab_magic != UX_ACL_MAGIC) {
+                        printf("\n  i_acl      = bad ACL block %d",
+                               uip->i_acl_blk);
+                        return;
+                }
+                hdr = (struct ux_acl_header *)(ab + 1);
+        }
+        if (!hdr->ah_access && !hdr->ah_default) {
+                return;
+        }
+
+        printf("\n  i_acl      = %d access, %d default",
+               hdr->ah_access, hdr->ah_default);
+        if (uip->i_acl_blk) {
+                printf(" (in block %d, %d users)",
+                       uip->i_acl_blk, ab->ab_refcount);
+        } else {
+                printf(" (inline)");
+        }
+}
+
+/*
+ * Print the entries of an index root or node, of which there
+ * can be no more than "limit".
+ */
+
+void
+print_dx_entries(struct ux_dx_entry *entries, int count, int limit)
+{
+        int                     x;
+
+        for (x = 0 ; x < count && x < limit ; x++) {
+                printf("      hash %08x -> lblk %d\n",
+                       entries[x].de_hash, entries[x].de_lblk);
+        }
+}
 
 void
 print_inode(int inum, struct ux_inode *uip)
 {
-        char                    buf[UX_BSIZE];
+        char                    *buf;
         struct ux_dirent        *dirent;
-        int                     i, x;
+        struct ux_dx_root       *root;
+        struct ux_dx_node       *node;
+        struct ux_extent        *extents;
+        int                     i, x, blk, lblk, nextents, nslots;
 
         printf("\ninode number %d\n", inum);
         printf("  i_mode     = %x\n", uip->i_mode);
@@ -35,12 +244,26 @@ print_inode(int inum, struct ux_inode *uip)
         printf("  i_gid      = %d\n", uip->i_gid);
         printf("  i_size     = %d\n", uip->i_size);
         printf("  i_blocks   = %d", uip->i_blocks);
-        for (i=0 ; i<UX_DIRECT_BLOCKS; i++) {
-                if (i % 4 == 0) {
+        printf("\n  i_flags    = %x", uip->i_flags);
+        if (uip->i_flags & UX_INDEX_FL) {
+                printf(" (indexed)");
+        }
+        print_acl(uip);
+        printf("\n  i_nextents = %d", uip->i_nextents);
+        if (uip->i_extent_blk) {
+                printf(" (tree of depth %d in block %d)",
+                       ((struct ux_extent_header *)
+                        block(uip->i_extent_blk))->eh_depth,
+                       uip->i_extent_blk);
+        }
+        nextents = read_extents(uip, &extents);
+        for (i=0 ; i<nextents; i++) {
+                if (i % 2 == 0) {
                         printf("\n");
                 }
-                printf("  i_addr[%2d] = %3d ", 
-                       i, uip->i_addr[i]);
+                printf("  [%4d] lblk %5d pblk %5d len %4d ", i,
+                       extents[i].e_lblk, extents[i].e_pblk,
+                       extents[i].e_len);
         }
 
         /*
@@ -49,85 +272,777 @@ print_inode(int inum, struct ux_inode *uip)
 
         if (uip->i_mode & S_IFDIR) {
                 printf("\n\n  Directory entries:\n");
-                for (i=0 ; i < uip->i_blocks ; i++) {
-                        lseek(devfd, uip->i_addr[i] * UX_BSIZE, 
-                              SEEK_SET);
-                        read(devfd, buf, UX_BSIZE);
+                for (i=0 ; i < nextents ; i++) {
+                    for (blk = 0 ; blk < (int)extents[i].e_len ; blk++) {
+                        buf = block(extents[i].e_pblk + blk);
+                        lblk = extents[i].e_lblk + blk;
+                        root = (struct ux_dx_root *)buf;
+                        node = (struct ux_dx_node *)buf;
                         dirent = (struct ux_dirent *)buf;
-                        for (x = 0 ; x < UX_DIRECT_BLOCKS ; x++) {
+                        nslots = ux_dir_nslots(buf, lblk, uip->i_flags,
+                                               bsize);
+
+                        /*
+                         * Block 0 of an indexed directory only
+                         * holds "." and ".." ahead of the index
+                         * root, and index nodes hold no entries.
+                         */
+
+                        if ((uip->i_flags & UX_INDEX_FL) && lblk == 0) {
+                                printf("    index: %d entries, %d levels "
+                                       "of nodes, magic %s\n",
+                                       root->dr_count, root->dr_levels,
+                                       root->dr_magic == UX_DX_MAGIC ?
+                                       "ok" : "BAD");
+                                print_dx_entries(root->dr_entries,
+                                                 root->dr_count,
+                                                 UX_DX_LIMIT(bsize));
+                        } else if (nslots == 0) {
+                                printf("    index node in lblk %d: "
+                                       "%d entries\n", lblk,
+                                       node->dn_count);
+                                print_dx_entries(node->dn_entries,
+                                                 node->dn_count,
+                                                 UX_DX_NODE_LIMIT(bsize));
+                        }
+                        for (x = 0 ; x < nslots ; x++) {
                                 if (dirent->d_ino != 0) {
                                         printf("    inum[%2d],"
-                                               "name[%s]\n",
-                                               dirent->d_ino, 
+                                               "type[%2d],name[%s]\n",
+                                               dirent->d_ino,
+                                               dirent->d_type,
                                                dirent->d_name);
                                 } 
                                 dirent++;
                         }
+                    }
                 }
                 printf("\n");
         } else {
                 printf("\n\n");
         }
+        free(extents);
 }
 
 int read_inode(ino_t inum, struct ux_inode *uip)
 {
-        if (sb.s_inode[inum] == UX_INODE_FREE) {
+        if (inum >= sb.s_ninodes || !testbit(imap, inum)) {
+                return -1;
+        }
+        memcpy(uip, block(sb.s_itable_start +
+                          inum / UX_INODES_PER_BLOCK(bsize)) +
+               (inum % UX_INODES_PER_BLOCK(bsize)) * UX_INODE_SIZE,
+               sizeof(struct ux_inode));
+        return 0;
+}
+
+/*
+ * Locality report. The whole tree is walked the way "find" or
+ * "grep -r" would: each directory is read, then the inode of
+ * every entry, then the data of every regular file, and then
+ * each subdirectory in turn. Every block read is fed to
+ * seek_to(), which counts how often and how far the head has
+ * to move to get there from the end of the previous read.
+ */
+
+#define LONG_SEEK       1024            /* blocks */
+
+struct locality {
+        long long               last;
+        long long               reads;
+        long long               seeks;
+        long long               long_seeks;
+        long long               distance;
+        long long               files;
+        long long               dirs;
+        long long               fragments;
+        long long               ino_to_data;
+        long long               dir_to_data;
+};
+
+void
+seek_to(struct locality *lp, long long blk, long long len)
+{
+        long long               d;
+
+        if (lp->last >= 0 && blk != lp->last + 1) {
+                d = blk > lp->last ? blk - lp->last : lp->last - blk;
+                lp->seeks++;
+                lp->distance += d;
+                if (d > LONG_SEEK) {
+                        lp->long_seeks++;
+                }
+        }
+        lp->reads += len;
+        lp->last = blk + len - 1;
+}
+
+long long
+inode_blk(ino_t inum)
+{
+        return sb.s_itable_start + inum / UX_INODES_PER_BLOCK(bsize);
+}
+
+long long
+distance(long long a, long long b)
+{
+        return a > b ? a - b : b - a;
+}
+
+void
+walk_dir(struct locality *lp, unsigned char *seen, struct ux_inode *dip)
+{
+        struct ux_extent        *dext, *fext;
+        struct ux_dirent        *dirent;
+        struct ux_inode         inode;
+        ino_t                   *subdirs;
+        int                     nsub = 0, maxsub = 64;
+        int                     i, j, x, blk, ndext, nfext, nslots;
+
+        lp->dirs++;
+        ndext = read_extents(dip, &dext);
+        subdirs = malloc(maxsub * sizeof(ino_t));
+        if (subdirs == NULL) {
+                fprintf(stderr, "uxfsdb: Out of memory\n");
+                exit(1);
+        }
+
+        for (i = 0 ; i < ndext ; i++) {
+                seek_to(lp, dext[i].e_pblk, dext[i].e_len);
+        }
+        for (i = 0 ; i < ndext ; i++) {
+            for (blk = 0 ; blk < (int)dext[i].e_len ; blk++) {
+                dirent = (struct ux_dirent *)block(dext[i].e_pblk + blk);
+                nslots = ux_dir_nslots(dirent, dext[i].e_lblk + blk,
+                                       dip->i_flags, bsize);
+                for (x = 0 ; x < nslots ; x++, dirent++) {
+                        if (dirent->d_ino == 0 ||
+                            !strcmp(dirent->d_name, ".") ||
+                            !strcmp(dirent->d_name, "..") ||
+                            read_inode(dirent->d_ino, &inode) < 0 ||
+                            testbit(seen, dirent->d_ino)) {
+                                continue;
+                        }
+                        seek_to(lp, inode_blk(dirent->d_ino), 1);
+                        if (S_ISDIR(inode.i_mode)) {
+                                if (nsub == maxsub) {
+                                        maxsub *= 2;
+                                        subdirs = realloc(subdirs,
+                                                maxsub * sizeof(ino_t));
+                                        if (subdirs == NULL) {
+                                                fprintf(stderr, "uxfsdb: "
+                                                        "Out of memory\n");
+                                                exit(1);
+                                        }
+                                }
+                                subdirs[nsub++] = dirent->d_ino;
+                                continue;
+                        }
+                        seen[dirent->d_ino >> 3] |= 1 << (dirent->d_ino & 7);
+                        nfext = read_extents(&inode, &fext);
+                        lp->files++;
+                        if (nfext == 0) {
+                                free(fext);
+                                continue;
+                        }
+                        if (nfext > 1) {
+                                lp->fragments += nfext - 1;
+                        }
+                        lp->ino_to_data += distance(inode_blk(dirent->d_ino),
+                                                    fext[0].e_pblk);
+                        if (ndext > 0) {
+                                lp->dir_to_data +=
+                                        distance(dext[0].e_pblk,
+                                                 fext[0].e_pblk);
+                        }
+                        for (j = 0 ; j < nfext ; j++) {
+                                seek_to(lp, fext[j].e_pblk, fext[j].e_len);
+                        }
+                        free(fext);
+                }
+            }
+        }
+        free(dext);
+
+        for (i = 0 ; i < nsub ; i++) {
+                if (testbit(seen, subdirs[i]) ||
+                    read_inode(subdirs[i], &inode) < 0) {
+                        continue;
+                }
+                seen[subdirs[i] >> 3] |= 1 << (subdirs[i] & 7);
+                walk_dir(lp, seen, &inode);
+        }
+        free(subdirs);
+}
+
+void
+print_locality(void)
+{
+        struct locality         l;
+        struct ux_inode         root;
+        unsigned char           *seen;
+
+        memset(&l, 0, sizeof(l));
+        l.last = -1;
+        seen = calloc(sb.s_ninodes / 8 + 1, 1);
+        if (seen == NULL || read_inode(UX_ROOT_INO, &root) < 0) {
+                printf("\nCannot read the root directory\n\n");
+                free(seen);
+                return;
+        }
+        seen[UX_ROOT_INO >> 3] |= 1 << (UX_ROOT_INO & 7);
+        seek_to(&l, inode_blk(UX_ROOT_INO), 1);
+        walk_dir(&l, seen, &root);
+        free(seen);
+
+        printf("\nLocality of a full tree walk:\n");
+        printf("  directories       = %lld\n", l.dirs);
+        printf("  files             = %lld\n", l.files);
+        printf("  extra extents     = %lld\n", l.fragments);
+        printf("  blocks read       = %lld\n", l.reads);
+        printf("  seeks             = %lld\n", l.seeks);
+        printf("  long seeks        = %lld (over %d blocks)\n",
+               l.long_seeks, LONG_SEEK);
+        printf("  avg seek          = %lld blocks\n",
+               l.seeks ? l.distance / l.seeks : 0);
+        printf("  avg inode to data = %lld blocks\n",
+               l.files ? l.ino_to_data / l.files : 0);
+        printf("  avg dir to data   = %lld blocks\n\n",
+               l.files ? l.dir_to_data / l.files : 0);
+}
+
+/*
+ * Output of the bulk dump commands. Each command produces a
+ * table of records, built up field by field with rec_num() and
+ * rec_str() and finished with rec_end(). In text and csv format
+ * the first record of a table is preceded by a header line of
+ * field names; in json format every record is one object on a
+ * line of its own, tagged with the name of its table.
+ */
+
+#define OUT_TEXT        0
+#define OUT_CSV         1
+#define OUT_JSON        2
+#define MAX_FIELDS      24
+
+int                        out_fmt = OUT_TEXT;
+char                       *out_table;
+int                        out_rows;
+int                        rec_nfields;
+char                       *rec_name[MAX_FIELDS];
+char                       rec_val[MAX_FIELDS][UX_NAMELEN + 1];
+int                        rec_isstr[MAX_FIELDS];
+
+void
+table_begin(char *name)
+{
+        out_table = name;
+        out_rows = 0;
+        rec_nfields = 0;
+}
+
+void
+rec_num(char *name, long long val)
+{
+        rec_name[rec_nfields] = name;
+        snprintf(rec_val[rec_nfields], sizeof(rec_val[0]), "%lld", val);
+        rec_isstr[rec_nfields++] = 0;
+}
+
+void
+rec_str(char *name, char *val)
+{
+        rec_name[rec_nfields] = name;
+        snprintf(rec_val[rec_nfields], sizeof(rec_val[0]), "%s", val);
+        rec_isstr[rec_nfields++] = 1;
+}
+
+void
+put_json_str(char *s)
+{
+        putchar('"');
+        for ( ; *s ; s++) {
+                if (*s == '"' || *s == '\\') {
+                        printf("\\%c", *s);
+                } else if ((unsigned char)*s < 0x20) {
+                        printf("\\u%04x", (unsigned char)*s);
+                } else {
+                        putchar(*s);
+                }
+        }
+        putchar('"');
+}
+
+void
+put_csv_str(char *s)
+{
+        if (strpbrk(s, ",\"\r\n") == NULL && !isspace((unsigned char)*s)) {
+                fputs(s, stdout);
+                return;
+        }
+        putchar('"');
+        for ( ; *s ; s++) {
+                if (*s == '"') {
+                        putchar('"');
+                }
+                putchar(*s);
+        }
+        putchar('"');
+}
+
+void
+rec_end(void)
+{
+        char                    sep = out_fmt == OUT_CSV ? ',' : ' ';
+        int                     i;
+
+        if (out_fmt == OUT_JSON) {
+                printf("{\"table\":\"%s\"", out_table);
+                for (i = 0 ; i < rec_nfields ; i++) {
+                        printf(",\"%s\":", rec_name[i]);
+                        if (rec_isstr[i]) {
+                                put_json_str(rec_val[i]);
+                        } else {
+                                fputs(rec_val[i], stdout);
+                        }
+                }
+                printf("}\n");
+        } else {
+                if (out_rows == 0) {
+                        for (i = 0 ; i < rec_nfields ; i++) {
+                                if (i) {
+                                        putchar(sep);
+                                }
+                                fputs(rec_name[i], stdout);
+                        }
+                        putchar('\n');
+                }
+                for (i = 0 ; i < rec_nfields ; i++) {
+                        if (i) {
+                                putchar(sep);
+                        }
+                        if (out_fmt == OUT_CSV && rec_isstr[i]) {
+                                put_csv_str(rec_val[i]);
+                        } else {
+                                fputs(rec_val[i], stdout);
+                        }
+                }
+                putchar('\n');
+        }
+        out_rows++;
+        rec_nfields = 0;
+}
+
+char *
+type_name(__u32 mode)
+{
+        switch (mode & S_IFMT) {
+        case S_IFREG:
+                return "file";
+        case S_IFDIR:
+                return "dir";
+        case S_IFLNK:
+                return "symlink";
+        case S_IFCHR:
+                return "chr";
+        case S_IFBLK:
+                return "blk";
+        case S_IFIFO:
+                return "fifo";
+        case S_IFSOCK:
+                return "sock";
+        }
+        return "unknown";
+}
+
+/*
+ * Count the clear bits of a bitmap.
+ */
+
+long long
+count_free(unsigned char *map, int size)
+{
+        long long               nfree = 0;
+        int                     i;
+
+        for (i = 0 ; i < size ; i++) {
+                if ((i & 7) == 0 && i + 8 <= size && map[i >> 3] == 0xff) {
+                        i += 7;
+                        continue;
+                }
+                nfree += !testbit(map, i);
+        }
+        return nfree;
+}
+
+void
+dump_super(void)
+{
+        table_begin("super");
+        rec_num("magic", sb.s_magic);
+        rec_str("state", sb.s_mod == UX_FSCLEAN ? "clean" : "dirty");
+        rec_num("bsize", sb.s_bsize);
+        rec_num("inode_size", sb.s_inode_size);
+        rec_num("ninodes", sb.s_ninodes);
+        rec_num("nblocks", sb.s_nblocks);
+        rec_num("nifree", sb.s_nifree);
+        rec_num("nbfree", sb.s_nbfree);
+        rec_num("imap_nifree", count_free(imap, sb.s_ninodes));
+        rec_num("bmap_nbfree", count_free(bmap, sb.s_nblocks));
+        rec_num("imap_start", sb.s_imap_start);
+        rec_num("imap_blocks", sb.s_imap_blocks);
+        rec_num("bmap_start", sb.s_bmap_start);
+        rec_num("bmap_blocks", sb.s_bmap_blocks);
+        rec_num("itable_start", sb.s_itable_start);
+        rec_num("itable_blocks", sb.s_itable_blocks);
+        rec_num("journal_start", sb.s_journal_start);
+        rec_num("journal_blocks", sb.s_journal_blocks);
+        rec_num("itable_lazy", sb.s_itable_lazy);
+        rec_num("data_start", sb.s_data_start);
+        rec_end();
+}
+
+/*
+ * One record per inode in use. The inode table is read straight
+ * out of the mapping, a block at a time.
+ */
+
+void
+dump_inodes(void)
+{
+        struct ux_inode         *uip;
+        __u32                   inum;
+
+        table_begin("inodes");
+        for (inum = 0 ; inum < sb.s_ninodes ; inum++) {
+                if (!testbit(imap, inum)) {
+                        continue;
+                }
+                uip = (struct ux_inode *)(block(sb.s_itable_start +
+                                inum / UX_INODES_PER_BLOCK(bsize)) +
+                        (inum % UX_INODES_PER_BLOCK(bsize)) * UX_INODE_SIZE);
+                rec_num("ino", inum);
+                rec_str("type", type_name(uip->i_mode));
+                rec_num("mode", uip->i_mode & 07777);
+                rec_num("nlink", uip->i_nlink);
+                rec_num("uid", uip->i_uid);
+                rec_num("gid", uip->i_gid);
+                rec_num("size", uip->i_size);
+                rec_num("blocks", uip->i_blocks);
+                rec_num("atime", uip->i_atime);
+                rec_num("mtime", uip->i_mtime);
+                rec_num("ctime", uip->i_ctime);
+                rec_num("flags", uip->i_flags);
+                rec_num("nextents", uip->i_nextents);
+                rec_num("extent_blk", uip->i_extent_blk);
+                rec_num("acl_blk", uip->i_acl_blk);
+                rec_end();
+        }
+}
+
+/*
+ * The block map: one record per extent of every inode in use.
+ */
+
+void
+dump_extents(void)
+{
+        struct ux_extent        *extents;
+        struct ux_inode         inode;
+        __u32                   inum;
+        int                     i, n;
+
+        table_begin("extents");
+        for (inum = 0 ; inum < sb.s_ninodes ; inum++) {
+                if (read_inode(inum, &inode) < 0) {
+                        continue;
+                }
+                n = read_extents(&inode, &extents);
+                for (i = 0 ; i < n ; i++) {
+                        rec_num("ino", inum);
+                        rec_num("index", i);
+                        rec_num("lblk", extents[i].e_lblk);
+                        rec_num("pblk", extents[i].e_pblk);
+                        rec_num("len", extents[i].e_len);
+                        rec_end();
+                }
+                free(extents);
+        }
+}
+
+/*
+ * Every entry of every directory, including "." and "..".
+ */
+
+void
+dump_dirents(void)
+{
+        struct ux_extent        *extents;
+        struct ux_inode         inode;
+        struct ux_dirent        *dirent;
+        char                    name[UX_NAMELEN + 1];
+        __u32                   inum, lblk;
+        int                     i, x, blk, n, nslots;
+
+        table_begin("dirents");
+        for (inum = 0 ; inum < sb.s_ninodes ; inum++) {
+                if (read_inode(inum, &inode) < 0 ||
+                    !S_ISDIR(inode.i_mode)) {
+                        continue;
+                }
+                n = read_extents(&inode, &extents);
+                for (i = 0 ; i < n ; i++) {
+                    for (blk = 0 ; blk < (int)extents[i].e_len ; blk++) {
+                        lblk = extents[i].e_lblk + blk;
+                        dirent = (struct ux_dirent *)
+                                block(extents[i].e_pblk + blk);
+                        nslots = ux_dir_nslots(dirent, lblk, inode.i_flags,
+                                               bsize);
+                        for (x = 0 ; x < nslots ; x++, dirent++) {
+                                if (dirent->d_ino == 0) {
+                                        continue;
+                                }
+                                memcpy(name, dirent->d_name, UX_NAMELEN);
+                                name[UX_NAMELEN] = '\0';
+                                rec_num("dir", inum);
+                                rec_num("lblk", lblk);
+                                rec_num("slot", x);
+                                rec_num("ino", dirent->d_ino);
+                                rec_num("type", dirent->d_type);
+                                rec_str("name", name);
+                                rec_end();
+                        }
+                    }
+                }
+                free(extents);
+        }
+}
+
+/*
+ * Free space as runs of clear bits, in disk block numbers for
+ * the block bitmap and inode numbers for the inode bitmap.
+ */
+
+void
+dump_runs(char *kind, unsigned char *map, int size, int base)
+{
+        int                     i, start;
+
+        for (i = 0 ; i < size ; i++) {
+                if ((i & 7) == 0 && map[i >> 3] == 0xff) {
+                        i += 7;
+                        continue;
+                }
+                if (testbit(map, i)) {
+                        continue;
+                }
+                start = i;
+                while (i + 1 < size && !testbit(map, i + 1)) {
+                        i++;
+                }
+                rec_str("kind", kind);
+                rec_num("start", base + start);
+                rec_num("len", i - start + 1);
+                rec_end();
+        }
+}
+
+void
+dump_free(void)
+{
+        table_begin("free");
+        dump_runs("inode", imap, sb.s_ninodes, 0);
+        dump_runs("block", bmap, sb.s_nblocks, sb.s_data_start);
+}
+
+void
+print_super(void)
+{
+        printf("\nSuperblock contents:\n");
+        printf("  s_magic   = 0x%x\n", sb.s_magic);
+        printf("  s_mod     = %s\n",
+               (sb.s_mod == UX_FSCLEAN) ? "UX_FSCLEAN" : "UX_FSDIRTY");
+        printf("  s_nifree  = %d\n", sb.s_nifree);
+        printf("  s_nbfree  = %d\n", sb.s_nbfree);
+        printf("  s_ninodes = %d\n", sb.s_ninodes);
+        printf("  s_nblocks = %d\n", sb.s_nblocks);
+        printf("  inode bitmap at %d (%d blocks)\n",
+               sb.s_imap_start, sb.s_imap_blocks);
+        printf("  block bitmap at %d (%d blocks)\n",
+               sb.s_bmap_start, sb.s_bmap_blocks);
+        printf("  inode table  at %d (%d blocks)\n",
+               sb.s_itable_start, sb.s_itable_blocks);
+        if (sb.s_itable_lazy) {
+                printf("  inode table not zeroed from block %d\n",
+                       sb.s_itable_start + sb.s_itable_lazy);
+        }
+        if (sb.s_journal_blocks) {
+                printf("  journal      at %d (%d blocks)\n",
+                       sb.s_journal_start, sb.s_journal_blocks);
+        }
+        printf("  data blocks  at %d\n", sb.s_data_start);
+        printf("  inode size   = %d\n", sb.s_inode_size);
+        printf("  block size   = %d\n", sb.s_bsize);
+        print_map("inodes", imap, sb.s_ninodes, 0);
+        print_map("blocks", bmap, sb.s_nblocks, sb.s_data_start);
+        printf("\n");
+}
+
+/*
+ * Run one command. Returns -1 if it is not one we know.
+ */
+
+int
+run_command(char *command)
+{
+        struct ux_inode         inode;
+        ino_t                   inum;
+
+        if (!strcmp(command, "super")) {
+                dump_super();
+        } else if (!strcmp(command, "inodes")) {
+                dump_inodes();
+        } else if (!strcmp(command, "extents")) {
+                dump_extents();
+        } else if (!strcmp(command, "dirents")) {
+                dump_dirents();
+        } else if (!strcmp(command, "free")) {
+                dump_free();
+        } else if (!strcmp(command, "all")) {
+                dump_super();
+                dump_inodes();
+                dump_extents();
+                dump_dirents();
+                dump_free();
+        } else if (command[0] == 'q') {
+                exit(0);
+        } else if (command[0] == 'i' && isdigit((unsigned char)command[1])) {
+                inum = atoi(&command[1]);
+                if (read_inode(inum, &inode) < 0) {
+                        printf("\ninode %d is not in use\n\n", (int)inum);
+                } else {
+                        print_inode(inum, &inode);
+                }
+        } else if (!strcmp(command, "l")) {
+                print_locality();
+        } else if (!strcmp(command, "s")) {
+                print_super();
+        } else {
+                fprintf(stderr, "uxfsdb: Unknown command \"%s\"\n", command);
                 return -1;
         }
-        lseek(devfd, (UX_INODE_BLOCK * UX_BSIZE) + 
-              (inum * UX_BSIZE), SEEK_SET);
-        read(devfd, (char *)uip, sizeof(struct ux_inode));
         return 0;
 }
 
+void
+usage(void)
+{
+        fprintf(stderr, "usage: fsdb [-o text|csv|json] device "
+                "[command ...]\n");
+        fprintf(stderr, "commands: iN l s q super inodes extents "
+                "dirents free all\n");
+        exit(1);
+}
+
+/*
+ * Commands come from the rest of the command line if there are
+ * any, and otherwise from stdin, with a prompt only if stdin is
+ * a terminal. The device is mapped read-only once up front, so
+ * the bulk commands are simple walks over memory.
+ */
+
 int
 main(int argc, char **argv)
 {
-        struct ux_inode           inode;
-        char                      buf[512];
         char                      command[512];
-        off_t                     nsectors;
-        int                       error, i, blk;
-        ino_t                     inum;
+        struct stat               st;
+        __u64                     size;
+        int                       c, i, status = 0, interactive;
 
-        devfd = open(argv[1], O_RDWR);
-        if (devfd < 0) {
-                fprintf(stderr, "uxmkfs: Failed to open device\n");
+        while ((c = getopt(argc, argv, "o:")) != -1) {
+                if (c != 'o') {
+                        usage();
+                }
+                if (!strcmp(optarg, "text")) {
+                        out_fmt = OUT_TEXT;
+                } else if (!strcmp(optarg, "csv")) {
+                        out_fmt = OUT_CSV;
+                } else if (!strcmp(optarg, "json")) {
+                        out_fmt = OUT_JSON;
+                } else {
+                        usage();
+                }
+        }
+        if (optind >= argc) {
+                usage();
+        }
+
+        devfd = open(argv[optind], O_RDONLY);
+        if (devfd < 0 || fstat(devfd, &st) < 0) {
+                fprintf(stderr, "uxfsdb: Failed to open device\n");
+                exit(1);
+        }
+        if (S_ISBLK(st.st_mode)) {
+                if (ioctl(devfd, BLKGETSIZE64, &size) < 0) {
+                        fprintf(stderr, "uxfsdb: Cannot size device\n");
+                        exit(1);
+                }
+                image_size = size;
+        } else {
+                image_size = st.st_size;
+        }
+        if (image_size < (off_t)sizeof(struct ux_superblock)) {
+                printf("This is not a uxfs filesystem\n");
+                exit(1);
+        }
+        image = mmap(NULL, image_size, PROT_READ, MAP_SHARED, devfd, 0);
+        if (image == MAP_FAILED) {
+                fprintf(stderr, "uxfsdb: Cannot map device\n");
                 exit(1);
         }
 
         /*
-         * Read in and validate the superblock
+         * Validate the superblock
          */
 
-        read(devfd, (char *)&sb, sizeof(struct ux_superblock));
+        memcpy(&sb, image, sizeof(struct ux_superblock));
         if (sb.s_magic != UX_MAGIC) {
                 printf("This is not a uxfs filesystem\n");
                 exit(1);
         }
+        bsize = sb.s_bsize;
+        if (bsize < UX_MIN_BSIZE || bsize > UX_MAX_BSIZE) {
+                printf("Bad block size %d\n", bsize);
+                exit(1);
+        }
+        if (sb.s_imap_blocks * UX_BITS_PER_BLOCK(bsize) < sb.s_ninodes ||
+            sb.s_bmap_blocks * UX_BITS_PER_BLOCK(bsize) < sb.s_nblocks) {
+                printf("Bitmaps are too small for the filesystem\n");
+                exit(1);
+        }
+        imap = read_map(sb.s_imap_start, sb.s_imap_blocks);
+        bmap = read_map(sb.s_bmap_start, sb.s_bmap_blocks);
 
+        if (optind + 1 < argc) {
+                for (i = optind + 1 ; i < argc ; i++) {
+                        if (run_command(argv[i]) < 0) {
+                                status = 1;
+                        }
+                }
+                exit(status);
+        }
+
+        interactive = isatty(0);
         while (1) {
-                printf("uxfsdb > ") ;
-                fflush(stdout);
-                scanf("%s", command);
-                if (command[0] == 'q') {
-                        exit(0);
+                if (interactive) {
+                        printf("uxfsdb > ");
                 }
-                if (command[0] == 'i') {
-                        inum = atoi(&command[1]);
-                        read_inode(inum, &inode);
-                        print_inode(inum, &inode);
+                fflush(stdout);
+                if (scanf("%511s", command) != 1) {
+                        exit(status);
                 }
-                if (command[0] == 's') {
-                        printf("\nSuperblock contents:\n");
-                        printf("  s_magic   = 0x%x\n", sb.s_magic);
-                        printf("  s_mod     = %s\n",
-                               (sb.s_mod == UX_FSCLEAN) ?
-                               "UX_FSCLEAN" : "UX_FSDIRTY");
-                        printf("  s_nifree  = %d\n", sb.s_nifree);
-                        printf("  s_nbfree  = %d\n\n", sb.s_nbfree);
+                if (run_command(command) < 0) {
+                        status = 1;
                 }
         }
 }
-
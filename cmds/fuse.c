@@ -0,0 +1,890 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- fuse.c --------------------------*/
+/*--------------------------------------------------------------*/
+
+#define FUSE_USE_VERSION 34
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libuxfs.h"
+
+/*
+ * uxfs-fuse serves a uxfs image through FUSE, for machines
+ * without the kernel module or for images that should not be
+ * trusted to it. All of the filesystem is in libuxfs; this file
+ * only translates between it and the FUSE low-level API.
+ *
+ * Every reference the FUSE kernel holds through a lookup is a
+ * reference on the in-core inode, dropped again by forget, and
+ * every open file holds one more. So an unlinked file stays
+ * until it is both forgotten and closed.
+ *
+ * Requests run on several threads. Metadata is changed under the
+ * filesystem's u_lock. File data is read and written with that
+ * lock dropped, under the inode's ui_rwlock: shared for reads,
+ * exclusive for writes and truncation, so that the blocks being
+ * read cannot be freed underneath. The rwlock is always taken
+ * before u_lock. Reads and writes splice data straight between
+ * the image and the FUSE device where the kernel allows it.
+ */
+
+#define UXFS_TIMEOUT    1.0     /* seconds the kernel may cache attributes */
+#define UXFS_ZERO       (128 * 1024)
+
+struct uxfs_opts
+{
+        char                    *image;
+        int                     rdonly;
+        unsigned long           cache_blocks;
+};
+
+enum {
+        KEY_RO,
+};
+
+static const struct fuse_opt uxfs_opt_spec[] = {
+        { "cache_blocks=%lu", offsetof(struct uxfs_opts, cache_blocks), 0 },
+        FUSE_OPT_KEY("ro", KEY_RO),
+        FUSE_OPT_END
+};
+
+static char             uxfs_zero[UXFS_ZERO];
+
+/*
+ * The FUSE root is inode 1, ours is UX_ROOT_INO.
+ */
+
+static __u32
+ux_ino(fuse_ino_t ino)
+{
+        return ino == FUSE_ROOT_ID ? UX_ROOT_INO : ino;
+}
+
+static fuse_ino_t
+fuse_ino(__u32 ino)
+{
+        return ino == UX_ROOT_INO ? FUSE_ROOT_ID : ino;
+}
+
+static struct ux_fs *
+uxfs(fuse_req_t req)
+{
+        return fuse_req_userdata(req);
+}
+
+/*
+ * Find the in-core inode for a FUSE inode number. The kernel
+ * only passes numbers it holds a lookup reference on, so the
+ * inode is always there unless the kernel is confused.
+ */
+
+static struct ux_inode_info *
+uxfs_inode(struct ux_fs *fs, fuse_ino_t ino)
+{
+        struct ux_inode_info    *ip;
+
+        pthread_mutex_lock(&fs->u_lock);
+        ip = ux_ifind(fs, ux_ino(ino));
+        pthread_mutex_unlock(&fs->u_lock);
+        return ip;
+}
+
+static void
+uxfs_stat(struct ux_fs *fs, struct ux_inode_info *ip, struct stat *st)
+{
+        ux_stat(fs, ip, st);
+        st->st_ino = fuse_ino(ip->ui_ino);
+}
+
+/*
+ * Reply with an entry for "ip", whose reference becomes the
+ * lookup reference the kernel now holds. Called with u_lock
+ * held.
+ */
+
+static void
+uxfs_reply_entry(fuse_req_t req, struct ux_fs *fs, struct ux_inode_info *ip,
+                 struct fuse_file_info *fi)
+{
+        struct fuse_entry_param e;
+
+        memset(&e, 0, sizeof(e));
+        e.ino = fuse_ino(ip->ui_ino);
+        e.attr_timeout = UXFS_TIMEOUT;
+        e.entry_timeout = UXFS_TIMEOUT;
+        uxfs_stat(fs, ip, &e.attr);
+        pthread_mutex_unlock(&fs->u_lock);
+
+        if (fi) {
+                if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+                        pthread_mutex_lock(&fs->u_lock);
+                        ux_iput_many(fs, ip, 2);
+                        pthread_mutex_unlock(&fs->u_lock);
+                }
+        } else if (fuse_reply_entry(req, &e) == -ENOENT) {
+                pthread_mutex_lock(&fs->u_lock);
+                ux_iput(fs, ip);
+                pthread_mutex_unlock(&fs->u_lock);
+        }
+}
+
+static void
+uxfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+        struct ux_fs            *fs = userdata;
+        struct ux_inode_info    *root;
+
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                       FUSE_CAP_SPLICE_WRITE |
+                                       FUSE_CAP_SPLICE_MOVE);
+
+        /*
+         * The kernel never looks the root up, so take the
+         * reference it is assumed to hold here.
+         */
+
+        pthread_mutex_lock(&fs->u_lock);
+        ux_iget(fs, UX_ROOT_INO, &root);
+        pthread_mutex_unlock(&fs->u_lock);
+}
+
+/*
+ * Drop whatever references the kernel did not give back before
+ * unmounting, so that unlinked files are freed.
+ */
+
+static void
+uxfs_destroy(void *userdata)
+{
+        struct ux_fs            *fs = userdata;
+        struct ux_inode_info    *ip, *next;
+        unsigned int            i;
+
+        pthread_mutex_lock(&fs->u_lock);
+        for (i = 0; i < fs->u_nihash; i++) {
+                for (ip = fs->u_ihash[i]; ip; ip = next) {
+                        next = ip->ui_hash;
+                        ux_iput_many(fs, ip, ip->ui_count);
+                }
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+}
+
+static void
+uxfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip, *ip;
+        __u32                   ino;
+        int                     error = -ENOENT;
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(parent));
+        if (!dip) {
+                error = -ESTALE;
+                goto out;
+        }
+        if (strlen(name) > UX_NAMELEN) {
+                error = -ENAMETOOLONG;
+                goto out;
+        }
+        ino = ux_find_entry(fs, dip, name);
+        if (ino) {
+                error = ux_iget(fs, ino, &ip);
+        }
+        if (!error) {
+                uxfs_reply_entry(req, fs, ip, NULL);
+                return;
+        }
+out:
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_err(req, -error);
+}
+
+static void
+uxfs_forget_one(struct ux_fs *fs, fuse_ino_t ino, uint64_t nlookup)
+{
+        ux_iput_many(fs, ux_ifind(fs, ux_ino(ino)), nlookup);
+}
+
+static void
+uxfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+        struct ux_fs            *fs = uxfs(req);
+
+        pthread_mutex_lock(&fs->u_lock);
+        uxfs_forget_one(fs, ino, nlookup);
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_none(req);
+}
+
+static void
+uxfs_forget_multi(fuse_req_t req, size_t count,
+                  struct fuse_forget_data *forgets)
+{
+        struct ux_fs            *fs = uxfs(req);
+        size_t                  i;
+
+        pthread_mutex_lock(&fs->u_lock);
+        for (i = 0; i < count; i++) {
+                uxfs_forget_one(fs, forgets[i].ino, forgets[i].nlookup);
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_none(req);
+}
+
+static void
+uxfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *ip;
+        struct stat             st;
+
+        pthread_mutex_lock(&fs->u_lock);
+        ip = ux_ifind(fs, ux_ino(ino));
+        if (ip) {
+                uxfs_stat(fs, ip, &st);
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+
+        if (!ip) {
+                fuse_reply_err(req, ESTALE);
+                return;
+        }
+        fuse_reply_attr(req, &st, UXFS_TIMEOUT);
+}
+
+static void
+uxfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+             struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *ip;
+        struct ux_inode         *uip;
+        struct stat             st;
+        time_t                  now = time(NULL);
+        int                     error = 0;
+
+        ip = uxfs_inode(fs, ino);
+        if (!ip) {
+                fuse_reply_err(req, ESTALE);
+                return;
+        }
+        uip = &ip->ui_inode;
+
+        pthread_rwlock_wrlock(&ip->ui_rwlock);
+        pthread_mutex_lock(&fs->u_lock);
+        if (fs->u_rdonly) {
+                error = -EROFS;
+                goto out;
+        }
+        if (to_set & FUSE_SET_ATTR_SIZE) {
+                error = ux_setsize(fs, ip, attr->st_size);
+                if (error) {
+                        goto out;
+                }
+        }
+        if (to_set & FUSE_SET_ATTR_MODE) {
+                uip->i_mode = (uip->i_mode & S_IFMT) | (attr->st_mode & 07777);
+        }
+        if (to_set & FUSE_SET_ATTR_UID) {
+                uip->i_uid = attr->st_uid;
+        }
+        if (to_set & FUSE_SET_ATTR_GID) {
+                uip->i_gid = attr->st_gid;
+        }
+        if (to_set & FUSE_SET_ATTR_ATIME) {
+                uip->i_atime = attr->st_atime;
+        }
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+                uip->i_atime = now;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME) {
+                uip->i_mtime = attr->st_mtime;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+                uip->i_mtime = now;
+        }
+        uip->i_ctime = now;
+        ux_mark_inode_dirty(ip);
+        uxfs_stat(fs, ip, &st);
+
+out:
+        pthread_mutex_unlock(&fs->u_lock);
+        pthread_rwlock_unlock(&ip->ui_rwlock);
+        if (error) {
+                fuse_reply_err(req, -error);
+        } else {
+                fuse_reply_attr(req, &st, UXFS_TIMEOUT);
+        }
+}
+
+struct uxfs_dirbuf
+{
+        fuse_req_t              req;
+        char                    *buf;
+        size_t                  size;
+        size_t                  len;
+};
+
+static int
+uxfs_filldir(void *arg, const char *name, __u32 ino, int type, off_t pos)
+{
+        struct uxfs_dirbuf      *db = arg;
+        struct stat             st;
+        size_t                  n;
+
+        memset(&st, 0, sizeof(st));
+        st.st_ino = fuse_ino(ino);
+        st.st_mode = type << 12;
+        n = fuse_add_direntry(db->req, db->buf + db->len, db->size - db->len,
+                              name, &st, pos);
+        if (n > db->size - db->len) {
+                return 1;
+        }
+        db->len += n;
+        return 0;
+}
+
+static void
+uxfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+             struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip;
+        struct uxfs_dirbuf      db;
+        int                     error = -ESTALE;
+
+        db.req = req;
+        db.size = size;
+        db.len = 0;
+        db.buf = malloc(size);
+        if (!db.buf) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(ino));
+        if (dip) {
+                error = ux_readdir(fs, dip, off, uxfs_filldir, &db);
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+
+        if (error) {
+                fuse_reply_err(req, -error);
+        } else {
+                fuse_reply_buf(req, db.buf, db.len);
+        }
+        free(db.buf);
+}
+
+static void
+uxfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *ip;
+        int                     error;
+
+        if ((fi->flags & O_ACCMODE) != O_RDONLY && fs->u_rdonly) {
+                fuse_reply_err(req, EROFS);
+                return;
+        }
+
+        pthread_mutex_lock(&fs->u_lock);
+        error = ux_iget(fs, ux_ino(ino), &ip);
+        pthread_mutex_unlock(&fs->u_lock);
+        if (error) {
+                fuse_reply_err(req, -error);
+                return;
+        }
+
+        fi->fh = (uintptr_t)ip;
+        if (fuse_reply_open(req, fi) == -ENOENT) {
+                pthread_mutex_lock(&fs->u_lock);
+                ux_iput(fs, ip);
+                pthread_mutex_unlock(&fs->u_lock);
+        }
+}
+
+static void
+uxfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+
+        pthread_mutex_lock(&fs->u_lock);
+        ux_iput(fs, (struct ux_inode_info *)(uintptr_t)fi->fh);
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_err(req, 0);
+}
+
+static void
+uxfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+            struct fuse_file_info *fi)
+{
+        const struct fuse_ctx   *ctx = fuse_req_ctx(req);
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip, *ip;
+        int                     error = -ESTALE;
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(parent));
+        if (dip) {
+                error = ux_create(fs, dip, name, mode, ctx->uid, ctx->gid,
+                                  &ip);
+        }
+        if (error) {
+                pthread_mutex_unlock(&fs->u_lock);
+                fuse_reply_err(req, -error);
+                return;
+        }
+
+        /*
+         * One reference for the lookup, one for the open file.
+         */
+
+        ip->ui_count++;
+        fi->fh = (uintptr_t)ip;
+        uxfs_reply_entry(req, fs, ip, fi);
+}
+
+static void
+uxfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+           dev_t rdev)
+{
+        const struct fuse_ctx   *ctx = fuse_req_ctx(req);
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip, *ip;
+        int                     error = -ESTALE;
+
+        if (!S_ISREG(mode)) {
+                fuse_reply_err(req, EPERM);
+                return;
+        }
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(parent));
+        if (dip) {
+                error = ux_create(fs, dip, name, mode, ctx->uid, ctx->gid,
+                                  &ip);
+        }
+        if (error) {
+                pthread_mutex_unlock(&fs->u_lock);
+                fuse_reply_err(req, -error);
+                return;
+        }
+        uxfs_reply_entry(req, fs, ip, NULL);
+}
+
+static void
+uxfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+        const struct fuse_ctx   *ctx = fuse_req_ctx(req);
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip, *ip;
+        int                     error = -ESTALE;
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(parent));
+        if (dip) {
+                error = ux_mkdir(fs, dip, name, mode, ctx->uid, ctx->gid,
+                                 &ip);
+        }
+        if (error) {
+                pthread_mutex_unlock(&fs->u_lock);
+                fuse_reply_err(req, -error);
+                return;
+        }
+        uxfs_reply_entry(req, fs, ip, NULL);
+}
+
+static void
+uxfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+          const char *newname)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip, *ip;
+        int                     error = -ESTALE;
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(newparent));
+        ip = ux_ifind(fs, ux_ino(ino));
+        if (dip && ip) {
+                error = ux_link(fs, ip, dip, newname);
+        }
+        if (error) {
+                pthread_mutex_unlock(&fs->u_lock);
+                fuse_reply_err(req, -error);
+                return;
+        }
+        ip->ui_count++;
+        uxfs_reply_entry(req, fs, ip, NULL);
+}
+
+static void
+uxfs_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int dir)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct ux_inode_info    *dip;
+        int                     error = -ESTALE;
+
+        pthread_mutex_lock(&fs->u_lock);
+        dip = ux_ifind(fs, ux_ino(parent));
+        if (dip) {
+                error = dir ? ux_rmdir(fs, dip, name) :
+                              ux_unlink(fs, dip, name);
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_err(req, -error);
+}
+
+static void
+uxfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        uxfs_remove(req, parent, name, 0);
+}
+
+static void
+uxfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        uxfs_remove(req, parent, name, 1);
+}
+
+/*
+ * Build a vector of the image ranges holding the data and let
+ * libfuse splice them to the kernel. Holes are filled from a
+ * static buffer of zeroes.
+ */
+
+static void
+uxfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+          struct fuse_file_info *fi)
+{
+        struct ux_inode_info    *ip = (struct ux_inode_info *)(uintptr_t)fi->fh;
+        struct ux_fs            *fs = uxfs(req);
+        struct fuse_bufvec      *bv = NULL, *nbv;
+        struct fuse_buf         *b;
+        size_t                  done = 0, n, boff, nbufs = 0, max = 0;
+        __u32                   pblk, count;
+        int                     error = 0;
+
+        pthread_rwlock_rdlock(&ip->ui_rwlock);
+        pthread_mutex_lock(&fs->u_lock);
+        if (off >= (off_t)ip->ui_inode.i_size) {
+                size = 0;
+        } else if (size > ip->ui_inode.i_size - off) {
+                size = ip->ui_inode.i_size - off;
+        }
+
+        while (done < size) {
+                boff = (off + done) % fs->u_bsize;
+                error = ux_extent_get(fs, ip, (off + done) / fs->u_bsize,
+                                      &pblk, &count);
+                if (error) {
+                        break;
+                }
+                n = (size_t)count * fs->u_bsize - boff;
+                if (n > size - done) {
+                        n = size - done;
+                }
+                if (!pblk && n > UXFS_ZERO) {
+                        n = UXFS_ZERO;
+                }
+
+                if (nbufs == max) {
+                        max += 16;
+                        nbv = realloc(bv, sizeof(struct fuse_bufvec) +
+                                      max * sizeof(struct fuse_buf));
+                        if (!nbv) {
+                                error = -ENOMEM;
+                                break;
+                        }
+                        bv = nbv;
+                }
+                b = &bv->buf[nbufs++];
+                memset(b, 0, sizeof(*b));
+                b->size = n;
+                if (pblk) {
+                        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                        b->fd = fs->u_fd;
+                        b->pos = (off_t)pblk * fs->u_bsize + boff;
+                } else {
+                        b->mem = uxfs_zero;
+                }
+                done += n;
+        }
+        pthread_mutex_unlock(&fs->u_lock);
+
+        if (error) {
+                fuse_reply_err(req, -error);
+        } else if (nbufs == 0) {
+                fuse_reply_buf(req, NULL, 0);
+        } else {
+                bv->count = nbufs;
+                bv->idx = 0;
+                bv->off = 0;
+                fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+        }
+        pthread_rwlock_unlock(&ip->ui_rwlock);
+        free(bv);
+}
+
+/*
+ * Allocate the blocks a write needs, then copy the data from the
+ * request to each extent in turn, spliced where possible.
+ */
+
+static void
+uxfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+               off_t off, struct fuse_file_info *fi)
+{
+        struct ux_inode_info    *ip = (struct ux_inode_info *)(uintptr_t)fi->fh;
+        struct ux_fs            *fs = uxfs(req);
+        size_t                  size = fuse_buf_size(in_buf), done = 0, n;
+        struct fuse_bufvec      dst = FUSE_BUFVEC_INIT(0);
+        __u32                   pblk, count;
+        ssize_t                 res;
+        int                     error;
+
+        pthread_rwlock_wrlock(&ip->ui_rwlock);
+        pthread_mutex_lock(&fs->u_lock);
+        error = ux_prepare_write(fs, ip, off, size);
+        pthread_mutex_unlock(&fs->u_lock);
+
+        while (!error && done < size) {
+                pthread_mutex_lock(&fs->u_lock);
+                error = ux_extent_get(fs, ip, (off + done) / fs->u_bsize,
+                                      &pblk, &count);
+                pthread_mutex_unlock(&fs->u_lock);
+                if (!error && !pblk) {
+                        error = -EIO;
+                }
+                if (error) {
+                        break;
+                }
+                n = (size_t)count * fs->u_bsize - (off + done) % fs->u_bsize;
+                if (n > size - done) {
+                        n = size - done;
+                }
+
+                dst.buf[0].size = n;
+                dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                dst.buf[0].fd = fs->u_fd;
+                dst.buf[0].pos = (off_t)pblk * fs->u_bsize +
+                                 (off + done) % fs->u_bsize;
+                dst.idx = 0;
+                dst.off = 0;
+                res = fuse_buf_copy(&dst, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+                if (res < 0) {
+                        error = res;
+                } else if ((size_t)res < n) {
+                        error = -EIO;
+                }
+                done += n;
+        }
+        pthread_rwlock_unlock(&ip->ui_rwlock);
+
+        if (error) {
+                fuse_reply_err(req, -error);
+        } else {
+                fuse_reply_write(req, size);
+        }
+}
+
+static void
+uxfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        struct ux_fs            *fs = uxfs(req);
+        struct statvfs          st;
+
+        memset(&st, 0, sizeof(st));
+        pthread_mutex_lock(&fs->u_lock);
+        st.f_bsize = fs->u_bsize;
+        st.f_frsize = fs->u_bsize;
+        st.f_blocks = fs->u_sb.s_nblocks;
+        st.f_bfree = fs->u_bfree;
+        st.f_bavail = fs->u_bfree;
+        st.f_files = fs->u_sb.s_ninodes;
+        st.f_ffree = fs->u_ifree;
+        st.f_favail = fs->u_ifree;
+        st.f_namemax = UX_NAMELEN;
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_statfs(req, &st);
+}
+
+/*
+ * There is no journal to commit, so an fsync of anything writes
+ * back all of the metadata.
+ */
+
+static void
+uxfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+           struct fuse_file_info *fi)
+{
+        struct ux_fs            *fs = uxfs(req);
+        int                     error;
+
+        pthread_mutex_lock(&fs->u_lock);
+        error = ux_fs_sync(fs);
+        pthread_mutex_unlock(&fs->u_lock);
+        fuse_reply_err(req, -error);
+}
+
+static const struct fuse_lowlevel_ops uxfs_ops = {
+        .init           = uxfs_init,
+        .destroy        = uxfs_destroy,
+        .lookup         = uxfs_lookup,
+        .forget         = uxfs_forget,
+        .forget_multi   = uxfs_forget_multi,
+        .getattr        = uxfs_getattr,
+        .setattr        = uxfs_setattr,
+        .readdir        = uxfs_readdir,
+        .open           = uxfs_open,
+        .release        = uxfs_release,
+        .create         = uxfs_create,
+        .mknod          = uxfs_mknod,
+        .mkdir          = uxfs_mkdir,
+        .link           = uxfs_link,
+        .unlink         = uxfs_unlink,
+        .rmdir          = uxfs_rmdir,
+        .read           = uxfs_read,
+        .write_buf      = uxfs_write_buf,
+        .statfs         = uxfs_statfs,
+        .fsync          = uxfs_fsync,
+        .fsyncdir       = uxfs_fsync,
+};
+
+/*
+ * The first argument that is not an option is the image; the
+ * second is left for fuse_parse_cmdline() as the mount point.
+ * "ro" is both noted and passed on to the kernel.
+ */
+
+static int
+uxfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+        struct uxfs_opts        *opts = data;
+
+        if (key == KEY_RO) {
+                opts->rdonly = 1;
+                return 1;
+        }
+        if (key == FUSE_OPT_KEY_NONOPT && !opts->image) {
+                opts->image = strdup(arg);
+                return 0;
+        }
+        return 1;
+}
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: uxfs-fuse [-f] [-s] [-d] "
+                "[-o ro,cache_blocks=N,...] image mountpoint\n");
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct fuse_args        args = FUSE_ARGS_INIT(argc, argv);
+        struct fuse_cmdline_opts cmd;
+        struct fuse_loop_config config;
+        struct fuse_session     *se;
+        struct uxfs_opts        opts;
+        struct ux_fs            *fs;
+        char                    *fsname;
+        int                     error, ret = 1;
+
+        memset(&opts, 0, sizeof(opts));
+        if (fuse_opt_parse(&args, &opts, uxfs_opt_spec, uxfs_opt_proc) < 0 ||
+            fuse_parse_cmdline(&args, &cmd) != 0) {
+                usage();
+        }
+        if (cmd.show_help || !opts.image || !cmd.mountpoint) {
+                usage();
+        }
+
+        /*
+         * Open the image before daemonizing, both to report
+         * errors and because the daemon changes to "/".
+         */
+
+        fs = ux_fs_open(opts.image, opts.rdonly, opts.cache_blocks, &error);
+        if (!fs) {
+                if (error == -EUCLEAN) {
+                        fprintf(stderr, "uxfs-fuse: %s was not cleanly "
+                                "unmounted; run fsck.uxfs\n", opts.image);
+                } else {
+                        fprintf(stderr, "uxfs-fuse: %s: %s\n", opts.image,
+                                strerror(-error));
+                }
+                return 1;
+        }
+
+        /*
+         * Permission checks, including ACLs, are left to the
+         * kernel, which sees the owner and mode of every inode.
+         */
+
+        fsname = malloc(strlen(opts.image) + sizeof("-ofsname="));
+        if (!fsname) {
+                fprintf(stderr, "uxfs-fuse: Out of memory\n");
+                goto out_close;
+        }
+        sprintf(fsname, "-ofsname=%s", opts.image);
+        if (fuse_opt_add_arg(&args, "-odefault_permissions") ||
+            fuse_opt_add_arg(&args, "-osubtype=uxfs") ||
+            fuse_opt_add_arg(&args, fsname)) {
+                fprintf(stderr, "uxfs-fuse: Out of memory\n");
+                goto out_close;
+        }
+
+        se = fuse_session_new(&args, &uxfs_ops, sizeof(uxfs_ops), fs);
+        if (!se) {
+                goto out_close;
+        }
+        if (fuse_set_signal_handlers(se) != 0) {
+                goto out_destroy;
+        }
+        if (fuse_session_mount(se, cmd.mountpoint) != 0) {
+                goto out_signals;
+        }
+
+        fuse_daemonize(cmd.foreground);
+        if (cmd.singlethread) {
+                ret = fuse_session_loop(se);
+        } else {
+                config.clone_fd = cmd.clone_fd;
+                config.max_idle_threads = cmd.max_idle_threads;
+                ret = fuse_session_loop_mt(se, &config);
+        }
+        fuse_session_unmount(se);
+
+out_signals:
+        fuse_remove_signal_handlers(se);
+out_destroy:
+        fuse_session_destroy(se);
+out_close:
+        error = ux_fs_close(fs);
+        if (error) {
+                fprintf(stderr, "uxfs-fuse: %s: %s\n", opts.image,
+                        strerror(-error));
+                ret = 1;
+        }
+        free(fsname);
+        free(opts.image);
+        free(cmd.mountpoint);
+        fuse_opt_free_args(&args);
+        return ret ? 1 : 0;
+}
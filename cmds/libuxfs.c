@@ -0,0 +1,3054 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- libuxfs.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libuxfs.h"
+
+#define UX_MIN_GROUP    1024
+#define UX_BPL          (8 * sizeof(long))
+#define JBD2_MAGIC      0xc03b3998
+
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+#define MAX(a, b)       ((a) > (b) ? (a) : (b))
+
+/*
+ * Bit n of an on-disk bitmap is bit (n % 8) of byte (n / 8).
+ */
+
+static int
+testbit(unsigned char *map, unsigned long n)
+{
+        return (map[n >> 3] >> (n & 7)) & 1;
+}
+
+static void
+setbit(unsigned char *map, unsigned long n)
+{
+        map[n >> 3] |= 1 << (n & 7);
+}
+
+static void
+clearbit(unsigned char *map, unsigned long n)
+{
+        map[n >> 3] &= ~(1 << (n & 7));
+}
+
+static int
+pread_full(int fd, void *buf, size_t len, off_t off)
+{
+        ssize_t                 n;
+
+        while (len > 0) {
+                n = pread(fd, buf, len, off);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return n < 0 ? -errno : -EIO;
+                }
+                buf = (char *)buf + n;
+                len -= n;
+                off += n;
+        }
+        return 0;
+}
+
+static int
+pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+        ssize_t                 n;
+
+        while (len > 0) {
+                n = pwrite(fd, buf, len, off);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return n < 0 ? -errno : -EIO;
+                }
+                buf = (const char *)buf + n;
+                len -= n;
+                off += n;
+        }
+        return 0;
+}
+
+/*
+ * Is the run of "len" blocks at "blk" inside the data area? All
+ * block numbers read from the image are checked with this before
+ * use, so that a corrupt image cannot make us read or write
+ * outside the filesystem.
+ */
+
+static int
+ux_data_ok(struct ux_fs *fs, __u32 blk, __u32 len)
+{
+        struct ux_superblock    *usb = &fs->u_sb;
+
+        return blk >= usb->s_data_start && len <= usb->s_nblocks &&
+               blk - usb->s_data_start <= usb->s_nblocks - len;
+}
+
+/*---------------------------- block cache -----------------------------*/
+
+/*
+ * Metadata blocks are cached in ux_bufs, found through a hash of
+ * the block number and kept on an LRU list. When the cache is
+ * full, the least recently used buffer nobody holds is written
+ * back if it is dirty and reused. Buffers are only allocated
+ * beyond u_maxbufs if every one is held.
+ */
+
+static void
+ux_lru_del(struct ux_fs *fs, struct ux_buf *bp)
+{
+        if (bp->b_prev) {
+                bp->b_prev->b_next = bp->b_next;
+        } else {
+                fs->u_lru = bp->b_next;
+        }
+        if (bp->b_next) {
+                bp->b_next->b_prev = bp->b_prev;
+        } else {
+                fs->u_lru_tail = bp->b_prev;
+        }
+}
+
+static void
+ux_lru_add(struct ux_fs *fs, struct ux_buf *bp)
+{
+        bp->b_prev = NULL;
+        bp->b_next = fs->u_lru;
+        if (fs->u_lru) {
+                fs->u_lru->b_prev = bp;
+        } else {
+                fs->u_lru_tail = bp;
+        }
+        fs->u_lru = bp;
+}
+
+static void
+ux_bhash_del(struct ux_fs *fs, struct ux_buf *bp)
+{
+        struct ux_buf           **pp;
+
+        pp = &fs->u_bhash[bp->b_blocknr % fs->u_nbhash];
+        while (*pp != bp) {
+                pp = &(*pp)->b_hash;
+        }
+        *pp = bp->b_hash;
+}
+
+static struct ux_buf *
+ux_bfind(struct ux_fs *fs, __u32 blk)
+{
+        struct ux_buf           *bp;
+
+        for (bp = fs->u_bhash[blk % fs->u_nbhash]; bp; bp = bp->b_hash) {
+                if (bp->b_blocknr == blk) {
+                        return bp;
+                }
+        }
+        return NULL;
+}
+
+static int
+ux_bwrite(struct ux_fs *fs, struct ux_buf *bp)
+{
+        int                     error;
+
+        error = pwrite_full(fs->u_fd, bp->b_data, fs->u_bsize,
+                            (off_t)bp->b_blocknr * fs->u_bsize);
+        if (!error) {
+                bp->b_dirty = 0;
+        }
+        return error;
+}
+
+/*
+ * Find a buffer to hold a block that is not in the cache.
+ */
+
+static struct ux_buf *
+ux_bnew(struct ux_fs *fs, int *errorp)
+{
+        struct ux_buf           *bp;
+
+        if (fs->u_nbufs >= fs->u_maxbufs) {
+                for (bp = fs->u_lru_tail; bp; bp = bp->b_prev) {
+                        if (bp->b_count == 0) {
+                                break;
+                        }
+                }
+                if (bp) {
+                        if (bp->b_dirty) {
+                                *errorp = ux_bwrite(fs, bp);
+                                if (*errorp) {
+                                        return NULL;
+                                }
+                        }
+                        ux_lru_del(fs, bp);
+                        ux_bhash_del(fs, bp);
+                        return bp;
+                }
+        }
+
+        bp = calloc(1, sizeof(struct ux_buf));
+        if (bp) {
+                bp->b_data = malloc(fs->u_bsize);
+        }
+        if (!bp || !bp->b_data) {
+                free(bp);
+                *errorp = -ENOMEM;
+                return NULL;
+        }
+        fs->u_nbufs++;
+        return bp;
+}
+
+/*
+ * Return block "blk" with a reference held, reading it in if
+ * "read" is set and zeroing it otherwise.
+ */
+
+static struct ux_buf *
+ux_getblk(struct ux_fs *fs, __u32 blk, int read, int *errorp)
+{
+        struct ux_buf           *bp;
+        int                     error;
+
+        if ((off_t)blk >= (off_t)fs->u_sb.s_data_start + fs->u_sb.s_nblocks) {
+                *errorp = -EIO;
+                return NULL;
+        }
+
+        bp = ux_bfind(fs, blk);
+        if (bp) {
+                ux_lru_del(fs, bp);
+                if (!read) {
+                        memset(bp->b_data, 0, fs->u_bsize);
+                        bp->b_dirty = 1;
+                }
+        } else {
+                bp = ux_bnew(fs, errorp);
+                if (!bp) {
+                        return NULL;
+                }
+                bp->b_blocknr = blk;
+                bp->b_dirty = 0;
+                bp->b_count = 0;
+                if (read) {
+                        error = pread_full(fs->u_fd, bp->b_data, fs->u_bsize,
+                                           (off_t)blk * fs->u_bsize);
+                        if (error) {
+                                free(bp->b_data);
+                                free(bp);
+                                fs->u_nbufs--;
+                                *errorp = error;
+                                return NULL;
+                        }
+                } else {
+                        memset(bp->b_data, 0, fs->u_bsize);
+                        bp->b_dirty = 1;
+                }
+                bp->b_hash = fs->u_bhash[blk % fs->u_nbhash];
+                fs->u_bhash[blk % fs->u_nbhash] = bp;
+        }
+
+        ux_lru_add(fs, bp);
+        bp->b_count++;
+        return bp;
+}
+
+struct ux_buf *
+ux_bread(struct ux_fs *fs, __u32 blk, int *errorp)
+{
+        return ux_getblk(fs, blk, 1, errorp);
+}
+
+/*
+ * A newly allocated metadata block: there is no need to read
+ * what it held before.
+ */
+
+struct ux_buf *
+ux_bget_zero(struct ux_fs *fs, __u32 blk, int *errorp)
+{
+        return ux_getblk(fs, blk, 0, errorp);
+}
+
+void
+ux_brelse(struct ux_fs *fs, struct ux_buf *bp)
+{
+        (void)fs;
+        if (bp) {
+                bp->b_count--;
+        }
+}
+
+void
+ux_bdirty(struct ux_buf *bp)
+{
+        bp->b_dirty = 1;
+}
+
+/*
+ * A metadata block is being freed. Drop it from the cache, so
+ * that a stale copy is never written over whatever the block is
+ * used for next.
+ */
+
+void
+ux_bforget(struct ux_fs *fs, __u32 blk)
+{
+        struct ux_buf           *bp = ux_bfind(fs, blk);
+
+        if (bp && bp->b_count == 0) {
+                ux_lru_del(fs, bp);
+                ux_bhash_del(fs, bp);
+                free(bp->b_data);
+                free(bp);
+                fs->u_nbufs--;
+        } else if (bp) {
+                bp->b_dirty = 0;
+        }
+}
+
+static int
+ux_bflush(struct ux_fs *fs)
+{
+        struct ux_buf           *bp;
+        int                     error = 0, err;
+
+        for (bp = fs->u_lru; bp; bp = bp->b_next) {
+                if (bp->b_dirty) {
+                        err = ux_bwrite(fs, bp);
+                        if (err && !error) {
+                                error = err;
+                        }
+                }
+        }
+        return error;
+}
+
+/*---------------------------- allocation ------------------------------*/
+
+/*
+ * The bitmaps are held in memory in whole and written back by
+ * ux_fs_sync(), one bitmap block at a time for the blocks that
+ * have changed. The groups and placement policy are those of
+ * kern/ux_alloc.c, with the number of CPUs standing in for the
+ * number of possible CPUs.
+ */
+
+static unsigned long
+ux_find_zero(unsigned char *map, unsigned long size, unsigned long start)
+{
+        for (; start < size; start++) {
+                if ((start & 7) == 0 && start + 8 <= size &&
+                    map[start >> 3] == 0xff) {
+                        start += 7;
+                        continue;
+                }
+                if (!testbit(map, start)) {
+                        return start;
+                }
+        }
+        return size;
+}
+
+static unsigned long
+ux_find_set(unsigned char *map, unsigned long size, unsigned long start)
+{
+        for (; start < size; start++) {
+                if ((start & 7) == 0 && start + 8 <= size &&
+                    map[start >> 3] == 0) {
+                        start += 7;
+                        continue;
+                }
+                if (testbit(map, start)) {
+                        return start;
+                }
+        }
+        return size;
+}
+
+static unsigned long
+ux_group_alloc(struct ux_fs *fs, unsigned char *map, unsigned char *dirty,
+               struct ux_group *g, unsigned long size, unsigned long goal,
+               unsigned long *count)
+{
+        unsigned long           bpb = UX_BITS_PER_BLOCK(fs->u_bsize);
+        unsigned long           start, bit, end, i;
+
+        if (!g->g_free) {
+                return size;
+        }
+
+        start = (goal >= g->g_start && goal < g->g_end) ? goal : g->g_next;
+        bit = ux_find_zero(map, g->g_end, start);
+        if (bit >= g->g_end) {
+                bit = ux_find_zero(map, start, g->g_start);
+                if (bit >= start) {
+                        return size;
+                }
+        }
+
+        end = ux_find_set(map, MIN(g->g_end, bit + *count), bit);
+        for (i = bit; i < end; i++) {
+                setbit(map, i);
+        }
+        dirty[bit / bpb] = 1;
+        g->g_free -= end - bit;
+        if (g->g_next >= bit && g->g_next < end) {
+                g->g_next = end;
+        }
+
+        *count = end - bit;
+        return bit;
+}
+
+static unsigned long
+ux_bitmap_alloc(struct ux_fs *fs, unsigned char *map, unsigned char *dirty,
+                struct ux_groups *gs, unsigned long size,
+                unsigned long goal, unsigned long *count)
+{
+        unsigned int            first, i;
+        unsigned long           bit;
+        int                     cpu;
+
+        if (goal < size) {
+                first = goal / gs->gs_size;
+        } else {
+                cpu = sched_getcpu();
+                first = (cpu < 0 ? 0 : cpu) % gs->gs_count;
+        }
+
+        for (i = 0; i < gs->gs_count; i++) {
+                bit = ux_group_alloc(fs, map, dirty,
+                                     &gs->gs_group[(first + i) % gs->gs_count],
+                                     size, goal, count);
+                if (bit < size) {
+                        return bit;
+                }
+        }
+        return size;
+}
+
+static int
+ux_bitmap_free(struct ux_fs *fs, unsigned char *map, unsigned char *dirty,
+               struct ux_groups *gs, unsigned long bit)
+{
+        struct ux_group         *g = &gs->gs_group[bit / gs->gs_size];
+
+        if (!testbit(map, bit)) {
+                return 0;
+        }
+        clearbit(map, bit);
+        dirty[bit / UX_BITS_PER_BLOCK(fs->u_bsize)] = 1;
+        g->g_free++;
+        if (bit < g->g_next) {
+                g->g_next = bit;
+        }
+        return 1;
+}
+
+static struct ux_group *
+ux_block_group_of(struct ux_fs *fs, unsigned long ino)
+{
+        unsigned int            ig = ino / fs->u_igroups.gs_size;
+
+        return &fs->u_bgroups.gs_group[(unsigned long long)ig *
+                                       fs->u_bgroups.gs_count /
+                                       fs->u_igroups.gs_count];
+}
+
+static int
+ux_group_roomy(struct ux_fs *fs, struct ux_group *g, unsigned long ifree,
+               unsigned long bfree)
+{
+        return g->g_free >= ifree &&
+               ux_block_group_of(fs, g->g_start)->g_free >= bfree;
+}
+
+static struct ux_group *
+ux_find_group_dir(struct ux_fs *fs, __u32 dir)
+{
+        struct ux_groups        *gs = &fs->u_igroups;
+        struct ux_group         *g, *best = NULL;
+        unsigned long           avei, aveb;
+        unsigned int            first, i;
+
+        avei = fs->u_ifree / gs->gs_count;
+        aveb = fs->u_bfree / fs->u_bgroups.gs_count;
+
+        if (dir == UX_ROOT_INO) {
+                first = random() % gs->gs_count;
+                for (i = 0; i < gs->gs_count; i++) {
+                        g = &gs->gs_group[(first + i) % gs->gs_count];
+                        if (!ux_group_roomy(fs, g, avei, aveb)) {
+                                continue;
+                        }
+                        if (!best ||
+                            ux_block_group_of(fs, g->g_start)->g_free >
+                            ux_block_group_of(fs, best->g_start)->g_free) {
+                                best = g;
+                        }
+                }
+                return best;
+        }
+
+        first = dir / gs->gs_size;
+        for (i = 0; i < gs->gs_count; i++) {
+                g = &gs->gs_group[(first + i) % gs->gs_count];
+                if (ux_group_roomy(fs, g, avei / 2, aveb / 2)) {
+                        return g;
+                }
+        }
+        return NULL;
+}
+
+__u32
+ux_inode_alloc(struct ux_fs *fs, __u32 dir, mode_t mode)
+{
+        unsigned long           ino, goal = dir, count = 1;
+        struct ux_group         *g;
+
+        if (S_ISDIR(mode)) {
+                g = ux_find_group_dir(fs, dir);
+                if (g) {
+                        goal = g->g_next;
+                }
+        }
+
+        ino = ux_bitmap_alloc(fs, fs->u_imap, fs->u_imap_dirty,
+                              &fs->u_igroups, fs->u_sb.s_ninodes, goal,
+                              &count);
+        if (ino >= fs->u_sb.s_ninodes) {
+                return 0;
+        }
+        fs->u_ifree--;
+        return ino;
+}
+
+void
+ux_inode_free(struct ux_fs *fs, __u32 ino)
+{
+        if (ino < UX_ROOT_INO || ino >= fs->u_sb.s_ninodes) {
+                return;
+        }
+        if (ux_bitmap_free(fs, fs->u_imap, fs->u_imap_dirty,
+                           &fs->u_igroups, ino)) {
+                fs->u_ifree++;
+        }
+}
+
+__u32
+ux_data_goal(struct ux_fs *fs, __u32 ino)
+{
+        return fs->u_sb.s_data_start + ux_block_group_of(fs, ino)->g_next;
+}
+
+__u32
+ux_data_alloc_blocks(struct ux_fs *fs, __u32 goal, __u32 *count)
+{
+        struct ux_superblock    *usb = &fs->u_sb;
+        unsigned long           i, next = ULONG_MAX, len = *count;
+
+        if (*count == 0) {
+                return 0;
+        }
+        if (goal >= usb->s_data_start &&
+            goal < usb->s_data_start + usb->s_nblocks) {
+                next = goal - usb->s_data_start;
+        }
+
+        i = ux_bitmap_alloc(fs, fs->u_bmap, fs->u_bmap_dirty,
+                            &fs->u_bgroups, usb->s_nblocks, next, &len);
+        if (i >= usb->s_nblocks) {
+                return 0;
+        }
+        *count = len;
+        fs->u_bfree -= len;
+        return usb->s_data_start + i;
+}
+
+void
+ux_data_free(struct ux_fs *fs, __u32 blk)
+{
+        struct ux_superblock    *usb = &fs->u_sb;
+
+        if (!ux_data_ok(fs, blk, 1)) {
+                return;
+        }
+        ux_bforget(fs, blk);
+        if (ux_bitmap_free(fs, fs->u_bmap, fs->u_bmap_dirty,
+                           &fs->u_bgroups, blk - usb->s_data_start)) {
+                fs->u_bfree++;
+        }
+}
+
+static unsigned long
+ux_count_free(unsigned char *map, unsigned long start, unsigned long end)
+{
+        unsigned long           bit, used = 0;
+
+        for (bit = start; bit < end; bit++) {
+                if ((bit & 7) == 0 && bit + 8 <= end) {
+                        used += __builtin_popcount(map[bit >> 3]);
+                        bit += 7;
+                        continue;
+                }
+                used += testbit(map, bit);
+        }
+        return end - start - used;
+}
+
+static long
+ux_groups_init(struct ux_fs *fs, struct ux_groups *gs, unsigned char *map,
+               unsigned long size)
+{
+        unsigned long           total = 0, count, gsize, bpb;
+        struct ux_group         *g;
+        unsigned int            i;
+        long                    ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+        bpb = UX_BITS_PER_BLOCK(fs->u_bsize);
+        count = MAX(size / UX_MIN_GROUP, 1);
+        count = MIN((unsigned long)MAX(ncpu, 1), count);
+        for (gsize = 1; gsize < (size + count - 1) / count; gsize <<= 1) {
+                ;
+        }
+        gs->gs_size = MIN(MAX(gsize, UX_BPL), bpb);
+        gs->gs_count = (size + gs->gs_size - 1) / gs->gs_size;
+        gs->gs_group = calloc(gs->gs_count, sizeof(struct ux_group));
+        if (!gs->gs_group) {
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < gs->gs_count; i++) {
+                g = &gs->gs_group[i];
+                g->g_start = i * gs->gs_size;
+                g->g_end = MIN(size, g->g_start + gs->gs_size);
+                g->g_next = g->g_start;
+                g->g_free = ux_count_free(map, g->g_start, g->g_end);
+                total += g->g_free;
+        }
+        return total;
+}
+
+/*------------------------------ inodes --------------------------------*/
+
+static struct ux_inode *
+ux_raw_inode(struct ux_fs *fs, __u32 ino, struct ux_buf **bpp, int *errorp)
+{
+        unsigned long           ipb = UX_INODES_PER_BLOCK(fs->u_bsize);
+
+        *bpp = ux_bread(fs, fs->u_sb.s_itable_start + ino / ipb, errorp);
+        if (!*bpp) {
+                return NULL;
+        }
+        return (struct ux_inode *)((*bpp)->b_data +
+                                   (ino % ipb) * UX_INODE_SIZE);
+}
+
+struct ux_inode_info *
+ux_ifind(struct ux_fs *fs, __u32 ino)
+{
+        struct ux_inode_info    *ip;
+
+        for (ip = fs->u_ihash[ino % fs->u_nihash]; ip; ip = ip->ui_hash) {
+                if (ip->ui_ino == ino) {
+                        return ip;
+                }
+        }
+        return NULL;
+}
+
+static struct ux_inode_info *
+ux_inode_new(struct ux_fs *fs, __u32 ino)
+{
+        struct ux_inode_info    *ip;
+
+        ip = calloc(1, sizeof(struct ux_inode_info));
+        if (!ip) {
+                return NULL;
+        }
+        ip->ui_ino = ino;
+        ip->ui_count = 1;
+        pthread_rwlock_init(&ip->ui_rwlock, NULL);
+        ip->ui_hash = fs->u_ihash[ino % fs->u_nihash];
+        fs->u_ihash[ino % fs->u_nihash] = ip;
+        return ip;
+}
+
+static void
+ux_inode_destroy(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        struct ux_inode_info    **pp;
+
+        pp = &fs->u_ihash[ip->ui_ino % fs->u_nihash];
+        while (*pp != ip) {
+                pp = &(*pp)->ui_hash;
+        }
+        *pp = ip->ui_hash;
+        pthread_rwlock_destroy(&ip->ui_rwlock);
+        free(ip);
+}
+
+/*
+ * Bring inode "ino" into core, or take another reference to it
+ * if it is there already. Only regular files and directories
+ * that are in use are accepted.
+ */
+
+int
+ux_iget(struct ux_fs *fs, __u32 ino, struct ux_inode_info **ipp)
+{
+        struct ux_inode_info    *ip;
+        struct ux_inode         *di;
+        struct ux_buf           *bp;
+        int                     error;
+
+        if (ino < UX_ROOT_INO || ino >= fs->u_sb.s_ninodes ||
+            !testbit(fs->u_imap, ino)) {
+                return -ENOENT;
+        }
+
+        ip = ux_ifind(fs, ino);
+        if (ip) {
+                ip->ui_count++;
+                *ipp = ip;
+                return 0;
+        }
+
+        di = ux_raw_inode(fs, ino, &bp, &error);
+        if (!di) {
+                return error;
+        }
+        if ((!S_ISDIR(di->i_mode) && !S_ISREG(di->i_mode)) ||
+            (di->i_extent_blk ? !ux_data_ok(fs, di->i_extent_blk, 1) :
+                                di->i_nextents > UX_INLINE_EXTENTS)) {
+                ux_brelse(fs, bp);
+                return -EIO;
+        }
+
+        ip = ux_inode_new(fs, ino);
+        if (!ip) {
+                ux_brelse(fs, bp);
+                return -ENOMEM;
+        }
+        memcpy(&ip->ui_inode, di, sizeof(struct ux_inode));
+        ux_brelse(fs, bp);
+
+        *ipp = ip;
+        return 0;
+}
+
+void
+ux_mark_inode_dirty(struct ux_inode_info *ip)
+{
+        ip->ui_dirty = 1;
+}
+
+/*
+ * Copy the in-core inode into its slot in the inode table.
+ */
+
+int
+ux_write_inode(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        struct ux_inode         *di;
+        struct ux_buf           *bp;
+        int                     error;
+
+        if (!ip->ui_dirty || fs->u_rdonly) {
+                return 0;
+        }
+        di = ux_raw_inode(fs, ip->ui_ino, &bp, &error);
+        if (!di) {
+                return error;
+        }
+        memcpy(di, &ip->ui_inode, sizeof(struct ux_inode));
+        ux_bdirty(bp);
+        ux_brelse(fs, bp);
+        ip->ui_dirty = 0;
+        return 0;
+}
+
+/*
+ * Drop the ACL record an inode is sharing, as ux_acl_release()
+ * does.
+ */
+
+static void
+ux_acl_release(struct ux_fs *fs, __u32 blk)
+{
+        struct ux_acl_block     *ab;
+        struct ux_buf           *bp;
+        int                     error;
+
+        if (!ux_data_ok(fs, blk, 1)) {
+                return;
+        }
+        bp = ux_bread(fs, blk, &error);
+        if (!bp) {
+                return;
+        }
+        ab = (struct ux_acl_block *)bp->b_data;
+        if (ab->ab_magic != UX_ACL_MAGIC || ab->ab_refcount == 0) {
+                ux_brelse(fs, bp);
+                return;
+        }
+        if (--ab->ab_refcount == 0) {
+                ux_brelse(fs, bp);
+                ux_data_free(fs, blk);
+                return;
+        }
+        ux_bdirty(bp);
+        ux_brelse(fs, bp);
+}
+
+/*
+ * The last reference to an inode with no links has gone: free
+ * its blocks, its share of an ACL block and the inode itself,
+ * as ux_evict_inode() does.
+ */
+
+static void
+ux_evict_inode(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+
+        ux_extent_truncate(fs, ip, 0);
+        if (uip->i_acl_blk) {
+                ux_acl_release(fs, uip->i_acl_blk);
+                uip->i_acl_blk = 0;
+        }
+        uip->i_size = 0;
+        ux_mark_inode_dirty(ip);
+        ux_write_inode(fs, ip);
+        ux_inode_free(fs, ip->ui_ino);
+}
+
+void
+ux_iput_many(struct ux_fs *fs, struct ux_inode_info *ip, unsigned long n)
+{
+        if (!ip) {
+                return;
+        }
+        ip->ui_count -= MIN(n, ip->ui_count);
+        if (ip->ui_count) {
+                return;
+        }
+        if (ip->ui_inode.i_nlink == 0 && !fs->u_rdonly) {
+                ux_evict_inode(fs, ip);
+        } else {
+                ux_write_inode(fs, ip);
+        }
+        ux_inode_destroy(fs, ip);
+}
+
+void
+ux_iput(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        ux_iput_many(fs, ip, 1);
+}
+
+void
+ux_stat(struct ux_fs *fs, struct ux_inode_info *ip, struct stat *st)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+
+        memset(st, 0, sizeof(*st));
+        st->st_ino = ip->ui_ino;
+        st->st_mode = uip->i_mode;
+        st->st_nlink = uip->i_nlink;
+        st->st_uid = uip->i_uid;
+        st->st_gid = uip->i_gid;
+        st->st_size = uip->i_size;
+        st->st_blksize = fs->u_bsize;
+        st->st_blocks = (blkcnt_t)uip->i_blocks * (fs->u_bsize / 512);
+        st->st_atime = uip->i_atime;
+        st->st_mtime = uip->i_mtime;
+        st->st_ctime = uip->i_ctime;
+}
+
+/*------------------------------ extents -------------------------------*/
+
+/*
+ * A path through the extent tree of an inode. Level 0 is the
+ * root and level "depth" the leaf. At each level p_idx is the
+ * entry that was followed or, in the leaf, the last extent
+ * starting at or before the block looked up (-1 if none). An
+ * inode with inline extents has a path of one level and no
+ * buffer.
+ */
+
+struct ux_extent_path
+{
+        struct ux_buf           *p_bp;
+        int                     p_idx;
+};
+
+static struct ux_extent_header *
+ux_eh(struct ux_buf *bp)
+{
+        return (struct ux_extent_header *)bp->b_data;
+}
+
+static struct ux_extent_idx *
+ux_ei(struct ux_buf *bp)
+{
+        return (struct ux_extent_idx *)(ux_eh(bp) + 1);
+}
+
+static int
+ux_extent_max(struct ux_fs *fs, struct ux_extent_header *eh)
+{
+        return eh->eh_depth ? (int)UX_EXTENT_IDX_PER_BLOCK(fs->u_bsize) :
+                              (int)UX_EXTENTS_PER_BLOCK(fs->u_bsize);
+}
+
+/*
+ * Read the extent block "blk", which must be at "depth" in the
+ * tree, or for the root (depth -1) at any depth. Only a root
+ * leaf may be empty.
+ */
+
+static struct ux_buf *
+ux_extent_read(struct ux_fs *fs, __u32 blk, int depth, int *errorp)
+{
+        struct ux_extent_header *eh;
+        struct ux_buf           *bp;
+
+        if (!ux_data_ok(fs, blk, 1)) {
+                *errorp = -EIO;
+                return NULL;
+        }
+        bp = ux_bread(fs, blk, errorp);
+        if (!bp) {
+                return NULL;
+        }
+        eh = ux_eh(bp);
+        if (eh->eh_magic != UX_EXTENT_MAGIC ||
+            eh->eh_depth > UX_EXTENT_MAX_DEPTH ||
+            eh->eh_entries > ux_extent_max(fs, eh) ||
+            (depth >= 0 && eh->eh_depth != depth) ||
+            (!eh->eh_entries && (depth >= 0 || eh->eh_depth))) {
+                ux_brelse(fs, bp);
+                *errorp = -EIO;
+                return NULL;
+        }
+        return bp;
+}
+
+static int
+ux_extent_search(struct ux_extent *ex, int n, __u32 lblk)
+{
+        int                     lo = 0, hi = n - 1, mid, found = -1;
+
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                if (ex[mid].e_lblk <= lblk) {
+                        found = mid;
+                        lo = mid + 1;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        return found;
+}
+
+/*
+ * The first entry of an index block covers everything below
+ * the second, so the search never fails.
+ */
+
+static int
+ux_extent_isearch(struct ux_extent_idx *ei, int n, __u32 lblk)
+{
+        int                     lo = 1, hi = n - 1, mid, found = 0;
+
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                if (ei[mid].ei_lblk <= lblk) {
+                        found = mid;
+                        lo = mid + 1;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        return found;
+}
+
+static void
+ux_extent_release(struct ux_fs *fs, struct ux_extent_path *path, int depth)
+{
+        int                     l;
+
+        for (l = 0; l <= depth; l++) {
+                ux_brelse(fs, path[l].p_bp);
+        }
+}
+
+/*
+ * Fill in the path to the leaf that holds, or would hold,
+ * logical block "lblk". Returns the depth of the tree, or -1
+ * with *errorp set.
+ */
+
+static int
+ux_extent_find(struct ux_fs *fs, struct ux_inode_info *ip, __u32 lblk,
+               struct ux_extent_path *path, int *errorp)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        struct ux_extent_header *eh;
+        int                     l, depth;
+
+        if (!uip->i_extent_blk) {
+                path[0].p_bp = NULL;
+                path[0].p_idx = ux_extent_search(uip->i_extents,
+                                                 uip->i_nextents, lblk);
+                return 0;
+        }
+
+        path[0].p_bp = ux_extent_read(fs, uip->i_extent_blk, -1, errorp);
+        if (!path[0].p_bp) {
+                return -1;
+        }
+        depth = ux_eh(path[0].p_bp)->eh_depth;
+        for (l = 0; l < depth; l++) {
+                eh = ux_eh(path[l].p_bp);
+                path[l].p_idx = ux_extent_isearch(ux_ei(path[l].p_bp),
+                                                  eh->eh_entries, lblk);
+                path[l + 1].p_bp = ux_extent_read(fs,
+                        ux_ei(path[l].p_bp)[path[l].p_idx].ei_blk,
+                        depth - l - 1, errorp);
+                if (!path[l + 1].p_bp) {
+                        ux_extent_release(fs, path, l);
+                        return -1;
+                }
+        }
+        eh = ux_eh(path[depth].p_bp);
+        path[depth].p_idx = ux_extent_search((struct ux_extent *)(eh + 1),
+                                             eh->eh_entries, lblk);
+        return depth;
+}
+
+/*
+ * Return the extents of the leaf at the end of "path" and in
+ * *np how many there are.
+ */
+
+static struct ux_extent *
+ux_extent_leaf(struct ux_inode_info *ip, struct ux_extent_path *path,
+               int depth, int *np)
+{
+        struct ux_extent_header *eh;
+
+        if (!path[depth].p_bp) {
+                *np = ip->ui_inode.i_nextents;
+                return ip->ui_inode.i_extents;
+        }
+        eh = ux_eh(path[depth].p_bp);
+        *np = eh->eh_entries;
+        return (struct ux_extent *)(eh + 1);
+}
+
+/*
+ * A leaf now has "n" extents, "change" more than before.
+ */
+
+static void
+ux_extent_dirty(struct ux_inode_info *ip, struct ux_buf *bp, int n,
+                int change)
+{
+        ip->ui_inode.i_nextents += change;
+        if (bp) {
+                ux_eh(bp)->eh_entries = n;
+                ux_bdirty(bp);
+        }
+        ux_mark_inode_dirty(ip);
+}
+
+/*
+ * The inline extents are full. Move them to a new root block.
+ */
+
+static int
+ux_extent_spill(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        struct ux_extent_header *eh;
+        struct ux_buf           *bp;
+        __u32                   blk, count = 1;
+        int                     error;
+
+        blk = ux_data_alloc_blocks(fs, uip->i_extents[0].e_pblk, &count);
+        if (!blk) {
+                return -ENOSPC;
+        }
+        bp = ux_bget_zero(fs, blk, &error);
+        if (!bp) {
+                ux_data_free(fs, blk);
+                return error;
+        }
+        eh = ux_eh(bp);
+        eh->eh_magic = UX_EXTENT_MAGIC;
+        eh->eh_entries = uip->i_nextents;
+        memcpy(eh + 1, uip->i_extents,
+               uip->i_nextents * sizeof(struct ux_extent));
+        ux_brelse(fs, bp);
+
+        memset(uip->i_extents, 0, sizeof(uip->i_extents));
+        uip->i_extent_blk = blk;
+        ux_mark_inode_dirty(ip);
+        return 0;
+}
+
+/*
+ * Every block on the path is full. Move the root's entries to
+ * a new block and make the root an index of that one block.
+ */
+
+static int
+ux_extent_grow(struct ux_fs *fs, struct ux_buf *root)
+{
+        struct ux_extent_header *eh = ux_eh(root);
+        struct ux_buf           *bp;
+        __u32                   blk, key, count = 1;
+        int                     error;
+
+        if (eh->eh_depth == UX_EXTENT_MAX_DEPTH) {
+                return -EFBIG;
+        }
+        blk = ux_data_alloc_blocks(fs, root->b_blocknr, &count);
+        if (!blk) {
+                return -ENOSPC;
+        }
+        bp = ux_bget_zero(fs, blk, &error);
+        if (!bp) {
+                ux_data_free(fs, blk);
+                return error;
+        }
+        memcpy(bp->b_data, root->b_data, fs->u_bsize);
+        ux_brelse(fs, bp);
+
+        key = eh->eh_depth ? ux_ei(root)[0].ei_lblk :
+                             ((struct ux_extent *)(eh + 1))[0].e_lblk;
+        memset(eh + 1, 0, fs->u_bsize - sizeof(struct ux_extent_header));
+        eh->eh_depth++;
+        eh->eh_entries = 1;
+        ux_ei(root)[0].ei_lblk = key;
+        ux_ei(root)[0].ei_blk = blk;
+        ux_bdirty(root);
+        return 0;
+}
+
+/*
+ * Split the full block at level "k" of "path", whose parent has
+ * room. When the path runs through the last entry, as it does
+ * when a file is written from start to end, only that entry
+ * moves, so the blocks left behind stay full.
+ */
+
+static int
+ux_extent_split(struct ux_fs *fs, struct ux_extent_path *path, int k)
+{
+        struct ux_extent_header *eh = ux_eh(path[k].p_bp), *neh, *peh;
+        struct ux_extent_idx    *pei;
+        struct ux_buf           *bp;
+        __u32                   blk, key, count = 1;
+        size_t                  size;
+        int                     n = eh->eh_entries, m, j, error;
+
+        m = (path[k].p_idx == n - 1) ? n - 1 : n / 2;
+        size = eh->eh_depth ? sizeof(struct ux_extent_idx) :
+                              sizeof(struct ux_extent);
+
+        blk = ux_data_alloc_blocks(fs, path[k].p_bp->b_blocknr, &count);
+        if (!blk) {
+                return -ENOSPC;
+        }
+        bp = ux_bget_zero(fs, blk, &error);
+        if (!bp) {
+                ux_data_free(fs, blk);
+                return error;
+        }
+        neh = ux_eh(bp);
+        neh->eh_magic = UX_EXTENT_MAGIC;
+        neh->eh_depth = eh->eh_depth;
+        neh->eh_entries = n - m;
+        memcpy(neh + 1, (char *)(eh + 1) + m * size, (n - m) * size);
+        key = neh->eh_depth ? ux_ei(bp)[0].ei_lblk :
+                              ((struct ux_extent *)(neh + 1))[0].e_lblk;
+        ux_brelse(fs, bp);
+
+        memset((char *)(eh + 1) + m * size, 0, (n - m) * size);
+        eh->eh_entries = m;
+        ux_bdirty(path[k].p_bp);
+
+        peh = ux_eh(path[k - 1].p_bp);
+        pei = ux_ei(path[k - 1].p_bp);
+        j = path[k - 1].p_idx + 1;
+        memmove(&pei[j + 1], &pei[j],
+                (peh->eh_entries - j) * sizeof(struct ux_extent_idx));
+        pei[j].ei_lblk = key;
+        pei[j].ei_blk = blk;
+        peh->eh_entries++;
+        ux_bdirty(path[k - 1].p_bp);
+        return 0;
+}
+
+/*
+ * The leaf at the end of "path" is full. Make room in it, or
+ * at least get one step closer: spill inline extents to a
+ * block, split the deepest full block whose parent has room,
+ * or push the root down a level. The caller looks the path up
+ * again afterwards.
+ */
+
+static int
+ux_extent_make_room(struct ux_fs *fs, struct ux_inode_info *ip,
+                    struct ux_extent_path *path, int depth)
+{
+        struct ux_extent_header *eh;
+        int                     k;
+
+        if (!path[0].p_bp) {
+                return ux_extent_spill(fs, ip);
+        }
+        for (k = depth; k > 0; k--) {
+                eh = ux_eh(path[k - 1].p_bp);
+                if (eh->eh_entries < ux_extent_max(fs, eh)) {
+                        return ux_extent_split(fs, path, k);
+                }
+        }
+        return ux_extent_grow(fs, path[0].p_bp);
+}
+
+static int
+ux_extent_insert(struct ux_fs *fs, struct ux_inode_info *ip, __u32 lblk,
+                 __u32 pblk, __u32 len)
+{
+        struct ux_extent_path   path[UX_EXTENT_MAX_DEPTH + 1];
+        struct ux_extent        *ex;
+        struct ux_buf           *bp;
+        int                     i, n, old, max, depth, error;
+
+again:
+        depth = ux_extent_find(fs, ip, lblk, path, &error);
+        if (depth < 0) {
+                return error;
+        }
+        ex = ux_extent_leaf(ip, path, depth, &n);
+        bp = path[depth].p_bp;
+        i = path[depth].p_idx;
+        old = n;
+
+        if (i >= 0 && ex[i].e_lblk + ex[i].e_len == lblk &&
+            ex[i].e_pblk + ex[i].e_len == pblk) {
+                ex[i].e_len += len;
+                if (i + 1 < n && ex[i + 1].e_lblk == lblk + len &&
+                    ex[i + 1].e_pblk == pblk + len) {
+                        ex[i].e_len += ex[i + 1].e_len;
+                        memmove(&ex[i + 1], &ex[i + 2],
+                                (n - i - 2) * sizeof(struct ux_extent));
+                        memset(&ex[n - 1], 0, sizeof(struct ux_extent));
+                        n--;
+                }
+                goto out;
+        }
+
+        if (i + 1 < n && ex[i + 1].e_lblk == lblk + len &&
+            ex[i + 1].e_pblk == pblk + len) {
+                ex[i + 1].e_lblk = lblk;
+                ex[i + 1].e_pblk = pblk;
+                ex[i + 1].e_len += len;
+                goto out;
+        }
+
+        max = bp ? (int)UX_EXTENTS_PER_BLOCK(fs->u_bsize) : UX_INLINE_EXTENTS;
+        if (n == max) {
+                error = ux_extent_make_room(fs, ip, path, depth);
+                ux_extent_release(fs, path, depth);
+                if (error) {
+                        return error;
+                }
+                goto again;
+        }
+
+        memmove(&ex[i + 2], &ex[i + 1], (n - i - 1) * sizeof(struct ux_extent));
+        ex[i + 1].e_lblk = lblk;
+        ex[i + 1].e_pblk = pblk;
+        ex[i + 1].e_len = len;
+        n++;
+
+out:
+        ux_extent_dirty(ip, bp, n, n - old);
+        ux_extent_release(fs, path, depth);
+        return 0;
+}
+
+/*
+ * Map logical block "lblk". On return *pblk is the disk block,
+ * or 0 for a hole, and *len the number of blocks from lblk that
+ * are mapped (or unmapped) the same way. A hole stops where the
+ * next leaf begins, so that an extent allocated for it always
+ * belongs in the leaf it is looked up in. An extent that points
+ * outside the data area makes the whole file unreadable.
+ */
+
+int
+ux_extent_get(struct ux_fs *fs, struct ux_inode_info *ip, __u32 lblk,
+              __u32 *pblk, __u32 *len)
+{
+        struct ux_extent_path   path[UX_EXTENT_MAX_DEPTH + 1];
+        struct ux_extent_header *eh;
+        struct ux_extent        *ex;
+        __u32                   end;
+        int                     i, n, l, depth, error = 0;
+
+        depth = ux_extent_find(fs, ip, lblk, path, &error);
+        if (depth < 0) {
+                return error;
+        }
+        ex = ux_extent_leaf(ip, path, depth, &n);
+        i = path[depth].p_idx;
+        if (i >= 0 && lblk - ex[i].e_lblk < ex[i].e_len) {
+                if (!ux_data_ok(fs, ex[i].e_pblk, ex[i].e_len)) {
+                        error = -EIO;
+                } else {
+                        *pblk = ex[i].e_pblk + (lblk - ex[i].e_lblk);
+                        *len = ex[i].e_lblk + ex[i].e_len - lblk;
+                }
+        } else {
+                end = (i + 1 < n) ? ex[i + 1].e_lblk : 0xffffffffU;
+                for (l = 0; l < depth; l++) {
+                        eh = ux_eh(path[l].p_bp);
+                        i = path[l].p_idx;
+                        if (i + 1 < eh->eh_entries &&
+                            ux_ei(path[l].p_bp)[i + 1].ei_lblk < end) {
+                                end = ux_ei(path[l].p_bp)[i + 1].ei_lblk;
+                        }
+                }
+                *pblk = 0;
+                *len = end - lblk;
+        }
+
+        ux_extent_release(fs, path, depth);
+        return error;
+}
+
+__u32
+ux_extent_bmap(struct ux_fs *fs, struct ux_inode_info *ip, __u32 lblk)
+{
+        __u32                   pblk, len;
+
+        if (ux_extent_get(fs, ip, lblk, &pblk, &len)) {
+                return 0;
+        }
+        return pblk;
+}
+
+/*
+ * Allocate up to *len blocks for the hole at logical block
+ * "lblk", no more than the hole holds.
+ */
+
+int
+ux_extent_alloc(struct ux_fs *fs, struct ux_inode_info *ip, __u32 lblk,
+                __u32 *pblk, __u32 *len)
+{
+        __u32                   goal = 0, blk, count, i;
+        int                     error;
+
+        error = ux_extent_get(fs, ip, lblk, &blk, &count);
+        if (error) {
+                return error;
+        }
+        count = MIN(count, *len);
+
+        if (lblk > 0) {
+                goal = ux_extent_bmap(fs, ip, lblk - 1);
+                if (goal) {
+                        goal++;
+                }
+        }
+        if (!goal) {
+                goal = ux_data_goal(fs, ip->ui_ino);
+        }
+
+        blk = ux_data_alloc_blocks(fs, goal, &count);
+        if (!blk) {
+                return -ENOSPC;
+        }
+
+        error = ux_extent_insert(fs, ip, lblk, blk, count);
+        if (error) {
+                for (i = 0; i < count; i++) {
+                        ux_data_free(fs, blk + i);
+                }
+                return error;
+        }
+
+        ip->ui_inode.i_blocks += count;
+        ux_mark_inode_dirty(ip);
+        *pblk = blk;
+        *len = count;
+        return 0;
+}
+
+/*
+ * One step of a truncate to "nblocks" blocks: free what lies
+ * beyond it of the last extent, and any extent blocks that are
+ * left empty. Returns 1 if there may be more to do.
+ */
+
+static int
+ux_extent_trim(struct ux_fs *fs, struct ux_inode_info *ip,
+               struct ux_extent_path *path, int depth, __u32 nblocks)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        struct ux_extent_header *eh;
+        struct ux_extent        *ex, *e;
+        __u32                   keep, i, blk;
+        int                     n, l;
+
+        ex = ux_extent_leaf(ip, path, depth, &n);
+        if (n == 0 || ex[n - 1].e_lblk + ex[n - 1].e_len <= nblocks) {
+                return 0;
+        }
+
+        e = &ex[n - 1];
+        keep = (e->e_lblk < nblocks) ? nblocks - e->e_lblk : 0;
+        if (ux_data_ok(fs, e->e_pblk, e->e_len)) {
+                for (i = keep; i < e->e_len; i++) {
+                        ux_data_free(fs, e->e_pblk + i);
+                }
+        }
+        uip->i_blocks -= MIN(e->e_len - keep, uip->i_blocks);
+        if (keep) {
+                e->e_len = keep;
+                ux_extent_dirty(ip, path[depth].p_bp, n, 0);
+                return 0;
+        }
+        memset(e, 0, sizeof(struct ux_extent));
+        ux_extent_dirty(ip, path[depth].p_bp, n - 1, -1);
+
+        for (l = depth; l > 0 && ux_eh(path[l].p_bp)->eh_entries == 0; l--) {
+                blk = path[l].p_bp->b_blocknr;
+                ux_brelse(fs, path[l].p_bp);
+                path[l].p_bp = NULL;
+                ux_data_free(fs, blk);
+
+                eh = ux_eh(path[l - 1].p_bp);
+                eh->eh_entries--;
+                memset(&ux_ei(path[l - 1].p_bp)[eh->eh_entries], 0,
+                       sizeof(struct ux_extent_idx));
+                if (l == 1 && eh->eh_entries == 0) {
+                        eh->eh_depth = 0;
+                }
+                ux_bdirty(path[l - 1].p_bp);
+        }
+        return 1;
+}
+
+/*
+ * After a truncate, pull the only child of the root up into
+ * the root and move a root leaf that fits back into the inode.
+ */
+
+static int
+ux_extent_shrink(struct ux_fs *fs, struct ux_inode_info *ip)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        struct ux_extent_header *eh;
+        struct ux_buf           *root, *bp;
+        __u32                   blk;
+        int                     error = 0;
+
+        if (!uip->i_extent_blk) {
+                return 0;
+        }
+        root = ux_extent_read(fs, uip->i_extent_blk, -1, &error);
+        if (!root) {
+                return error;
+        }
+        eh = ux_eh(root);
+
+        while (eh->eh_depth > 0 && eh->eh_entries == 1) {
+                blk = ux_ei(root)[0].ei_blk;
+                bp = ux_extent_read(fs, blk, eh->eh_depth - 1, &error);
+                if (!bp) {
+                        ux_brelse(fs, root);
+                        return error;
+                }
+                memcpy(root->b_data, bp->b_data, fs->u_bsize);
+                ux_bdirty(root);
+                ux_brelse(fs, bp);
+                ux_data_free(fs, blk);
+        }
+
+        if (eh->eh_depth == 0 && eh->eh_entries <= UX_INLINE_EXTENTS) {
+                memset(uip->i_extents, 0, sizeof(uip->i_extents));
+                memcpy(uip->i_extents, eh + 1,
+                       eh->eh_entries * sizeof(struct ux_extent));
+                ux_brelse(fs, root);
+                ux_data_free(fs, uip->i_extent_blk);
+                uip->i_extent_blk = 0;
+                ux_mark_inode_dirty(ip);
+                return 0;
+        }
+        ux_brelse(fs, root);
+        return 0;
+}
+
+/*
+ * Free every block at or beyond logical block "nblocks", one
+ * extent at a time from the end.
+ */
+
+int
+ux_extent_truncate(struct ux_fs *fs, struct ux_inode_info *ip, __u32 nblocks)
+{
+        struct ux_extent_path   path[UX_EXTENT_MAX_DEPTH + 1];
+        int                     depth, more, error;
+
+        do {
+                depth = ux_extent_find(fs, ip, 0xffffffffU, path, &error);
+                if (depth < 0) {
+                        return error;
+                }
+                more = ux_extent_trim(fs, ip, path, depth, nblocks);
+                ux_extent_release(fs, path, depth);
+        } while (more);
+
+        return ux_extent_shrink(fs, ip);
+}
+
+/*---------------------------- directories -----------------------------*/
+
+static int
+ux_name_eq(struct ux_dirent *dirent, const char *name)
+{
+        return dirent->d_ino && !strncmp(dirent->d_name, name, UX_NAMELEN);
+}
+
+static struct ux_buf *
+ux_dir_bread(struct ux_fs *fs, struct ux_inode_info *dip, __u32 lblk,
+             int *errorp)
+{
+        __u32                   pblk = ux_extent_bmap(fs, dip, lblk);
+
+        if (!pblk) {
+                *errorp = -EIO;
+                return NULL;
+        }
+        return ux_bread(fs, pblk, errorp);
+}
+
+struct ux_dx_item
+{
+        __u32                   hash;
+        struct ux_dirent        de;
+};
+
+static int
+ux_dx_cmp(const void *a, const void *b)
+{
+        __u32                   ha = ((const struct ux_dx_item *)a)->hash;
+        __u32                   hb = ((const struct ux_dx_item *)b)->hash;
+
+        return (ha > hb) - (ha < hb);
+}
+
+/*
+ * One level of the path from the index root down to a leaf, as
+ * in ux_dx.c.
+ */
+
+struct ux_dx_frame
+{
+        struct ux_buf           *bp;
+        struct ux_dx_entry      *entries;
+        __u16                   *count;
+        int                     limit;
+        int                     idx;
+};
+
+static void
+ux_dx_release(struct ux_fs *fs, struct ux_dx_frame *frames, int levels)
+{
+        int                     l;
+
+        for (l = 0; l <= levels; l++) {
+                ux_brelse(fs, frames[l].bp);
+        }
+}
+
+static int
+ux_dx_search(struct ux_dx_frame *frame, __u32 hash)
+{
+        int                     lo = 1, hi = *frame->count - 1, mid, idx = 0;
+
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                if (frame->entries[mid].de_hash <= hash) {
+                        idx = mid;
+                        lo = mid + 1;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        return idx;
+}
+
+static int
+ux_dx_probe(struct ux_fs *fs, struct ux_inode_info *dip, __u32 hash,
+            struct ux_dx_frame *frames)
+{
+        struct ux_dx_root       *root;
+        struct ux_dx_node       *node;
+        struct ux_buf           *bp;
+        int                     l, levels, error;
+
+        bp = ux_dir_bread(fs, dip, 0, &error);
+        if (!bp) {
+                return error;
+        }
+        root = (struct ux_dx_root *)bp->b_data;
+        if (root->dr_magic != UX_DX_MAGIC || root->dr_count == 0 ||
+            root->dr_count > UX_DX_LIMIT(fs->u_bsize) ||
+            root->dr_levels > UX_DX_MAX_LEVELS) {
+                ux_brelse(fs, bp);
+                return -EIO;
+        }
+        levels = root->dr_levels;
+        frames[0].bp = bp;
+        frames[0].entries = root->dr_entries;
+        frames[0].count = &root->dr_count;
+        frames[0].limit = UX_DX_LIMIT(fs->u_bsize);
+
+        for (l = 0; ; l++) {
+                frames[l].idx = ux_dx_search(&frames[l], hash);
+                if (l == levels) {
+                        return levels;
+                }
+                bp = ux_dir_bread(fs, dip,
+                                  frames[l].entries[frames[l].idx].de_lblk,
+                                  &error);
+                node = bp ? (struct ux_dx_node *)bp->b_data : NULL;
+                if (!bp || !ux_dx_is_node(node) || node->dn_count == 0 ||
+                    node->dn_count > UX_DX_NODE_LIMIT(fs->u_bsize)) {
+                        ux_brelse(fs, bp);
+                        ux_dx_release(fs, frames, l);
+                        return bp ? -EIO : error;
+                }
+                frames[l + 1].bp = bp;
+                frames[l + 1].entries = node->dn_entries;
+                frames[l + 1].count = &node->dn_count;
+                frames[l + 1].limit = UX_DX_NODE_LIMIT(fs->u_bsize);
+        }
+}
+
+static struct ux_buf *
+ux_dx_leaf(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+           struct ux_dx_frame *frames, int *levelsp, int *errorp)
+{
+        struct ux_dx_frame      *frame;
+        struct ux_buf           *bp;
+        int                     levels;
+
+        levels = ux_dx_probe(fs, dip, ux_dx_hash(name), frames);
+        if (levels < 0) {
+                *errorp = levels;
+                return NULL;
+        }
+        frame = &frames[levels];
+        bp = ux_dir_bread(fs, dip, frame->entries[frame->idx].de_lblk,
+                          errorp);
+        if (!bp) {
+                ux_dx_release(fs, frames, levels);
+                return NULL;
+        }
+        *levelsp = levels;
+        return bp;
+}
+
+/*
+ * Append a new, zeroed block to a directory.
+ */
+
+static struct ux_buf *
+ux_dir_grow(struct ux_fs *fs, struct ux_inode_info *dip, __u32 *lblk,
+            int *errorp)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        __u32                   pblk, len = 1;
+
+        *lblk = uip->i_blocks;
+        *errorp = ux_extent_alloc(fs, dip, *lblk, &pblk, &len);
+        if (*errorp) {
+                return NULL;
+        }
+        uip->i_size += fs->u_bsize;
+        ux_mark_inode_dirty(dip);
+        return ux_bget_zero(fs, pblk, errorp);
+}
+
+static struct ux_buf *
+ux_dx_new_node(struct ux_fs *fs, struct ux_inode_info *dip, __u32 *lblk,
+               int *errorp)
+{
+        struct ux_dx_node       *node;
+        struct ux_buf           *bp;
+
+        bp = ux_dir_grow(fs, dip, lblk, errorp);
+        if (!bp) {
+                return NULL;
+        }
+        node = (struct ux_dx_node *)bp->b_data;
+        node->dn_fake.d_type = UX_DT_DX_NODE;
+        node->dn_magic = UX_DX_NODE_MAGIC;
+        return bp;
+}
+
+static void
+ux_dx_insert(struct ux_dx_frame *frame, __u32 hash, __u32 lblk)
+{
+        struct ux_dx_entry      *entries = frame->entries;
+        int                     idx = frame->idx + 1;
+
+        memmove(&entries[idx + 1], &entries[idx],
+                (*frame->count - idx) * sizeof(struct ux_dx_entry));
+        entries[idx].de_hash = hash;
+        entries[idx].de_lblk = lblk;
+        (*frame->count)++;
+        ux_bdirty(frame->bp);
+}
+
+static int
+ux_dx_split(struct ux_fs *fs, struct ux_inode_info *dip,
+            struct ux_dx_frame *frame, struct ux_buf *bp)
+{
+        int                     dpb = UX_DIRS_PER_BLOCK(fs->u_bsize);
+        struct ux_dirent        *dirent, *ndirent;
+        struct ux_dx_item       *items;
+        struct ux_buf           *nbp;
+        __u32                   lblk;
+        int                     i, m = 0, d, error;
+
+        items = malloc(dpb * sizeof(struct ux_dx_item));
+        if (!items) {
+                return -ENOMEM;
+        }
+
+        dirent = (struct ux_dirent *)bp->b_data;
+        for (i = 0; i < dpb; i++) {
+                items[i].hash = ux_dx_hash(dirent[i].d_name);
+                items[i].de = dirent[i];
+        }
+        qsort(items, dpb, sizeof(struct ux_dx_item), ux_dx_cmp);
+
+        for (d = 0; d < dpb / 2 && !m; d++) {
+                if (items[dpb / 2 + d].hash != items[dpb / 2 + d - 1].hash) {
+                        m = dpb / 2 + d;
+                } else if (dpb / 2 - d > 0 &&
+                           items[dpb / 2 - d].hash !=
+                           items[dpb / 2 - d - 1].hash) {
+                        m = dpb / 2 - d;
+                }
+        }
+        if (!m) {
+                free(items);
+                return -ENOSPC;
+        }
+
+        nbp = ux_dir_grow(fs, dip, &lblk, &error);
+        if (!nbp) {
+                free(items);
+                return error;
+        }
+
+        memset(bp->b_data, 0, fs->u_bsize);
+        ndirent = (struct ux_dirent *)nbp->b_data;
+        for (i = 0; i < dpb; i++) {
+                if (i < m) {
+                        dirent[i] = items[i].de;
+                } else {
+                        ndirent[i - m] = items[i].de;
+                }
+        }
+        ux_bdirty(bp);
+        ux_bdirty(nbp);
+        ux_brelse(fs, nbp);
+
+        ux_dx_insert(frame, items[m].hash, lblk);
+        free(items);
+        return 0;
+}
+
+static int
+ux_dx_split_node(struct ux_fs *fs, struct ux_inode_info *dip,
+                 struct ux_dx_frame *frame)
+{
+        struct ux_dx_frame      *parent = frame - 1;
+        int                     m = *frame->count / 2;
+        int                     n = *frame->count - m;
+        struct ux_dx_node       *nnode;
+        struct ux_buf           *nbp;
+        __u32                   lblk;
+        int                     error;
+
+        nbp = ux_dx_new_node(fs, dip, &lblk, &error);
+        if (!nbp) {
+                return error;
+        }
+        nnode = (struct ux_dx_node *)nbp->b_data;
+        memcpy(nnode->dn_entries, &frame->entries[m],
+               n * sizeof(struct ux_dx_entry));
+        nnode->dn_count = n;
+        ux_bdirty(nbp);
+        ux_brelse(fs, nbp);
+
+        ux_dx_insert(parent, frame->entries[m].de_hash, lblk);
+        memset(&frame->entries[m], 0, n * sizeof(struct ux_dx_entry));
+        *frame->count = m;
+        ux_bdirty(frame->bp);
+        return 0;
+}
+
+static int
+ux_dx_grow_root(struct ux_fs *fs, struct ux_inode_info *dip,
+                struct ux_dx_frame *frame)
+{
+        struct ux_dx_root       *root = (struct ux_dx_root *)frame->bp->b_data;
+        struct ux_dx_node       *nnode;
+        struct ux_buf           *nbp;
+        __u32                   lblk;
+        int                     error;
+
+        if (root->dr_levels == UX_DX_MAX_LEVELS) {
+                return -ENOSPC;
+        }
+        nbp = ux_dx_new_node(fs, dip, &lblk, &error);
+        if (!nbp) {
+                return error;
+        }
+        nnode = (struct ux_dx_node *)nbp->b_data;
+        memcpy(nnode->dn_entries, root->dr_entries,
+               root->dr_count * sizeof(struct ux_dx_entry));
+        nnode->dn_count = root->dr_count;
+        ux_bdirty(nbp);
+        ux_brelse(fs, nbp);
+
+        memset(root->dr_entries, 0,
+               root->dr_count * sizeof(struct ux_dx_entry));
+        root->dr_entries[0].de_hash = 0;
+        root->dr_entries[0].de_lblk = lblk;
+        root->dr_count = 1;
+        root->dr_levels++;
+        ux_bdirty(frame->bp);
+        return 0;
+}
+
+static int
+ux_dx_add(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+          __u32 ino, mode_t mode)
+{
+        struct ux_dx_frame      frames[UX_DX_MAX_LEVELS + 1];
+        struct ux_dirent        *dirent, *slot;
+        struct ux_buf           *bp;
+        int                     i, k, levels, error = 0;
+
+again:
+        bp = ux_dx_leaf(fs, dip, name, frames, &levels, &error);
+        if (!bp) {
+                return error;
+        }
+
+        slot = NULL;
+        dirent = (struct ux_dirent *)bp->b_data;
+        for (i = 0; i < (int)UX_DIRS_PER_BLOCK(fs->u_bsize); i++, dirent++) {
+                if (dirent->d_ino == 0) {
+                        if (!slot) {
+                                slot = dirent;
+                        }
+                } else if (ux_name_eq(dirent, name)) {
+                        error = -EEXIST;
+                        goto out;
+                }
+        }
+        if (slot) {
+                slot->d_ino = ino;
+                slot->d_type = UX_DT(mode);
+                strcpy(slot->d_name, name);
+                ux_bdirty(bp);
+                goto out;
+        }
+
+        k = levels;
+        while (k >= 0 && *frames[k].count >= frames[k].limit) {
+                k--;
+        }
+        if (k == levels) {
+                error = ux_dx_split(fs, dip, &frames[levels], bp);
+        } else if (k >= 0) {
+                error = ux_dx_split_node(fs, dip, &frames[k + 1]);
+        } else {
+                error = ux_dx_grow_root(fs, dip, &frames[0]);
+        }
+        if (!error) {
+                ux_brelse(fs, bp);
+                ux_dx_release(fs, frames, levels);
+                goto again;
+        }
+
+out:
+        ux_brelse(fs, bp);
+        ux_dx_release(fs, frames, levels);
+        return error;
+}
+
+/*
+ * Turn a full linear directory into an indexed one, exactly as
+ * ux_dx_convert() does: nothing is rewritten until every block
+ * has been read.
+ */
+
+static int
+ux_dx_convert(struct ux_fs *fs, struct ux_inode_info *dip)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        int                     dpb = UX_DIRS_PER_BLOCK(fs->u_bsize);
+        struct ux_buf           *bp, **bps = NULL;
+        struct ux_dirent        *dirent, dotdot;
+        struct ux_dx_root       *root;
+        struct ux_dx_item       *items;
+        __u32                   nleaves, lblk, newblk, per;
+        int                     i, n = 0, next, count, *start = NULL;
+        int                     error = 0;
+
+        nleaves = uip->i_blocks;
+        items = malloc((size_t)nleaves * dpb * sizeof(struct ux_dx_item));
+        start = malloc((nleaves + 1) * sizeof(int));
+        bps = calloc(nleaves + 1, sizeof(struct ux_buf *));
+        if (!items || !start || !bps) {
+                error = -ENOMEM;
+                goto out;
+        }
+
+        memset(&dotdot, 0, sizeof(dotdot));
+        for (lblk = 0; lblk < nleaves; lblk++) {
+                bp = ux_dir_bread(fs, dip, lblk, &error);
+                if (!bp) {
+                        goto out;
+                }
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = 0; i < dpb; i++, dirent++) {
+                        if (dirent->d_ino == 0 ||
+                            !strcmp(dirent->d_name, ".")) {
+                                continue;
+                        }
+                        if (!strcmp(dirent->d_name, "..")) {
+                                dotdot = *dirent;
+                                continue;
+                        }
+                        items[n].hash = ux_dx_hash(dirent->d_name);
+                        items[n].de = *dirent;
+                        n++;
+                }
+                ux_brelse(fs, bp);
+        }
+        qsort(items, n, sizeof(struct ux_dx_item), ux_dx_cmp);
+
+        per = (n + nleaves - 1) / nleaves;
+        for (lblk = 1, next = 0; lblk <= nleaves; lblk++) {
+                start[lblk - 1] = next;
+                count = 0;
+                while (next < n && (count < (int)per || lblk == nleaves ||
+                       items[next].hash == items[next - 1].hash)) {
+                        if (count == dpb) {
+                                error = -ENOSPC;
+                                goto out;
+                        }
+                        count++;
+                        next++;
+                }
+        }
+        start[nleaves] = n;
+
+        bp = ux_dir_grow(fs, dip, &newblk, &error);
+        if (!bp) {
+                goto out;
+        }
+        bps[newblk] = bp;
+        for (lblk = 0; lblk < nleaves; lblk++) {
+                bps[lblk] = ux_dir_bread(fs, dip, lblk, &error);
+                if (!bps[lblk]) {
+                        goto out;
+                }
+        }
+
+        memset(bps[0]->b_data, 0, fs->u_bsize);
+        root = (struct ux_dx_root *)bps[0]->b_data;
+        root->dr_dot.d_ino = dip->ui_ino;
+        root->dr_dot.d_type = UX_DT(S_IFDIR);
+        strcpy(root->dr_dot.d_name, ".");
+        root->dr_dotdot = dotdot;
+        root->dr_magic = UX_DX_MAGIC;
+
+        for (lblk = 1; lblk <= nleaves; lblk++) {
+                bp = bps[lblk];
+                memset(bp->b_data, 0, fs->u_bsize);
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = start[lblk - 1]; i < start[lblk]; i++) {
+                        *dirent++ = items[i].de;
+                }
+                ux_bdirty(bp);
+                if (lblk == 1 || start[lblk - 1] < n) {
+                        root->dr_entries[root->dr_count].de_hash =
+                                root->dr_count ?
+                                items[start[lblk - 1]].hash : 0;
+                        root->dr_entries[root->dr_count].de_lblk = lblk;
+                        root->dr_count++;
+                }
+        }
+        ux_bdirty(bps[0]);
+
+        uip->i_flags |= UX_INDEX_FL;
+        ux_mark_inode_dirty(dip);
+
+out:
+        if (bps) {
+                for (lblk = 0; lblk <= nleaves; lblk++) {
+                        ux_brelse(fs, bps[lblk]);
+                }
+        }
+        free(bps);
+        free(start);
+        free(items);
+        return error;
+}
+
+/*
+ * Look up "name" in directory "dip" and return its inode number,
+ * or 0 if it is not there.
+ */
+
+__u32
+ux_find_entry(struct ux_fs *fs, struct ux_inode_info *dip, const char *name)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        struct ux_dirent        *dirent;
+        struct ux_dx_frame      frames[UX_DX_MAX_LEVELS + 1];
+        struct ux_buf           *bp;
+        __u32                   blk, ino = 0;
+        int                     i, levels, error;
+
+        if (uip->i_flags & UX_INDEX_FL) {
+                bp = ux_dx_leaf(fs, dip, name, frames, &levels, &error);
+                if (!bp) {
+                        return 0;
+                }
+                ux_dx_release(fs, frames, levels);
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = 0; i < (int)UX_DIRS_PER_BLOCK(fs->u_bsize); i++) {
+                        if (ux_name_eq(&dirent[i], name)) {
+                                ino = dirent[i].d_ino;
+                                break;
+                        }
+                }
+                ux_brelse(fs, bp);
+                return ino;
+        }
+
+        for (blk = 0; blk < uip->i_blocks && !ino; blk++) {
+                bp = ux_dir_bread(fs, dip, blk, &error);
+                if (!bp) {
+                        return 0;
+                }
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = 0; i < (int)UX_DIRS_PER_BLOCK(fs->u_bsize); i++) {
+                        if (ux_name_eq(&dirent[i], name)) {
+                                ino = dirent[i].d_ino;
+                                break;
+                        }
+                }
+                ux_brelse(fs, bp);
+        }
+        return ino;
+}
+
+/*
+ * Add "name" to directory "dip", checking for the name in the
+ * blocks read while looking for a free slot as ux_diradd() in
+ * the kernel does. Callers are expected to have looked it up
+ * already.
+ */
+
+int
+ux_diradd(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+          __u32 ino, mode_t mode)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        struct ux_dirent        *dirent, *slot;
+        struct ux_buf           *bp;
+        __u32                   blk;
+        int                     i, error;
+
+        if (uip->i_flags & UX_INDEX_FL) {
+                return ux_dx_add(fs, dip, name, ino, mode);
+        }
+
+        for (blk = dip->ui_dir_free; blk < uip->i_blocks; blk++) {
+                bp = ux_dir_bread(fs, dip, blk, &error);
+                if (!bp) {
+                        return error;
+                }
+                slot = NULL;
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = 0; i < (int)UX_DIRS_PER_BLOCK(fs->u_bsize);
+                     i++, dirent++) {
+                        if (dirent->d_ino == 0) {
+                                if (!slot) {
+                                        slot = dirent;
+                                }
+                        } else if (ux_name_eq(dirent, name)) {
+                                ux_brelse(fs, bp);
+                                return -EEXIST;
+                        }
+                }
+                if (slot) {
+                        slot->d_ino = ino;
+                        slot->d_type = UX_DT(mode);
+                        strcpy(slot->d_name, name);
+                        ux_bdirty(bp);
+                        ux_brelse(fs, bp);
+                        dip->ui_dir_free = blk;
+                        return 0;
+                }
+                ux_brelse(fs, bp);
+        }
+        dip->ui_dir_free = uip->i_blocks;
+
+        if (uip->i_blocks >= UX_DIR_LINEAR_MAX) {
+                error = ux_dx_convert(fs, dip);
+                if (error) {
+                        return error;
+                }
+                return ux_dx_add(fs, dip, name, ino, mode);
+        }
+
+        bp = ux_dir_grow(fs, dip, &blk, &error);
+        if (!bp) {
+                return error;
+        }
+        dirent = (struct ux_dirent *)bp->b_data;
+        dirent->d_ino = ino;
+        dirent->d_type = UX_DT(mode);
+        strcpy(dirent->d_name, name);
+        ux_bdirty(bp);
+        ux_brelse(fs, bp);
+        return 0;
+}
+
+/*
+ * Remove "name" from directory "dip" and return the inode number
+ * it named, or 0 if it was not there.
+ */
+
+__u32
+ux_dirdel(struct ux_fs *fs, struct ux_inode_info *dip, const char *name)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        struct ux_dirent        *dirent;
+        struct ux_dx_frame      frames[UX_DX_MAX_LEVELS + 1];
+        struct ux_buf           *bp = NULL;
+        __u32                   blk, lblk = 0, nblocks, ino = 0;
+        int                     i, levels, error;
+
+        nblocks = uip->i_blocks;
+        if (uip->i_flags & UX_INDEX_FL) {
+                bp = ux_dx_leaf(fs, dip, name, frames, &levels, &error);
+                nblocks = bp ? 1 : 0;
+                if (bp) {
+                        ux_dx_release(fs, frames, levels);
+                }
+        }
+
+        for (blk = 0; blk < nblocks && !ino; blk++) {
+                if (!(uip->i_flags & UX_INDEX_FL)) {
+                        lblk = blk;
+                        bp = ux_dir_bread(fs, dip, blk, &error);
+                        if (!bp) {
+                                return 0;
+                        }
+                }
+                dirent = (struct ux_dirent *)bp->b_data;
+                for (i = 0; i < (int)UX_DIRS_PER_BLOCK(fs->u_bsize); i++) {
+                        if (ux_name_eq(&dirent[i], name)) {
+                                ino = dirent[i].d_ino;
+                                memset(&dirent[i], 0,
+                                       sizeof(struct ux_dirent));
+                                ux_bdirty(bp);
+                                break;
+                        }
+                }
+                ux_brelse(fs, bp);
+        }
+
+        if (ino && !(uip->i_flags & UX_INDEX_FL) &&
+            lblk < dip->ui_dir_free) {
+                dip->ui_dir_free = lblk;
+        }
+        return ino;
+}
+
+/*
+ * Call "filldir" for each entry of "dip" from byte position "pos",
+ * as ux_readdir() does, until it returns non-zero. Each call is
+ * passed the position of the entry that follows.
+ */
+
+int
+ux_readdir(struct ux_fs *fs, struct ux_inode_info *dip, off_t pos,
+           ux_filldir_t filldir, void *arg)
+{
+        struct ux_inode         *uip = &dip->ui_inode;
+        char                    name[UX_NAMELEN + 1];
+        struct ux_dirent        *dirent;
+        struct ux_buf           *bp;
+        __u32                   lblk;
+        int                     slot, nslots, error;
+
+        while (pos < (off_t)uip->i_size) {
+                lblk = pos / fs->u_bsize;
+                slot = (pos % fs->u_bsize) / sizeof(struct ux_dirent);
+                if (slot < (int)UX_DIRS_PER_BLOCK(fs->u_bsize)) {
+                        bp = ux_dir_bread(fs, dip, lblk, &error);
+                        if (!bp) {
+                                return error;
+                        }
+                        nslots = ux_dir_nslots(bp->b_data, lblk,
+                                               uip->i_flags, fs->u_bsize);
+                        dirent = (struct ux_dirent *)bp->b_data;
+                        for (; slot < nslots; slot++) {
+                                pos += sizeof(struct ux_dirent);
+                                if (!dirent[slot].d_ino) {
+                                        continue;
+                                }
+                                memcpy(name, dirent[slot].d_name, UX_NAMELEN);
+                                name[UX_NAMELEN] = '\0';
+                                if (filldir(arg, name, dirent[slot].d_ino,
+                                            dirent[slot].d_type, pos)) {
+                                        ux_brelse(fs, bp);
+                                        return 0;
+                                }
+                        }
+                        ux_brelse(fs, bp);
+                }
+                pos = (off_t)(lblk + 1) * fs->u_bsize;
+        }
+        return 0;
+}
+
+static int
+ux_empty_filldir(void *arg, const char *name, __u32 ino, int type, off_t pos)
+{
+        (void)ino;
+        (void)type;
+        (void)pos;
+        if (strcmp(name, ".") && strcmp(name, "..")) {
+                *(int *)arg = 0;
+                return 1;
+        }
+        return 0;
+}
+
+/*------------------------------ namespace -----------------------------*/
+
+static int
+ux_new_inode(struct ux_fs *fs, struct ux_inode_info *dip, mode_t mode,
+             uid_t uid, gid_t gid, struct ux_inode_info **ipp)
+{
+        struct ux_inode_info    *ip;
+        struct ux_inode         *nip;
+        __u32                   ino;
+
+        ino = ux_inode_alloc(fs, dip->ui_ino, mode);
+        if (!ino) {
+                return -ENOSPC;
+        }
+        ip = ux_inode_new(fs, ino);
+        if (!ip) {
+                ux_inode_free(fs, ino);
+                return -ENOMEM;
+        }
+
+        nip = &ip->ui_inode;
+        nip->i_mode = mode;
+        nip->i_uid = uid;
+        nip->i_gid = (dip->ui_inode.i_mode & S_ISGID) ?
+                     (gid_t)dip->ui_inode.i_gid : gid;
+        nip->i_atime = nip->i_mtime = nip->i_ctime = time(NULL);
+        ux_mark_inode_dirty(ip);
+        *ipp = ip;
+        return 0;
+}
+
+static int
+ux_dir_check(struct ux_fs *fs, struct ux_inode_info *dip, const char *name)
+{
+        if (fs->u_rdonly) {
+                return -EROFS;
+        }
+        if (!S_ISDIR(dip->ui_inode.i_mode)) {
+                return -ENOTDIR;
+        }
+        if (strlen(name) > UX_NAMELEN) {
+                return -ENAMETOOLONG;
+        }
+        if (ux_find_entry(fs, dip, name)) {
+                return -EEXIST;
+        }
+        return 0;
+}
+
+static void
+ux_touch(struct ux_inode_info *ip)
+{
+        ip->ui_inode.i_mtime = ip->ui_inode.i_ctime = time(NULL);
+        ux_mark_inode_dirty(ip);
+}
+
+int
+ux_create(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+          mode_t mode, uid_t uid, gid_t gid, struct ux_inode_info **ipp)
+{
+        struct ux_inode_info    *ip;
+        int                     error;
+
+        error = ux_dir_check(fs, dip, name);
+        if (error) {
+                return error;
+        }
+        error = ux_new_inode(fs, dip, (mode & 07777) | S_IFREG, uid, gid,
+                             &ip);
+        if (error) {
+                return error;
+        }
+        ip->ui_inode.i_nlink = 1;
+
+        error = ux_diradd(fs, dip, name, ip->ui_ino, ip->ui_inode.i_mode);
+        if (error) {
+                ip->ui_inode.i_nlink = 0;
+                ux_iput(fs, ip);
+                return error;
+        }
+        ux_touch(dip);
+        *ipp = ip;
+        return 0;
+}
+
+int
+ux_mkdir(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+         mode_t mode, uid_t uid, gid_t gid, struct ux_inode_info **ipp)
+{
+        struct ux_inode_info    *ip;
+        struct ux_dirent        *dirent;
+        struct ux_buf           *bp;
+        __u32                   lblk;
+        int                     error;
+
+        error = ux_dir_check(fs, dip, name);
+        if (error) {
+                return error;
+        }
+        if (dip->ui_inode.i_mode & S_ISGID) {
+                mode |= S_ISGID;
+        }
+        error = ux_new_inode(fs, dip, (mode & 07777) | S_IFDIR, uid, gid,
+                             &ip);
+        if (error) {
+                return error;
+        }
+        ip->ui_inode.i_nlink = 2;
+
+        bp = ux_dir_grow(fs, ip, &lblk, &error);
+        if (!bp) {
+                goto out_drop;
+        }
+        dirent = (struct ux_dirent *)bp->b_data;
+        dirent[0].d_ino = ip->ui_ino;
+        dirent[0].d_type = UX_DT(S_IFDIR);
+        strcpy(dirent[0].d_name, ".");
+        dirent[1].d_ino = dip->ui_ino;
+        dirent[1].d_type = UX_DT(S_IFDIR);
+        strcpy(dirent[1].d_name, "..");
+        ux_bdirty(bp);
+        ux_brelse(fs, bp);
+
+        error = ux_diradd(fs, dip, name, ip->ui_ino, ip->ui_inode.i_mode);
+        if (error) {
+                goto out_drop;
+        }
+        dip->ui_inode.i_nlink++;
+        ux_touch(dip);
+        *ipp = ip;
+        return 0;
+
+out_drop:
+        ip->ui_inode.i_nlink = 0;
+        ux_iput(fs, ip);
+        return error;
+}
+
+int
+ux_link(struct ux_fs *fs, struct ux_inode_info *ip, struct ux_inode_info *dip,
+        const char *name)
+{
+        int                     error;
+
+        if (S_ISDIR(ip->ui_inode.i_mode)) {
+                return -EPERM;
+        }
+        error = ux_dir_check(fs, dip, name);
+        if (error) {
+                return error;
+        }
+        error = ux_diradd(fs, dip, name, ip->ui_ino, ip->ui_inode.i_mode);
+        if (error) {
+                return error;
+        }
+        ip->ui_inode.i_nlink++;
+        ip->ui_inode.i_ctime = time(NULL);
+        ux_mark_inode_dirty(ip);
+        ux_touch(dip);
+        return 0;
+}
+
+/*
+ * Remove a name. The inode itself is freed by the ux_iput()
+ * that drops its last reference.
+ */
+
+static int
+ux_remove(struct ux_fs *fs, struct ux_inode_info *dip, const char *name,
+          int dir)
+{
+        struct ux_inode_info    *ip;
+        __u32                   ino;
+        int                     error, empty = 1;
+
+        if (fs->u_rdonly) {
+                return -EROFS;
+        }
+        if (!S_ISDIR(dip->ui_inode.i_mode)) {
+                return -ENOTDIR;
+        }
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+                return dir ? -EINVAL : -EISDIR;
+        }
+        ino = ux_find_entry(fs, dip, name);
+        if (!ino) {
+                return -ENOENT;
+        }
+        error = ux_iget(fs, ino, &ip);
+        if (error) {
+                return error;
+        }
+
+        if (dir) {
+                if (!S_ISDIR(ip->ui_inode.i_mode)) {
+                        error = -ENOTDIR;
+                } else {
+                        error = ux_readdir(fs, ip, 0, ux_empty_filldir,
+                                           &empty);
+                        if (!error && !empty) {
+                                error = -ENOTEMPTY;
+                        }
+                }
+        } else if (S_ISDIR(ip->ui_inode.i_mode)) {
+                error = -EISDIR;
+        }
+        if (error) {
+                ux_iput(fs, ip);
+                return error;
+        }
+
+        ux_dirdel(fs, dip, name);
+        if (dir) {
+                ip->ui_inode.i_nlink = 0;
+                if (dip->ui_inode.i_nlink > 2) {
+                        dip->ui_inode.i_nlink--;
+                }
+        } else if (ip->ui_inode.i_nlink) {
+                ip->ui_inode.i_nlink--;
+        }
+        ip->ui_inode.i_ctime = time(NULL);
+        ux_mark_inode_dirty(ip);
+        ux_touch(dip);
+        ux_iput(fs, ip);
+        return 0;
+}
+
+int
+ux_unlink(struct ux_fs *fs, struct ux_inode_info *dip, const char *name)
+{
+        return ux_remove(fs, dip, name, 0);
+}
+
+int
+ux_rmdir(struct ux_fs *fs, struct ux_inode_info *dip, const char *name)
+{
+        return ux_remove(fs, dip, name, 1);
+}
+
+/*------------------------------ file data -----------------------------*/
+
+static int
+ux_zero_blocks(struct ux_fs *fs, __u32 blk, __u32 count)
+{
+        static char             *zero;
+        int                     error;
+
+        if (!zero) {
+                zero = calloc(1, UX_MAX_BSIZE);
+                if (!zero) {
+                        return -ENOMEM;
+                }
+        }
+        for (; count > 0; count--, blk++) {
+                error = pwrite_full(fs->u_fd, zero, fs->u_bsize,
+                                    (off_t)blk * fs->u_bsize);
+                if (error) {
+                        return error;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Change the size of a regular file. Blocks past the new end
+ * are freed, and the rest of the new last block is zeroed so
+ * that growing the file again reads zeroes.
+ */
+
+int
+ux_setsize(struct ux_fs *fs, struct ux_inode_info *ip, off_t size)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        __u32                   nblocks, pblk;
+        size_t                  tail;
+        char                    *zero;
+        int                     error;
+
+        if (fs->u_rdonly) {
+                return -EROFS;
+        }
+        if (S_ISDIR(uip->i_mode)) {
+                return -EISDIR;
+        }
+        if (size < 0 || size > 0xffffffffLL) {
+                return -EFBIG;
+        }
+
+        nblocks = (size + fs->u_bsize - 1) / fs->u_bsize;
+        if (size < (off_t)uip->i_size) {
+                error = ux_extent_truncate(fs, ip, nblocks);
+                if (error) {
+                        return error;
+                }
+                tail = size % fs->u_bsize;
+                pblk = tail ? ux_extent_bmap(fs, ip, nblocks - 1) : 0;
+                if (pblk) {
+                        zero = calloc(1, fs->u_bsize - tail);
+                        if (!zero) {
+                                return -ENOMEM;
+                        }
+                        error = pwrite_full(fs->u_fd, zero,
+                                            fs->u_bsize - tail,
+                                            (off_t)pblk * fs->u_bsize + tail);
+                        free(zero);
+                        if (error) {
+                                return error;
+                        }
+                }
+        }
+        uip->i_size = size;
+        ux_touch(ip);
+        return 0;
+}
+
+/*
+ * Get a write of "len" bytes at "off" ready: allocate blocks for
+ * any holes in the range, zero the parts of new blocks that the
+ * write will not cover and move the end of file. The caller then
+ * writes the data to the blocks ux_extent_get() maps.
+ */
+
+int
+ux_prepare_write(struct ux_fs *fs, struct ux_inode_info *ip, off_t off,
+                 size_t len)
+{
+        struct ux_inode         *uip = &ip->ui_inode;
+        __u32                   lblk, last, pblk, count;
+        off_t                   end = off + len;
+        int                     error;
+
+        if (fs->u_rdonly) {
+                return -EROFS;
+        }
+        if (off < 0 || end > 0xffffffffLL) {
+                return -EFBIG;
+        }
+        if (len == 0) {
+                return 0;
+        }
+
+        lblk = off / fs->u_bsize;
+        last = (end - 1) / fs->u_bsize;
+        while (lblk <= last) {
+                error = ux_extent_get(fs, ip, lblk, &pblk, &count);
+                if (error) {
+                        return error;
+                }
+                count = MIN(count, last - lblk + 1);
+                if (pblk) {
+                        lblk += count;
+                        continue;
+                }
+                error = ux_extent_alloc(fs, ip, lblk, &pblk, &count);
+                if (error) {
+                        return error;
+                }
+                if ((off_t)lblk * fs->u_bsize < off) {
+                        error = ux_zero_blocks(fs, pblk, 1);
+                }
+                if (!error && (off_t)(lblk + count) * fs->u_bsize > end) {
+                        error = ux_zero_blocks(fs, pblk + count - 1, 1);
+                }
+                if (error) {
+                        return error;
+                }
+                lblk += count;
+        }
+
+        if (end > (off_t)uip->i_size) {
+                uip->i_size = end;
+        }
+        ux_touch(ip);
+        return 0;
+}
+
+/*
+ * Plain read and write through the extent map, for callers that
+ * have no use for doing their own I/O.
+ */
+
+ssize_t
+ux_file_read(struct ux_fs *fs, struct ux_inode_info *ip, char *buf,
+             size_t len, off_t off)
+{
+        __u32                   lblk, pblk, count;
+        size_t                  done = 0, n, boff;
+        int                     error;
+
+        if (off >= (off_t)ip->ui_inode.i_size) {
+                return 0;
+        }
+        len = MIN(len, (size_t)(ip->ui_inode.i_size - off));
+        while (done < len) {
+                lblk = (off + done) / fs->u_bsize;
+                boff = (off + done) % fs->u_bsize;
+                error = ux_extent_get(fs, ip, lblk, &pblk, &count);
+                if (error) {
+                        return error;
+                }
+                n = MIN((size_t)count * fs->u_bsize - boff, len - done);
+                if (pblk) {
+                        error = pread_full(fs->u_fd, buf + done, n,
+                                           (off_t)pblk * fs->u_bsize + boff);
+                        if (error) {
+                                return error;
+                        }
+                } else {
+                        memset(buf + done, 0, n);
+                }
+                done += n;
+        }
+        return done;
+}
+
+ssize_t
+ux_file_write(struct ux_fs *fs, struct ux_inode_info *ip, const char *buf,
+              size_t len, off_t off)
+{
+        __u32                   lblk, pblk, count;
+        size_t                  done = 0, n, boff;
+        int                     error;
+
+        error = ux_prepare_write(fs, ip, off, len);
+        if (error) {
+                return error;
+        }
+        while (done < len) {
+                lblk = (off + done) / fs->u_bsize;
+                boff = (off + done) % fs->u_bsize;
+                error = ux_extent_get(fs, ip, lblk, &pblk, &count);
+                if (!error && !pblk) {
+                        error = -EIO;
+                }
+                if (error) {
+                        return error;
+                }
+                n = MIN((size_t)count * fs->u_bsize - boff, len - done);
+                error = pwrite_full(fs->u_fd, buf + done, n,
+                                    (off_t)pblk * fs->u_bsize + boff);
+                if (error) {
+                        return error;
+                }
+                done += n;
+        }
+        return done;
+}
+
+/*---------------------------- the filesystem --------------------------*/
+
+/*
+ * Write the superblock. Only the structure is written, so the
+ * rest of block 0 is left as mkfs made it.
+ */
+
+static int
+ux_write_super(struct ux_fs *fs)
+{
+        fs->u_sb.s_nifree = fs->u_ifree;
+        fs->u_sb.s_nbfree = fs->u_bfree;
+        return pwrite_full(fs->u_fd, &fs->u_sb, sizeof(struct ux_superblock),
+                           0);
+}
+
+static int
+ux_write_map(struct ux_fs *fs, unsigned char *map, unsigned char *dirty,
+             __u32 start, __u32 nblocks)
+{
+        __u32                   i;
+        int                     error;
+
+        for (i = 0; i < nblocks; i++) {
+                if (!dirty[i]) {
+                        continue;
+                }
+                error = pwrite_full(fs->u_fd, map + (size_t)i * fs->u_bsize,
+                                    fs->u_bsize,
+                                    (off_t)(start + i) * fs->u_bsize);
+                if (error) {
+                        return error;
+                }
+                dirty[i] = 0;
+        }
+        return 0;
+}
+
+/*
+ * Write back everything that has changed: inodes, cached blocks,
+ * bitmaps and the superblock, and wait for it to reach the disk.
+ */
+
+int
+ux_fs_sync(struct ux_fs *fs)
+{
+        struct ux_inode_info    *ip;
+        unsigned int            i;
+        int                     error = 0, err;
+
+        if (fs->u_rdonly) {
+                return 0;
+        }
+        for (i = 0; i < fs->u_nihash; i++) {
+                for (ip = fs->u_ihash[i]; ip; ip = ip->ui_hash) {
+                        err = ux_write_inode(fs, ip);
+                        if (err && !error) {
+                                error = err;
+                        }
+                }
+        }
+        err = ux_bflush(fs);
+        if (!err) {
+                err = ux_write_map(fs, fs->u_imap, fs->u_imap_dirty,
+                                   fs->u_sb.s_imap_start,
+                                   fs->u_sb.s_imap_blocks);
+        }
+        if (!err) {
+                err = ux_write_map(fs, fs->u_bmap, fs->u_bmap_dirty,
+                                   fs->u_sb.s_bmap_start,
+                                   fs->u_sb.s_bmap_blocks);
+        }
+        if (!err) {
+                err = ux_write_super(fs);
+        }
+        if (!err && fsync(fs->u_fd) < 0) {
+                err = -errno;
+        }
+        return error ? error : err;
+}
+
+/*
+ * The geometry checks of the kernel's ux_check_geometry().
+ */
+
+static int
+ux_check_geometry(struct ux_superblock *usb, off_t devblocks)
+{
+        unsigned long long      bpb = UX_BITS_PER_BLOCK(usb->s_bsize);
+
+        if (usb->s_inode_size != UX_INODE_SIZE ||
+            usb->s_ninodes <= UX_FIRST_INO || usb->s_nblocks < 2) {
+                return 0;
+        }
+        if (usb->s_imap_blocks * bpb < usb->s_ninodes ||
+            usb->s_bmap_blocks * bpb < usb->s_nblocks ||
+            (unsigned long long)usb->s_itable_blocks *
+            UX_INODES_PER_BLOCK(usb->s_bsize) < usb->s_ninodes) {
+                return 0;
+        }
+        if (usb->s_imap_start < 1 ||
+            usb->s_bmap_start < usb->s_imap_start + usb->s_imap_blocks ||
+            usb->s_itable_start < usb->s_bmap_start + usb->s_bmap_blocks ||
+            usb->s_data_start < usb->s_itable_start + usb->s_itable_blocks) {
+                return 0;
+        }
+        if (usb->s_journal_blocks &&
+            (usb->s_journal_start < usb->s_itable_start + usb->s_itable_blocks ||
+             usb->s_data_start < (unsigned long long)usb->s_journal_start +
+                                 usb->s_journal_blocks)) {
+                return 0;
+        }
+        if ((off_t)usb->s_data_start + usb->s_nblocks > devblocks) {
+                return 0;
+        }
+        return usb->s_itable_lazy < usb->s_itable_blocks;
+}
+
+/*
+ * Does the journal hold transactions that have to be replayed?
+ * The jbd2 superblock is big-endian and s_start, the sixth word
+ * after the header, is 0 when the journal is empty.
+ */
+
+static int
+ux_journal_dirty(struct ux_fs *fs)
+{
+        __u32                   js[8];
+
+        if (!fs->u_sb.s_journal_blocks) {
+                return 0;
+        }
+        if (pread_full(fs->u_fd, js, sizeof(js),
+                       (off_t)fs->u_sb.s_journal_start * fs->u_bsize)) {
+                return 1;
+        }
+        return ntohl(js[0]) == JBD2_MAGIC && js[7] != 0;
+}
+
+static int
+ux_read_map(struct ux_fs *fs, unsigned char **mapp, unsigned char **dirtyp,
+            __u32 start, __u32 nblocks)
+{
+        *mapp = malloc((size_t)nblocks * fs->u_bsize);
+        *dirtyp = calloc(nblocks, 1);
+        if (!*mapp || !*dirtyp) {
+                return -ENOMEM;
+        }
+        return pread_full(fs->u_fd, *mapp, (size_t)nblocks * fs->u_bsize,
+                          (off_t)start * fs->u_bsize);
+}
+
+static void
+ux_fs_free(struct ux_fs *fs)
+{
+        struct ux_inode_info    *ip;
+        struct ux_buf           *bp;
+        unsigned int            i;
+
+        while ((bp = fs->u_lru) != NULL) {
+                fs->u_lru = bp->b_next;
+                free(bp->b_data);
+                free(bp);
+        }
+        for (i = 0; fs->u_ihash && i < fs->u_nihash; i++) {
+                while ((ip = fs->u_ihash[i]) != NULL) {
+                        fs->u_ihash[i] = ip->ui_hash;
+                        pthread_rwlock_destroy(&ip->ui_rwlock);
+                        free(ip);
+                }
+        }
+        free(fs->u_ihash);
+        free(fs->u_bhash);
+        free(fs->u_igroups.gs_group);
+        free(fs->u_bgroups.gs_group);
+        free(fs->u_imap);
+        free(fs->u_bmap);
+        free(fs->u_imap_dirty);
+        free(fs->u_bmap_dirty);
+        pthread_mutex_destroy(&fs->u_lock);
+        if (fs->u_fd >= 0) {
+                close(fs->u_fd);
+        }
+        free(fs);
+}
+
+/*
+ * Open the image or device at "path", read-only if "rdonly" is
+ * set, with room for "cache" metadata blocks in the cache (or
+ * UX_CACHE_BLOCKS if it is 0). An image that was not cleanly
+ * unmounted or whose journal needs recovery is refused, as the
+ * kernel refuses it.
+ */
+
+struct ux_fs *
+ux_fs_open(const char *path, int rdonly, unsigned long cache, int *errorp)
+{
+        struct ux_fs            *fs;
+        struct stat             st;
+        unsigned long long      bytes;
+        long                    ifree, bfree;
+        int                     error = -ENOMEM;
+
+        fs = calloc(1, sizeof(struct ux_fs));
+        if (!fs) {
+                *errorp = -ENOMEM;
+                return NULL;
+        }
+        pthread_mutex_init(&fs->u_lock, NULL);
+        fs->u_rdonly = rdonly;
+        fs->u_fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+        if (fs->u_fd < 0 || fstat(fs->u_fd, &st) < 0) {
+                error = -errno;
+                goto out;
+        }
+        bytes = st.st_size;
+        if (S_ISBLK(st.st_mode) &&
+            ioctl(fs->u_fd, BLKGETSIZE64, &bytes) < 0) {
+                error = -errno;
+                goto out;
+        }
+
+        error = pread_full(fs->u_fd, &fs->u_sb, sizeof(struct ux_superblock),
+                           0);
+        if (error) {
+                goto out;
+        }
+        error = -EINVAL;
+        fs->u_bsize = fs->u_sb.s_bsize;
+        if (fs->u_sb.s_magic != UX_MAGIC || fs->u_bsize < UX_MIN_BSIZE ||
+            fs->u_bsize > UX_MAX_BSIZE || (fs->u_bsize & (fs->u_bsize - 1)) ||
+            !ux_check_geometry(&fs->u_sb, bytes / fs->u_bsize)) {
+                goto out;
+        }
+        if (fs->u_sb.s_mod != UX_FSCLEAN || ux_journal_dirty(fs)) {
+                error = -EUCLEAN;
+                goto out;
+        }
+
+        error = ux_read_map(fs, &fs->u_imap, &fs->u_imap_dirty,
+                            fs->u_sb.s_imap_start, fs->u_sb.s_imap_blocks);
+        if (!error) {
+                error = ux_read_map(fs, &fs->u_bmap, &fs->u_bmap_dirty,
+                                    fs->u_sb.s_bmap_start,
+                                    fs->u_sb.s_bmap_blocks);
+        }
+        if (error) {
+                goto out;
+        }
+        ifree = ux_groups_init(fs, &fs->u_igroups, fs->u_imap,
+                               fs->u_sb.s_ninodes);
+        bfree = ux_groups_init(fs, &fs->u_bgroups, fs->u_bmap,
+                               fs->u_sb.s_nblocks);
+        if (ifree < 0 || bfree < 0) {
+                error = -ENOMEM;
+                goto out;
+        }
+        fs->u_ifree = ifree;
+        fs->u_bfree = bfree;
+
+        fs->u_maxbufs = cache ? cache : UX_CACHE_BLOCKS;
+        fs->u_nbhash = fs->u_maxbufs;
+        fs->u_nihash = 1024;
+        fs->u_bhash = calloc(fs->u_nbhash, sizeof(struct ux_buf *));
+        fs->u_ihash = calloc(fs->u_nihash, sizeof(struct ux_inode_info *));
+        if (!fs->u_bhash || !fs->u_ihash) {
+                error = -ENOMEM;
+                goto out;
+        }
+        srandom(time(NULL) ^ getpid());
+
+        /*
+         * Mark the filesystem dirty on disk before changing
+         * anything.
+         */
+
+        if (!rdonly) {
+                fs->u_sb.s_mod = UX_FSDIRTY;
+                error = ux_write_super(fs);
+                if (!error && fsync(fs->u_fd) < 0) {
+                        error = -errno;
+                }
+                if (error) {
+                        goto out;
+                }
+        }
+
+        *errorp = 0;
+        return fs;
+
+out:
+        ux_fs_free(fs);
+        *errorp = error;
+        return NULL;
+}
+
+/*
+ * Write everything back, mark the filesystem clean if that
+ * worked, and free it. In-core inodes still referenced are
+ * written but not evicted.
+ */
+
+int
+ux_fs_close(struct ux_fs *fs)
+{
+        int                     error = 0;
+
+        if (!fs->u_rdonly) {
+                error = ux_fs_sync(fs);
+                if (!error) {
+                        fs->u_sb.s_mod = UX_FSCLEAN;
+                        error = ux_write_super(fs);
+                }
+                if (!error && fsync(fs->u_fd) < 0) {
+                        error = -errno;
+                }
+        }
+        ux_fs_free(fs);
+        return error;
+}
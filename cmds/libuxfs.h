@@ -0,0 +1,199 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- libuxfs.h ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * libuxfs works on a uxfs image from userspace. It follows the
+ * kernel code closely, and most functions have the name of the
+ * kernel function they stand in for: the allocators and groups
+ * of ux_alloc.c, the extent map of ux_extent.c, ux_iget() and
+ * ux_write_inode(), and the linear and hashed directory code of
+ * ux_dir.c and ux_dx.c.
+ *
+ * Metadata blocks go through a block cache of ux_bufs, the
+ * userspace buffer heads. Both bitmaps are read in whole and
+ * in-core inodes are cached by number. File data never goes
+ * through the cache; callers map it with ux_extent_get() and
+ * do their own I/O on u_fd.
+ *
+ * Nothing is journaled. Opening an image read-write marks it
+ * UX_FSDIRTY on disk, and only ux_fs_close() marks it clean
+ * again. If the process dies in between, the image has to be
+ * checked with fsck.uxfs before the kernel will mount it.
+ *
+ * Apart from ux_fs_open() and ux_fs_close(), every function
+ * here must be called with u_lock held.
+ */
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+#include "../kern/ux_fs.h"
+
+/*
+ * A cached metadata block.
+ */
+
+struct ux_buf
+{
+        __u32                   b_blocknr;
+        int                     b_count;        /* references */
+        int                     b_dirty;
+        char                    *b_data;
+        struct ux_buf           *b_hash;        /* hash chain */
+        struct ux_buf           *b_prev;        /* LRU list, most */
+        struct ux_buf           *b_next;        /* recent first */
+};
+
+/*
+ * An allocation group, as in the kernel, minus the lock.
+ */
+
+struct ux_group
+{
+        unsigned long           g_start;        /* first bit */
+        unsigned long           g_end;          /* one past the last bit */
+        unsigned long           g_next;         /* next bit to try */
+        unsigned long           g_free;         /* clear bits */
+};
+
+struct ux_groups
+{
+        struct ux_group         *gs_group;
+        unsigned int            gs_count;
+        unsigned long           gs_size;        /* bits per group */
+};
+
+/*
+ * An in-core inode. ui_count counts the references held by the
+ * caller, such as the lookups a FUSE kernel remembers. When it
+ * drops to zero and the inode has no links, it is freed.
+ */
+
+struct ux_inode_info
+{
+        __u32                   ui_ino;
+        struct ux_inode         ui_inode;       /* copy of the disk inode */
+        unsigned long           ui_count;
+        int                     ui_dirty;
+        __u32                   ui_dir_free;    /* first dir block that may
+                                                   have a free slot */
+        pthread_rwlock_t        ui_rwlock;      /* for the caller's data
+                                                   I/O, not taken here */
+        struct ux_inode_info    *ui_hash;
+};
+
+struct ux_fs
+{
+        int                     u_fd;
+        int                     u_rdonly;
+        int                     u_bsize;
+        struct ux_superblock    u_sb;           /* in-core superblock */
+        unsigned char           *u_imap;        /* inode bitmap */
+        unsigned char           *u_bmap;        /* block bitmap */
+        unsigned char           *u_imap_dirty;  /* per bitmap block */
+        unsigned char           *u_bmap_dirty;
+        struct ux_groups        u_igroups;      /* inode allocation groups */
+        struct ux_groups        u_bgroups;      /* block allocation groups */
+        unsigned long           u_ifree;        /* free inodes */
+        unsigned long           u_bfree;        /* free data blocks */
+        pthread_mutex_t         u_lock;
+
+        struct ux_buf           **u_bhash;      /* block cache */
+        unsigned int            u_nbhash;
+        struct ux_buf           *u_lru;
+        struct ux_buf           *u_lru_tail;
+        unsigned long           u_nbufs;
+        unsigned long           u_maxbufs;
+
+        struct ux_inode_info    **u_ihash;      /* inode cache */
+        unsigned int            u_nihash;
+};
+
+#define UX_CACHE_BLOCKS 4096    /* default size of the block cache */
+
+/*
+ * Opening and closing. Errors are returned as negative errno
+ * values, as in the kernel.
+ */
+
+extern struct ux_fs *ux_fs_open(const char *, int, unsigned long, int *);
+extern int ux_fs_close(struct ux_fs *);
+extern int ux_fs_sync(struct ux_fs *);
+
+/*
+ * The block cache.
+ */
+
+extern struct ux_buf *ux_bread(struct ux_fs *, __u32, int *);
+extern struct ux_buf *ux_bget_zero(struct ux_fs *, __u32, int *);
+extern void ux_brelse(struct ux_fs *, struct ux_buf *);
+extern void ux_bdirty(struct ux_buf *);
+extern void ux_bforget(struct ux_fs *, __u32);
+
+/*
+ * Allocation
+ */
+
+extern __u32 ux_inode_alloc(struct ux_fs *, __u32, mode_t);
+extern void ux_inode_free(struct ux_fs *, __u32);
+extern __u32 ux_data_alloc_blocks(struct ux_fs *, __u32, __u32 *);
+extern void ux_data_free(struct ux_fs *, __u32);
+extern __u32 ux_data_goal(struct ux_fs *, __u32);
+
+/*
+ * Inodes and their extent maps
+ */
+
+extern int ux_iget(struct ux_fs *, __u32, struct ux_inode_info **);
+extern struct ux_inode_info *ux_ifind(struct ux_fs *, __u32);
+extern void ux_iput(struct ux_fs *, struct ux_inode_info *);
+extern void ux_iput_many(struct ux_fs *, struct ux_inode_info *,
+                         unsigned long);
+extern void ux_mark_inode_dirty(struct ux_inode_info *);
+extern int ux_write_inode(struct ux_fs *, struct ux_inode_info *);
+extern void ux_stat(struct ux_fs *, struct ux_inode_info *, struct stat *);
+
+extern int ux_extent_get(struct ux_fs *, struct ux_inode_info *, __u32,
+                         __u32 *, __u32 *);
+extern __u32 ux_extent_bmap(struct ux_fs *, struct ux_inode_info *, __u32);
+extern int ux_extent_alloc(struct ux_fs *, struct ux_inode_info *, __u32,
+                           __u32 *, __u32 *);
+extern int ux_extent_truncate(struct ux_fs *, struct ux_inode_info *, __u32);
+
+/*
+ * Directories
+ */
+
+typedef int (*ux_filldir_t)(void *, const char *, __u32, int, off_t);
+
+extern __u32 ux_find_entry(struct ux_fs *, struct ux_inode_info *,
+                           const char *);
+extern int ux_diradd(struct ux_fs *, struct ux_inode_info *, const char *,
+                     __u32, mode_t);
+extern __u32 ux_dirdel(struct ux_fs *, struct ux_inode_info *,
+                       const char *);
+extern int ux_readdir(struct ux_fs *, struct ux_inode_info *, off_t,
+                      ux_filldir_t, void *);
+
+/*
+ * Namespace operations and file size and data, built on the
+ * above. New inodes are returned with one reference held.
+ */
+
+extern int ux_create(struct ux_fs *, struct ux_inode_info *, const char *,
+                     mode_t, uid_t, gid_t, struct ux_inode_info **);
+extern int ux_mkdir(struct ux_fs *, struct ux_inode_info *, const char *,
+                    mode_t, uid_t, gid_t, struct ux_inode_info **);
+extern int ux_link(struct ux_fs *, struct ux_inode_info *,
+                   struct ux_inode_info *, const char *);
+extern int ux_unlink(struct ux_fs *, struct ux_inode_info *, const char *);
+extern int ux_rmdir(struct ux_fs *, struct ux_inode_info *, const char *);
+extern int ux_setsize(struct ux_fs *, struct ux_inode_info *, off_t);
+extern int ux_prepare_write(struct ux_fs *, struct ux_inode_info *, off_t,
+                            size_t);
+extern ssize_t ux_file_read(struct ux_fs *, struct ux_inode_info *, char *,
+                            size_t, off_t);
+extern ssize_t ux_file_write(struct ux_fs *, struct ux_inode_info *,
+                             const char *, size_t, off_t);
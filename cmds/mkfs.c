@@ -2,12 +2,19 @@
 /*---------------------------- mkfs.c --------------------------*/
 /*--------------------------------------------------------------*/
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
 #include <time.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <linux/xattr.h>
 #include <linux/posix_acl.h>
 #include <linux/posix_acl_xattr.h>
@@ -17,154 +24,511 @@
 #include "../kern/ux_fs.h"
 #include "../kern/ux_acl.h"
 
+/*
+ * By default one inode is created for every UX_BYTES_PER_INODE
+ * bytes of the device, and blocks are UX_DEFAULT_BSIZE bytes.
+ */
+
+#define UX_BYTES_PER_INODE 8192
+#define UX_DEFAULT_BSIZE 4096
+
+/*
+ * Filesystems of UX_JOURNAL_MIN_FS blocks or more get a journal
+ * of 1/64th of the device, kept between the smallest journal
+ * jbd2 accepts and UX_JOURNAL_MAX blocks.
+ */
+
+#define UX_JOURNAL_MIN 1024
+#define UX_JOURNAL_MAX 32768
+#define UX_JOURNAL_MIN_FS 16384
+
+/*
+ * The start of a jbd2 journal superblock. jbd2 keeps its
+ * metadata big-endian.
+ */
+
+#define JBD2_MAGIC 0xc03b3998
+#define JBD2_SUPERBLOCK_V2 4
+
+struct jbd2_super
+{
+        __u32 h_magic;
+        __u32 h_blocktype;
+        __u32 h_sequence;
+        __u32 s_blocksize;
+        __u32 s_maxlen;
+        __u32 s_first;
+        __u32 s_sequence;
+        __u32 s_start;
+        __s32 s_errno;
+        __u32 s_feature_compat;
+        __u32 s_feature_incompat;
+        __u32 s_feature_ro_compat;
+        __u8 s_uuid[16];
+        __u32 s_nr_users;
+};
+
+/*
+ * Zeroing falls back to plain writes of this many bytes at a
+ * time where the device cannot zero a range itself.
+ */
+
+#define ZERO_CHUNK (1 << 20)
+
+int                     bsize = UX_DEFAULT_BSIZE;
+
+/*
+ * Bit n of an on-disk bitmap is bit (n % 8) of byte (n / 8).
+ */
+
+static void
+setbit(char *map, int n)
+{
+        map[n >> 3] |= 1 << (n & 7);
+}
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: uxmkfs [-L] [-b block-size] [-N inodes] "
+                "[-J journal-blocks] device [blocks]\n");
+        exit(1);
+}
+
+/*
+ * Return the size of the device (or image file) in blocks.
+ */
+
+static off_t
+device_blocks(int devfd)
+{
+        struct stat             st;
+        unsigned long long      bytes;
+
+        if (fstat(devfd, &st) < 0) {
+                return -1;
+        }
+        if (S_ISBLK(st.st_mode)) {
+                if (ioctl(devfd, BLKGETSIZE64, &bytes) < 0) {
+                        return -1;
+                }
+                return bytes / bsize;
+        }
+        return st.st_size / bsize;
+}
+
+/*
+ * Work out where each region goes. The block bitmap needs to
+ * cover whatever is left once the other regions are placed, so
+ * its size is computed against an upper bound of that.
+ */
+
+static int
+layout(struct ux_superblock *sb, off_t nblocks, off_t ninodes, off_t jblocks)
+{
+        off_t                   rest;
+
+        if (ninodes == 0) {
+                ninodes = nblocks * bsize / UX_BYTES_PER_INODE;
+        }
+        if (ninodes < UX_FIRST_INO + 4) {
+                ninodes = UX_FIRST_INO + 4;
+        }
+        if (jblocks < 0) {
+                jblocks = 0;
+                if (nblocks >= UX_JOURNAL_MIN_FS) {
+                        jblocks = nblocks / 64;
+                        if (jblocks < UX_JOURNAL_MIN) {
+                                jblocks = UX_JOURNAL_MIN;
+                        }
+                        if (jblocks > UX_JOURNAL_MAX) {
+                                jblocks = UX_JOURNAL_MAX;
+                        }
+                }
+        }
+        if (ninodes > 0xffffffffLL || nblocks > 0xffffffffLL) {
+                return -1;
+        }
+
+        sb->s_ninodes = ninodes;
+        sb->s_imap_start = 1;
+        sb->s_imap_blocks = (ninodes + UX_BITS_PER_BLOCK(bsize) - 1) /
+                            UX_BITS_PER_BLOCK(bsize);
+        sb->s_bmap_start = sb->s_imap_start + sb->s_imap_blocks;
+
+        sb->s_inode_size = UX_INODE_SIZE;
+        sb->s_itable_blocks = (ninodes + UX_INODES_PER_BLOCK(bsize) - 1) /
+                              UX_INODES_PER_BLOCK(bsize);
+
+        rest = nblocks - sb->s_bmap_start - sb->s_itable_blocks - jblocks;
+        if (rest <= 0) {
+                return -1;
+        }
+        sb->s_bmap_blocks = (rest + UX_BITS_PER_BLOCK(bsize) - 1) /
+                            UX_BITS_PER_BLOCK(bsize);
+
+        sb->s_itable_start = sb->s_bmap_start + sb->s_bmap_blocks;
+        sb->s_journal_start = sb->s_itable_start + sb->s_itable_blocks;
+        sb->s_journal_blocks = jblocks;
+        sb->s_data_start = sb->s_journal_start + sb->s_journal_blocks;
+        if (nblocks < (off_t)sb->s_data_start + 2) {
+                return -1;
+        }
+        sb->s_nblocks = nblocks - sb->s_data_start;
+        return 0;
+}
+
+static void
+write_failed(char *what)
+{
+        fprintf(stderr, "uxmkfs: Cannot write %s: %s\n", what,
+                strerror(errno));
+        exit(1);
+}
+
+/*
+ * Write "cnt" buffers to consecutive bytes of the device
+ * starting at "off", carrying on after a short write.
+ */
+
+static void
+write_iov(int devfd, struct iovec *iov, int cnt, off_t off, char *what)
+{
+        ssize_t                 n;
+
+        while (cnt > 0) {
+                n = pwritev(devfd, iov, cnt, off);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        write_failed(what);
+                }
+                if (n == 0) {
+                        errno = EIO;
+                        write_failed(what);
+                }
+                off += n;
+                while (cnt > 0 && (size_t)n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        iov++;
+                        cnt--;
+                }
+                if (cnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+}
+
+static void
+write_blocks(int devfd, void *buf, off_t blk, off_t count, char *what)
+{
+        struct iovec            iov;
+
+        iov.iov_base = buf;
+        iov.iov_len = count * bsize;
+        write_iov(devfd, &iov, 1, blk * bsize, what);
+}
+
+/*
+ * Zero "count" blocks from "blk", letting the device do it if
+ * it can: BLKZEROOUT on a block device, an unwritten extent
+ * from fallocate() on an image file.
+ */
+
+static void
+zero_blocks(int devfd, off_t blk, off_t count, char *what)
+{
+        struct stat             st;
+        struct iovec            iov;
+        unsigned long long      range[2];
+        off_t                   off = blk * bsize, len = count * bsize;
+        static char             *zero;
+
+        if (count == 0) {
+                return;
+        }
+        if (fstat(devfd, &st) == 0 && S_ISBLK(st.st_mode)) {
+                range[0] = off;
+                range[1] = len;
+                if (ioctl(devfd, BLKZEROOUT, range) == 0) {
+                        return;
+                }
+        } else if (fallocate(devfd, FALLOC_FL_ZERO_RANGE, off, len) == 0) {
+                return;
+        }
+
+        if (zero == NULL) {
+                zero = calloc(1, ZERO_CHUNK);
+                if (zero == NULL) {
+                        fprintf(stderr, "uxmkfs: Out of memory\n");
+                        exit(1);
+                }
+        }
+        while (len > 0) {
+                iov.iov_base = zero;
+                iov.iov_len = len < ZERO_CHUNK ? len : ZERO_CHUNK;
+                write_iov(devfd, &iov, 1, off, what);
+                off += iov.iov_len;
+                len -= iov.iov_len;
+        }
+}
+
+static void *
+zalloc(size_t size)
+{
+        void                    *p = calloc(1, size);
+
+        if (p == NULL) {
+                fprintf(stderr, "uxmkfs: Out of memory\n");
+                exit(1);
+        }
+        return p;
+}
+
+/*
+ * Build an empty journal: just its superblock, marked as
+ * needing no recovery. jbd2 ignores the other blocks until
+ * it has written them itself.
+ */
+
+static void
+make_journal(char *block, struct ux_superblock *sb)
+{
+        struct jbd2_super       *js;
+        int                     i;
+
+        js = (struct jbd2_super *)block;
+        js->h_magic = htonl(JBD2_MAGIC);
+        js->h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+        js->s_blocksize = htonl(bsize);
+        js->s_maxlen = htonl(sb->s_journal_blocks);
+        js->s_first = htonl(1);
+        js->s_sequence = htonl(1);
+        js->s_start = 0;
+        js->s_nr_users = htonl(1);
+        srand(time(NULL) ^ getpid());
+        for (i = 0; i < 16; i++) {
+                js->s_uuid[i] = rand();
+        }
+}
+
+/*
+ * Fill in a directory inode whose entries are in disk block
+ * "blk".
+ */
+
+static void
+make_dir(struct ux_inode *inode, int nlink, __u32 blk, time_t tm)
+{
+        inode->i_mode = S_IFDIR | 0755;
+        inode->i_nlink = nlink;
+        inode->i_atime = tm;
+        inode->i_mtime = tm;
+        inode->i_ctime = tm;
+        inode->i_uid = 0;
+        inode->i_gid = 0;
+        inode->i_size = bsize;
+        inode->i_blocks = 1;
+        inode->i_nextents = 1;
+        inode->i_extents[0].e_lblk = 0;
+        inode->i_extents[0].e_pblk = blk;
+        inode->i_extents[0].e_len = 1;
+}
+
+static void
+make_dirent(struct ux_dirent *dir, __u32 ino, char *name)
+{
+        dir->d_ino = ino;
+        dir->d_type = UX_DT(S_IFDIR);
+        strcpy(dir->d_name, name);
+}
+
+/*
+ * Everything mkfs writes is built in memory first. The
+ * superblock, both bitmaps and the first inode table block are
+ * contiguous on disk and go out in one pwritev(); the journal
+ * superblock and the two directory blocks take one write each.
+ * The rest of the inode table is zeroed by the device, or with
+ * -L left for the kernel to zero in the background after the
+ * first mount.
+ */
+
 int main(int argc, char **argv)
 {
-        struct ux_dirent        dir;
-        struct ux_superblock    sb;
-        struct ux_inode         inode;
+        struct ux_superblock    *sb;
+        struct ux_inode         *inode;
+        struct ux_dirent        *dir;
+        struct iovec            iov[4];
         time_t                  tm;
-        off_t                   nsectors = UX_MAXBLOCKS;
-        int                     devfd, error, i;
-        int                     map_blks;
-        char                    block[UX_BSIZE];
-        struct posix_acl* acl;
-        size_t acl_size;
-        void* acl_in_fs;
-
-        if (argc != 2) {
+        off_t                   nsectors, devsize, ninodes = 0;
+        off_t                   jblocks = -1;
+        int                     devfd, c, lazy = 0;
+        __u32                   i;
+        char                    *sblock, *imap, *bmap, *itable;
+        char                    *dirs, *journal;
+
+        while ((c = getopt(argc, argv, "b:N:J:L")) != -1) {
+                switch (c) {
+                case 'b':
+                        bsize = atoi(optarg);
+                        if (bsize < UX_MIN_BSIZE || bsize > UX_MAX_BSIZE ||
+                            (bsize & (bsize - 1)) != 0) {
+                                fprintf(stderr, "uxmkfs: Block size must "
+                                        "be a power of two from %d to %d\n",
+                                        UX_MIN_BSIZE, UX_MAX_BSIZE);
+                                exit(1);
+                        }
+                        break;
+                case 'N':
+                        ninodes = strtoll(optarg, NULL, 0);
+                        break;
+                case 'J':
+                        jblocks = strtoll(optarg, NULL, 0);
+                        if (jblocks != 0 && (jblocks < UX_JOURNAL_MIN ||
+                                             jblocks > 0xffffffffLL)) {
+                                fprintf(stderr, "uxmkfs: Journal must be "
+                                        "0 or at least %d blocks\n",
+                                        UX_JOURNAL_MIN);
+                                exit(1);
+                        }
+                        break;
+                case 'L':
+                        lazy = 1;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind != argc - 1 && optind != argc - 2) {
                 fprintf(stderr, "uxmkfs: Need to specify device\n");
-                exit(1);
+                usage();
         }
-        devfd = open(argv[1], O_WRONLY);
+
+        devfd = open(argv[optind], O_WRONLY);
         if (devfd < 0) {
                 fprintf(stderr, "uxmkfs: Failed to open device\n");
                 exit(1);
         }
-        error = lseek(devfd, (off_t)(nsectors * 512), SEEK_SET);
-        if (error == -1) {
+
+        devsize = device_blocks(devfd);
+        nsectors = devsize;
+        if (optind == argc - 2) {
+                nsectors = strtoll(argv[optind + 1], NULL, 0);
+        }
+        if (devsize < 0 || nsectors <= 0 || nsectors > devsize) {
                 fprintf(stderr, "uxmkfs: Cannot create filesystem"
                         " of specified size\n");
                 exit(1);
         }
-        lseek(devfd, 0, SEEK_SET);
 
         /*
-         * Fill in the fields of the superblock and write
-         * it out to the first block of the device.
+         * Fill in the fields of the superblock.
          */
 
-        sb.s_magic = UX_MAGIC;
-        sb.s_mod = UX_FSCLEAN;
-        sb.s_nifree = UX_MAXFILES - 4;  
-        sb.s_nbfree = UX_MAXBLOCKS - 2;
+        sblock = zalloc(bsize);
+        sb = (struct ux_superblock *)sblock;
+        if (layout(sb, nsectors, ninodes, jblocks) < 0) {
+                fprintf(stderr, "uxmkfs: Cannot create filesystem"
+                        " of specified size\n");
+                exit(1);
+        }
+        sb->s_magic = UX_MAGIC;
+        sb->s_mod = UX_FSCLEAN;
+        sb->s_bsize = bsize;
+        sb->s_nifree = sb->s_ninodes - UX_FIRST_INO;
+        sb->s_nbfree = sb->s_nblocks - 2;
+        if (lazy && sb->s_itable_blocks > 1) {
+                sb->s_itable_lazy = 1;
+        }
 
         /*
          * First 4 inodes are in use. Inodes 0 and 1 are not
          * used by anything, 2 is the root directory and 3 is
-         * lost+found.
+         * lost+found. The rest of the inodes are marked unused.
          */
 
-        sb.s_inode[0]  = UX_INODE_INUSE;
-        sb.s_inode[1]  = UX_INODE_INUSE;
-        sb.s_inode[2]  = UX_INODE_INUSE;
-        sb.s_inode[3]  = UX_INODE_INUSE;
-
-        /*
-         * The rest of the inodes are marked unused
-         */
-
-        for (i = 4 ; i < UX_MAXFILES ; i++) {
-                sb.s_inode[i] = UX_INODE_FREE;
+        imap = zalloc((size_t)sb->s_imap_blocks * bsize);
+        for (i = 0 ; i < UX_FIRST_INO ; i++) {
+                setbit(imap, i);
         }
 
         /*
          * The first two blocks are allocated for the entries
-         * for the root and lost+found directories.
-         */
-
-        sb.s_block[0] = UX_BLOCK_INUSE;
-        sb.s_block[1] = UX_BLOCK_INUSE;
-
-        /*
-         * The rest of the blocks are marked unused
+         * for the root and lost+found directories. The rest
+         * of the blocks are marked unused.
          */
 
-        for (i = 2 ; i < UX_MAXBLOCKS ; i++) {
-                sb.s_block[i] = UX_BLOCK_FREE;
-        }
-
-        write(devfd, (char *)&sb, sizeof(struct ux_superblock));
+        bmap = zalloc((size_t)sb->s_bmap_blocks * bsize);
+        setbit(bmap, 0);
+        setbit(bmap, 1);
 
         /*
          * The root directory and lost+found directory inodes
-         * must be initialized.
+         * must be initialized. All four reserved inodes are in
+         * the first block of the inode table.
          */
 
         time(&tm);
-        memset((void *)&inode, 0, sizeof(struct ux_inode));
-        inode.i_mode = S_IFDIR | 0755;
-        inode.i_nlink = 3;        /* ".", ".." and "lost+found" */
-        inode.i_atime = tm;
-        inode.i_mtime = tm;
-        inode.i_ctime = tm;
-        inode.i_uid = 0;
-        inode.i_gid = 0;
-        inode.i_size = UX_BSIZE;
-        inode.i_blocks = 1;
-        inode.i_addr[0] = UX_FIRST_DATA_BLOCK;
-
-        lseek(devfd, UX_INODE_BLOCK * UX_BSIZE + 1024, SEEK_SET);
-        write(devfd, (char *)&inode, sizeof(struct ux_superblock));
-
-        memset((void *)&inode, 0 , sizeof(struct ux_inode));
-        inode.i_mode = S_IFDIR | 0755;
-        inode.i_nlink = 2;        /* "." and ".." */
-        inode.i_atime = tm;
-        inode.i_mtime = tm;
-        inode.i_ctime = tm;
-        inode.i_uid = 0;
-        inode.i_gid = 0;
-        inode.i_size = UX_BSIZE;
-        inode.i_blocks = 1;
-        inode.i_addr[0] = UX_FIRST_DATA_BLOCK + 1;
-        
-
-        lseek(devfd, UX_INODE_BLOCK * UX_BSIZE + 1536, SEEK_SET);
-        write(devfd, (char *)&inode, sizeof(struct ux_superblock));
+        itable = zalloc(bsize);
+        inode = (struct ux_inode *)itable;
+        make_dir(&inode[UX_ROOT_INO], 3, sb->s_data_start, tm);
+        make_dir(&inode[UX_ROOT_INO + 1], 2, sb->s_data_start + 1, tm);
 
         /*
-         * Fill in the directory entries for root 
+         * Fill in the directory entries for root and lost+found
          */
 
-        lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-        memset((void *)&block, 0, UX_BSIZE);
-        write(devfd, block, UX_BSIZE);
-        lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE, SEEK_SET);
-        dir.d_ino = 2;
-        strcpy(dir.d_name, ".");
-        write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-        dir.d_ino = 2;
-        strcpy(dir.d_name, "..");
-        write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-        dir.d_ino = 3;
-        strcpy(dir.d_name, "lost+found");
-        write(devfd, (char *)&dir, sizeof(struct ux_dirent));
+        dirs = zalloc(2 * bsize);
+        dir = (struct ux_dirent *)dirs;
+        make_dirent(&dir[0], UX_ROOT_INO, ".");
+        make_dirent(&dir[1], UX_ROOT_INO, "..");
+        make_dirent(&dir[2], UX_ROOT_INO + 1, "lost+found");
+        dir = (struct ux_dirent *)(dirs + bsize);
+        make_dirent(&dir[0], UX_ROOT_INO + 1, ".");
+        make_dirent(&dir[1], UX_ROOT_INO, "..");
 
         /*
-         * Fill in the directory entries for lost+found 
+         * Zero the rest of the inode table, then write everything
+         * out. layout() puts the bitmaps and the inode table right
+         * after the superblock with no gaps between them.
          */
 
-        lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE + UX_BSIZE,
-              SEEK_SET);
-        memset((void *)&block, 0, UX_BSIZE);
-        write(devfd, block, UX_BSIZE);
-        lseek(devfd, UX_FIRST_DATA_BLOCK * UX_BSIZE + UX_BSIZE, 
-              SEEK_SET);
-        dir.d_ino = 2;
-        strcpy(dir.d_name, ".");
-        write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-        dir.d_ino = 2;
-        strcpy(dir.d_name, "..");
-        write(devfd, (char *)&dir, sizeof(struct ux_dirent));
-}
+        if (!sb->s_itable_lazy) {
+                zero_blocks(devfd, sb->s_itable_start + 1,
+                            sb->s_itable_blocks - 1, "inode table");
+        }
+
+        iov[0].iov_base = sblock;
+        iov[0].iov_len = bsize;
+        iov[1].iov_base = imap;
+        iov[1].iov_len = (size_t)sb->s_imap_blocks * bsize;
+        iov[2].iov_base = bmap;
+        iov[2].iov_len = (size_t)sb->s_bmap_blocks * bsize;
+        iov[3].iov_base = itable;
+        iov[3].iov_len = bsize;
+        write_iov(devfd, iov, 4, 0, "superblock and bitmaps");
 
+        if (sb->s_journal_blocks) {
+                journal = zalloc(bsize);
+                make_journal(journal, sb);
+                write_blocks(devfd, journal, sb->s_journal_start, 1,
+                             "journal");
+        }
+        write_blocks(devfd, dirs, sb->s_data_start, 2, "root directory");
+
+        if (fsync(devfd) < 0 || close(devfd) < 0) {
+                write_failed("device");
+        }
+
+        printf("uxmkfs: %u inodes, %u data blocks of %d bytes\n",
+               sb->s_ninodes, sb->s_nblocks, bsize);
+        if (sb->s_journal_blocks) {
+                printf("uxmkfs: %u block journal\n", sb->s_journal_blocks);
+        }
+        if (sb->s_itable_lazy) {
+                printf("uxmkfs: inode table will be zeroed after mount\n");
+        }
+        return 0;
+}
@@ -3,129 +3,526 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/jhash.h>
+#include <linux/mbcache.h>
 #include "ux_xattr.h"
 #include "ux_acl.h"
 #include "ux_fs.h"
+#include "ux_journal.h"
+#include "ux_trace.h"
 
-struct posix_acl* ux_get_acl(struct inode *inode, int type)
+/*
+ * Size of the on-disk entries for "acl".
+ */
+
+static size_t ux_acl_entries_size(const struct posix_acl *acl)
 {
-	struct ux_inode* uip = (struct ux_inode*)inode->i_private;
-	struct buffer_head* acl_bh;
-	struct posix_acl *acl;
-	int error;
-	void *default_acl_in_fs, *access_acl_in_fs;
+	const struct posix_acl_entry *pa, *pe;
+	size_t size = 0;
 
-	if (!inode) {
-		return -EINVAL;
+	if (!acl) {
+		return 0;
 	}
 
-	if (!uip->i_acl_blk_addr) {
-		uip->i_acl_blk_addr = ux_data_alloc(inode->i_sb);
+	FOREACH_ACL_ENTRY(pa, acl, pe) {
+		if (pa->e_tag == ACL_USER || pa->e_tag == ACL_GROUP) {
+			size += sizeof(struct ux_acl_entry);
+		} else {
+			size += UX_ACL_ENTRY_SHORT;
+		}
 	}
 
-	acl_bh = sb_bread(inode->i_sb, uip->i_acl_blk_addr);
-	if (!acl_bh) {
-		return ERR_PTR(-EIO);
-	}
-	
-	switch (type) {
-	case ACL_TYPE_ACCESS:
-		access_acl_in_fs = kmalloc(uip->i_access_acl_size, GFP_KERNEL);
-		memcpy(access_acl_in_fs, acl_bh->b_data + UX_ACCESS_ACL_OFFSET, uip->i_access_acl_size);
-		acl = posix_acl_from_xattr(inode->i_sb->s_user_ns, access_acl_in_fs, uip->i_access_acl_size);
-		
-		brelse(acl_bh);
-		return acl;
-	case ACL_TYPE_DEFAULT:
-		default_acl_in_fs = kmalloc(uip->i_default_acl_size, GFP_KERNEL);
-		memcpy(default_acl_in_fs, acl_bh->b_data + UX_DEFAULT_ACL_OFFSET, uip->i_default_acl_size);
-		acl = posix_acl_from_xattr(inode->i_sb->s_user_ns, default_acl_in_fs, uip->i_default_acl_size);
+	return size;
+}
 
-		brelse(acl_bh);
-		return acl;
+/*
+ * Encode "pa" as an on-disk entry and return its length.
+ */
+
+static size_t ux_acl_entry_encode(struct ux_acl_entry *entry,
+				  const struct posix_acl_entry *pa)
+{
+	entry->e_tag = pa->e_tag;
+	entry->e_perm = pa->e_perm;
+	entry->e_id = 0;
+	switch (pa->e_tag) {
+	case ACL_USER:
+		entry->e_id = from_kuid(&init_user_ns, pa->e_uid);
+		return sizeof(struct ux_acl_entry);
+	case ACL_GROUP:
+		entry->e_id = from_kgid(&init_user_ns, pa->e_gid);
+		return sizeof(struct ux_acl_entry);
 	default:
-		brelse(acl_bh);
-		BUG();
+		return UX_ACL_ENTRY_SHORT;
 	}
 }
 
-static int __ux_set_acl(struct inode *inode, struct posix_acl *acl, int type)
+/*
+ * What ux_acl_walk() does with each piece of the record.
+ */
+
+enum {
+	UX_ACL_BUILD,		/* copy it to "p" */
+	UX_ACL_HASH,		/* add it to *hash */
+	UX_ACL_MATCH,		/* compare it with "p" */
+};
+
+/*
+ * Walk the record for the given pair of ACLs a piece at a time,
+ * so that it can be written, hashed or compared in place without
+ * first being built in a scratch buffer. Returns 0 if a
+ * UX_ACL_MATCH finds a difference, 1 otherwise.
+ */
+
+static int ux_acl_walk(int op, char *p, __u32 *hash,
+		       const struct posix_acl *access,
+		       const struct posix_acl *dflt)
 {
-	struct ux_inode* uip = (struct ux_inode*)inode->i_private;
-	struct buffer_head* acl_bh;
-	int error;
-	void *default_acl_in_fs, *access_acl_in_fs;
+	const struct posix_acl *acls[2] = { access, dflt };
+	const struct posix_acl_entry *pa, *pe;
+	struct ux_acl_header hdr;
+	struct ux_acl_entry entry;
+	const void *piece = &hdr;
+	size_t len = sizeof(hdr);
+	int i = 0;
 
-	if (!acl) {
-		return -EINVAL;
+	hdr.ah_access = access ? access->a_count : 0;
+	hdr.ah_default = dflt ? dflt->a_count : 0;
+	pa = pe = NULL;
+
+	for (;;) {
+		switch (op) {
+		case UX_ACL_BUILD:
+			memcpy(p, piece, len);
+			break;
+		case UX_ACL_HASH:
+			*hash = jhash(piece, len, *hash);
+			break;
+		case UX_ACL_MATCH:
+			if (memcmp(p, piece, len)) {
+				return 0;
+			}
+			break;
+		}
+		p += len;
+
+		while (pa == pe) {
+			if (i == 2) {
+				return 1;
+			}
+			pa = acls[i] ? acls[i]->a_entries : NULL;
+			pe = acls[i] ? pa + acls[i]->a_count : NULL;
+			i++;
+		}
+		len = ux_acl_entry_encode(&entry, pa++);
+		piece = &entry;
 	}
+}
 
-	if (!inode) {
-		return -EINVAL;
+/*
+ * Decode "count" entries at *pp, which must end by "end". If
+ * "want" is not set the entries are only skipped.
+ */
+
+static struct posix_acl *ux_acl_decode(const char **pp, const char *end,
+				       int count, int want)
+{
+	const struct ux_acl_entry *entry;
+	struct posix_acl *acl = NULL;
+	const char *p = *pp;
+	int i;
+
+	if (want && count) {
+		acl = posix_acl_alloc(count, GFP_NOFS);
+		if (!acl) {
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		entry = (const struct ux_acl_entry *)p;
+		if (p + UX_ACL_ENTRY_SHORT > end) {
+			goto fail;
+		}
+		if (entry->e_tag == ACL_USER || entry->e_tag == ACL_GROUP) {
+			if (p + sizeof(struct ux_acl_entry) > end) {
+				goto fail;
+			}
+			p += sizeof(struct ux_acl_entry);
+		} else {
+			p += UX_ACL_ENTRY_SHORT;
+		}
+		if (!acl) {
+			continue;
+		}
+
+		acl->a_entries[i].e_tag = entry->e_tag;
+		acl->a_entries[i].e_perm = entry->e_perm;
+		switch (entry->e_tag) {
+		case ACL_USER_OBJ:
+		case ACL_GROUP_OBJ:
+		case ACL_MASK:
+		case ACL_OTHER:
+			break;
+		case ACL_USER:
+			acl->a_entries[i].e_uid =
+				make_kuid(&init_user_ns, entry->e_id);
+			break;
+		case ACL_GROUP:
+			acl->a_entries[i].e_gid =
+				make_kgid(&init_user_ns, entry->e_id);
+			break;
+		default:
+			goto fail;
+		}
+	}
+
+	*pp = p;
+	return acl;
+
+fail:
+	posix_acl_release(acl);
+	return ERR_PTR(-EIO);
+}
+
+/*
+ * Find the ACL record of "inode". If it is in a shared ACL block
+ * *bhp holds a reference to that block for the caller to
+ * release. Returns NULL if the inode has no ACLs.
+ */
+
+static struct ux_acl_header *ux_acl_record(struct inode *inode,
+					   struct buffer_head **bhp,
+					   size_t *size)
+{
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct ux_acl_header *hdr;
+	struct ux_acl_block *ab;
+	struct buffer_head *bh;
+
+	*bhp = NULL;
+	if (!uip->i_acl_blk) {
+		hdr = (struct ux_acl_header *)uip->i_acl;
+		if (!hdr->ah_access && !hdr->ah_default) {
+			return NULL;
+		}
+		*size = UX_INLINE_ACL;
+		return hdr;
 	}
 
-	if (!uip->i_acl_blk_addr) {
-		uip->i_acl_blk_addr = ux_data_alloc(inode->i_sb);
+	bh = sb_bread(inode->i_sb, uip->i_acl_blk);
+	if (!bh) {
+		return ERR_PTR(-EIO);
 	}
+	ux_stat_inc(inode->i_sb, UX_STAT_ACL_BLOCK_READ);
 
-	acl_bh = sb_bread(inode->i_sb, uip->i_acl_blk_addr);
-	if (!acl_bh) {
+	ab = (struct ux_acl_block *)bh->b_data;
+	if (ab->ab_magic != UX_ACL_MAGIC || ab->ab_refcount == 0 ||
+	    ab->ab_size > UX_ACL_MAX_RECORD(inode->i_sb->s_blocksize)) {
+		brelse(bh);
 		return ERR_PTR(-EIO);
 	}
 
-	switch(type) {
-		case ACL_TYPE_ACCESS:
-			error = posix_acl_valid(inode->i_sb->s_user_ns, acl);
-			if (error) {
-				return error;
-			}
+	/*
+	 * Let later writers of the same record find this block.
+	 */
 
-			access_acl_in_fs = kmalloc(UX_BSIZE/2, GFP_KERNEL);
-			uip->i_access_acl_size = posix_acl_to_xattr(inode->i_sb->s_user_ns, acl, access_acl_in_fs, UX_BSIZE/2);
-			memcpy(acl_bh->b_data + UX_ACCESS_ACL_OFFSET, access_acl_in_fs, uip->i_access_acl_size);
-			
-			break;
+	mb_cache_entry_create(fs->u_acl_cache, GFP_NOFS, ab->ab_hash,
+			      uip->i_acl_blk, true);
 
-		case ACL_TYPE_DEFAULT:
-			if (!S_ISDIR(inode->i_mode)) {
-				return acl ? -EACCES : 0;
-			}
-			
-			error = posix_acl_valid(inode->i_sb->s_user_ns, acl);
-			if (error) {
-				
-				return error;
+	*bhp = bh;
+	*size = ab->ab_size;
+	return (struct ux_acl_header *)(ab + 1);
+}
+
+/*
+ * Find a shared ACL block holding the "size" byte record of the
+ * given pair of ACLs, or make one, and take a reference to it.
+ */
+
+static __u32 ux_acl_share(struct super_block *sb,
+			  const struct posix_acl *access,
+			  const struct posix_acl *dflt, size_t size)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct mb_cache_entry *ce;
+	struct ux_acl_block *ab;
+	struct buffer_head *bh;
+	__u32 hash = 0, blk;
+
+	ux_acl_walk(UX_ACL_HASH, NULL, &hash, access, dflt);
+
+	ce = mb_cache_entry_find_first(fs->u_acl_cache, hash);
+	while (ce) {
+		bh = sb_bread(sb, ce->e_value);
+		if (bh && ux_journal_get_write_access(bh)) {
+			brelse(bh);
+			bh = NULL;
+		}
+		if (bh) {
+			lock_buffer(bh);
+			ab = (struct ux_acl_block *)bh->b_data;
+			if (ab->ab_magic == UX_ACL_MAGIC &&
+			    ab->ab_refcount > 0 &&
+			    ab->ab_refcount < UX_ACL_REFCOUNT_MAX &&
+			    ab->ab_size == size &&
+			    ux_acl_walk(UX_ACL_MATCH, (char *)(ab + 1), NULL,
+					access, dflt)) {
+				ab->ab_refcount++;
+				unlock_buffer(bh);
+				ux_journal_dirty(bh);
+				brelse(bh);
+				blk = ce->e_value;
+				mb_cache_entry_touch(fs->u_acl_cache, ce);
+				mb_cache_entry_put(fs->u_acl_cache, ce);
+				return blk;
 			}
-				
-			default_acl_in_fs = kmalloc(UX_BSIZE/2, GFP_KERNEL);
-			uip->i_default_acl_size  = posix_acl_to_xattr(inode->i_sb->s_user_ns, acl, default_acl_in_fs, UX_BSIZE/2);
-			
-			memcpy(acl_bh->b_data + UX_DEFAULT_ACL_OFFSET, default_acl_in_fs, uip->i_default_acl_size);
-			
-			break;
+			unlock_buffer(bh);
+			brelse(bh);
+		}
+		ce = mb_cache_entry_find_next(fs->u_acl_cache, ce);
+	}
 
-		default:
-			brelse(acl_bh);
-			return -EINVAL;
+	blk = ux_data_alloc(sb);
+	if (!blk) {
+		return 0;
+	}
+
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		ux_data_free(sb, blk);
+		return 0;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	if (ux_journal_get_write_access(bh)) {
+		brelse(bh);
+		ux_data_free(sb, blk);
+		return 0;
+	}
+
+	lock_buffer(bh);
+	ab = (struct ux_acl_block *)bh->b_data;
+	ab->ab_magic = UX_ACL_MAGIC;
+	ab->ab_refcount = 1;
+	ab->ab_hash = hash;
+	ab->ab_size = size;
+	ux_acl_walk(UX_ACL_BUILD, (char *)(ab + 1), NULL, access, dflt);
+	unlock_buffer(bh);
+	ux_journal_dirty(bh);
+	brelse(bh);
+
+	mb_cache_entry_create(fs->u_acl_cache, GFP_NOFS, hash, blk, true);
+	return blk;
+}
+
+/*
+ * Drop a reference to a shared ACL block, freeing it when the
+ * last user goes away.
+ */
+
+void ux_acl_release(struct super_block *sb, __u32 blk)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_acl_block *ab;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		return;
+	}
+	if (ux_journal_get_write_access(bh)) {
+		brelse(bh);
+		return;
 	}
 
-	mark_buffer_dirty(acl_bh);
-	brelse(acl_bh);
+	lock_buffer(bh);
+	ab = (struct ux_acl_block *)bh->b_data;
+	if (ab->ab_magic != UX_ACL_MAGIC || ab->ab_refcount == 0) {
+		unlock_buffer(bh);
+		brelse(bh);
+		return;
+	}
+
+	if (--ab->ab_refcount == 0) {
+		unlock_buffer(bh);
+		mb_cache_entry_delete(fs->u_acl_cache, ab->ab_hash, blk);
+		ux_journal_forget(sb, bh, blk);
+		ux_data_free(sb, blk);
+		return;
+	}
+
+	unlock_buffer(bh);
+	ux_journal_dirty(bh);
+	brelse(bh);
+}
+
+/*
+ * Store the access and default ACLs of "inode". Either may be
+ * NULL, meaning there is nothing beyond the mode bits.
+ */
+
+static int ux_acl_write(struct inode *inode, const struct posix_acl *access,
+			const struct posix_acl *dflt)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	__u32 old = uip->i_acl_blk, blk = 0;
+	size_t size;
+
+	size = ux_acl_entries_size(access) + ux_acl_entries_size(dflt);
+	if (size) {
+		size += sizeof(struct ux_acl_header);
+	}
+	if (size > UX_ACL_MAX_RECORD(sb->s_blocksize)) {
+		trace_uxfs_acl_store(inode, old, 0, size, -E2BIG);
+		return -E2BIG;
+	}
+
+	if (size > UX_INLINE_ACL) {
+		blk = ux_acl_share(sb, access, dflt, size);
+		if (!blk) {
+			trace_uxfs_acl_store(inode, old, 0, size, -ENOSPC);
+			return -ENOSPC;
+		}
+	}
+	trace_uxfs_acl_store(inode, old, blk, size, 0);
+
+	memset(uip->i_acl, 0, UX_INLINE_ACL);
+	if (size && !blk) {
+		ux_acl_walk(UX_ACL_BUILD, (char *)uip->i_acl, NULL,
+			    access, dflt);
+	}
+	uip->i_acl_blk = blk;
 	mark_inode_dirty(inode);
-	set_cached_acl(inode, type, acl);
-	
+
+	if (old) {
+		ux_acl_release(sb, old);
+	}
 	return 0;
 }
 
+struct posix_acl* ux_get_acl(struct inode *inode, int type)
+{
+	struct ux_acl_header *hdr;
+	struct buffer_head *bh;
+	struct posix_acl *acl;
+	const char *p, *end;
+	size_t size;
+
+	hdr = ux_acl_record(inode, &bh, &size);
+	if (IS_ERR_OR_NULL(hdr)) {
+		trace_uxfs_acl_load(inode, type, UX_I(inode)->ui_inode.i_acl_blk,
+				    0, PTR_ERR_OR_ZERO(hdr));
+		return (struct posix_acl *)hdr;
+	}
+
+	p = (const char *)(hdr + 1);
+	end = (const char *)hdr + size;
+	acl = ux_acl_decode(&p, end, hdr->ah_access,
+			    type == ACL_TYPE_ACCESS);
+	if (type == ACL_TYPE_DEFAULT && !IS_ERR(acl)) {
+		acl = ux_acl_decode(&p, end, hdr->ah_default, 1);
+	}
+	trace_uxfs_acl_load(inode, type, UX_I(inode)->ui_inode.i_acl_blk,
+			    size, PTR_ERR_OR_ZERO(acl));
+
+	brelse(bh);
+	return acl;
+}
+
+/*
+ * Fill in the cached ACLs of an inode being read in. An inode
+ * without ACLs, or with an inline record, needs no I/O to find
+ * them, so they are set up here and permission checks never call
+ * ux_get_acl() at all. A record in an ACL block is read on first
+ * use and then stays cached by the VFS with the inode.
+ */
+
+void ux_acl_iget(struct inode *inode)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct ux_acl_header *hdr = (struct ux_acl_header *)uip->i_acl;
+	struct posix_acl *access, *dflt;
+	const char *p, *end;
+
+	if (uip->i_acl_blk) {
+		return;
+	}
+	if (!hdr->ah_access && !hdr->ah_default) {
+		cache_no_acl(inode);
+		return;
+	}
+
+	p = (const char *)(hdr + 1);
+	end = (const char *)hdr + UX_INLINE_ACL;
+	access = ux_acl_decode(&p, end, hdr->ah_access, 1);
+	if (IS_ERR(access)) {
+		return;
+	}
+	dflt = ux_acl_decode(&p, end, hdr->ah_default, 1);
+	trace_uxfs_acl_load(inode, ACL_TYPE_ACCESS | ACL_TYPE_DEFAULT, 0,
+			    UX_INLINE_ACL, PTR_ERR_OR_ZERO(dflt));
+	if (IS_ERR(dflt)) {
+		posix_acl_release(access);
+		return;
+	}
+
+	set_cached_acl(inode, ACL_TYPE_ACCESS, access);
+	set_cached_acl(inode, ACL_TYPE_DEFAULT, dflt);
+	posix_acl_release(access);
+	posix_acl_release(dflt);
+}
+
+static int __ux_set_acl(struct inode *inode, struct posix_acl *acl, int type)
+{
+	struct posix_acl *other;
+	int error;
+
+	switch (type) {
+	case ACL_TYPE_ACCESS:
+		other = get_acl(inode, ACL_TYPE_DEFAULT);
+		break;
+	case ACL_TYPE_DEFAULT:
+		if (!S_ISDIR(inode->i_mode)) {
+			return acl ? -EACCES : 0;
+		}
+		other = get_acl(inode, ACL_TYPE_ACCESS);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (IS_ERR(other)) {
+		return PTR_ERR(other);
+	}
+
+	if (type == ACL_TYPE_ACCESS) {
+		error = ux_acl_write(inode, acl, other);
+	} else {
+		error = ux_acl_write(inode, other, acl);
+	}
+	posix_acl_release(other);
+
+	if (!error) {
+		set_cached_acl(inode, type, acl);
+	}
+	return error;
+}
+
 int ux_set_acl(struct inode *inode, struct posix_acl *acl, int type)
 {
+	handle_t *handle;
 	int error;
 	int update_mode = 0;
 	umode_t mode = inode->i_mode;
-	
+
 	if (type == ACL_TYPE_ACCESS && acl) {
 		error = posix_acl_update_mode(inode, &mode, &acl);
-		
+
 		if (error) {
 			return error;
 		}
@@ -133,18 +530,25 @@ int ux_set_acl(struct inode *inode, struct posix_acl *acl, int type)
 		update_mode = 1;
 	}
 
+	handle = ux_journal_start(inode->i_sb, UX_NS_CREDITS, 1);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
 	error = __ux_set_acl(inode, acl, type);
 	if (!error && update_mode) {
 		inode->i_mode = mode;
 		inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
 	}
+	ux_journal_stop(handle);
 
 	return error;
 }
 
 /*
- * Initialize the ACLs of a new inode. Called from ux_new_inode.
+ * Initialize the ACLs of a new inode. Both ACLs are written in
+ * one go; posix_acl_create() has already dropped any that are
+ * equivalent to the mode, so most new inodes store nothing.
  *
  * dir->i_mutex: down
  * inode->i_mutex: up (access to inode is still exclusive)
@@ -153,27 +557,21 @@ int ux_init_acl(struct inode *inode, struct inode *dir)
 {
 	struct posix_acl *default_acl, *acl;
 	int error;
-	
+
 	error = posix_acl_create(dir, &inode->i_mode, &default_acl, &acl);
 	if (error) {
 		return error;
 	}
 
-	inode->i_default_acl = NULL;
-	inode->i_acl = NULL;
-	
-	if (default_acl) {
-		error = __ux_set_acl(inode, default_acl, ACL_TYPE_DEFAULT);
-		posix_acl_release(default_acl);
+	if (default_acl || acl) {
+		error = ux_acl_write(inode, acl, default_acl);
 	}
-	
-	if (acl) {
-		if (!error) {
-			error = __ux_set_acl(inode, acl, ACL_TYPE_ACCESS);
-		}
-		
-		posix_acl_release(acl);
+	if (!error) {
+		set_cached_acl(inode, ACL_TYPE_DEFAULT, default_acl);
+		set_cached_acl(inode, ACL_TYPE_ACCESS, acl);
 	}
 
+	posix_acl_release(default_acl);
+	posix_acl_release(acl);
 	return error;
-}
\ No newline at end of file
+}
@@ -1,6 +1,16 @@
 #include <linux/posix_acl.h>
 #include <linux/posix_acl_xattr.h>
 
+/*
+ * mkfs includes this header without the kernel's definitions of
+ * the VFS structures, so declare the ones used below.
+ */
+
+struct inode;
+struct super_block;
+
 extern struct posix_acl *ux_get_acl(struct inode *inode, int type);
 extern int ux_set_acl(struct inode *inode, struct posix_acl *acl, int type);
 extern int ux_init_acl(struct inode *, struct inode *);
+extern void ux_acl_release(struct super_block *, __u32);
+extern void ux_acl_iget(struct inode *);
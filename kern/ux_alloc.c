@@ -7,64 +7,757 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/uaccess.h>
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
 #include "ux_fs.h"
+#include "ux_journal.h"
+#include "ux_trace.h"
 
 /*
- * Allocate a new inode. We update the superblock and return
- * the inode number.
+ * The bitmaps are spread over several blocks. These helpers
+ * find clear or set bits in the range [start, size) a word at a
+ * time, moving from one bitmap block to the next. They return
+ * "size" if there is no such bit.
  */
 
-ino_t ux_inode_alloc(struct super_block *sb)
+static unsigned long ux_find_zero(struct super_block *sb,
+				  struct buffer_head **map,
+				  unsigned long size, unsigned long start)
+{
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	unsigned long idx, base, lim, bit;
+
+	while (start < size) {
+		idx = start / bpb;
+		base = idx * bpb;
+		lim = min_t(unsigned long, size - base, bpb);
+		bit = find_next_zero_bit_le(map[idx]->b_data, lim,
+					    start - base);
+		if (bit < lim) {
+			return base + bit;
+		}
+		start = base + bpb;
+	}
+
+	return size;
+}
+
+static unsigned long ux_find_set(struct super_block *sb,
+				 struct buffer_head **map,
+				 unsigned long size, unsigned long start)
+{
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	unsigned long idx, base, lim, bit;
+
+	while (start < size) {
+		idx = start / bpb;
+		base = idx * bpb;
+		lim = min_t(unsigned long, size - base, bpb);
+		bit = find_next_bit_le(map[idx]->b_data, lim, start - base);
+		if (bit < lim) {
+			return base + bit;
+		}
+		start = base + bpb;
+	}
+
+	return size;
+}
+
+/*
+ * Each bitmap is divided into allocation groups of gs_size bits,
+ * a power of two no smaller than BITS_PER_LONG and no larger
+ * than a bitmap block. So no two groups share a word of the
+ * bitmap and each group lies in a single bitmap block. A group
+ * has its own lock, free count and allocation cursor, so CPUs
+ * allocating from different groups never touch the same lock or
+ * the same part of the bitmap.
+ *
+ * The bitmap block is handed to the journal before the group
+ * lock is taken and marked dirty after it is dropped, as both
+ * may sleep.
+ */
+
+static inline struct ux_group *ux_group_of(struct ux_groups *gs,
+					   unsigned long bit)
+{
+	return &gs->gs_group[bit / gs->gs_size];
+}
+
+static inline struct buffer_head *ux_group_bh(struct super_block *sb,
+					      struct buffer_head **map,
+					      struct ux_group *g)
+{
+	return map[g->g_start / UX_BITS_PER_BLOCK(sb->s_blocksize)];
+}
+
+/*
+ * Claim up to *count clear bits from group "g", starting the
+ * search at "goal" if it lies in the group and at the group's
+ * cursor otherwise. Returns the first bit claimed and sets
+ * *count, or returns "size" if the group is full.
+ */
+
+static unsigned long ux_group_alloc(struct super_block *sb,
+				    struct buffer_head **map,
+				    struct ux_group *g, unsigned long size,
+				    unsigned long goal, unsigned long *count)
+{
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head *bh = ux_group_bh(sb, map, g);
+	unsigned long start, bit, end, i;
+
+	if (ux_journal_get_write_access(bh)) {
+		return size;
+	}
+
+	spin_lock(&g->g_lock);
+	if (!g->g_free) {
+		spin_unlock(&g->g_lock);
+		return size;
+	}
+
+	start = (goal >= g->g_start && goal < g->g_end) ? goal : g->g_next;
+	bit = ux_find_zero(sb, map, g->g_end, start);
+	if (bit >= g->g_end) {
+		bit = ux_find_zero(sb, map, start, g->g_start);
+		if (bit >= start) {
+			spin_unlock(&g->g_lock);
+			return size;
+		}
+	}
+
+	end = ux_find_set(sb, map,
+			  min_t(unsigned long, g->g_end, bit + *count), bit);
+	for (i = bit; i < end; i++) {
+		__set_bit_le(i % bpb, bh->b_data);
+	}
+	g->g_free -= end - bit;
+	if (g->g_next >= bit && g->g_next < end) {
+		g->g_next = end;
+	}
+	spin_unlock(&g->g_lock);
+	ux_journal_dirty(bh);
+
+	*count = end - bit;
+	return bit;
+}
+
+/*
+ * Claim up to *count clear bits of a bitmap of "size" bits. The
+ * group holding "goal" is tried first, or, without a goal, the
+ * group belonging to this CPU. The others follow in turn, and
+ * groups whose free count says they are full are skipped
+ * without taking their lock. Returns "size" if nothing is free.
+ */
+
+static unsigned long ux_bitmap_alloc(struct super_block *sb,
+				     struct buffer_head **map,
+				     struct ux_groups *gs, unsigned long size,
+				     unsigned long goal, unsigned long *count)
 {
 	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
-	struct ux_superblock *usb = fs->u_sb;
-	int i;
-	
-	if (usb->s_nifree == 0) {
+	unsigned long bit, want = *count;
+	unsigned int first, i;
+	struct ux_group *g;
+
+	if (goal < size) {
+		first = goal / gs->gs_size;
+	} else {
+		first = raw_smp_processor_id() % gs->gs_count;
+	}
+
+	for (i = 0; i < gs->gs_count; i++) {
+		g = &gs->gs_group[(first + i) % gs->gs_count];
+		if (!READ_ONCE(g->g_free)) {
+			continue;
+		}
+		bit = ux_group_alloc(sb, map, g, size, goal, count);
+		if (bit < size) {
+			trace_uxfs_bitmap_alloc(sb, gs == &fs->u_igroups, goal,
+						want, i + 1, bit, *count);
+			ux_stat_inc(sb, gs == &fs->u_igroups ?
+					UX_STAT_INODE_ALLOC : UX_STAT_BLOCK_ALLOC);
+			ux_stat_add(sb, UX_STAT_ALLOC_GROUPS, i + 1);
+			return bit;
+		}
+	}
+
+	trace_uxfs_bitmap_alloc(sb, gs == &fs->u_igroups, goal, want,
+				gs->gs_count, size, 0);
+	ux_stat_inc(sb, UX_STAT_ALLOC_FAIL);
+	ux_stat_add(sb, UX_STAT_ALLOC_GROUPS, gs->gs_count);
+	return size;
+}
+
+/*
+ * Give back a bit. The group's cursor is pulled back so that
+ * the lowest free bit is found again by its next allocation.
+ */
+
+static int ux_bitmap_free(struct super_block *sb, struct buffer_head **map,
+			  struct ux_groups *gs, unsigned long bit)
+{
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	struct ux_group *g = ux_group_of(gs, bit);
+	struct buffer_head *bh = ux_group_bh(sb, map, g);
+	int freed;
+
+	if (ux_journal_get_write_access(bh)) {
 		return 0;
 	}
 
-	for (i = 3; i < UX_MAXFILES; i++) {
-		if (usb->s_inode[i] == UX_INODE_FREE) {
-			usb->s_inode[i] = UX_INODE_INUSE;
-			usb->s_nifree--;
-			
-			ux_write_super(sb);
-			return i;
+	spin_lock(&g->g_lock);
+	freed = __test_and_clear_bit_le(bit % bpb, bh->b_data);
+	if (freed) {
+		g->g_free++;
+		if (bit < g->g_next) {
+			g->g_next = bit;
 		}
 	}
+	spin_unlock(&g->g_lock);
 
-	return 0;
+	if (freed) {
+		ux_journal_dirty(bh);
+	}
+	return freed;
+}
+
+/*
+ * Placement. Inode group i goes with the block group covering
+ * the same fraction of the disk, so that the data of the files
+ * in a group lands together. A new file's inode is put next to
+ * its parent directory's and its data in the block group that
+ * goes with its inode. New directories are spread out instead,
+ * in the spirit of the Orlov allocator: a top-level directory
+ * goes to a randomly chosen group with more than the average
+ * free inodes and blocks, and a deeper one stays in its parent's
+ * group unless that is running short.
+ */
+
+static struct ux_group *ux_block_group_of(struct ux_fs *fs, unsigned long ino)
+{
+	unsigned int ig = ino / fs->u_igroups.gs_size;
+
+	return &fs->u_bgroups.gs_group[(u64)ig * fs->u_bgroups.gs_count /
+				       fs->u_igroups.gs_count];
+}
+
+static int ux_group_roomy(struct ux_fs *fs, struct ux_group *g,
+			  unsigned long ifree, unsigned long bfree)
+{
+	return READ_ONCE(g->g_free) >= ifree &&
+	       READ_ONCE(ux_block_group_of(fs, g->g_start)->g_free) >= bfree;
+}
+
+static struct ux_group *ux_find_group_dir(struct super_block *sb,
+					  struct inode *dir)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_groups *gs = &fs->u_igroups;
+	unsigned long avei, aveb;
+	struct ux_group *g, *best = NULL;
+	unsigned int first, i;
+
+	avei = percpu_counter_read_positive(&fs->u_ifree) / gs->gs_count;
+	aveb = percpu_counter_read_positive(&fs->u_bfree) /
+	       fs->u_bgroups.gs_count;
+
+	if (dir->i_ino == UX_ROOT_INO) {
+		first = prandom_u32_max(gs->gs_count);
+		for (i = 0; i < gs->gs_count; i++) {
+			g = &gs->gs_group[(first + i) % gs->gs_count];
+			if (!ux_group_roomy(fs, g, avei, aveb)) {
+				continue;
+			}
+			if (!best ||
+			    READ_ONCE(ux_block_group_of(fs, g->g_start)->g_free) >
+			    READ_ONCE(ux_block_group_of(fs, best->g_start)->g_free)) {
+				best = g;
+			}
+		}
+		return best;
+	}
+
+	first = dir->i_ino / gs->gs_size;
+	for (i = 0; i < gs->gs_count; i++) {
+		g = &gs->gs_group[(first + i) % gs->gs_count];
+		if (ux_group_roomy(fs, g, avei / 2, aveb / 2)) {
+			return g;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Allocate a new inode of type "mode" in directory "dir" and
+ * return its number. The free counts are kept in per-CPU
+ * counters while the filesystem is mounted and only copied to
+ * the superblock by ux_write_super().
+ */
+
+ino_t ux_inode_alloc(struct super_block *sb, struct inode *dir, umode_t mode)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+	unsigned long ino, goal = dir->i_ino, count = 1;
+	struct ux_group *g;
+
+	if (S_ISDIR(mode)) {
+		g = ux_find_group_dir(sb, dir);
+		if (g) {
+			goal = READ_ONCE(g->g_next);
+		}
+	}
+
+	ino = ux_bitmap_alloc(sb, fs->u_imap, &fs->u_igroups,
+			      usb->s_ninodes, goal, &count);
+	if (ino >= usb->s_ninodes) {
+		return 0;
+	}
+
+	percpu_counter_dec(&fs->u_ifree);
+	return ino;
+}
+
+/*
+ * Where the data of "inode" should go when there is nothing
+ * better to go by: the allocation cursor of the block group
+ * that goes with the inode.
+ */
+
+__u32 ux_data_goal(struct inode *inode)
+{
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
+	struct ux_group *g = ux_block_group_of(fs, inode->i_ino);
+
+	return fs->u_sb->s_data_start + READ_ONCE(g->g_next);
 }
 
 /*
- * Allocate a new data block. We update the superblock and return
- * the new block number.
+ * Allocate a new data block and return its block number.
  */
 
 __u32 ux_data_alloc(struct super_block *sb)
+{
+	__u32 count = 1;
+
+	return ux_data_alloc_blocks(sb, 0, &count, 0);
+}
+
+/*
+ * Allocate a run of up to *count contiguous data blocks. The
+ * search starts at disk block "goal", or in this CPU's group if
+ * there is no goal. The first free block found is returned, and
+ * *count is set to the length of the free run claimed from
+ * there. A run never crosses from one group into the next.
+ *
+ * Blocks promised to delayed allocations are not for anyone
+ * else. A caller that holds such a promise says so with
+ * "reserved" and hands the promise back with ux_data_unreserve()
+ * once the blocks are in place. Anyone else first reserves the
+ * blocks it asks for, or failing that a single block, so that
+ * it can only take what is free and unpromised.
+ */
+
+__u32 ux_data_alloc_blocks(struct super_block *sb, __u32 goal, __u32 *count,
+			   int reserved)
 {
 	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
 	struct ux_superblock *usb = fs->u_sb;
-	int i;
+	unsigned long i, next = ULONG_MAX, len = *count;
 
-	if (usb->s_nbfree == 0) {
+	if (*count == 0) {
+		return 0;
+	}
+
+	if (!reserved && ux_data_reserve(sb, len)) {
+		len = 1;
+		if (ux_data_reserve(sb, len)) {
+			return 0;
+		}
+	}
+	*count = len;
+
+	if (goal >= usb->s_data_start &&
+	    goal < usb->s_data_start + usb->s_nblocks) {
+		next = goal - usb->s_data_start;
+	}
+
+	i = ux_bitmap_alloc(sb, fs->u_bmap, &fs->u_bgroups,
+			    usb->s_nblocks, next, &len);
+	if (i >= usb->s_nblocks) {
+		if (!reserved) {
+			ux_data_unreserve(sb, *count);
+		}
 		return 0;
 	}
 
 	/*
-	 * Start looking at block 1. Block 0 is
-	 * for the root directory.
+	 * Take the blocks off the free count before handing back
+	 * the reservation, so that free - u_dirty never briefly
+	 * shows more than there is.
 	 */
 
-	for (i = 1; i < UX_MAXBLOCKS; i++) {
-		if (usb->s_block[i] == UX_BLOCK_FREE) {
-			usb->s_block[i] = UX_BLOCK_INUSE;
-			usb->s_nbfree--;
-			ux_write_super(sb);
-			return UX_FIRST_DATA_BLOCK + i;
-		}
+	percpu_counter_sub(&fs->u_bfree, len);
+	if (!reserved) {
+		ux_data_unreserve(sb, *count);
+	}
+	*count = len;
+	return usb->s_data_start + i;
+}
+
+/*
+ * Release an inode.
+ */
+
+void ux_inode_free(struct super_block *sb, ino_t ino)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+
+	if (ino < UX_ROOT_INO || ino >= usb->s_ninodes) {
+		return;
+	}
+	if (ux_bitmap_free(sb, fs->u_imap, &fs->u_igroups, ino)) {
+		percpu_counter_inc(&fs->u_ifree);
+	}
+}
+
+/*
+ * Release a data block given its disk block number.
+ */
+
+void ux_data_free(struct super_block *sb, __u32 blk)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+
+	if (blk < usb->s_data_start ||
+	    blk >= usb->s_data_start + usb->s_nblocks) {
+		return;
+	}
+	if (ux_bitmap_free(sb, fs->u_bmap, &fs->u_bgroups,
+			   blk - usb->s_data_start)) {
+		percpu_counter_inc(&fs->u_bfree);
+	}
+}
+
+/*
+ * Delayed allocation promises blocks to buffered writes before
+ * it picks them. u_dirty counts the promised blocks and a new
+ * promise is only made if the free count can still cover all
+ * of them. Writeback draws on the promise as it allocates, and
+ * anything not needed after all is handed back with
+ * ux_data_unreserve().
+ *
+ * A promise is added to u_dirty before the check rather than
+ * after, so that of two writers racing for the last blocks
+ * each sees the other's. The cheap approximate counts are good
+ * enough unless space is nearly gone. Then the exact sums are
+ * taken under u_dirty_lock, one writer at a time, and the
+ * promise is withdrawn if they do not cover it.
+ */
+
+int ux_data_reserve(struct super_block *sb, __u32 count)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	s64 free, dirty;
+	int error = 0;
+
+	percpu_counter_add(&fs->u_dirty, count);
+	free = percpu_counter_read_positive(&fs->u_bfree);
+	dirty = percpu_counter_read_positive(&fs->u_dirty);
+	if (free >= dirty + UX_COUNTER_SLACK) {
+		return 0;
+	}
+	percpu_counter_sub(&fs->u_dirty, count);
+
+	spin_lock(&fs->u_dirty_lock);
+	percpu_counter_add(&fs->u_dirty, count);
+	free = percpu_counter_sum_positive(&fs->u_bfree);
+	dirty = percpu_counter_sum_positive(&fs->u_dirty);
+	if (free < dirty) {
+		percpu_counter_sub(&fs->u_dirty, count);
+		error = -ENOSPC;
+	}
+	spin_unlock(&fs->u_dirty_lock);
+	return error;
+}
+
+void ux_data_unreserve(struct super_block *sb, __u32 count)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	percpu_counter_sub(&fs->u_dirty, count);
+}
+
+/*
+ * Count the clear bits of a bitmap in [start, end).
+ */
+
+static unsigned long ux_count_free(struct super_block *sb,
+				   struct buffer_head **map,
+				   unsigned long start, unsigned long end)
+{
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	unsigned long bit, lim, bytes, used = 0;
+
+	for (bit = start; bit < end && bit % 8; bit++) {
+		used += test_bit_le(bit % bpb, map[bit / bpb]->b_data);
+	}
+	while (bit + 8 <= end) {
+		lim = min(end, round_down(bit, bpb) + bpb);
+		bytes = (lim - bit) / 8;
+		used += memweight(map[bit / bpb]->b_data + (bit % bpb) / 8,
+				  bytes);
+		bit += bytes * 8;
+	}
+	for (; bit < end; bit++) {
+		used += test_bit_le(bit % bpb, map[bit / bpb]->b_data);
+	}
+
+	return end - start - used;
+}
+
+/*
+ * Split a bitmap of "size" bits into allocation groups, about
+ * one per CPU but never smaller than UX_MIN_GROUP bits nor
+ * larger than a bitmap block, and
+ * count the free bits of each. Returns the total free.
+ */
+
+static long ux_groups_init(struct super_block *sb, struct ux_groups *gs,
+			   struct buffer_head **map, unsigned long size)
+{
+	unsigned long total = 0;
+	unsigned int i, count;
+	struct ux_group *g;
+
+	count = clamp_t(unsigned long, num_possible_cpus(), 1,
+			max_t(unsigned long, size / UX_MIN_GROUP, 1));
+	gs->gs_size = clamp_t(unsigned long,
+			      roundup_pow_of_two(DIV_ROUND_UP(size, count)),
+			      BITS_PER_LONG,
+			      UX_BITS_PER_BLOCK(sb->s_blocksize));
+	gs->gs_count = DIV_ROUND_UP(size, gs->gs_size);
+	gs->gs_group = kcalloc(gs->gs_count, sizeof(struct ux_group),
+			       GFP_KERNEL);
+	if (!gs->gs_group) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < gs->gs_count; i++) {
+		g = &gs->gs_group[i];
+		spin_lock_init(&g->g_lock);
+		g->g_start = i * gs->gs_size;
+		g->g_end = min(size, g->g_start + gs->gs_size);
+		g->g_next = g->g_start;
+		g->g_free = ux_count_free(sb, map, g->g_start, g->g_end);
+		total += g->g_free;
+	}
+
+	return total;
+}
+
+/*
+ * Set up the allocation groups and free counters at mount time.
+ * They are counted from the bitmaps rather than taken from the
+ * superblock, whose copy is only refreshed by ux_write_super()
+ * and may be stale after a crash.
+ */
+
+int ux_alloc_init(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+	long ifree, bfree;
+	int error = -ENOMEM;
+
+	ifree = ux_groups_init(sb, &fs->u_igroups, fs->u_imap,
+			       usb->s_ninodes);
+	if (ifree < 0) {
+		return ifree;
+	}
+	bfree = ux_groups_init(sb, &fs->u_bgroups, fs->u_bmap,
+			       usb->s_nblocks);
+	if (bfree < 0) {
+		goto out_igroups;
 	}
 
+	error = percpu_counter_init(&fs->u_ifree, ifree, GFP_KERNEL);
+	if (error) {
+		goto out_bgroups;
+	}
+	error = percpu_counter_init(&fs->u_bfree, bfree, GFP_KERNEL);
+	if (error) {
+		goto out_ifree;
+	}
+	error = percpu_counter_init(&fs->u_dirty, 0, GFP_KERNEL);
+	if (error) {
+		goto out_bfree;
+	}
+	spin_lock_init(&fs->u_dirty_lock);
 	return 0;
+
+out_bfree:
+	percpu_counter_destroy(&fs->u_bfree);
+out_ifree:
+	percpu_counter_destroy(&fs->u_ifree);
+out_bgroups:
+	kfree(fs->u_bgroups.gs_group);
+out_igroups:
+	kfree(fs->u_igroups.gs_group);
+	return error;
+}
+
+void ux_alloc_destroy(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	percpu_counter_destroy(&fs->u_ifree);
+	percpu_counter_destroy(&fs->u_bfree);
+	percpu_counter_destroy(&fs->u_dirty);
+	kfree(fs->u_igroups.gs_group);
+	kfree(fs->u_bgroups.gs_group);
+}
+
+/*
+ * Lazy inode table initialization. mkfs -L only writes the
+ * first block of the inode table, and the rest is zeroed here
+ * after mount, a batch of blocks at a time from a delayed work
+ * item, with s_itable_lazy recording how far it has got. Stale
+ * data in a free slot does no harm, as only the inode bitmap
+ * says which inodes are in use, but fsck and fsdb can trust a
+ * zeroed table.
+ *
+ * Inodes may already have been allocated from a block that is
+ * still to be zeroed, so each slot is only cleared if its bit
+ * is clear, under the lock of its allocation group. An inode
+ * allocated after that is written in full when it is first
+ * logged.
+ */
+
+#define UX_LAZYINIT_BATCH	64		/* blocks per pass */
+#define UX_LAZYINIT_DELAY	(HZ / 10)	/* between passes */
+
+static int ux_lazyinit_block(struct super_block *sb, unsigned long blk)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+	unsigned long ipb = UX_INODES_PER_BLOCK(sb->s_blocksize);
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+	unsigned long ino, i;
+	struct buffer_head *bh;
+	struct ux_group *g;
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(sb, 2, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	bh = sb_bread(sb, usb->s_itable_start + blk);
+	if (!bh) {
+		error = -EIO;
+		goto out;
+	}
+	error = ux_journal_get_write_access(bh);
+	if (error) {
+		brelse(bh);
+		goto out;
+	}
+	for (i = 0; i < ipb; i++) {
+		ino = blk * ipb + i;
+		if (ino >= usb->s_ninodes) {
+			memset(bh->b_data + i * UX_INODE_SIZE, 0,
+			       (ipb - i) * UX_INODE_SIZE);
+			break;
+		}
+		g = ux_group_of(&fs->u_igroups, ino);
+		spin_lock(&g->g_lock);
+		if (!test_bit_le(ino % bpb, fs->u_imap[ino / bpb]->b_data)) {
+			memset(bh->b_data + i * UX_INODE_SIZE, 0,
+			       UX_INODE_SIZE);
+		}
+		spin_unlock(&g->g_lock);
+	}
+	ux_journal_dirty(bh);
+	brelse(bh);
+
+	error = ux_journal_get_write_access(fs->u_sbh);
+	if (!error) {
+		lock_buffer(fs->u_sbh);
+		usb->s_itable_lazy = blk + 1 < usb->s_itable_blocks ?
+				     blk + 1 : 0;
+		unlock_buffer(fs->u_sbh);
+		ux_journal_dirty(fs->u_sbh);
+		ux_stat_inc(sb, UX_STAT_SB_DIRTY);
+	}
+
+out:
+	ux_journal_stop(handle);
+	return error;
+}
+
+static void ux_lazyinit_work(struct work_struct *work)
+{
+	struct ux_fs *fs = container_of(to_delayed_work(work),
+					struct ux_fs, u_lazyinit);
+	struct super_block *sb = fs->u_vfs_sb;
+	struct ux_superblock *usb = fs->u_sb;
+	int n, error = 0;
+
+	/*
+	 * A frozen filesystem is left alone until it thaws.
+	 */
+
+	if (sb_start_write_trylock(sb)) {
+		for (n = 0; n < UX_LAZYINIT_BATCH && usb->s_itable_lazy; n++) {
+			error = ux_lazyinit_block(sb, usb->s_itable_lazy);
+			if (error) {
+				break;
+			}
+		}
+		sb_end_write(sb);
+	}
+
+	if (error) {
+		printk(KERN_WARNING "uxfs: inode table initialization "
+		       "stopped at block %u (%d)\n", usb->s_itable_lazy, error);
+		return;
+	}
+	if (usb->s_itable_lazy) {
+		queue_delayed_work(system_long_wq, &fs->u_lazyinit,
+				   UX_LAZYINIT_DELAY);
+	}
+}
+
+/*
+ * Start zeroing the inode table if mkfs left some of it. This
+ * is only done on a read-write mount; a read-only one leaves it
+ * for the next read-write mount.
+ */
+
+void ux_lazyinit_start(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	fs->u_vfs_sb = sb;
+	INIT_DELAYED_WORK(&fs->u_lazyinit, ux_lazyinit_work);
+	if (fs->u_sb->s_itable_lazy && !sb_rdonly(sb)) {
+		queue_delayed_work(system_long_wq, &fs->u_lazyinit,
+				   UX_LAZYINIT_DELAY);
+	}
+}
+
+void ux_lazyinit_stop(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	cancel_delayed_work_sync(&fs->u_lazyinit);
 }
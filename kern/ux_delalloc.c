@@ -0,0 +1,281 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- ux_delalloc.c ---------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include "ux_fs.h"
+#include "ux_journal.h"
+
+/*
+ * Buffered writes into a hole do not allocate disk blocks.
+ * Instead the logical blocks are recorded here as a delayed
+ * allocation range and the same number of blocks is reserved
+ * from the filesystem's free count, together with enough for
+ * the extent blocks that mapping them could take. Writeback
+ * later allocates each range in one go, so a file written in
+ * small appends still ends up contiguous on disk.
+ *
+ * The ranges of an inode are kept sorted, never overlap and are
+ * merged when they touch. They are protected by ui_extent_lock.
+ */
+
+struct ux_da_range
+{
+	struct list_head dr_list;
+	__u32 dr_lblk;
+	__u32 dr_len;
+};
+
+static inline __u32 ux_da_end(struct ux_da_range *r)
+{
+	return r->dr_lblk + r->dr_len;
+}
+
+/*
+ * The most extent blocks writeback could need to map "count"
+ * delayed blocks. Each block may end up an extent of its own,
+ * and the tree they land in is taken to be only half full at
+ * every level up to the deepest root. Even a single block is
+ * promised a whole path, enough to split every level and push
+ * the root down.
+ */
+
+static __u32 ux_da_meta_needed(struct super_block *sb, __u32 count)
+{
+	__u64 n = count, total = 0;
+	__u32 per = UX_EXTENTS_PER_BLOCK(sb->s_blocksize) / 2;
+	int l;
+
+	for (l = 0; l <= UX_EXTENT_MAX_DEPTH; l++) {
+		n = DIV_ROUND_UP_ULL(n, per);
+		total += n;
+		per = UX_EXTENT_IDX_PER_BLOCK(sb->s_blocksize) / 2;
+	}
+	return min_t(__u64, total, U32_MAX);
+}
+
+/*
+ * Hand back whatever extent blocks the delayed blocks that are
+ * left no longer need.
+ */
+
+static void ux_da_trim(struct inode *inode)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	__u32 need = ux_da_meta_needed(inode->i_sb, ui->ui_da_blocks);
+
+	if (ui->ui_da_meta > need) {
+		ux_data_unreserve(inode->i_sb, ui->ui_da_meta - need);
+		ui->ui_da_meta = need;
+	}
+}
+
+/*
+ * Return 1 if "lblk" has a delayed allocation and set *len to
+ * the number of delayed blocks from there. Otherwise return 0
+ * and set *len to the distance to the next delayed range.
+ */
+
+int ux_da_lookup(struct inode *inode, __u32 lblk, __u32 *len)
+{
+	struct ux_da_range *r;
+
+	list_for_each_entry(r, &UX_I(inode)->ui_delalloc, dr_list) {
+		if (lblk < r->dr_lblk) {
+			*len = r->dr_lblk - lblk;
+			return 0;
+		}
+		if (lblk < ux_da_end(r)) {
+			*len = ux_da_end(r) - lblk;
+			return 1;
+		}
+	}
+
+	*len = U32_MAX - lblk;
+	return 0;
+}
+
+/*
+ * Reserve "len" blocks for the hole at "lblk", and any extent
+ * blocks they add to the worst case, and record them as a
+ * delayed allocation.
+ */
+
+int ux_da_reserve(struct inode *inode, __u32 lblk, __u32 len)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	struct list_head *head = &ui->ui_delalloc;
+	struct ux_da_range *r, *prev = NULL, *next = NULL;
+	__u32 meta;
+	int error;
+
+	list_for_each_entry(r, head, dr_list) {
+		if (r->dr_lblk > lblk) {
+			next = r;
+			break;
+		}
+		prev = r;
+	}
+
+	meta = ux_da_meta_needed(inode->i_sb, ui->ui_da_blocks + len);
+	meta = meta > ui->ui_da_meta ? meta - ui->ui_da_meta : 0;
+	error = ux_data_reserve(inode->i_sb, len + meta);
+	if (error) {
+		return error;
+	}
+
+	if (prev && ux_da_end(prev) == lblk) {
+		prev->dr_len += len;
+		if (next && ux_da_end(prev) == next->dr_lblk) {
+			prev->dr_len += next->dr_len;
+			list_del(&next->dr_list);
+			kfree(next);
+		}
+		goto out;
+	}
+	if (next && lblk + len == next->dr_lblk) {
+		next->dr_lblk = lblk;
+		next->dr_len += len;
+		goto out;
+	}
+
+	r = kmalloc(sizeof(struct ux_da_range), GFP_NOFS);
+	if (!r) {
+		ux_data_unreserve(inode->i_sb, len + meta);
+		return -ENOMEM;
+	}
+	r->dr_lblk = lblk;
+	r->dr_len = len;
+	list_add(&r->dr_list, prev ? &prev->dr_list : head);
+
+out:
+	ui->ui_da_blocks += len;
+	ui->ui_da_meta += meta;
+	return 0;
+}
+
+/*
+ * Forget any delayed allocation in [lblk, lblk + len) and give
+ * the reservation back. Used by truncate, eviction and writes
+ * that came up short.
+ */
+
+void ux_da_release(struct inode *inode, __u32 lblk, __u32 len)
+{
+	struct list_head *head = &UX_I(inode)->ui_delalloc;
+	struct ux_da_range *r, *tmp, *tail;
+	__u32 end = (len > U32_MAX - lblk) ? U32_MAX : lblk + len;
+	__u32 freed = 0;
+
+	list_for_each_entry_safe(r, tmp, head, dr_list) {
+		if (ux_da_end(r) <= lblk) {
+			continue;
+		}
+		if (r->dr_lblk >= end) {
+			break;
+		}
+
+		if (r->dr_lblk < lblk && ux_da_end(r) > end) {
+			tail = kmalloc(sizeof(struct ux_da_range),
+				       GFP_NOFS | __GFP_NOFAIL);
+			tail->dr_lblk = end;
+			tail->dr_len = ux_da_end(r) - end;
+			list_add(&tail->dr_list, &r->dr_list);
+			freed += end - lblk;
+			r->dr_len = lblk - r->dr_lblk;
+			break;
+		}
+
+		if (r->dr_lblk < lblk) {
+			freed += ux_da_end(r) - lblk;
+			r->dr_len = lblk - r->dr_lblk;
+		} else if (ux_da_end(r) > end) {
+			freed += end - r->dr_lblk;
+			r->dr_len = ux_da_end(r) - end;
+			r->dr_lblk = end;
+		} else {
+			freed += r->dr_len;
+			list_del(&r->dr_list);
+			kfree(r);
+		}
+	}
+
+	if (freed) {
+		UX_I(inode)->ui_da_blocks -= freed;
+		ux_data_unreserve(inode->i_sb, freed);
+		ux_da_trim(inode);
+	}
+}
+
+/*
+ * Writeback has reached "lblk", which has a delayed allocation.
+ * Allocate the whole range it belongs to, so that neighbouring
+ * dirty pages land next to each other, and return the mapping
+ * of "lblk" as ux_extent_get() would. Returns -EAGAIN if
+ * ui_extent_lock had to be dropped before "lblk" was mapped;
+ * the caller should look it up again.
+ */
+
+int ux_da_alloc(struct inode *inode, __u32 lblk, __u32 *pblk, __u32 *len)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	struct ux_da_range *r;
+	__u32 blk, count;
+	int error = 0;
+
+	*pblk = 0;
+	list_for_each_entry(r, &ui->ui_delalloc, dr_list) {
+		if (lblk >= r->dr_lblk && lblk < ux_da_end(r)) {
+			break;
+		}
+	}
+	if (&r->dr_list == &ui->ui_delalloc) {
+		return -EIO;
+	}
+
+	/*
+	 * Each pass allocates the longest free run it can find
+	 * and takes it off the front of the range. Anything left
+	 * after a failure stays reserved for the next attempt.
+	 * Every pass is complete in itself, so a long range may
+	 * be spread over several transactions. Starting a new one
+	 * drops the lock, after which "r" may be gone; the rest
+	 * is left to a later pass of writeback.
+	 */
+
+	while (r->dr_len) {
+		error = ux_journal_ensure(UX_ALLOC_CREDITS, 0,
+					  &ui->ui_extent_lock);
+		if (error > 0) {
+			ux_da_trim(inode);
+			return *pblk ? 0 : -EAGAIN;
+		}
+		if (error) {
+			break;
+		}
+		count = r->dr_len;
+		error = ux_extent_alloc(inode, r->dr_lblk, &blk, &count, 1);
+		if (error) {
+			break;
+		}
+
+		if (lblk >= r->dr_lblk && lblk < r->dr_lblk + count) {
+			*pblk = blk + (lblk - r->dr_lblk);
+			*len = r->dr_lblk + count - lblk;
+		}
+		r->dr_lblk += count;
+		r->dr_len -= count;
+		ui->ui_da_blocks -= count;
+	}
+
+	if (!r->dr_len) {
+		list_del(&r->dr_list);
+		kfree(r);
+	}
+	ux_da_trim(inode);
+
+	return *pblk ? 0 : error;
+}
@@ -8,66 +8,135 @@
 #include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
 
 #include "ux_fs.h"
 #include "ux_xattr.h"
 #include "ux_acl.h"
+#include "ux_journal.h"
 
 /*
- * Add "name" to the directory "dip"
+ * Read logical block "lblk" of directory "dip". A directory has
+ * no holes, so an unmapped block means the extent map could not
+ * be read, and NULL is returned as for a failed read.
  */
 
-int ux_diradd(struct inode *dip, const char *name, int inum)
+struct buffer_head *ux_dir_bread(struct inode *dip, __u32 lblk)
 {
-	struct ux_inode *uip = (struct ux_inode *)dip->i_private;
+	__u32 pblk = ux_extent_bmap(dip, lblk);
+
+	if (!pblk) {
+		return NULL;
+	}
+	return sb_bread(dip->i_sb, pblk);
+}
+
+/*
+ * Add "name" to the directory "dip". This is the only pass made
+ * over the directory: the VFS has already looked the name up
+ * with the directory locked, so rather than scanning for it
+ * again we only check the blocks we read while looking for a
+ * free slot, and fail with -EEXIST if it turns up there.
+ *
+ * ui_dir_free remembers the first block that may still have a
+ * free slot, so blocks that are known to be full are skipped.
+ * It is protected by the directory's i_rwsem.
+ */
+
+int ux_diradd(struct inode *dip, const char *name, int inum, umode_t mode)
+{
+	struct ux_inode_info *ui = UX_I(dip);
+	struct ux_inode *uip = &ui->ui_inode;
 	struct buffer_head *bh;
 	struct super_block *sb = dip->i_sb;
-	struct ux_dirent *dirent;
-	__u32 blk;
-	int i, pos;
+	struct ux_dirent *dirent, *slot;
+	__u32 blk, len;
+	int i, pos, error;
+
+	if (uip->i_flags & UX_INDEX_FL) {
+		return ux_dx_add(dip, name, inum, mode);
+	}
 
-	for (blk = 0; blk < uip->i_blocks; blk++) {
-		bh = sb_bread(sb, uip->i_addr[blk]);
+	for (blk = ui->ui_dir_free; blk < uip->i_blocks; blk++) {
+		bh = ux_dir_bread(dip, blk);
+		if (!bh) {
+			return -EIO;
+		}
+
+		slot = NULL;
 		dirent = (struct ux_dirent *)bh->b_data;
-		for (i = 0; i < UX_DIRS_PER_BLOCK; i++) {
-			if (dirent->d_ino != 0) {
-				dirent++;
-				continue;
-			} else {
-				dirent->d_ino = inum;
-				strcpy(dirent->d_name, name);
-				mark_buffer_dirty(bh);
+		for (i = 0; i < UX_DIRS_PER_BLOCK(sb->s_blocksize); i++) {
+			if (dirent->d_ino == 0) {
+				if (!slot) {
+					slot = dirent;
+				}
+			} else if (!strcmp(dirent->d_name, name)) {
 				brelse(bh);
-				return 0;
+				return -EEXIST;
 			}
+			dirent++;
 		}
-		
+
+		if (slot) {
+			error = ux_journal_get_write_access(bh);
+			if (error) {
+				brelse(bh);
+				return error;
+			}
+			slot->d_ino = inum;
+			slot->d_type = UX_DT(mode);
+			strcpy(slot->d_name, name);
+			ux_journal_dirty(bh);
+			brelse(bh);
+			ui->ui_dir_free = blk;
+			return 0;
+		}
+
 		brelse(bh);
 	}
+	ui->ui_dir_free = uip->i_blocks;
 
 	/*
-	 * We didn't find an empty slot so need to allocate
-	 * a new block if there's space in the inode.
+	 * We didn't find an empty slot. Once the directory has
+	 * grown past a few blocks, index it rather than making
+	 * every lookup scan yet another block.
 	 */
 
-	if (uip->i_blocks < UX_DIRECT_BLOCKS) {
-		pos = uip->i_blocks;
-		blk = ux_data_alloc(sb);
-		uip->i_blocks++;
-		uip->i_size += UX_BSIZE;
-		dip->i_size += UX_BSIZE;
-		dip->i_blocks++;
-		uip->i_addr[pos] = blk;
+	if (uip->i_blocks >= UX_DIR_LINEAR_MAX) {
+		error = ux_dx_convert(dip);
+		if (error) {
+			return error;
+		}
+		return ux_dx_add(dip, name, inum, mode);
+	}
+
+	pos = uip->i_blocks;
+	len = 1;
+	error = ux_extent_alloc(dip, pos, &blk, &len, 0);
+	if (!error) {
+		uip->i_size += sb->s_blocksize;
+		dip->i_size += sb->s_blocksize;
 		bh = sb_bread(sb, blk);
-		memset(bh->b_data, 0, UX_BSIZE);
+		if (!bh) {
+			return -EIO;
+		}
+		error = ux_journal_get_write_access(bh);
+		if (error) {
+			brelse(bh);
+			return error;
+		}
+		memset(bh->b_data, 0, sb->s_blocksize);
 		dirent = (struct ux_dirent *)bh->b_data;
 		dirent->d_ino = inum;
+		dirent->d_type = UX_DT(mode);
 		strcpy(dirent->d_name, name);
-		mark_buffer_dirty(bh);
+		ux_journal_dirty(bh);
 		brelse(bh);
+		mark_inode_dirty(dip);
 	}
 
-	return 0;
+	return error;
 }
 
 /*
@@ -76,24 +145,39 @@ int ux_diradd(struct inode *dip, const char *name, int inum)
 
 int ux_dirdel(struct inode *dip, char *name)
 {
-	struct ux_inode *uip = (struct ux_inode *)dip->i_private;
+	struct ux_inode_info *ui = UX_I(dip);
+	struct ux_inode *uip = &ui->ui_inode;
 	struct buffer_head *bh;
 	struct super_block *sb = dip->i_sb;
 	struct ux_dirent *dirent;
 	__u32 blk = 0;
 	int i, ino;
 
+	if (uip->i_flags & UX_INDEX_FL) {
+		return ux_dx_del(dip, name);
+	}
+
 	while (blk < uip->i_blocks) {
-		bh = sb_bread(sb, uip->i_addr[blk]);
-		blk++;
+		bh = ux_dir_bread(dip, blk);
+		if (!bh) {
+			return 0;
+		}
 		dirent = (struct ux_dirent *)bh->b_data;
-		for (i = 0; i < UX_DIRS_PER_BLOCK; i++) {
-			if (!strcmp(dirent->d_name, name)) {
+		for (i = 0; i < UX_DIRS_PER_BLOCK(sb->s_blocksize); i++) {
+			if (dirent->d_ino && !strcmp(dirent->d_name, name)) {
+				if (ux_journal_get_write_access(bh)) {
+					brelse(bh);
+					return 0;
+				}
 				ino = dirent->d_ino;
 				dirent->d_ino = 0;
+				dirent->d_type = 0;
 				dirent->d_name[0] = '\0';
-				mark_buffer_dirty(bh);
+				ux_journal_dirty(bh);
 				brelse(bh);
+				if (blk < ui->ui_dir_free) {
+					ui->ui_dir_free = blk;
+				}
 				return ino;
 			}
 
@@ -101,50 +185,165 @@ int ux_dirdel(struct inode *dip, char *name)
 		}
 
 		brelse(bh);
+		blk++;
 	}
 
 	return 0;
 }
 
-int ux_readdir(struct file *filp, struct dir_context *ctx)
+/*
+ * A directory entry and its readdir position.
+ */
+
+struct ux_dir_item
 {
-	unsigned long pos;
-	struct inode *inode = filp->f_inode;
-	struct ux_inode *uip = (struct ux_inode *)inode->i_private;
-	struct ux_dirent *udir;
-	struct buffer_head *bh;
-	__u32 blk;
+	loff_t pos;
+	struct ux_dirent de;
+};
 
-start_again:
-	pos = ctx->pos;
-	if (pos >= inode->i_size) {
-		return 0;
+static int ux_dir_item_cmp(const void *a, const void *b)
+{
+	loff_t pa = ((const struct ux_dir_item *)a)->pos;
+	loff_t pb = ((const struct ux_dir_item *)b)->pos;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/*
+ * The readdir position of "name". Below its ux_dx_hash() goes
+ * a second hash, FNV-1a run from the end of the name back to
+ * the start, so that two names have to agree in both to share
+ * a position. 0 and 1 are kept for "." and "..".
+ */
+
+static loff_t ux_dir_pos(const char *name)
+{
+	__u32 minor = 2166136261U;
+	int i = strnlen(name, UX_NAMELEN);
+
+	while (i-- > 0) {
+		minor ^= (unsigned char)name[i];
+		minor *= 16777619U;
 	}
+	return clamp_t(loff_t, UX_DIR_HASH_POS(ux_dx_hash(name)) | (minor >> 1),
+		       2, UX_DIR_EOF - 1);
+}
 
-	blk = (pos + 1) / UX_BSIZE;
-	blk = uip->i_addr[blk];
-	bh = sb_bread(inode->i_sb, blk);
-	udir = (struct ux_dirent *)(bh->b_data + pos % UX_BSIZE);
+/*
+ * Emit, in position order, the entries of the "count" blocks
+ * from "lblk" whose positions are at or past ctx->pos. Nothing
+ * is held while dir_emit() copies out. Returns 1 if the caller's
+ * buffer filled up, 0 once every entry has gone out, or an
+ * error.
+ */
 
-	/*
-	 * Skip over 'null' directory entries.
-	 */
+int ux_dir_emit(struct inode *dip, struct dir_context *ctx, __u32 lblk,
+		__u32 count)
+{
+	struct ux_inode *uip = &UX_I(dip)->ui_inode;
+	struct super_block *sb = dip->i_sb;
+	int dpb = UX_DIRS_PER_BLOCK(sb->s_blocksize);
+	struct ux_dir_item *items;
+	struct ux_dirent *dirent;
+	struct buffer_head *bh;
+	int i, n = 0, nslots, error = 0;
+	loff_t pos;
+	__u32 b;
+
+	items = kvmalloc_array(count * dpb, sizeof(struct ux_dir_item),
+			       GFP_KERNEL);
+	if (!items) {
+		return -ENOMEM;
+	}
+
+	for (b = lblk; b < lblk + count; b++) {
+		bh = ux_dir_bread(dip, b);
+		if (!bh) {
+			error = -EIO;
+			goto out;
+		}
+
+		/*
+		 * Block 0 of an indexed directory holds "." and
+		 * ".." followed by the index root, and index nodes
+		 * hold no entries at all.
+		 */
 
-	if (udir->d_ino == 0) {
-		ctx->pos += sizeof(struct ux_dirent);
+		nslots = ux_dir_nslots(bh->b_data, b, uip->i_flags,
+				       sb->s_blocksize);
+		dirent = (struct ux_dirent *)bh->b_data;
+		for (i = 0; i < nslots; i++, dirent++) {
+			if (!dirent->d_ino || !strcmp(dirent->d_name, ".") ||
+			    !strcmp(dirent->d_name, "..")) {
+				continue;
+			}
+			pos = ux_dir_pos(dirent->d_name);
+			if (pos >= ctx->pos) {
+				items[n].pos = pos;
+				items[n].de = *dirent;
+				n++;
+			}
+		}
 		brelse(bh);
-		goto start_again;
-	} else {
-		dir_emit(ctx, udir->d_name, sizeof(udir->d_name),
-			udir->d_ino, DT_UNKNOWN);
+	}
+	sort(items, n, sizeof(struct ux_dir_item), ux_dir_item_cmp, NULL);
+
+	for (i = 0; i < n; i++) {
+		ctx->pos = items[i].pos;
+		if (!dir_emit(ctx, items[i].de.d_name,
+			      strnlen(items[i].de.d_name, UX_NAMELEN),
+			      items[i].de.d_ino, items[i].de.d_type)) {
+			error = 1;
+			goto out;
+		}
+		ctx->pos++;
 	}
 
-	ctx->pos += sizeof(struct ux_dirent);
-	brelse(bh);
+out:
+	kvfree(items);
+	return error;
+}
+
+/*
+ * "." and ".." come first, then the entries in position order.
+ * A linear directory is only a few blocks, so all of it is read
+ * on each call; an indexed one is read a leaf at a time.
+ */
+
+int ux_readdir(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *inode = file_inode(filp);
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	int error;
+
+	if (!dir_emit_dots(filp, ctx) || ctx->pos >= UX_DIR_EOF) {
+		return 0;
+	}
+	if (uip->i_flags & UX_INDEX_FL) {
+		return ux_dx_readdir(inode, ctx);
+	}
+
+	error = ux_dir_emit(inode, ctx, 0, uip->i_blocks);
+	if (error) {
+		return error < 0 ? error : 0;
+	}
+	ctx->pos = UX_DIR_EOF;
 	return 0;
 }
 
+/*
+ * Positions are hashes, so the end of a directory is UX_DIR_EOF
+ * however big it is.
+ */
+
+static loff_t ux_dir_llseek(struct file *filp, loff_t offset, int whence)
+{
+	return generic_file_llseek_size(filp, offset, whence, UX_DIR_EOF,
+					UX_DIR_EOF);
+}
+
 const struct file_operations ux_dir_operations = {
+	.llseek		= ux_dir_llseek,
 	.read		= generic_read_dir,
 	.iterate_shared	= ux_readdir,
 	.fsync		= generic_file_fsync,
@@ -154,9 +353,13 @@ const struct file_operations ux_dir_operations = {
  * When we reach this point, ux_lookup() has already been called
  * to create a negative entry in the dcache. Thus, we need to
  * allocate a new inode on disk and associate it with the dentry.
+ *
+ * Each of the operations below runs as a single journal handle,
+ * started by the exported wrapper around its __ux_ body.
  */
 
-int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
+static int __ux_create(struct inode *dip, struct dentry *dentry,
+		       umode_t mode, bool excl)
 {
 	struct super_block *sb = dip->i_sb;
 	struct ux_inode *nip;
@@ -165,32 +368,32 @@ int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
 	int error;
 
 	/*
-	 * See if the entry exists. If not, create a new
-	 * disk inode, and incore inode. The add the new
-	 * entry to the directory.
+	 * Create a new disk inode and incore inode, then add
+	 * the new entry to the directory. The lookup has been
+	 * done already, so ux_diradd() is the only pass made
+	 * over the directory.
 	 */
-	
-	inum = ux_find_entry(dip, (char *)dentry->d_name.name);
-	if (inum) {
-		return -EEXIST;
-	}
 
 	inode = new_inode(sb);
 	if (!inode) {
 		return -ENOSPC;
 	}
 
-	inum = ux_inode_alloc(sb);
+	if (ux_inode_info_init(inode)) {
+		iput(inode);
+		return -ENOMEM;
+	}
+
+	inum = ux_inode_alloc(sb, dip, S_IFREG);
 	if (!inum) {
 		iput(inode);
 		return -ENOSPC;
 	}
 
-	ux_diradd(dip, (char *)dentry->d_name.name, inum);
 	set_nlink(inode, 1);
 	inode->i_size = 0;
 	inode->i_blocks = 0;
-	inode->i_blkbits = UX_BSIZE_BITS;
+	inode->i_blkbits = sb->s_blocksize_bits;
 	inode->i_uid = current_fsuid();
 	inode->i_gid = (dip->i_mode & S_ISGID) ?
 			dip->i_gid : current_fsgid();
@@ -201,28 +404,21 @@ int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
 	inode->i_mapping->a_ops = &ux_aops;
 	inode->i_mode = mode | S_IFREG;
 	inode->i_ino = inum;
-	
-	inode->i_private = kmalloc(sizeof(struct ux_inode), GFP_KERNEL);
-	
-	nip = (struct ux_inode *)inode->i_private;
+
+	nip = &UX_I(inode)->ui_inode;
 	nip->i_mode = mode | S_IFREG;
 	nip->i_nlink = 1;
 	nip->i_atime = nip->i_ctime = nip->i_mtime = inode->i_atime.tv_sec;
 	nip->i_uid = __kuid_val(inode->i_uid);
 	nip->i_gid = __kgid_val(inode->i_gid);
-	nip->i_size = 0;
-	nip->i_blocks = 0;
-	
-	memset(nip->i_addr, 0, UX_DIRECT_BLOCKS * sizeof(nip->i_addr[0]));
-	if (!nip->i_acl_blk_addr) {
-		nip->i_acl_blk_addr = ux_data_alloc(sb);
-		inode->i_default_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-		inode->i_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-	}
 
 	error = ux_init_acl(inode, dip);
+	if (!error) {
+		error = ux_diradd(dip, (char *)dentry->d_name.name, inum,
+				   inode->i_mode);
+	}
 	if (error) {
-		return error;
+		goto out_drop;
 	}
 
 	insert_inode_hash(inode);
@@ -230,6 +426,32 @@ int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
 	mark_inode_dirty(inode);
 
 	return 0;
+
+	/*
+	 * Dropping the last link hands the inode and anything
+	 * allocated for it back through ux_evict_inode().
+	 */
+
+out_drop:
+	clear_nlink(inode);
+	iput(inode);
+	return error;
+}
+
+int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(dip->i_sb, UX_NS_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	error = __ux_create(dip, dentry, mode, excl);
+	ux_journal_stop(handle);
+	ux_hist_time(dip->i_sb, UX_HIST_CREATE, start);
+	return error;
 }
 
 /*
@@ -237,7 +459,7 @@ int ux_create(struct inode *dip, struct dentry *dentry, umode_t mode, bool excl)
  * so must create the directory and instantiate it.
  */
 
-int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
+static int __ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 {
 	struct ux_inode *nip;
 	struct buffer_head *bh;
@@ -245,35 +467,33 @@ int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 	struct ux_dirent *dirent;
 	struct inode *inode;
 	ino_t inum;
-	int blk;
+	__u32 blk, len;
 	int error;
 
 	/*
-	 * Make sure there isn't already an entry. If not,
-	 * allocate one, a new inode and new incore inode.
+	 * Allocate a new inode and new incore inode, build the
+	 * directory and only then link it into the parent.
 	 */
 
-	inum = ux_find_entry(dip, (char *)dentry->d_name.name);
-	if (inum) {
-		return -EEXIST;
-	}
-
 	inode = new_inode(sb);
 	if (!inode) {
 		return -ENOSPC;
 	}
 
-	inum = ux_inode_alloc(sb);
+	if (ux_inode_info_init(inode)) {
+		iput(inode);
+		return -ENOMEM;
+	}
+
+	inum = ux_inode_alloc(sb, dip, S_IFDIR);
 	if (!inum) {
 		iput(inode);
 		return -ENOSPC;
 	}
 
-	ux_diradd(dip, (char *)dentry->d_name.name, inum);
 	set_nlink(inode, 2);
-	inode->i_size = UX_BSIZE;
-	inode->i_blocks = 1;
-	inode->i_blkbits = UX_BSIZE_BITS;
+	inode->i_size = sb->s_blocksize;
+	inode->i_blkbits = sb->s_blocksize_bits;
 	inode->i_uid = current_fsuid();
 	inode->i_gid = (dip->i_mode & S_ISGID) ?
 			dip->i_gid : current_fsgid();
@@ -284,9 +504,8 @@ int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 	inode->i_mapping->a_ops = &ux_aops;
 	inode->i_mode = mode | S_IFDIR;
 	inode->i_ino = inum;
-	inode->i_private = kmalloc(sizeof(struct ux_inode), GFP_KERNEL);
 
-	nip = (struct ux_inode *)inode->i_private;
+	nip = &UX_I(inode)->ui_inode;
 	nip->i_mode = mode | S_IFDIR;
 	nip->i_nlink = 2;
 	nip->i_atime = nip->i_ctime
@@ -294,34 +513,47 @@ int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 	nip->i_uid = __kuid_val(current_fsuid());
 	nip->i_gid = (dip->i_mode & S_ISGID) ?
 		      __kgid_val(dip->i_gid) : __kgid_val(current_fsgid());
-	nip->i_size = 512;
-	nip->i_blocks = 1;
-	memset(nip->i_addr, 0, UX_DIRECT_BLOCKS * sizeof(nip->i_addr[0]));
-	
-	blk = ux_data_alloc(sb);
-	nip->i_addr[0] = blk;
-	if (!nip->i_acl_blk_addr) {
-		nip->i_acl_blk_addr = ux_data_alloc(sb);
-		inode->i_default_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-		inode->i_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-	}
+	nip->i_size = sb->s_blocksize;
+	inode->i_blocks = 0;
 
+	len = 1;
+	error = ux_extent_alloc(inode, 0, &blk, &len, 0);
+	if (error) {
+		goto out_drop;
+	}
 	error = ux_init_acl(inode, dip);
 	if (error) {
-		return error;
+		goto out_drop;
 	}
 
 	bh = sb_bread(sb, blk);
-	memset(bh->b_data, 0, UX_BSIZE);
+	if (!bh) {
+		error = -EIO;
+		goto out_drop;
+	}
+	error = ux_journal_get_write_access(bh);
+	if (error) {
+		brelse(bh);
+		goto out_drop;
+	}
+	memset(bh->b_data, 0, sb->s_blocksize);
 	dirent = (struct ux_dirent *)bh->b_data;
 	dirent->d_ino = inum;
+	dirent->d_type = DT_DIR;
 	strcpy(dirent->d_name, ".");
 	dirent++;
-	dirent->d_ino = inode->i_ino;
+	dirent->d_ino = dip->i_ino;
+	dirent->d_type = DT_DIR;
 	strcpy(dirent->d_name, "..");
-	mark_buffer_dirty(bh);
+	ux_journal_dirty(bh);
 	brelse(bh);
 
+	error = ux_diradd(dip, (char *)dentry->d_name.name, inum,
+				   inode->i_mode);
+	if (error) {
+		goto out_drop;
+	}
+
 	insert_inode_hash(inode);
 	d_instantiate(dentry, inode);
 	mark_inode_dirty(inode);
@@ -332,13 +564,34 @@ int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 
 	inode_inc_link_count(dip);
 	return 0;
+
+out_drop:
+	clear_nlink(inode);
+	iput(inode);
+	return error;
+}
+
+int ux_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(dip->i_sb, UX_NS_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	error = __ux_mkdir(dip, dentry, mode);
+	ux_journal_stop(handle);
+	ux_hist_time(dip->i_sb, UX_HIST_CREATE, start);
+	return error;
 }
 
 /*
  * Remove the specified directory.
  */
 
-int ux_rmdir(struct inode *dip, struct dentry *dentry)
+static int __ux_rmdir(struct inode *dip, struct dentry *dentry)
 {
 	struct inode *inode = dentry->d_inode;
 	int inum;
@@ -367,6 +620,22 @@ int ux_rmdir(struct inode *dip, struct dentry *dentry)
 	return 0;
 }
 
+int ux_rmdir(struct inode *dip, struct dentry *dentry)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(dip->i_sb, UX_NS_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	error = __ux_rmdir(dip, dentry);
+	ux_journal_stop(handle);
+	ux_hist_time(dip->i_sb, UX_HIST_REMOVE, start);
+	return error;
+}
+
 /*
  * Lookup the specified file. A call is made to iget() to
  * bring the inode into core.
@@ -375,6 +644,7 @@ int ux_rmdir(struct inode *dip, struct dentry *dentry)
 struct dentry *ux_lookup(struct inode *dip, struct dentry *dentry,
 			unsigned int flags)
 {
+	u64 start = ktime_get_ns();
 	struct inode *inode = NULL;
 	int inum;
 
@@ -391,6 +661,7 @@ struct dentry *ux_lookup(struct inode *dip, struct dentry *dentry,
 	}
 
 	d_add(dentry, inode);
+	ux_hist_time(dip->i_sb, UX_HIST_LOOKUP, start);
 	return NULL;
 }
 
@@ -398,7 +669,8 @@ struct dentry *ux_lookup(struct inode *dip, struct dentry *dentry,
  * Called in response to an ln command/syscall.
  */
 
-int ux_link(struct dentry *old, struct inode *dip, struct dentry *new)
+static int __ux_link(struct dentry *old, struct inode *dip,
+		     struct dentry *new)
 {
 	struct inode *inode = old->d_inode;
 	int error;
@@ -406,7 +678,11 @@ int ux_link(struct dentry *old, struct inode *dip, struct dentry *new)
 	/*
 	 * Add the new file (new) to its parent directory (dip)
 	 */
-	error = ux_diradd(dip, new->d_name.name, inode->i_ino);
+	error = ux_diradd(dip, new->d_name.name, inode->i_ino,
+			   inode->i_mode);
+	if (error) {
+		return error;
+	}
 
 	/*
 	 * Increment the link count of the target inode
@@ -419,11 +695,27 @@ int ux_link(struct dentry *old, struct inode *dip, struct dentry *new)
 	return 0;
 }
 
+int ux_link(struct dentry *old, struct inode *dip, struct dentry *new)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(dip->i_sb, UX_NS_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	error = __ux_link(old, dip, new);
+	ux_journal_stop(handle);
+	ux_hist_time(dip->i_sb, UX_HIST_CREATE, start);
+	return error;
+}
+
 /*
  * Called to remove a file (decrement its link count)
  */
 
-int ux_unlink(struct inode *dip, struct dentry *dentry)
+static int __ux_unlink(struct inode *dip, struct dentry *dentry)
 {
 	struct inode *inode = dentry->d_inode;
 
@@ -433,6 +725,22 @@ int ux_unlink(struct inode *dip, struct dentry *dentry)
 	return 0;
 }
 
+int ux_unlink(struct inode *dip, struct dentry *dentry)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int error;
+
+	handle = ux_journal_start(dip->i_sb, UX_NS_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	error = __ux_unlink(dip, dentry);
+	ux_journal_stop(handle);
+	ux_hist_time(dip->i_sb, UX_HIST_REMOVE, start);
+	return error;
+}
+
 const struct inode_operations ux_dir_inops = {
 	.create	= ux_create,
 	.lookup	= ux_lookup,
@@ -440,6 +748,7 @@ const struct inode_operations ux_dir_inops = {
 	.rmdir	= ux_rmdir,
 	.link	= ux_link,
 	.unlink	= ux_unlink,
+	.setattr	= ux_setattr,
 	.listxattr	= generic_listxattr,
 	.get_acl	= ux_get_acl,
 	.set_acl	= ux_set_acl,
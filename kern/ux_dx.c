@@ -0,0 +1,731 @@
+/*--------------------------------------------------------------*/
+/*----------------------------- ux_dx.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include "ux_fs.h"
+#include "ux_journal.h"
+
+/*
+ * A directory entry together with the hash of its name, used
+ * while entries are redistributed between leaves.
+ */
+
+struct ux_dx_item
+{
+	__u32 hash;
+	struct ux_dirent de;
+};
+
+static int ux_dx_cmp(const void *a, const void *b)
+{
+	__u32 ha = ((const struct ux_dx_item *)a)->hash;
+	__u32 hb = ((const struct ux_dx_item *)b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/*
+ * One level of the path from the index root down to a leaf:
+ * the root or node block, its entries, how many it has and may
+ * have, and the entry that was followed.
+ */
+
+struct ux_dx_frame
+{
+	struct buffer_head *bh;
+	struct ux_dx_entry *entries;
+	__u16 *count;
+	int limit;
+	int idx;
+};
+
+static void ux_dx_release(struct ux_dx_frame *frames, int levels)
+{
+	int l;
+
+	for (l = 0; l <= levels; l++) {
+		brelse(frames[l].bh);
+	}
+}
+
+/*
+ * Return the entry of "frame" that "hash" falls under. The first
+ * entry covers everything below the second, so the search cannot
+ * fall off the front.
+ */
+
+static int ux_dx_search(struct ux_dx_frame *frame, __u32 hash)
+{
+	int lo = 1, hi = *frame->count - 1, mid, idx = 0;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (frame->entries[mid].de_hash <= hash) {
+			idx = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return idx;
+}
+
+/*
+ * Read the index of "dip" from the root down to the node above
+ * the leaf that "hash" falls in. Returns the number of levels
+ * of nodes below the root, so that frames[levels] names the
+ * leaf, or an error. The caller must release the frames.
+ */
+
+static int ux_dx_probe(struct inode *dip, __u32 hash,
+		       struct ux_dx_frame *frames)
+{
+	unsigned long bsize = dip->i_sb->s_blocksize;
+	struct ux_dx_root *root;
+	struct ux_dx_node *node;
+	struct buffer_head *bh;
+	int l, levels;
+
+	bh = ux_dir_bread(dip, 0);
+	if (!bh) {
+		return -EIO;
+	}
+
+	root = (struct ux_dx_root *)bh->b_data;
+	if (root->dr_magic != UX_DX_MAGIC || root->dr_count == 0 ||
+	    root->dr_count > UX_DX_LIMIT(bsize) ||
+	    root->dr_levels > UX_DX_MAX_LEVELS) {
+		brelse(bh);
+		return -EIO;
+	}
+	levels = root->dr_levels;
+	frames[0].bh = bh;
+	frames[0].entries = root->dr_entries;
+	frames[0].count = &root->dr_count;
+	frames[0].limit = UX_DX_LIMIT(bsize);
+
+	for (l = 0; ; l++) {
+		frames[l].idx = ux_dx_search(&frames[l], hash);
+		if (l == levels) {
+			return levels;
+		}
+
+		bh = ux_dir_bread(dip, frames[l].entries[frames[l].idx].de_lblk);
+		node = bh ? (struct ux_dx_node *)bh->b_data : NULL;
+		if (!bh || !ux_dx_is_node(node) || node->dn_count == 0 ||
+		    node->dn_count > UX_DX_NODE_LIMIT(bsize)) {
+			brelse(bh);
+			ux_dx_release(frames, l);
+			return -EIO;
+		}
+		frames[l + 1].bh = bh;
+		frames[l + 1].entries = node->dn_entries;
+		frames[l + 1].count = &node->dn_count;
+		frames[l + 1].limit = UX_DX_NODE_LIMIT(bsize);
+	}
+}
+
+/*
+ * Read the leaf block that "name" belongs in, leaving the index
+ * path to it in "frames" and its depth in *levelsp.
+ */
+
+static struct buffer_head *ux_dx_leaf(struct inode *dip, const char *name,
+				      struct ux_dx_frame *frames,
+				      int *levelsp)
+{
+	struct ux_dx_frame *frame;
+	struct buffer_head *bh;
+	int levels;
+
+	levels = ux_dx_probe(dip, ux_dx_hash(name), frames);
+	if (levels < 0) {
+		return NULL;
+	}
+
+	frame = &frames[levels];
+	bh = ux_dir_bread(dip, frame->entries[frame->idx].de_lblk);
+	if (!bh) {
+		ux_dx_release(frames, levels);
+		return NULL;
+	}
+	*levelsp = levels;
+	return bh;
+}
+
+/*
+ * Look for "name" in an indexed directory. Only the blocks on
+ * the path from the root to one leaf are read, and *nblocks
+ * says how many that was.
+ */
+
+int ux_dx_find(struct inode *dip, const char *name, int *nblocks)
+{
+	struct ux_dx_frame frames[UX_DX_MAX_LEVELS + 1];
+	struct buffer_head *bh;
+	struct ux_dirent *dirent;
+	int i, levels, ino = 0;
+
+	*nblocks = 1;
+	bh = ux_dx_leaf(dip, name, frames, &levels);
+	if (!bh) {
+		return 0;
+	}
+	ux_dx_release(frames, levels);
+	*nblocks = levels + 2;
+
+	dirent = (struct ux_dirent *)bh->b_data;
+	for (i = 0; i < UX_DIRS_PER_BLOCK(dip->i_sb->s_blocksize); i++) {
+		if (dirent->d_ino && !strcmp(dirent->d_name, name)) {
+			ino = dirent->d_ino;
+			break;
+		}
+		dirent++;
+	}
+
+	brelse(bh);
+	return ino;
+}
+
+/*
+ * Readdir of an indexed directory, one leaf per pass in hash
+ * order. Each pass looks up the leaf that ctx->pos falls in,
+ * notes where the next leaf's hashes begin, and emits the leaf.
+ */
+
+int ux_dx_readdir(struct inode *dip, struct dir_context *ctx)
+{
+	struct ux_dx_frame frames[UX_DX_MAX_LEVELS + 1];
+	struct ux_dx_frame *frame;
+	loff_t next;
+	__u32 lblk;
+	int l, levels, error;
+
+	while (ctx->pos < UX_DIR_EOF) {
+		levels = ux_dx_probe(dip, UX_DIR_POS_HASH(ctx->pos), frames);
+		if (levels < 0) {
+			return levels;
+		}
+		frame = &frames[levels];
+		lblk = frame->entries[frame->idx].de_lblk;
+
+		next = UX_DIR_EOF;
+		for (l = levels; l >= 0; l--) {
+			frame = &frames[l];
+			if (frame->idx + 1 < *frame->count) {
+				next = UX_DIR_HASH_POS(
+					frame->entries[frame->idx + 1].de_hash);
+				break;
+			}
+		}
+		ux_dx_release(frames, levels);
+
+		error = ux_dir_emit(dip, ctx, lblk, 1);
+		if (error) {
+			return error < 0 ? error : 0;
+		}
+		ctx->pos = next;
+	}
+	return 0;
+}
+
+/*
+ * Append a new, zeroed block to the directory.
+ */
+
+static struct buffer_head *ux_dx_grow(struct inode *dip, __u32 *lblk)
+{
+	struct ux_inode *uip = &UX_I(dip)->ui_inode;
+	struct super_block *sb = dip->i_sb;
+	struct buffer_head *bh;
+	__u32 pblk, len = 1;
+	int error;
+
+	*lblk = uip->i_blocks;
+	error = ux_extent_alloc(dip, *lblk, &pblk, &len, 0);
+	if (error) {
+		return ERR_PTR(error);
+	}
+
+	uip->i_size += sb->s_blocksize;
+	dip->i_size += sb->s_blocksize;
+	mark_inode_dirty(dip);
+
+	bh = sb_bread(sb, pblk);
+	if (!bh) {
+		return ERR_PTR(-EIO);
+	}
+	error = ux_journal_get_write_access(bh);
+	if (error) {
+		brelse(bh);
+		return ERR_PTR(error);
+	}
+	memset(bh->b_data, 0, sb->s_blocksize);
+	return bh;
+}
+
+/*
+ * Append a new, empty index node to the directory.
+ */
+
+static struct buffer_head *ux_dx_new_node(struct inode *dip, __u32 *lblk)
+{
+	struct ux_dx_node *node;
+	struct buffer_head *bh;
+
+	bh = ux_dx_grow(dip, lblk);
+	if (IS_ERR(bh)) {
+		return bh;
+	}
+	node = (struct ux_dx_node *)bh->b_data;
+	node->dn_fake.d_type = UX_DT_DX_NODE;
+	node->dn_magic = UX_DX_NODE_MAGIC;
+	return bh;
+}
+
+/*
+ * Add an entry for block "lblk", covering hashes from "hash",
+ * after the entry followed in "frame". The caller has write
+ * access to the frame's block and has checked it has room.
+ */
+
+static void ux_dx_insert(struct ux_dx_frame *frame, __u32 hash, __u32 lblk)
+{
+	struct ux_dx_entry *entries = frame->entries;
+	int idx = frame->idx + 1;
+
+	memmove(&entries[idx + 1], &entries[idx],
+		(*frame->count - idx) * sizeof(struct ux_dx_entry));
+	entries[idx].de_hash = hash;
+	entries[idx].de_lblk = lblk;
+	(*frame->count)++;
+	ux_journal_dirty(frame->bh);
+}
+
+/*
+ * The leaf in "bh", found through "frame", is full. Move the
+ * upper half of its hash range to a new leaf and add that leaf
+ * to the frame's block, which has room. Entries with equal
+ * hashes are never separated, so a lookup only ever needs one
+ * leaf.
+ */
+
+static int ux_dx_split(struct inode *dip, struct ux_dx_frame *frame,
+		       struct buffer_head *bh)
+{
+	struct super_block *sb = dip->i_sb;
+	int dpb = UX_DIRS_PER_BLOCK(sb->s_blocksize);
+	struct ux_dirent *dirent, *ndirent;
+	struct ux_dx_item *items;
+	struct buffer_head *nbh;
+	__u32 lblk;
+	int i, m = 0, d;
+
+	items = kmalloc_array(dpb, sizeof(struct ux_dx_item), GFP_NOFS);
+	if (!items) {
+		return -ENOMEM;
+	}
+
+	dirent = (struct ux_dirent *)bh->b_data;
+	for (i = 0; i < dpb; i++) {
+		items[i].hash = ux_dx_hash(dirent[i].d_name);
+		items[i].de = dirent[i];
+	}
+	sort(items, dpb, sizeof(struct ux_dx_item), ux_dx_cmp, NULL);
+
+	for (d = 0; d < dpb / 2 && !m; d++) {
+		if (items[dpb / 2 + d].hash != items[dpb / 2 + d - 1].hash) {
+			m = dpb / 2 + d;
+		} else if (dpb / 2 - d > 0 &&
+			   items[dpb / 2 - d].hash !=
+			   items[dpb / 2 - d - 1].hash) {
+			m = dpb / 2 - d;
+		}
+	}
+	if (!m) {
+		kfree(items);
+		return -ENOSPC;
+	}
+
+	if (ux_journal_get_write_access(bh) ||
+	    ux_journal_get_write_access(frame->bh)) {
+		kfree(items);
+		return -EIO;
+	}
+
+	nbh = ux_dx_grow(dip, &lblk);
+	if (IS_ERR(nbh)) {
+		kfree(items);
+		return PTR_ERR(nbh);
+	}
+
+	/*
+	 * Rewrite the old leaf with the lower half and fill the
+	 * new one with the upper half.
+	 */
+
+	memset(bh->b_data, 0, sb->s_blocksize);
+	ndirent = (struct ux_dirent *)nbh->b_data;
+	for (i = 0; i < dpb; i++) {
+		if (i < m) {
+			dirent[i] = items[i].de;
+		} else {
+			ndirent[i - m] = items[i].de;
+		}
+	}
+	ux_journal_dirty(bh);
+	ux_journal_dirty(nbh);
+	brelse(nbh);
+
+	ux_dx_insert(frame, items[m].hash, lblk);
+	kfree(items);
+	return 0;
+}
+
+/*
+ * The node of "frame" is full, but the one above it has room.
+ * Move the upper half of its entries to a new node.
+ */
+
+static int ux_dx_split_node(struct inode *dip, struct ux_dx_frame *frame)
+{
+	struct ux_dx_frame *parent = frame - 1;
+	struct ux_dx_node *nnode;
+	struct buffer_head *nbh;
+	int m = *frame->count / 2, n = *frame->count - m;
+	__u32 lblk;
+
+	if (ux_journal_get_write_access(frame->bh) ||
+	    ux_journal_get_write_access(parent->bh)) {
+		return -EIO;
+	}
+	nbh = ux_dx_new_node(dip, &lblk);
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	nnode = (struct ux_dx_node *)nbh->b_data;
+	memcpy(nnode->dn_entries, &frame->entries[m],
+	       n * sizeof(struct ux_dx_entry));
+	nnode->dn_count = n;
+	ux_journal_dirty(nbh);
+	brelse(nbh);
+
+	ux_dx_insert(parent, frame->entries[m].de_hash, lblk);
+	memset(&frame->entries[m], 0, n * sizeof(struct ux_dx_entry));
+	*frame->count = m;
+	ux_journal_dirty(frame->bh);
+	return 0;
+}
+
+/*
+ * Every block of the index on the way to a full leaf is full.
+ * Move the root's entries to a new node and leave the root
+ * naming just that node, one level further up.
+ */
+
+static int ux_dx_grow_root(struct inode *dip, struct ux_dx_frame *frame)
+{
+	struct ux_dx_root *root = (struct ux_dx_root *)frame->bh->b_data;
+	struct ux_dx_node *nnode;
+	struct buffer_head *nbh;
+	__u32 lblk;
+
+	if (root->dr_levels == UX_DX_MAX_LEVELS) {
+		return -ENOSPC;
+	}
+	if (ux_journal_get_write_access(frame->bh)) {
+		return -EIO;
+	}
+	nbh = ux_dx_new_node(dip, &lblk);
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	nnode = (struct ux_dx_node *)nbh->b_data;
+	memcpy(nnode->dn_entries, root->dr_entries,
+	       root->dr_count * sizeof(struct ux_dx_entry));
+	nnode->dn_count = root->dr_count;
+	ux_journal_dirty(nbh);
+	brelse(nbh);
+
+	memset(root->dr_entries, 0,
+	       root->dr_count * sizeof(struct ux_dx_entry));
+	root->dr_entries[0].de_hash = 0;
+	root->dr_entries[0].de_lblk = lblk;
+	root->dr_count = 1;
+	root->dr_levels++;
+	ux_journal_dirty(frame->bh);
+	return 0;
+}
+
+/*
+ * Add "name" to an indexed directory.
+ */
+
+int ux_dx_add(struct inode *dip, const char *name, int inum, umode_t mode)
+{
+	struct ux_dx_frame frames[UX_DX_MAX_LEVELS + 1];
+	struct super_block *sb = dip->i_sb;
+	struct ux_dirent *dirent, *slot;
+	struct buffer_head *bh;
+	int i, k, levels, error = 0;
+
+again:
+	bh = ux_dx_leaf(dip, name, frames, &levels);
+	if (!bh) {
+		return -EIO;
+	}
+
+	/*
+	 * As in ux_diradd(), the leaf is checked for the name
+	 * while we look for a free slot in it.
+	 */
+
+	slot = NULL;
+	dirent = (struct ux_dirent *)bh->b_data;
+	for (i = 0; i < UX_DIRS_PER_BLOCK(sb->s_blocksize); i++) {
+		if (dirent->d_ino == 0) {
+			if (!slot) {
+				slot = dirent;
+			}
+		} else if (!strcmp(dirent->d_name, name)) {
+			error = -EEXIST;
+			goto out;
+		}
+		dirent++;
+	}
+	if (slot) {
+		error = ux_journal_get_write_access(bh);
+		if (error) {
+			goto out;
+		}
+		slot->d_ino = inum;
+		slot->d_type = UX_DT(mode);
+		strcpy(slot->d_name, name);
+		ux_journal_dirty(bh);
+		goto out;
+	}
+
+	/*
+	 * The leaf is full. Split it if the block above it has
+	 * room. Otherwise make room one level further up, by
+	 * splitting the lowest full node whose parent has room or
+	 * failing that by adding a level at the root, and look
+	 * again.
+	 */
+
+	k = levels;
+	while (k >= 0 && *frames[k].count >= frames[k].limit) {
+		k--;
+	}
+	if (k == levels) {
+		error = ux_dx_split(dip, &frames[levels], bh);
+	} else if (k >= 0) {
+		error = ux_dx_split_node(dip, &frames[k + 1]);
+	} else {
+		error = ux_dx_grow_root(dip, &frames[0]);
+	}
+	if (!error) {
+		brelse(bh);
+		ux_dx_release(frames, levels);
+		goto again;
+	}
+
+out:
+	brelse(bh);
+	ux_dx_release(frames, levels);
+	return error;
+}
+
+/*
+ * Remove "name" from an indexed directory and return its inode
+ * number. Leaves are never merged.
+ */
+
+int ux_dx_del(struct inode *dip, const char *name)
+{
+	struct ux_dx_frame frames[UX_DX_MAX_LEVELS + 1];
+	struct buffer_head *bh;
+	struct ux_dirent *dirent;
+	int i, levels, ino = 0;
+
+	bh = ux_dx_leaf(dip, name, frames, &levels);
+	if (!bh) {
+		return 0;
+	}
+	ux_dx_release(frames, levels);
+
+	dirent = (struct ux_dirent *)bh->b_data;
+	for (i = 0; i < UX_DIRS_PER_BLOCK(dip->i_sb->s_blocksize); i++) {
+		if (dirent->d_ino && !strcmp(dirent->d_name, name)) {
+			if (ux_journal_get_write_access(bh)) {
+				break;
+			}
+			ino = dirent->d_ino;
+			dirent->d_ino = 0;
+			dirent->d_type = 0;
+			dirent->d_name[0] = '\0';
+			ux_journal_dirty(bh);
+			break;
+		}
+		dirent++;
+	}
+
+	brelse(bh);
+	return ino;
+}
+
+/*
+ * Turn a full linear directory into an indexed one. All entries
+ * other than "." and ".." are sorted by hash and spread over the
+ * existing blocks 1..n-1 plus one new block, and block 0 is
+ * rewritten as the index root. Everything that can fail is done
+ * before any block is rewritten, so on error the directory is
+ * still a valid linear one, at worst with an extra empty block.
+ */
+
+int ux_dx_convert(struct inode *dip)
+{
+	struct ux_inode *uip = &UX_I(dip)->ui_inode;
+	struct super_block *sb = dip->i_sb;
+	int dpb = UX_DIRS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head *bh, **bhs = NULL;
+	struct ux_dirent *dirent, dotdot;
+	struct ux_dx_root *root;
+	struct ux_dx_item *items;
+	__u32 nleaves, lblk, newblk, per;
+	int i, n = 0, next, count, *start = NULL, error = 0;
+
+	nleaves = uip->i_blocks;
+	items = kvmalloc_array(nleaves * dpb, sizeof(struct ux_dx_item),
+			       GFP_NOFS);
+	start = kmalloc_array(nleaves + 1, sizeof(int), GFP_NOFS);
+	bhs = kcalloc(nleaves + 1, sizeof(struct buffer_head *), GFP_NOFS);
+	if (!items || !start || !bhs) {
+		error = -ENOMEM;
+		goto out;
+	}
+
+	memset(&dotdot, 0, sizeof(dotdot));
+	for (lblk = 0; lblk < nleaves; lblk++) {
+		bh = ux_dir_bread(dip, lblk);
+		if (!bh) {
+			error = -EIO;
+			goto out;
+		}
+		dirent = (struct ux_dirent *)bh->b_data;
+		for (i = 0; i < dpb; i++, dirent++) {
+			if (dirent->d_ino == 0) {
+				continue;
+			}
+			if (!strcmp(dirent->d_name, ".")) {
+				continue;
+			}
+			if (!strcmp(dirent->d_name, "..")) {
+				dotdot = *dirent;
+				continue;
+			}
+			items[n].hash = ux_dx_hash(dirent->d_name);
+			items[n].de = *dirent;
+			n++;
+		}
+		brelse(bh);
+	}
+	sort(items, n, sizeof(struct ux_dx_item), ux_dx_cmp, NULL);
+
+	/*
+	 * Work out where each of leaves 1..nleaves starts, filling
+	 * them evenly but moving a boundary forward when it would
+	 * separate two names with the same hash.
+	 */
+
+	per = DIV_ROUND_UP(n, nleaves);
+	for (lblk = 1, next = 0; lblk <= nleaves; lblk++) {
+		start[lblk - 1] = next;
+		count = 0;
+		while (next < n && (count < per || lblk == nleaves ||
+		       items[next].hash == items[next - 1].hash)) {
+			if (count == dpb) {
+				error = -ENOSPC;
+				goto out;
+			}
+			count++;
+			next++;
+		}
+	}
+	start[nleaves] = n;
+
+	/*
+	 * Get hold of the new leaf, the old blocks and write
+	 * access to all of them.
+	 */
+
+	bh = ux_dx_grow(dip, &newblk);
+	if (IS_ERR(bh)) {
+		error = PTR_ERR(bh);
+		goto out;
+	}
+	bhs[newblk] = bh;
+	for (lblk = 0; lblk < nleaves; lblk++) {
+		bh = ux_dir_bread(dip, lblk);
+		if (!bh) {
+			error = -EIO;
+			goto out;
+		}
+		bhs[lblk] = bh;
+		error = ux_journal_get_write_access(bh);
+		if (error) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Nothing can fail from here on.
+	 */
+
+	memset(bhs[0]->b_data, 0, sb->s_blocksize);
+	root = (struct ux_dx_root *)bhs[0]->b_data;
+	root->dr_dot.d_ino = dip->i_ino;
+	root->dr_dot.d_type = DT_DIR;
+	strcpy(root->dr_dot.d_name, ".");
+	root->dr_dotdot = dotdot;
+	root->dr_magic = UX_DX_MAGIC;
+
+	for (lblk = 1; lblk <= nleaves; lblk++) {
+		bh = bhs[lblk];
+		memset(bh->b_data, 0, sb->s_blocksize);
+		dirent = (struct ux_dirent *)bh->b_data;
+		for (i = start[lblk - 1]; i < start[lblk]; i++) {
+			*dirent++ = items[i].de;
+		}
+		ux_journal_dirty(bh);
+		if (lblk == 1 || start[lblk - 1] < n) {
+			root->dr_entries[root->dr_count].de_hash =
+				root->dr_count ? items[start[lblk - 1]].hash : 0;
+			root->dr_entries[root->dr_count].de_lblk = lblk;
+			root->dr_count++;
+		}
+	}
+	ux_journal_dirty(bhs[0]);
+
+	uip->i_flags |= UX_INDEX_FL;
+	mark_inode_dirty(dip);
+
+out:
+	if (bhs) {
+		for (lblk = 0; lblk <= nleaves; lblk++) {
+			brelse(bhs[lblk]);
+		}
+	}
+	kfree(bhs);
+	kfree(start);
+	kvfree(items);
+	return error;
+}
@@ -0,0 +1,809 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- ux_extent.c ----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/string.h>
+#include "ux_fs.h"
+#include "ux_journal.h"
+
+/*
+ * A path through the extent tree of an inode. Level 0 is the
+ * root and level "depth" the leaf. At each level p_idx is the
+ * entry that was followed or, in the leaf, the last extent
+ * starting at or before the block looked up (-1 if there is
+ * none). An inode whose extents are still inline has a path of
+ * one level and no buffer.
+ */
+
+struct ux_extent_path
+{
+	struct buffer_head *p_bh;
+	int p_idx;
+};
+
+static inline struct ux_extent_header *ux_eh(struct buffer_head *bh)
+{
+	return (struct ux_extent_header *)bh->b_data;
+}
+
+static inline struct ux_extent_idx *ux_ei(struct buffer_head *bh)
+{
+	return (struct ux_extent_idx *)(ux_eh(bh) + 1);
+}
+
+static inline struct ux_extent *ux_ex(struct buffer_head *bh)
+{
+	return (struct ux_extent *)(ux_eh(bh) + 1);
+}
+
+static int ux_extent_max(struct super_block *sb, struct ux_extent_header *eh)
+{
+	return eh->eh_depth ? UX_EXTENT_IDX_PER_BLOCK(sb->s_blocksize) :
+			      UX_EXTENTS_PER_BLOCK(sb->s_blocksize);
+}
+
+/*
+ * Read the extent block "blk", which must be at "depth" in the
+ * tree or, for the root (depth -1), at any depth. Only a root
+ * leaf may be empty.
+ */
+
+static struct buffer_head *ux_extent_read(struct super_block *sb, __u32 blk,
+					  int depth)
+{
+	struct ux_extent_header *eh;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		return ERR_PTR(-EIO);
+	}
+
+	eh = ux_eh(bh);
+	if (eh->eh_magic != UX_EXTENT_MAGIC ||
+	    eh->eh_depth > UX_EXTENT_MAX_DEPTH ||
+	    eh->eh_entries > ux_extent_max(sb, eh) ||
+	    (depth >= 0 && eh->eh_depth != depth) ||
+	    (!eh->eh_entries && (depth >= 0 || eh->eh_depth))) {
+		brelse(bh);
+		return ERR_PTR(-EIO);
+	}
+	return bh;
+}
+
+/*
+ * Return the index of the last extent starting at or before
+ * "lblk", or -1 if there is none.
+ */
+
+static int ux_extent_search(struct ux_extent *ex, int n, __u32 lblk)
+{
+	int lo = 0, hi = n - 1, mid, found = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ex[mid].e_lblk <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * The same for an index block, whose first entry covers
+ * everything below the second.
+ */
+
+static int ux_extent_isearch(struct ux_extent_idx *ei, int n, __u32 lblk)
+{
+	int lo = 1, hi = n - 1, mid, found = 0;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ei[mid].ei_lblk <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+static void ux_extent_release(struct ux_extent_path *path, int depth)
+{
+	int l;
+
+	for (l = 0; l <= depth; l++) {
+		brelse(path[l].p_bh);
+	}
+}
+
+/*
+ * Fill in the path to the leaf that holds, or would hold,
+ * logical block "lblk", and return the depth of the tree.
+ */
+
+static int ux_extent_find(struct inode *inode, __u32 lblk,
+			  struct ux_extent_path *path)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int l, depth;
+
+	if (!uip->i_extent_blk) {
+		path[0].p_bh = NULL;
+		path[0].p_idx = ux_extent_search(uip->i_extents,
+						 uip->i_nextents, lblk);
+		return 0;
+	}
+
+	bh = ux_extent_read(sb, uip->i_extent_blk, -1);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+	path[0].p_bh = bh;
+	depth = ux_eh(bh)->eh_depth;
+
+	for (l = 0; l < depth; l++) {
+		bh = path[l].p_bh;
+		path[l].p_idx = ux_extent_isearch(ux_ei(bh),
+						  ux_eh(bh)->eh_entries, lblk);
+		bh = ux_extent_read(sb, ux_ei(bh)[path[l].p_idx].ei_blk,
+				    depth - l - 1);
+		if (IS_ERR(bh)) {
+			ux_extent_release(path, l);
+			return PTR_ERR(bh);
+		}
+		path[l + 1].p_bh = bh;
+	}
+
+	bh = path[depth].p_bh;
+	path[depth].p_idx = ux_extent_search(ux_ex(bh), ux_eh(bh)->eh_entries,
+					     lblk);
+	return depth;
+}
+
+/*
+ * Return the extents of the leaf at the end of "path", and in
+ * *np how many there are.
+ */
+
+static struct ux_extent *ux_extent_leaf(struct inode *inode,
+					struct ux_extent_path *path,
+					int depth, int *np)
+{
+	struct buffer_head *bh = path[depth].p_bh;
+
+	if (!bh) {
+		*np = UX_I(inode)->ui_inode.i_nextents;
+		return UX_I(inode)->ui_inode.i_extents;
+	}
+	*np = ux_eh(bh)->eh_entries;
+	return ux_ex(bh);
+}
+
+/*
+ * Get write access to the blocks at levels "from" to "to" of
+ * "path".
+ */
+
+static int ux_extent_access(struct ux_extent_path *path, int from, int to)
+{
+	int l;
+
+	for (l = from; l <= to; l++) {
+		if (path[l].p_bh &&
+		    ux_journal_get_write_access(path[l].p_bh)) {
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A leaf now holds "n" extents, "change" more than before.
+ */
+
+static void ux_extent_dirty(struct inode *inode, struct buffer_head *bh,
+			    int n, int change)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+
+	uip->i_nextents += change;
+	if (bh) {
+		ux_eh(bh)->eh_entries = n;
+		ux_journal_dirty(bh);
+	}
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Allocate a new extent block near "goal" and return it zeroed
+ * and ready to be changed. Writeback of a delayed allocation,
+ * "reserved", takes the block from the inode's metadata promise
+ * while there is any left.
+ */
+
+static struct buffer_head *ux_extent_new(struct inode *inode, __u32 goal,
+					 int reserved)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	__u32 blk, count;
+
+	reserved = reserved && ui->ui_da_meta;
+	count = 1;
+	blk = ux_data_alloc_blocks(sb, goal, &count, reserved);
+	if (!blk) {
+		return ERR_PTR(-ENOSPC);
+	}
+
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		ux_data_free(sb, blk);
+		return ERR_PTR(-EIO);
+	}
+	if (ux_journal_get_write_access(bh)) {
+		brelse(bh);
+		ux_data_free(sb, blk);
+		return ERR_PTR(-EIO);
+	}
+
+	memset(bh->b_data, 0, sb->s_blocksize);
+	ux_eh(bh)->eh_magic = UX_EXTENT_MAGIC;
+	if (reserved) {
+		ui->ui_da_meta--;
+		ux_data_unreserve(sb, 1);
+	}
+	return bh;
+}
+
+/*
+ * The inline extents are full. Move them all to a new root
+ * block, next to the start of the file's data if possible.
+ */
+
+static int ux_extent_spill(struct inode *inode, int reserved)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct buffer_head *bh;
+
+	bh = ux_extent_new(inode, uip->i_extents[0].e_pblk, reserved);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	ux_eh(bh)->eh_entries = uip->i_nextents;
+	memcpy(ux_ex(bh), uip->i_extents,
+	       uip->i_nextents * sizeof(struct ux_extent));
+	ux_journal_dirty(bh);
+
+	memset(uip->i_extents, 0, sizeof(uip->i_extents));
+	uip->i_extent_blk = bh->b_blocknr;
+	brelse(bh);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Every block on the path is full. Move the root's entries to
+ * a new block and make the root an index of that one block.
+ */
+
+static int ux_extent_grow(struct inode *inode, struct buffer_head *root,
+			  int reserved)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ux_extent_header *eh = ux_eh(root);
+	struct buffer_head *bh;
+	__u32 key;
+
+	if (eh->eh_depth == UX_EXTENT_MAX_DEPTH) {
+		return -EFBIG;
+	}
+	if (ux_journal_get_write_access(root)) {
+		return -EIO;
+	}
+	bh = ux_extent_new(inode, root->b_blocknr, reserved);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+
+	memcpy(bh->b_data, root->b_data, sb->s_blocksize);
+	ux_journal_dirty(bh);
+
+	key = eh->eh_depth ? ux_ei(root)[0].ei_lblk : ux_ex(root)[0].e_lblk;
+	memset(eh + 1, 0, sb->s_blocksize - sizeof(struct ux_extent_header));
+	eh->eh_depth++;
+	eh->eh_entries = 1;
+	ux_ei(root)[0].ei_lblk = key;
+	ux_ei(root)[0].ei_blk = bh->b_blocknr;
+	ux_journal_dirty(root);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Split the full block at level "k" of "path", whose parent has
+ * room. When the path runs through the block's last entry, as
+ * it does while a file is written from start to end, only that
+ * entry moves, so the blocks left behind stay full.
+ */
+
+static int ux_extent_split(struct inode *inode, struct ux_extent_path *path,
+			   int k, int reserved)
+{
+	struct buffer_head *bh = path[k].p_bh, *parent = path[k - 1].p_bh;
+	struct ux_extent_header *eh = ux_eh(bh), *peh = ux_eh(parent);
+	struct ux_extent_idx *pei = ux_ei(parent);
+	struct buffer_head *nbh;
+	int n = eh->eh_entries, m, j;
+	size_t size;
+	__u32 key;
+
+	if (ux_extent_access(path, k - 1, k)) {
+		return -EIO;
+	}
+	nbh = ux_extent_new(inode, bh->b_blocknr, reserved);
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	m = (path[k].p_idx == n - 1) ? n - 1 : n / 2;
+	size = eh->eh_depth ? sizeof(struct ux_extent_idx) :
+			      sizeof(struct ux_extent);
+
+	ux_eh(nbh)->eh_depth = eh->eh_depth;
+	ux_eh(nbh)->eh_entries = n - m;
+	memcpy(ux_eh(nbh) + 1, (char *)(eh + 1) + m * size, (n - m) * size);
+	key = eh->eh_depth ? ux_ei(nbh)[0].ei_lblk : ux_ex(nbh)[0].e_lblk;
+	ux_journal_dirty(nbh);
+
+	memset((char *)(eh + 1) + m * size, 0, (n - m) * size);
+	eh->eh_entries = m;
+	ux_journal_dirty(bh);
+
+	j = path[k - 1].p_idx + 1;
+	memmove(&pei[j + 1], &pei[j],
+		(peh->eh_entries - j) * sizeof(struct ux_extent_idx));
+	pei[j].ei_lblk = key;
+	pei[j].ei_blk = nbh->b_blocknr;
+	peh->eh_entries++;
+	ux_journal_dirty(parent);
+	brelse(nbh);
+	return 0;
+}
+
+/*
+ * The leaf at the end of "path" is full. Make room in it, or at
+ * least get a step closer: spill the inline extents to a block,
+ * split the deepest full block whose parent has room, or push
+ * the root down a level. The caller looks the path up again
+ * afterwards. A root already UX_EXTENT_MAX_DEPTH deep cannot
+ * be pushed down and the insert fails with -EFBIG.
+ */
+
+static int ux_extent_make_room(struct inode *inode,
+			       struct ux_extent_path *path, int depth,
+			       int reserved)
+{
+	struct ux_extent_header *eh;
+	int k;
+
+	if (!path[0].p_bh) {
+		return ux_extent_spill(inode, reserved);
+	}
+	for (k = depth; k > 0; k--) {
+		eh = ux_eh(path[k - 1].p_bh);
+		if (eh->eh_entries < ux_extent_max(inode->i_sb, eh)) {
+			return ux_extent_split(inode, path, k, reserved);
+		}
+	}
+	return ux_extent_grow(inode, path[0].p_bh, reserved);
+}
+
+/*
+ * Record that "len" blocks at logical block "lblk" now live at
+ * disk block "pblk". The new run is merged with its neighbours
+ * in the leaf when they are contiguous on disk.
+ */
+
+static int ux_extent_insert(struct inode *inode, __u32 lblk,
+			    __u32 pblk, __u32 len, int reserved)
+{
+	struct ux_extent_path path[UX_EXTENT_MAX_DEPTH + 1];
+	struct buffer_head *bh;
+	struct ux_extent *ex;
+	int i, n, old, max, depth, error;
+
+again:
+	depth = ux_extent_find(inode, lblk, path);
+	if (depth < 0) {
+		return depth;
+	}
+	ex = ux_extent_leaf(inode, path, depth, &n);
+	bh = path[depth].p_bh;
+	i = path[depth].p_idx;
+	old = n;
+
+	max = bh ? UX_EXTENTS_PER_BLOCK(inode->i_sb->s_blocksize) :
+		   UX_INLINE_EXTENTS;
+	if (n == max &&
+	    !(i >= 0 && ex[i].e_lblk + ex[i].e_len == lblk &&
+	      ex[i].e_pblk + ex[i].e_len == pblk) &&
+	    !(i + 1 < n && ex[i + 1].e_lblk == lblk + len &&
+	      ex[i + 1].e_pblk == pblk + len)) {
+		error = ux_extent_make_room(inode, path, depth, reserved);
+		ux_extent_release(path, depth);
+		if (error) {
+			return error;
+		}
+		goto again;
+	}
+
+	if (bh && ux_journal_get_write_access(bh)) {
+		ux_extent_release(path, depth);
+		return -EIO;
+	}
+
+	if (i >= 0 && ex[i].e_lblk + ex[i].e_len == lblk &&
+	    ex[i].e_pblk + ex[i].e_len == pblk) {
+		ex[i].e_len += len;
+		if (i + 1 < n && ex[i + 1].e_lblk == lblk + len &&
+		    ex[i + 1].e_pblk == pblk + len) {
+			ex[i].e_len += ex[i + 1].e_len;
+			memmove(&ex[i + 1], &ex[i + 2],
+				(n - i - 2) * sizeof(struct ux_extent));
+			memset(&ex[n - 1], 0, sizeof(struct ux_extent));
+			n--;
+		}
+		goto out;
+	}
+
+	if (i + 1 < n && ex[i + 1].e_lblk == lblk + len &&
+	    ex[i + 1].e_pblk == pblk + len) {
+		ex[i + 1].e_lblk = lblk;
+		ex[i + 1].e_pblk = pblk;
+		ex[i + 1].e_len += len;
+		goto out;
+	}
+
+	memmove(&ex[i + 2], &ex[i + 1],
+		(n - i - 1) * sizeof(struct ux_extent));
+	ex[i + 1].e_lblk = lblk;
+	ex[i + 1].e_pblk = pblk;
+	ex[i + 1].e_len = len;
+	n++;
+
+out:
+	ux_extent_dirty(inode, bh, n, n - old);
+	ux_extent_release(path, depth);
+	return 0;
+}
+
+/*
+ * Map logical block "lblk" of "inode". On return *pblk is the
+ * disk block, or 0 for a hole, and *len is the number of blocks
+ * from lblk that are mapped (or unmapped) the same way. A hole
+ * stops where the next leaf begins, so that whatever is
+ * allocated for it belongs in the leaf it was looked up in.
+ */
+
+int ux_extent_get(struct inode *inode, __u32 lblk, __u32 *pblk, __u32 *len)
+{
+	struct ux_extent_path path[UX_EXTENT_MAX_DEPTH + 1];
+	struct buffer_head *bh;
+	struct ux_extent *ex;
+	int i, n, l, depth;
+	__u32 end;
+
+	depth = ux_extent_find(inode, lblk, path);
+	if (depth < 0) {
+		return depth;
+	}
+
+	ex = ux_extent_leaf(inode, path, depth, &n);
+	i = path[depth].p_idx;
+	if (i >= 0 && lblk < ex[i].e_lblk + ex[i].e_len) {
+		*pblk = ex[i].e_pblk + (lblk - ex[i].e_lblk);
+		*len = ex[i].e_lblk + ex[i].e_len - lblk;
+	} else {
+		end = (i + 1 < n) ? ex[i + 1].e_lblk : U32_MAX;
+		for (l = 0; l < depth; l++) {
+			bh = path[l].p_bh;
+			i = path[l].p_idx;
+			if (i + 1 < ux_eh(bh)->eh_entries) {
+				end = min(end, ux_ei(bh)[i + 1].ei_lblk);
+			}
+		}
+		*pblk = 0;
+		*len = end - lblk;
+	}
+
+	ux_extent_release(path, depth);
+	return 0;
+}
+
+/*
+ * Return the disk block holding logical block "lblk", or 0.
+ */
+
+__u32 ux_extent_bmap(struct inode *inode, __u32 lblk)
+{
+	__u32 pblk, len;
+
+	if (ux_extent_get(inode, lblk, &pblk, &len)) {
+		return 0;
+	}
+	return pblk;
+}
+
+/*
+ * Return -EFBIG if no new extent could be added at logical
+ * block "lblk": the root is already UX_EXTENT_MAX_DEPTH deep
+ * and every block on the way down to the leaf is full. Buffered
+ * writes check before they reserve, as writeback has no one to
+ * report the error to.
+ */
+
+int ux_extent_room(struct inode *inode, __u32 lblk)
+{
+	struct ux_extent_path path[UX_EXTENT_MAX_DEPTH + 1];
+	struct ux_extent_header *eh;
+	int l, depth, error = 0;
+
+	depth = ux_extent_find(inode, lblk, path);
+	if (depth < 0) {
+		return depth;
+	}
+
+	if (depth == UX_EXTENT_MAX_DEPTH) {
+		error = -EFBIG;
+		for (l = 0; l <= depth; l++) {
+			eh = ux_eh(path[l].p_bh);
+			if (eh->eh_entries < ux_extent_max(inode->i_sb, eh)) {
+				error = 0;
+				break;
+			}
+		}
+	}
+
+	ux_extent_release(path, depth);
+	return error;
+}
+
+/*
+ * Allocate up to *len blocks for the hole at logical block
+ * "lblk", no more than the hole holds. We aim for the disk
+ * block following the previous logical block so that the
+ * file's extent simply grows, and otherwise for the part of
+ * the disk that goes with the inode. "reserved" says the
+ * blocks were promised to a delayed allocation; the promise is
+ * handed back only once they are in the map, so that a failed
+ * insert leaves it whole.
+ */
+
+int ux_extent_alloc(struct inode *inode, __u32 lblk, __u32 *pblk, __u32 *len,
+		    int reserved)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct super_block *sb = inode->i_sb;
+	__u32 goal = 0, blk, count, i;
+	int error;
+
+	error = ux_extent_get(inode, lblk, &blk, &count);
+	if (error) {
+		return error;
+	}
+	count = min(count, *len);
+
+	if (lblk > 0) {
+		goal = ux_extent_bmap(inode, lblk - 1);
+		if (goal) {
+			goal++;
+		}
+	}
+	if (!goal) {
+		goal = ux_data_goal(inode);
+	}
+
+	blk = ux_data_alloc_blocks(sb, goal, &count, reserved);
+	if (!blk) {
+		return -ENOSPC;
+	}
+
+	error = ux_extent_insert(inode, lblk, blk, count, reserved);
+	if (error) {
+		for (i = 0; i < count; i++) {
+			ux_data_free(sb, blk + i);
+		}
+		return error;
+	}
+	if (reserved) {
+		ux_data_unreserve(sb, count);
+	}
+
+	inode->i_blocks += (blkcnt_t)count << (inode->i_blkbits - 9);
+	uip->i_blocks += count;
+	mark_inode_dirty(inode);
+
+	*pblk = blk;
+	*len = count;
+	return 0;
+}
+
+/*
+ * One step of a truncate to "nblocks": free whatever lies beyond
+ * it of the last extent, and the extent blocks that leaves
+ * empty. Each step is complete in itself and gets its own
+ * journal credits, so that a file of any size can be truncated
+ * over several transactions. Returns 1 if there may be more to
+ * do, 0 when done.
+ */
+
+static int ux_extent_trim(struct inode *inode, struct ux_extent_path *path,
+			  int depth, __u32 nblocks)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ux_extent_header *eh;
+	struct ux_extent *ex, *e;
+	__u32 keep, i, freed, blk;
+	int n, l, error, isdir = S_ISDIR(inode->i_mode);
+
+	ex = ux_extent_leaf(inode, path, depth, &n);
+	if (n == 0 || ex[n - 1].e_lblk + ex[n - 1].e_len <= nblocks) {
+		return 0;
+	}
+	e = &ex[n - 1];
+	keep = (e->e_lblk < nblocks) ? nblocks - e->e_lblk : 0;
+	freed = e->e_len - keep;
+
+	error = ux_journal_ensure(UX_TRUNCATE_CREDITS +
+				  freed / UX_BITS_PER_BLOCK(sb->s_blocksize),
+				  depth + 1 + (isdir ? freed : 0),
+				  &UX_I(inode)->ui_extent_lock);
+	if (error > 0) {
+		return 1;	/* the tree may have changed; look again */
+	}
+	if (error || ux_extent_access(path, 0, depth)) {
+		return -EIO;
+	}
+
+	for (i = keep; i < e->e_len; i++) {
+		if (isdir) {
+			ux_journal_forget(sb, NULL, e->e_pblk + i);
+		}
+		ux_data_free(sb, e->e_pblk + i);
+	}
+	inode->i_blocks -= (blkcnt_t)freed << (inode->i_blkbits - 9);
+	uip->i_blocks -= freed;
+
+	if (keep) {
+		e->e_len = keep;
+		ux_extent_dirty(inode, path[depth].p_bh, n, 0);
+		return 0;
+	}
+	memset(e, 0, sizeof(struct ux_extent));
+	ux_extent_dirty(inode, path[depth].p_bh, n - 1, -1);
+
+	for (l = depth; l > 0 && ux_eh(path[l].p_bh)->eh_entries == 0; l--) {
+		blk = path[l].p_bh->b_blocknr;
+		ux_journal_forget(sb, path[l].p_bh, blk);
+		path[l].p_bh = NULL;
+		ux_data_free(sb, blk);
+
+		eh = ux_eh(path[l - 1].p_bh);
+		eh->eh_entries--;
+		memset(&ux_ei(path[l - 1].p_bh)[eh->eh_entries], 0,
+		       sizeof(struct ux_extent_idx));
+		if (l == 1 && eh->eh_entries == 0) {
+			eh->eh_depth = 0;
+		}
+		ux_journal_dirty(path[l - 1].p_bh);
+	}
+	return 1;
+}
+
+/*
+ * Once a truncate is done, pull the only child of the root up
+ * into the root, and move a root leaf that fits back into the
+ * inode.
+ */
+
+static void ux_extent_shrink(struct inode *inode)
+{
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ux_extent_header *eh;
+	struct buffer_head *root, *bh;
+	__u32 blk;
+	int error;
+
+again:
+	if (!uip->i_extent_blk) {
+		return;
+	}
+	root = ux_extent_read(sb, uip->i_extent_blk, -1);
+	if (IS_ERR(root)) {
+		return;
+	}
+	eh = ux_eh(root);
+	if ((eh->eh_depth == 0 && eh->eh_entries > UX_INLINE_EXTENTS) ||
+	    (eh->eh_depth > 0 && eh->eh_entries > 1)) {
+		brelse(root);
+		return;
+	}
+	error = ux_journal_ensure(UX_TRUNCATE_CREDITS, UX_EXTENT_MAX_DEPTH + 1,
+				  &UX_I(inode)->ui_extent_lock);
+	if (error > 0) {
+		brelse(root);
+		goto again;
+	}
+	if (error || ux_journal_get_write_access(root)) {
+		brelse(root);
+		return;
+	}
+
+	while (eh->eh_depth > 0 && eh->eh_entries == 1) {
+		blk = ux_ei(root)[0].ei_blk;
+		bh = ux_extent_read(sb, blk, eh->eh_depth - 1);
+		if (IS_ERR(bh)) {
+			brelse(root);
+			return;
+		}
+		memcpy(root->b_data, bh->b_data, sb->s_blocksize);
+		ux_journal_dirty(root);
+		ux_journal_forget(sb, bh, blk);
+		ux_data_free(sb, blk);
+	}
+
+	if (eh->eh_depth == 0 && eh->eh_entries <= UX_INLINE_EXTENTS) {
+		memset(uip->i_extents, 0, sizeof(uip->i_extents));
+		memcpy(uip->i_extents, ux_ex(root),
+		       eh->eh_entries * sizeof(struct ux_extent));
+		blk = uip->i_extent_blk;
+		ux_journal_forget(sb, root, blk);
+		ux_data_free(sb, blk);
+		uip->i_extent_blk = 0;
+		mark_inode_dirty(inode);
+		return;
+	}
+	brelse(root);
+}
+
+/*
+ * Free every block at or beyond logical block "nblocks", one
+ * extent at a time from the end. Directory blocks are metadata,
+ * so the journal must not replay them over their next owner,
+ * and the same goes for the extent blocks. Called inside a
+ * handle with ui_extent_lock held for writing; the lock is
+ * dropped whenever the journal has to start a new transaction.
+ */
+
+void ux_extent_truncate(struct inode *inode, __u32 nblocks)
+{
+	struct ux_extent_path path[UX_EXTENT_MAX_DEPTH + 1];
+	int depth, more;
+
+	do {
+		depth = ux_extent_find(inode, U32_MAX, path);
+		if (depth < 0) {
+			return;
+		}
+		more = ux_extent_trim(inode, path, depth, nblocks);
+		ux_extent_release(path, depth);
+	} while (more > 0);
+
+	ux_extent_shrink(inode);
+}
@@ -4,94 +4,474 @@
 
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
 #include "ux_fs.h"
 #include "ux_xattr.h"
 #include "ux_acl.h"
+#include "ux_journal.h"
+#include "ux_trace.h"
 
-const struct file_operations ux_file_operations = {
-	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
-	.mmap		= generic_file_mmap,
-};
+/*
+ * Fill in "iomap" for "len" blocks at "lblk", which are either
+ * at disk block "pblk" or, if that is 0, of the given type.
+ */
 
-int ux_get_block(struct inode *inode, sector_t block,
-		struct buffer_head *bh_result, int create)
+static void ux_iomap_set(struct inode *inode, struct iomap *iomap,
+			 __u32 lblk, __u32 pblk, __u32 len, u16 type)
 {
-	struct super_block *sb = inode->i_sb;
-	struct ux_inode *uip = (struct ux_inode *)inode->i_private;
-	__u32 blk, acl_blk_num;
+	unsigned int bits = inode->i_blkbits;
 
-	/*
-	 * First check to see if the file can be extended.
-	 */
-	if (block >= UX_DIRECT_BLOCKS) {
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)lblk << bits;
+	iomap->length = (loff_t)len << bits;
+	if (pblk) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)pblk << bits;
+	} else {
+		iomap->type = type;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+}
+
+/*
+ * Map the file range starting at "pos" for iomap. We report as
+ * much of the range as one extent, one delayed allocation or one
+ * hole covers. A buffered write into a hole only reserves space
+ * and gets a delayed allocation; blocks are picked at writeback.
+ * Direct writes need real blocks and allocate them here.
+ */
+
+static int ux_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			  unsigned flags, struct iomap *iomap,
+			  struct iomap *srcmap)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	unsigned int bits = inode->i_blkbits;
+	__u32 lblk, pblk, len, dalen, max;
+	u16 type = IOMAP_HOLE;
+	handle_t *handle = NULL;
+	int error;
+
+	if ((pos >> bits) >= U32_MAX) {
 		return -EFBIG;
 	}
 
+	lblk = pos >> bits;
+	max = min_t(loff_t, ((pos + length - 1) >> bits) - lblk + 1,
+		    U32_MAX - lblk);
+
 	/*
-	 * If we're creating, we must allocate a new block.
+	 * The handle for a direct allocation has to be started
+	 * before the extent lock is taken.
 	 */
-	if (create) {
-		blk = ux_data_alloc(sb);
-		if (blk == 0) {
-			return -ENOSPC;
+
+	if ((flags & IOMAP_WRITE) && (flags & IOMAP_DIRECT)) {
+		handle = ux_journal_start(inode->i_sb, UX_ALLOC_CREDITS, 0);
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
 		}
+	}
+
+	if (flags & IOMAP_WRITE) {
+		down_write(&ui->ui_extent_lock);
+	} else {
+		down_read(&ui->ui_extent_lock);
+	}
 
-		acl_blk_num = ux_data_alloc(sb);
-		if (!acl_blk_num) {
-			iput(inode);
-			return -ENOSPC;
+	iomap->flags = 0;
+	error = ux_extent_get(inode, lblk, &pblk, &len);
+	if (error) {
+		goto out;
+	}
+	len = min(len, max);
+
+	if (!pblk) {
+		if (ux_da_lookup(inode, lblk, &dalen)) {
+			type = IOMAP_DELALLOC;
+		}
+		len = min(len, dalen);
+
+		if (type == IOMAP_HOLE && (flags & IOMAP_WRITE)) {
+			if (flags & IOMAP_DIRECT) {
+				error = ux_extent_alloc(inode, lblk,
+							&pblk, &len, 0);
+			} else {
+				error = ux_extent_room(inode, lblk);
+				if (!error) {
+					error = ux_da_reserve(inode, lblk,
+							      len);
+				}
+				type = IOMAP_DELALLOC;
+			}
+			if (error) {
+				goto out;
+			}
+			iomap->flags |= IOMAP_F_NEW;
 		}
+	}
+
+	ux_iomap_set(inode, iomap, lblk, pblk, len, type);
 
-		uip->i_addr[block] = blk;
-		uip->i_acl_blk_addr = acl_blk_num;
-		inode->i_blocks++;
-		uip->i_size = inode->i_size;
+out:
+	trace_uxfs_iomap_begin(inode, lblk, error ? 0 : pblk, error ? 0 : len,
+			       flags, error ? 0 : iomap->type, error);
+	ux_stat_inc(inode->i_sb, flags & IOMAP_WRITE ?
+			UX_STAT_MAP_CREATE : UX_STAT_MAP_READ);
+	if (flags & IOMAP_WRITE) {
+		up_write(&ui->ui_extent_lock);
+	} else {
+		up_read(&ui->ui_extent_lock);
+	}
+	ux_journal_stop(handle);
+	return error;
+}
+
+/*
+ * A buffered write that grew the file has already updated
+ * i_size; make sure the inode gets written back with it. If
+ * the write came up short, give back the reservation for any
+ * new delayed blocks it never reached.
+ */
+
+static int ux_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	unsigned int bits = inode->i_blkbits;
+	__u32 start, end;
+
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED) {
 		mark_inode_dirty(inode);
 	}
 
-	map_bh(bh_result, sb, uip->i_addr[block]);
-	if (create) {
-		set_buffer_new(bh_result);
+	if (iomap->type == IOMAP_DELALLOC &&
+	    (iomap->flags & IOMAP_F_NEW) && written < length) {
+		start = (pos + written + (1 << bits) - 1) >> bits;
+		end = (pos + length + (1 << bits) - 1) >> bits;
+		if (start < end) {
+			down_write(&UX_I(inode)->ui_extent_lock);
+			ux_da_release(inode, start, end - start);
+			up_write(&UX_I(inode)->ui_extent_lock);
+		}
+	}
+
+	return 0;
+}
+
+const struct iomap_ops ux_iomap_ops = {
+	.iomap_begin	= ux_iomap_begin,
+	.iomap_end	= ux_iomap_end,
+};
+
+/*
+ * Extend the file once a direct write past EOF has completed.
+ */
+
+static int ux_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+			       unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (error) {
+		return error;
+	}
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops ux_dio_write_ops = {
+	.end_io		= ux_dio_write_end_io,
+};
+
+static ssize_t ux_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		return generic_file_read_iter(iocb, to);
+	}
+
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ux_iomap_ops, NULL,
+			   is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+/*
+ * Writes go through iomap. O_DIRECT writes go straight to disk
+ * and fall back to the page cache only if iomap asks us to,
+ * which it does when it cannot invalidate cached pages.
+ */
+
+static ssize_t ux_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0) {
+		goto out;
+	}
+
+	ret = file_remove_privs(file);
+	if (ret) {
+		goto out;
 	}
+	ret = file_update_time(file);
+	if (ret) {
+		goto out;
+	}
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = iomap_dio_rw(iocb, from, &ux_iomap_ops,
+				   &ux_dio_write_ops, is_sync_kiocb(iocb));
+		if (ret != -ENOTBLK) {
+			goto out;
+		}
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	}
+
+	ret = iomap_file_buffered_write(iocb, from, &ux_iomap_ops);
+	if (ret > 0) {
+		iocb->ki_pos += ret;
+	}
+
+out:
+	inode_unlock(inode);
+	if (ret > 0) {
+		ret = generic_write_sync(iocb, ret);
+	}
+	return ret;
+}
+
+static vm_fault_t ux_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &ux_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ux_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= ux_page_mkwrite,
+};
 
+static int ux_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ux_file_vm_ops;
 	return 0;
 }
 
-int ux_writepage(struct page *page, struct writeback_control *wbc)
+const struct file_operations ux_file_operations = {
+	.llseek		= generic_file_llseek,
+	.read_iter	= ux_file_read_iter,
+	.write_iter	= ux_file_write_iter,
+	.mmap		= ux_file_mmap,
+	.open		= generic_file_open,
+	.fsync		= generic_file_fsync,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
+};
+
+/*
+ * Change the attributes of a file. Shrinking a file releases
+ * the blocks beyond the new end of file.
+ */
+
+int ux_setattr(struct dentry *dentry, struct iattr *attr)
 {
-	return block_write_full_page(page, ux_get_block, wbc);
+	struct inode *inode = d_inode(dentry);
+	handle_t *handle;
+	__u32 nblocks;
+	int error;
+
+	error = setattr_prepare(dentry, attr);
+	if (error) {
+		return error;
+	}
+
+	if ((attr->ia_valid & ATTR_SIZE) &&
+	    attr->ia_size != i_size_read(inode)) {
+		error = inode_newsize_ok(inode, attr->ia_size);
+		if (error) {
+			return error;
+		}
+
+		/*
+		 * An async direct write may still be running into
+		 * blocks the truncate is about to free.
+		 */
+
+		inode_dio_wait(inode);
+
+		if (attr->ia_size < i_size_read(inode)) {
+			error = iomap_truncate_page(inode, attr->ia_size,
+						    NULL, &ux_iomap_ops);
+			if (error) {
+				return error;
+			}
+		}
+
+		truncate_setsize(inode, attr->ia_size);
+		nblocks = (attr->ia_size + inode->i_sb->s_blocksize - 1) >>
+			  inode->i_blkbits;
+		handle = ux_journal_start(inode->i_sb,
+					  ux_truncate_credits(inode),
+					  ux_truncate_revokes(inode));
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
+		}
+		down_write(&UX_I(inode)->ui_extent_lock);
+		ux_da_release(inode, nblocks, U32_MAX - nblocks);
+		ux_extent_truncate(inode, nblocks);
+		up_write(&UX_I(inode)->ui_extent_lock);
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+		ux_journal_stop(handle);
+	}
+
+	setattr_copy(inode, attr);
+	if (attr->ia_valid & ATTR_MODE) {
+		error = posix_acl_chmod(inode, inode->i_mode);
+	}
+
+	mark_inode_dirty(inode);
+	return error;
+}
+
+/*
+ * Writeback maps one extent at a time and reuses the mapping
+ * for every dirty block that falls inside it. Reaching a delayed
+ * allocation allocates the whole range it belongs to.
+ */
+
+static int ux_map_blocks(struct iomap_writepage_ctx *wpc,
+			 struct inode *inode, loff_t offset)
+{
+	struct ux_inode_info *ui = UX_I(inode);
+	__u32 lblk, pblk, len, dalen;
+	handle_t *handle;
+	int error;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length) {
+		return 0;
+	}
+
+	handle = ux_journal_start(inode->i_sb, UX_ALLOC_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+
+	lblk = offset >> inode->i_blkbits;
+	down_write(&ui->ui_extent_lock);
+	do {
+		error = ux_extent_get(inode, lblk, &pblk, &len);
+		if (!error && !pblk && ux_da_lookup(inode, lblk, &dalen)) {
+			error = ux_da_alloc(inode, lblk, &pblk, &len);
+		}
+	} while (error == -EAGAIN);
+	up_write(&ui->ui_extent_lock);
+	ux_journal_stop(handle);
+
+	trace_uxfs_map_blocks(inode, lblk, error ? 0 : pblk, error ? 0 : len,
+			      IOMAP_WRITE,
+			      !error && pblk ? IOMAP_MAPPED : IOMAP_HOLE, error);
+	ux_stat_inc(inode->i_sb, UX_STAT_MAP_CREATE);
+	if (error) {
+		return error;
+	}
+	wpc->iomap.flags = 0;
+	ux_iomap_set(inode, &wpc->iomap, lblk, pblk, len, IOMAP_HOLE);
+	return 0;
 }
 
-int ux_readpage(struct file *file, struct page *page)
+static const struct iomap_writeback_ops ux_writeback_ops = {
+	.map_blocks	= ux_map_blocks,
+};
+
+static int ux_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return block_read_full_page(page, ux_get_block);
+	struct iomap_writepage_ctx wpc = { };
+
+	return iomap_writepage(page, wbc, &wpc, &ux_writeback_ops);
 }
 
-int ux_write_begin(struct file *file, struct address_space *mapping,
-			loff_t pos, unsigned int len, unsigned int flags,
-			struct page **pagep, void **fsdata)
+/*
+ * Write back a whole range of dirty pages under one writepage
+ * context. Dirty blocks that are contiguous on disk are gathered
+ * into a single ioend and go out as one large bio; how many pages
+ * we write and where we resume (including range_cyclic) is left
+ * to write_cache_pages() and the writeback_control.
+ */
+
+static int ux_writepages(struct address_space *mapping,
+			 struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	return iomap_writepages(mapping, wbc, &wpc, &ux_writeback_ops);
+}
+
+static int ux_readpage(struct file *file, struct page *page)
+{
+	return iomap_readpage(page, &ux_iomap_ops);
+}
+
+/*
+ * Readahead maps whole extents at a time, so a run of contiguous
+ * blocks goes to the device as one large bio.
+ */
+
+static void ux_readahead(struct readahead_control *rac)
 {
-	return block_write_begin(mapping, pos, len, flags, pagep, ux_get_block);
+	iomap_readahead(rac, &ux_iomap_ops);
 }
 
-sector_t ux_bmap(struct address_space *mapping, sector_t block)
+static sector_t ux_bmap(struct address_space *mapping, sector_t block)
 {
-	return generic_block_bmap(mapping, block, ux_get_block);
+	return iomap_bmap(mapping, block, &ux_iomap_ops);
 }
 
 const struct address_space_operations ux_aops = {
-	.readpage	= ux_readpage,
-	.writepage	= ux_writepage,
-	.write_begin	= ux_write_begin,
-	.write_end	= generic_write_end,
-	.bmap		= ux_bmap,
+	.readpage		= ux_readpage,
+	.readahead		= ux_readahead,
+	.writepage		= ux_writepage,
+	.writepages		= ux_writepages,
+	.set_page_dirty		= iomap_set_page_dirty,
+	.releasepage		= iomap_releasepage,
+	.invalidatepage		= iomap_invalidatepage,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.migratepage		= iomap_migrate_page,
+	.error_remove_page	= generic_error_remove_page,
+	.direct_IO		= noop_direct_IO,
+	.bmap			= ux_bmap,
 };
 
 const struct inode_operations ux_file_inops = {
 	.link	= ux_link,
 	.unlink	= ux_unlink,
+	.setattr	= ux_setattr,
 	.listxattr	= generic_listxattr,
 	.get_acl	= ux_get_acl,
 	.set_acl	= ux_set_acl,
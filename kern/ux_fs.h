@@ -8,23 +8,68 @@ extern const struct inode_operations ux_dir_inops;
 extern const struct file_operations ux_dir_operations;
 extern const struct file_operations ux_file_operations;
 
-#define UX_NAMELEN 28
-#define UX_DIRS_PER_BLOCK 15
-#define UX_DIRECT_BLOCKS 15
-#define UX_MAXFILES 32
-#define UX_MAXBLOCKS 470
-#define UX_FIRST_DATA_BLOCK 50
-#define UX_BSIZE 512
-#define UX_BSIZE_BITS 9
+#define UX_NAMELEN 26
+#define UX_INLINE_EXTENTS 4
+#define UX_INLINE_ACL 28
+#define UX_MIN_BSIZE 512
+#define UX_MAX_BSIZE 4096
 #define UX_MAGIC 0x58494e55
-#define UX_INODE_BLOCK 8
+#define UX_EXTENT_MAGIC 0x58455855
+#define UX_DX_MAGIC 0x58445855
+#define UX_DX_NODE_MAGIC 0x4e445855
+#define UX_ACL_MAGIC 0x58415855
+#define UX_INODE_SIZE 128
+#define UX_FIRST_INO 4
+#define UX_DIR_LINEAR_MAX 4
+#define UX_EXTENT_MAX_DEPTH 3
+#define UX_DX_MAX_LEVELS 2
 #define UX_ROOT_INO 2
-#define UX_DEFAULT_ACL_OFFSET 0
-#define UX_ACCESS_ACL_OFFSET UX_BSIZE/2
 
 /*
- * The on-disk superblock. The number of inodes and 
- * data blocks is fixed.
+ * The block size is chosen by mkfs. These give the layout of
+ * the various kinds of block for a block size of "bsize".
+ */
+
+#define UX_BITS_PER_BLOCK(bsize) ((bsize) * 8)
+#define UX_INODES_PER_BLOCK(bsize) ((bsize) / UX_INODE_SIZE)
+#define UX_DIRS_PER_BLOCK(bsize) ((bsize) / sizeof(struct ux_dirent))
+#define UX_EXTENTS_PER_BLOCK(bsize) \
+        (((bsize) - sizeof(struct ux_extent_header)) / \
+         sizeof(struct ux_extent))
+#define UX_EXTENT_IDX_PER_BLOCK(bsize) \
+        (((bsize) - sizeof(struct ux_extent_header)) / \
+         sizeof(struct ux_extent_idx))
+#define UX_DX_LIMIT(bsize) \
+        (((bsize) - sizeof(struct ux_dx_root)) / sizeof(struct ux_dx_entry))
+#define UX_DX_NODE_LIMIT(bsize) \
+        (((bsize) - sizeof(struct ux_dx_node)) / sizeof(struct ux_dx_entry))
+#define UX_ACL_MAX_RECORD(bsize) ((bsize) - sizeof(struct ux_acl_block))
+
+/*
+ * The on-disk superblock. It always starts at byte 0 of the
+ * device and records the geometry chosen by mkfs. All block
+ * numbers are in units of s_bsize bytes, and the filesystem is
+ * laid out as
+ *
+ *   block 0                    superblock
+ *   s_imap_start               inode bitmap, s_imap_blocks long
+ *   s_bmap_start               block bitmap, s_bmap_blocks long
+ *   s_itable_start             inode table, s_itable_blocks long,
+ *                              UX_INODES_PER_BLOCK(s_bsize) inodes
+ *                              per block
+ *   s_journal_start            jbd2 journal, s_journal_blocks long,
+ *                              if s_journal_blocks is not 0
+ *   s_data_start               s_nblocks data blocks
+ *
+ * The inode bitmap has one bit per inode and the block bitmap
+ * one bit per data block, bit n standing for disk block
+ * s_data_start + n. Bit n of a bitmap is bit (n % 8) of byte
+ * (n / 8), i.e. little-endian bit order on every host.
+ *
+ * mkfs -L writes only the first block of the inode table. If
+ * s_itable_lazy is not 0, blocks from s_itable_lazy on may hold
+ * stale data in the slots of free inodes until the kernel has
+ * zeroed them in the background.
  */
 
 struct ux_superblock
@@ -32,13 +77,45 @@ struct ux_superblock
         __u32 s_magic;
         __u32 s_mod;
         __u32 s_nifree;
-        __u32 s_inode[UX_MAXFILES];
         __u32 s_nbfree;
-        __u32 s_block[UX_MAXBLOCKS];
+        __u32 s_ninodes;
+        __u32 s_nblocks;
+        __u32 s_imap_start;
+        __u32 s_imap_blocks;
+        __u32 s_bmap_start;
+        __u32 s_bmap_blocks;
+        __u32 s_itable_start;
+        __u32 s_itable_blocks;
+        __u32 s_data_start;
+        __u32 s_inode_size;
+        __u32 s_bsize;
+        __u32 s_journal_start;
+        __u32 s_journal_blocks;
+        __u32 s_itable_lazy;    /* first inode table block not yet
+                                   zeroed, or 0 */
 };
 
 /*
- * The on-disk inode.
+ * A run of contiguous data blocks: e_len blocks starting at
+ * logical block e_lblk of the file live at disk block e_pblk.
+ */
+
+struct ux_extent
+{
+        __u32 e_lblk;
+        __u32 e_pblk;
+        __u32 e_len;
+};
+
+/*
+ * The on-disk inode. Up to UX_INLINE_EXTENTS extents are held
+ * in i_extents[]. Once a file needs more, all of its extents
+ * move to a tree of extent blocks rooted at i_extent_blk. In
+ * both cases they are sorted by e_lblk and i_nextents says how
+ * many there are in all.
+ *
+ * Inodes are packed into the inode table UX_INODE_SIZE bytes
+ * apart, so the structure is padded out to exactly that size.
  */
 
 struct ux_inode
@@ -52,20 +129,81 @@ struct ux_inode
         __s32 i_gid;
         __u32 i_size;
         __u32 i_blocks;
-        __u32 i_addr[UX_DIRECT_BLOCKS];
-        __u32 i_acl_blk_addr;
-        __u32 i_default_acl_size;
-        __u32 i_access_acl_size;
+        __u32 i_nextents;
+        __u32 i_extent_blk;
+        struct ux_extent i_extents[UX_INLINE_EXTENTS];
+        __u32 i_acl_blk;        /* shared ACL block, or 0 */
+        __u32 i_flags;
+        __u8 i_acl[UX_INLINE_ACL]; /* inline ACL record */
 };
 
 /*
- * Allocation flags
+ * Inode flags
  */
 
-#define UX_INODE_FREE 0
-#define UX_INODE_INUSE 1
-#define UX_BLOCK_FREE 0
-#define UX_BLOCK_INUSE 1
+#define UX_INDEX_FL 0x1         /* directory has a hashed index */
+
+/*
+ * Header of an extent block. A leaf, at depth 0, is followed by
+ * an array of struct ux_extent filling the rest of the block.
+ * A block at depth d > 0 is followed instead by an array of
+ * struct ux_extent_idx, each naming a block at depth d - 1 and
+ * the first logical block it may map; the first entry stands
+ * for everything below the second. Only the root, i_extent_blk,
+ * may be empty, and only as a leaf. The root is at most
+ * UX_EXTENT_MAX_DEPTH deep.
+ */
+
+struct ux_extent_header
+{
+        __u32 eh_magic;
+        __u16 eh_entries;
+        __u16 eh_depth;
+};
+
+struct ux_extent_idx
+{
+        __u32 ei_lblk;
+        __u32 ei_blk;
+};
+
+/*
+ * POSIX ACLs are kept as one record per inode holding both the
+ * access and the default ACL: a header giving the number of
+ * entries of each, followed by the entries. ACL_USER and
+ * ACL_GROUP entries carry an id; the others stop after e_perm.
+ *
+ * An inode whose ACLs are equivalent to its mode has no record.
+ * A record of up to UX_INLINE_ACL bytes lives in i_acl. Larger
+ * ones go in an ACL block named by i_acl_blk, which is shared by
+ * every inode with the same record and freed with its last user.
+ */
+
+struct ux_acl_header
+{
+        __u16 ah_access;
+        __u16 ah_default;
+};
+
+struct ux_acl_entry
+{
+        __u16 e_tag;
+        __u16 e_perm;
+        __u32 e_id;
+};
+
+#define UX_ACL_ENTRY_SHORT 4    /* entry without e_id */
+
+struct ux_acl_block
+{
+        __u32 ab_magic;
+        __u32 ab_refcount;
+        __u32 ab_hash;
+        __u32 ab_size;          /* bytes of record that follow */
+};
+
+#define UX_ACL_REFCOUNT_MAX 1024
+#define UX_ACL_CACHE_BITS 6      /* log2 of mbcache hash buckets */
 
 /*
  * Filesystem flags
@@ -75,13 +213,198 @@ struct ux_inode
 #define UX_FSDIRTY 1
 
 /*
- * FIxed size directory entry.
+ * FIxed size directory entry. Names are always NUL terminated.
+ * d_type holds the file type bits of the inode's mode in the
+ * DT_* encoding used by readdir, or 0 if it is not known.
  */
 
 struct ux_dirent
 {
         __u32 d_ino;
-        char d_name[UX_NAMELEN];
+        __u8 d_type;
+        char d_name[UX_NAMELEN + 1];
+};
+
+#define UX_DT(mode) (((mode) >> 12) & 15)
+
+/*
+ * A directory starts out as a plain array of entries. Once it
+ * needs more than UX_DIR_LINEAR_MAX blocks it is converted to a
+ * hashed index and UX_INDEX_FL is set. Block 0 then holds the
+ * "." and ".." entries followed by the index root: dr_count
+ * entries sorted by hash, each naming the block that covers
+ * every name whose hash lies between de_hash and the next
+ * entry's de_hash. The first entry covers everything below the
+ * second whatever its de_hash.
+ *
+ * When dr_levels is 0 the root names leaves, which are ordinary
+ * blocks of ux_dirents and split in two when they fill up. Once
+ * the root is full it moves to an index node and names that
+ * instead, adding a level, up to UX_DX_MAX_LEVELS levels of
+ * nodes. A node is laid out like the root, behind an empty
+ * entry of type UX_DT_DX_NODE so that nothing scanning the
+ * directory for entries finds any in it.
+ */
+
+#define UX_DT_DX_NODE 0xff
+
+struct ux_dx_entry
+{
+        __u32 de_hash;
+        __u32 de_lblk;
+};
+
+struct ux_dx_root
+{
+        struct ux_dirent dr_dot;
+        struct ux_dirent dr_dotdot;
+        __u32 dr_magic;
+        __u16 dr_count;
+        __u16 dr_levels;
+        struct ux_dx_entry dr_entries[];
+};
+
+struct ux_dx_node
+{
+        struct ux_dirent dn_fake;
+        __u32 dn_magic;
+        __u16 dn_count;
+        __u16 dn_pad;
+        struct ux_dx_entry dn_entries[];
+};
+
+static inline int ux_dx_is_node(const void *buf)
+{
+        const struct ux_dx_node *node = buf;
+
+        return node->dn_fake.d_ino == 0 &&
+               node->dn_fake.d_type == UX_DT_DX_NODE &&
+               node->dn_magic == UX_DX_NODE_MAGIC;
+}
+
+/*
+ * How many of the slots at the start of "buf", block "lblk" of
+ * a directory with flags "flags", may hold entries: all of them
+ * in a leaf, "." and ".." in the index root, none in a node.
+ */
+
+static inline int ux_dir_nslots(const void *buf, __u32 lblk, __u32 flags,
+                                unsigned long bsize)
+{
+        if (!(flags & UX_INDEX_FL)) {
+                return UX_DIRS_PER_BLOCK(bsize);
+        }
+        if (lblk == 0) {
+                return 2;
+        }
+        return ux_dx_is_node(buf) ? 0 : UX_DIRS_PER_BLOCK(bsize);
+}
+
+/*
+ * The hash of a directory entry name (32-bit FNV-1a).
+ */
+
+static inline __u32 ux_dx_hash(const char *name)
+{
+        __u32 hash = 2166136261U;
+        int i;
+
+        for (i = 0; i < UX_NAMELEN && name[i]; i++) {
+                hash ^= (unsigned char)name[i];
+                hash *= 16777619U;
+        }
+        return hash;
+}
+
+#ifdef __KERNEL__
+
+/*
+ * Below this many spare blocks ux_data_reserve() stops trusting
+ * the approximate per-CPU counts.
+ */
+
+#define UX_COUNTER_SLACK (4 * num_online_cpus() * percpu_counter_batch)
+
+/*
+ * Readdir positions are made from hashes of the names rather
+ * than offsets into the directory, so that an entry keeps its
+ * position while blocks split and the directory is indexed.
+ * The name's ux_dx_hash() sits above bit 31, so the positions
+ * run in the same order as the index. UX_DIR_EOF is past them
+ * all.
+ */
+
+#define UX_DIR_EOF LLONG_MAX
+#define UX_DIR_HASH_POS(hash) ((loff_t)(hash) << 31)
+#define UX_DIR_POS_HASH(pos) ((__u32)((pos) >> 31))
+
+/*
+ * An allocation group: a slice of the inode or block bitmap
+ * with its own lock, free count and allocation cursor.
+ */
+
+struct ux_group
+{
+        spinlock_t g_lock;
+        unsigned long g_start;          /* first bit */
+        unsigned long g_end;            /* one past the last bit */
+        unsigned long g_next;           /* next bit to try */
+        unsigned long g_free;           /* clear bits */
+} ____cacheline_aligned_in_smp;
+
+struct ux_groups
+{
+        struct ux_group *gs_group;
+        unsigned int gs_count;
+        unsigned long gs_size;          /* bits per group */
+};
+
+#define UX_MIN_GROUP 1024
+
+/*
+ * Per-mount statistics, shown under /sys/fs/uxfs/<dev> by
+ * ux_stats.c. They are kept per CPU so that counting costs one
+ * this_cpu_add() and are only summed when read.
+ */
+
+enum {
+        UX_STAT_LOOKUP,                 /* directory name searches */
+        UX_STAT_LOOKUP_MISS,            /* ... that found nothing */
+        UX_STAT_LOOKUP_BLOCKS,          /* dir blocks they read */
+        UX_STAT_INODE_ALLOC,            /* inode bitmap allocations */
+        UX_STAT_BLOCK_ALLOC,            /* block bitmap allocations */
+        UX_STAT_ALLOC_GROUPS,           /* groups scanned for them */
+        UX_STAT_ALLOC_FAIL,             /* allocations that failed */
+        UX_STAT_SB_DIRTY,               /* superblock dirtied */
+        UX_STAT_INODE_READ,             /* inodes read by ux_iget() */
+        UX_STAT_INODE_WRITE,            /* inodes written back */
+        UX_STAT_ACL_BLOCK_READ,         /* shared ACL blocks read */
+        UX_STAT_MAP_READ,               /* block mappings, no create */
+        UX_STAT_MAP_CREATE,             /* ... and with create */
+        UX_STAT_NR
+};
+
+/*
+ * Histograms have log2 buckets: bucket n counts values below
+ * 2^n units, the last bucket everything above. The unit is 1024
+ * ns (about a microsecond) for latencies and one block for
+ * UX_HIST_LOOKUP_BLOCKS.
+ */
+
+enum {
+        UX_HIST_LOOKUP,                 /* ux_lookup() latency */
+        UX_HIST_CREATE,                 /* create, mkdir and link */
+        UX_HIST_REMOVE,                 /* unlink and rmdir */
+        UX_HIST_LOOKUP_BLOCKS,          /* dir blocks per lookup */
+        UX_HIST_NR
+};
+
+#define UX_HIST_BUCKETS 16
+
+struct ux_stats
+{
+        u64 st_count[UX_STAT_NR];
+        u64 st_hist[UX_HIST_NR][UX_HIST_BUCKETS];
 };
 
 /*
@@ -92,18 +415,114 @@ struct ux_fs
 {
         struct ux_superblock *u_sb;
         struct buffer_head *u_sbh;
+        struct buffer_head **u_imap;    /* inode bitmap blocks */
+        struct buffer_head **u_bmap;    /* block bitmap blocks */
+        struct ux_groups u_igroups;     /* inode allocation groups */
+        struct ux_groups u_bgroups;     /* block allocation groups */
+        struct percpu_counter u_ifree;  /* free inodes */
+        struct percpu_counter u_bfree;  /* free data blocks */
+        struct percpu_counter u_dirty;  /* blocks promised to delayed
+                                           allocations */
+        spinlock_t u_dirty_lock;        /* exact u_dirty checks */
+        struct mb_cache *u_acl_cache;   /* shared ACL blocks by hash */
+        struct journal_s *u_journal;    /* or NULL if there is none */
+        struct delayed_work u_lazyinit; /* zeroes the inode table */
+        struct super_block *u_vfs_sb;   /* for u_lazyinit */
+        struct ux_stats __percpu *u_stats;
+        struct kobject *u_kobj;         /* /sys/fs/uxfs/<dev> */
 };
 
-#ifdef __KERNEL__
+static inline void ux_stat_add(struct super_block *sb, int stat, u64 n)
+{
+        struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+        this_cpu_add(fs->u_stats->st_count[stat], n);
+}
+
+static inline void ux_stat_inc(struct super_block *sb, int stat)
+{
+        ux_stat_add(sb, stat, 1);
+}
+
+extern void ux_hist_add(struct super_block *, int, u64);
+
+/*
+ * Record the time since "start", taken with ktime_get_ns().
+ */
 
-extern ino_t ux_inode_alloc(struct super_block *);
+static inline void ux_hist_time(struct super_block *sb, int hist, u64 start)
+{
+        ux_hist_add(sb, hist, ktime_get_ns() - start);
+}
+
+/*
+ * The in-core part of a uxfs inode, hung off i_private. It holds
+ * a copy of the on-disk inode plus state that is never written.
+ */
+
+struct ux_inode_info
+{
+        struct ux_inode ui_inode;       /* copy of the disk inode */
+        __u32 ui_dir_free;              /* first dir block that may
+                                           have a free slot */
+        struct rw_semaphore ui_extent_lock; /* file block map */
+        struct list_head ui_delalloc;   /* delayed allocations */
+        __u32 ui_da_blocks;             /* blocks in ui_delalloc */
+        __u32 ui_da_meta;               /* extent blocks promised to
+                                           them */
+};
+
+static inline struct ux_inode_info *UX_I(struct inode *inode)
+{
+        return (struct ux_inode_info *)inode->i_private;
+}
+
+extern ino_t ux_inode_alloc(struct super_block *, struct inode *, umode_t);
 extern __u32 ux_data_alloc(struct super_block *);
+extern __u32 ux_data_alloc_blocks(struct super_block *, __u32, __u32 *,
+                                   int);
+extern __u32 ux_data_goal(struct inode *);
+extern void ux_inode_free(struct super_block *, ino_t);
+extern void ux_data_free(struct super_block *, __u32);
+extern int ux_data_reserve(struct super_block *, __u32);
+extern void ux_data_unreserve(struct super_block *, __u32);
+extern int ux_alloc_init(struct super_block *);
+extern void ux_alloc_destroy(struct super_block *);
+extern void ux_lazyinit_start(struct super_block *);
+extern void ux_lazyinit_stop(struct super_block *);
+extern int ux_stats_register(struct super_block *);
+extern void ux_stats_unregister(struct super_block *);
+extern int ux_stats_init(void);
+extern void ux_stats_exit(void);
+
+extern int ux_extent_get(struct inode *, __u32, __u32 *, __u32 *);
+extern int ux_extent_alloc(struct inode *, __u32, __u32 *, __u32 *, int);
+extern void ux_extent_truncate(struct inode *, __u32);
+extern __u32 ux_extent_bmap(struct inode *, __u32);
+extern int ux_extent_room(struct inode *, __u32);
+extern int ux_setattr(struct dentry *, struct iattr *);
+
+extern int ux_da_lookup(struct inode *, __u32, __u32 *);
+extern int ux_da_reserve(struct inode *, __u32, __u32);
+extern void ux_da_release(struct inode *, __u32, __u32);
+extern int ux_da_alloc(struct inode *, __u32, __u32 *, __u32 *);
+
+extern const struct iomap_ops ux_iomap_ops;
 
 extern int ux_find_entry(struct inode *, char *);
+extern struct buffer_head *ux_dir_bread(struct inode *, __u32);
+extern int ux_dir_emit(struct inode *, struct dir_context *, __u32, __u32);
 extern int ux_unlink(struct inode *, struct dentry *);
 extern int ux_link(struct dentry *, struct inode *,
                    struct dentry *);
 
+extern int ux_dx_find(struct inode *, const char *, int *);
+extern int ux_dx_add(struct inode *, const char *, int, umode_t);
+extern int ux_dx_del(struct inode *, const char *);
+extern int ux_dx_convert(struct inode *);
+extern int ux_dx_readdir(struct inode *, struct dir_context *);
+
+extern int ux_inode_info_init(struct inode *);
 extern struct inode *ux_iget(struct super_block *, unsigned long);
 extern void ux_write_super(struct super_block *sb);
 
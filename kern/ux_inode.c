@@ -10,9 +10,31 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <linux/mbcache.h>
+#include <linux/percpu_counter.h>
 #include "ux_fs.h"
 #include "ux_xattr.h"
 #include "ux_acl.h"
+#include "ux_journal.h"
+
+#define CREATE_TRACE_POINTS
+#include "ux_trace.h"
+
+/*
+ * Count a lookup that read "blocks" directory blocks and found
+ * "ino", or nothing if it is 0.
+ */
+
+static void ux_count_lookup(struct super_block *sb, int blocks, int ino)
+{
+	ux_stat_inc(sb, UX_STAT_LOOKUP);
+	ux_stat_add(sb, UX_STAT_LOOKUP_BLOCKS, blocks);
+	ux_hist_add(sb, UX_HIST_LOOKUP_BLOCKS, blocks);
+	if (!ino) {
+		ux_stat_inc(sb, UX_STAT_LOOKUP_MISS);
+	}
+}
 
 /*
  * This function looks for "name" in the directory "dip".
@@ -21,26 +43,79 @@
 
 int ux_find_entry(struct inode *dip, char *name)
 {
-	struct ux_inode *uip = (struct ux_inode *)dip->i_private;
+	struct ux_inode *uip = &UX_I(dip)->ui_inode;
 	struct super_block *sb = dip->i_sb;
 	struct buffer_head *bh;
 	struct ux_dirent *dirent;
-	int i, blk;
+	int i, blk, ino;
+
+	/*
+	 * An indexed lookup reads the root, any index nodes below
+	 * it and one leaf.
+	 */
 
+	if (uip->i_flags & UX_INDEX_FL) {
+		ino = ux_dx_find(dip, name, &blk);
+		trace_uxfs_find_entry(dip, name, blk, 1, ino);
+		ux_count_lookup(sb, blk, ino);
+		return ino;
+	}
 
 	for (blk = 0; blk < uip->i_blocks; blk++) {
-		bh = sb_bread(sb, uip->i_addr[blk]);
+		bh = ux_dir_bread(dip, blk);
+		if (!bh) {
+			break;
+		}
 		dirent = (struct ux_dirent *)bh->b_data;
-		for (i = 0; i < UX_DIRS_PER_BLOCK; i++) {
+		for (i = 0; i < UX_DIRS_PER_BLOCK(sb->s_blocksize); i++) {
 			if (strcmp(dirent->d_name, name) == 0) {
+				ino = dirent->d_ino;
 				brelse(bh);
-				return dirent->d_ino;
+				trace_uxfs_find_entry(dip, name, blk + 1, 0, ino);
+				ux_count_lookup(sb, blk + 1, ino);
+				return ino;
 			}
 			dirent++;
 		}
 		brelse(bh);
 	}
 
+	trace_uxfs_find_entry(dip, name, blk, 0, 0);
+	ux_count_lookup(sb, blk, 0);
+	return 0;
+}
+
+/*
+ * Return the inode table block holding inode "ino" and the
+ * byte offset of the inode within it.
+ */
+
+static sector_t ux_inode_block(struct super_block *sb, unsigned long ino,
+			       unsigned int *offset)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	unsigned long ipb = UX_INODES_PER_BLOCK(sb->s_blocksize);
+
+	*offset = (ino % ipb) * UX_INODE_SIZE;
+	return fs->u_sb->s_itable_start + ino / ipb;
+}
+
+/*
+ * Attach the in-core part of a uxfs inode.
+ */
+
+int ux_inode_info_init(struct inode *inode)
+{
+	struct ux_inode_info *ui;
+
+	ui = kzalloc(sizeof(struct ux_inode_info), GFP_KERNEL);
+	if (!ui) {
+		return -ENOMEM;
+	}
+
+	init_rwsem(&ui->ui_extent_lock);
+	INIT_LIST_HEAD(&ui->ui_delalloc);
+	inode->i_private = ui;
 	return 0;
 }
 
@@ -54,27 +129,14 @@ struct inode *ux_iget(struct super_block *sb, unsigned long ino)
 	struct buffer_head *bh;
 	struct ux_inode *di;
 	struct inode *inode;
-	void* default_acl_in_fs;
-	void* access_acl_in_fs;
-	struct buffer_head *acl_bh;
-	
-	int block;
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	unsigned int offset;
+	sector_t block;
 
-	if (ino < UX_ROOT_INO || ino > UX_MAXFILES) {
+	if (ino < UX_ROOT_INO || ino >= fs->u_sb->s_ninodes) {
 		return ERR_PTR(-ENOENT);
 	}
 
-	/*
-	 * Note that for simplicity, there is only one
-	 * inode per block!
-	 */
-
-	block = UX_INODE_BLOCK + ino;
-	bh = sb_bread(sb, block);
-	if (!bh) {
-		return ERR_PTR(-EIO);
-	}
-
 	inode = iget_locked(sb, ino);
 	if (!inode) {
 		return ERR_PTR(-ENOMEM);
@@ -84,7 +146,16 @@ struct inode *ux_iget(struct super_block *sb, unsigned long ino)
 		return inode;
 	}
 
-	di = (struct ux_inode *)(bh->b_data);
+	block = ux_inode_block(sb, ino, &offset);
+	bh = sb_bread(sb, block);
+	trace_uxfs_iget(sb, ino, block, bh ? 0 : -EIO);
+	if (!bh) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	ux_stat_inc(sb, UX_STAT_INODE_READ);
+
+	di = (struct ux_inode *)(bh->b_data + offset);
 	inode->i_mode = di->i_mode;
 	
 	if (di->i_mode & S_IFDIR) {
@@ -102,37 +173,22 @@ struct inode *ux_iget(struct super_block *sb, unsigned long ino)
 	i_gid_write(inode, di->i_gid);
 	set_nlink(inode, di->i_nlink);
 	inode->i_size = di->i_size;
-	inode->i_blocks = di->i_blocks;
-	inode->i_blkbits = UX_BSIZE_BITS;
+	inode->i_blocks = (blkcnt_t)di->i_blocks << (sb->s_blocksize_bits - 9);
+	inode->i_blkbits = sb->s_blocksize_bits;
 	inode->i_atime.tv_sec = di->i_atime;
 	inode->i_mtime.tv_sec = di->i_mtime;
 	inode->i_ctime.tv_sec = di->i_ctime;
 	inode->i_atime.tv_nsec = 0;
 	inode->i_mtime.tv_nsec = 0;
 	inode->i_ctime.tv_nsec = 0;
-	inode->i_private = kmalloc(sizeof(struct ux_inode), GFP_KERNEL);
-
-	if (!di->i_acl_blk_addr) {
-		di->i_acl_blk_addr = ux_data_alloc(sb);
-		inode->i_default_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-		inode->i_acl = posix_acl_from_mode(inode->i_mode, GFP_KERNEL);
-	} else {
-		acl_bh = sb_bread(sb, di->i_acl_blk_addr);
-		if (!acl_bh) {
-			return ERR_PTR(-EIO);
-		}
-
-		default_acl_in_fs = kmalloc(di->i_default_acl_size, GFP_KERNEL);
-		access_acl_in_fs = kmalloc(di->i_access_acl_size, GFP_KERNEL);
-		
-		memcpy(default_acl_in_fs, acl_bh->b_data + UX_DEFAULT_ACL_OFFSET, di->i_default_acl_size);
-		memcpy(access_acl_in_fs, acl_bh->b_data + UX_ACCESS_ACL_OFFSET, di->i_access_acl_size);
-		inode->i_default_acl = posix_acl_from_xattr(inode->i_sb->s_user_ns, default_acl_in_fs, di->i_default_acl_size);
-		inode->i_acl = posix_acl_from_xattr(inode->i_sb->s_user_ns, access_acl_in_fs, di->i_access_acl_size);
-		brelse(acl_bh);
+	if (ux_inode_info_init(inode)) {
+		brelse(bh);
+		iget_failed(inode);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	memcpy(inode->i_private, di, sizeof(struct ux_inode));
+	memcpy(&UX_I(inode)->ui_inode, di, sizeof(struct ux_inode));
+	ux_acl_iget(inode);
 	brelse(bh);
 	unlock_new_inode(inode);
 	
@@ -140,30 +196,34 @@ struct inode *ux_iget(struct super_block *sb, unsigned long ino)
 }
 
 /*
- * This function is called to write a dirty inode to disk.
+ * Copy the in-core inode into its slot in the inode table.
  */
 
-int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
+static int ux_update_inode(struct inode *inode)
 {
 	unsigned long ino = inode->i_ino;
-	struct ux_inode* uip = (struct ux_inode *)inode->i_private;
+	struct ux_inode *uip = &UX_I(inode)->ui_inode;
 	struct buffer_head* bh;
-	struct buffer_head* acl_bh;
-	void* default_acl_in_fs;
-	void* access_acl_in_fs;
-	int error = 0;
+	unsigned int offset;
+	sector_t block;
+	int error;
 
 	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
 	struct ux_superblock *usb = fs->u_sb;
 
-	if (ino < UX_ROOT_INO || ino > UX_MAXFILES) {
+	if (ino < UX_ROOT_INO || ino >= usb->s_ninodes) {
 		return -EIO;
 	}
 
-	bh = sb_bread(inode->i_sb, UX_INODE_BLOCK + ino);
-	if (!bh) {
-		return ERR_PTR(-EIO);
+	block = ux_inode_block(inode->i_sb, ino, &offset);
+	bh = sb_bread(inode->i_sb, block);
+	error = bh ? ux_journal_get_write_access(bh) : -EIO;
+	trace_uxfs_write_inode(inode->i_sb, ino, block, error);
+	if (error) {
+		brelse(bh);
+		return error;
 	}
+	ux_stat_inc(inode->i_sb, UX_STAT_INODE_WRITE);
 
 	uip->i_mode = inode->i_mode;
 	uip->i_nlink = inode->i_nlink;
@@ -173,46 +233,52 @@ int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
 	uip->i_uid = __kuid_val(inode->i_uid);
 	uip->i_gid = __kgid_val(inode->i_gid);
 	uip->i_size = inode->i_size;
-	uip->i_blocks = inode->i_blocks;
 
-	if (inode->i_acl || inode->i_default_acl) {
-		acl_bh = sb_bread(inode->i_sb, uip->i_acl_blk_addr);
-		
-		if (!acl_bh) {
-			return ERR_PTR(-EIO);
-		}
+	memcpy(bh->b_data + offset, uip, sizeof(struct ux_inode));
+	ux_journal_dirty(bh);
+	brelse(bh);
 
-		if (inode->i_default_acl) {
-			error = posix_acl_valid(inode->i_sb->s_user_ns, inode->i_default_acl);
-			if (error) {
-				return error;
-			}			
+	return 0;
+}
 
-			default_acl_in_fs = kmalloc(UX_BSIZE/2, GFP_KERNEL);
-			uip->i_default_acl_size  = posix_acl_to_xattr(inode->i_sb->s_user_ns, inode->i_default_acl, default_acl_in_fs, UX_BSIZE/2);
-			memcpy(acl_bh->b_data + UX_DEFAULT_ACL_OFFSET, default_acl_in_fs, uip->i_default_acl_size);
-		}
+/*
+ * With a journal, inodes are logged as soon as they are dirtied
+ * so that they commit along with the rest of the operation.
+ */
 
-		error = 0;
-		if (inode->i_acl) {
-			error = posix_acl_valid(inode->i_sb->s_user_ns, inode->i_acl);
-			if (error) {
-				return error;
-			}
+static void ux_dirty_inode(struct inode *inode, int flags)
+{
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
+	handle_t *handle;
 
-			access_acl_in_fs = kmalloc(UX_BSIZE/2, GFP_KERNEL);
-			uip->i_access_acl_size = posix_acl_to_xattr(inode->i_sb->s_user_ns, inode->i_acl, access_acl_in_fs, UX_BSIZE/2);
-			memcpy(acl_bh->b_data + UX_ACCESS_ACL_OFFSET, access_acl_in_fs, uip->i_access_acl_size);
-		}
+	if (!fs->u_journal || flags == I_DIRTY_TIME || !UX_I(inode)) {
+		return;
+	}
 
-		mark_buffer_dirty(acl_bh);
-		brelse(acl_bh);
+	handle = ux_journal_start(inode->i_sb, UX_INODE_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		return;
 	}
+	ux_update_inode(inode);
+	ux_journal_stop(handle);
+}
 
-	memcpy(bh->b_data, uip, sizeof(struct ux_inode));
-	mark_buffer_dirty(bh);
-	brelse(bh);
+/*
+ * This function is called to write a dirty inode to disk. With
+ * a journal the inode has been logged already and a sync only
+ * has to wait for the commit.
+ */
+
+int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct ux_fs *fs = (struct ux_fs *)inode->i_sb->s_fs_info;
 
+	if (!fs->u_journal) {
+		return ux_update_inode(inode);
+	}
+	if (wbc->sync_mode == WB_SYNC_ALL && !(current->flags & PF_MEMALLOC)) {
+		return ux_journal_commit(inode->i_sb, 1);
+	}
 	return 0;
 }
 
@@ -223,31 +289,167 @@ int ux_write_inode(struct inode *inode, struct writeback_control *wbc)
 void ux_evict_inode(struct inode *inode)
 {
 	unsigned long inum = inode->i_ino;
-	struct ux_inode *uip = (struct ux_inode *)inode->i_private;
 	struct super_block *sb = inode->i_sb;
-	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
-	struct ux_superblock *usb = fs->u_sb;
-	int i;
+	struct ux_inode *uip;
+	handle_t *handle;
+
+	truncate_inode_pages_final(&inode->i_data);
+
+	/*
+	 * An inode whose ux_iget() failed has no in-core part and
+	 * its link count was never read, so there is nothing on
+	 * disk to give back.
+	 */
+
+	if (!UX_I(inode)) {
+		invalidate_inode_buffers(inode);
+		clear_inode(inode);
+		return;
+	}
+	uip = &UX_I(inode)->ui_inode;
+	ux_da_release(inode, 0, U32_MAX);
 
 	if (!inode->i_nlink) {
-		usb->s_nbfree += uip->i_blocks;
-		for (i = 0; i < uip->i_blocks; i++) {
-			usb->s_block[uip->i_addr[i]] = UX_BLOCK_FREE;
-			uip->i_addr[i] = UX_BLOCK_FREE;
+		handle = ux_journal_start(sb, ux_truncate_credits(inode) +
+					  UX_NS_CREDITS,
+					  ux_truncate_revokes(inode) + 1);
+		if (IS_ERR(handle)) {
+			/*
+			 * Freeing without a handle would write journaled
+			 * blocks behind the journal's back. Leave the
+			 * inode allocated with no links for fsck to
+			 * reclaim.
+			 */
+
+			printk(KERN_WARNING "uxfs: cannot free inode %lu "
+			       "(%ld)\n", inum, PTR_ERR(handle));
+			goto out;
+		}
+		down_write(&UX_I(inode)->ui_extent_lock);
+		ux_extent_truncate(inode, 0);
+		up_write(&UX_I(inode)->ui_extent_lock);
+		ux_journal_ensure(UX_NS_CREDITS, 1, NULL);
+		if (uip->i_acl_blk) {
+			ux_acl_release(sb, uip->i_acl_blk);
+			uip->i_acl_blk = 0;
 		}
-		usb->s_inode[inum] = UX_INODE_FREE;
-		usb->s_nifree++;
-		ux_write_super(sb);
+		ux_inode_free(sb, inum);
+		ux_journal_stop(handle);
 	}
 
+out:
 	kfree(inode->i_private);
 	inode->i_private = NULL;
 
-	truncate_inode_pages_final(&inode->i_data);
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 }
 
+/*
+ * Read the "count" blocks of an allocation bitmap starting at
+ * "start". The buffers stay pinned for the life of the mount.
+ */
+
+static struct buffer_head **ux_get_bitmap(struct super_block *sb,
+					  __u32 start, __u32 count)
+{
+	struct buffer_head **map;
+	__u32 i;
+
+	map = kvcalloc(count, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!map) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		map[i] = sb_bread(sb, start + i);
+		if (!map[i]) {
+			while (i--) {
+				brelse(map[i]);
+			}
+			kvfree(map);
+			return NULL;
+		}
+	}
+
+	return map;
+}
+
+static void ux_put_bitmap(struct buffer_head **map, __u32 count)
+{
+	__u32 i;
+
+	if (!map) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		brelse(map[i]);
+	}
+	kvfree(map);
+}
+
+/*
+ * Sanity check the geometry recorded by mkfs against itself
+ * and against the size of the device.
+ */
+
+static int ux_check_geometry(struct super_block *sb,
+			     struct ux_superblock *usb)
+{
+	u64 devblocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	unsigned long bpb = UX_BITS_PER_BLOCK(sb->s_blocksize);
+
+	if (usb->s_inode_size != UX_INODE_SIZE) {
+		return 0;
+	}
+	if (usb->s_ninodes <= UX_FIRST_INO || usb->s_nblocks < 2) {
+		return 0;
+	}
+	if ((u64)usb->s_imap_blocks * bpb < usb->s_ninodes ||
+	    (u64)usb->s_bmap_blocks * bpb < usb->s_nblocks ||
+	    (u64)usb->s_itable_blocks * UX_INODES_PER_BLOCK(sb->s_blocksize) <
+	    usb->s_ninodes) {
+		return 0;
+	}
+	if (usb->s_imap_start < 1 ||
+	    usb->s_bmap_start < usb->s_imap_start + usb->s_imap_blocks ||
+	    usb->s_itable_start < usb->s_bmap_start + usb->s_bmap_blocks ||
+	    usb->s_data_start < usb->s_itable_start + usb->s_itable_blocks) {
+		return 0;
+	}
+	if (usb->s_journal_blocks &&
+	    (usb->s_journal_start < usb->s_itable_start + usb->s_itable_blocks ||
+	     usb->s_data_start < (u64)usb->s_journal_start +
+				 usb->s_journal_blocks)) {
+		return 0;
+	}
+	if ((u64)usb->s_data_start + usb->s_nblocks > devblocks) {
+		return 0;
+	}
+	if (usb->s_itable_lazy >= usb->s_itable_blocks) {
+		return 0;
+	}
+	if (usb->s_nifree > usb->s_ninodes || usb->s_nbfree > usb->s_nblocks) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ux_sync_fs(struct super_block *sb, int wait)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	ux_write_super(sb);
+	if (fs->u_journal) {
+		return ux_journal_commit(sb, wait);
+	}
+	if (wait) {
+		return sync_dirty_buffer(fs->u_sbh);
+	}
+	return 0;
+}
+
 /*
  * This function is called when the filesystem is being
  * unmounted. We free the ux_fs structure allocated during
@@ -259,6 +461,16 @@ void ux_put_super(struct super_block *sb)
 	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
 	struct buffer_head *bh = fs->u_sbh;
 
+	ux_lazyinit_stop(sb);
+	fs->u_sb->s_mod = UX_FSCLEAN;
+	ux_sync_fs(sb, 1);
+	ux_journal_destroy(sb);
+	ux_alloc_destroy(sb);
+	ux_put_bitmap(fs->u_imap, fs->u_sb->s_imap_blocks);
+	ux_put_bitmap(fs->u_bmap, fs->u_sb->s_bmap_blocks);
+	mb_cache_destroy(fs->u_acl_cache);
+	ux_stats_unregister(sb);
+
 	/*
 	 * Free the ux_fs structure allocated by ux_read_super
 	 */
@@ -268,7 +480,9 @@ void ux_put_super(struct super_block *sb)
 }
 
 /*
- * This function will be called by the df command.
+ * This function will be called by the df command. The free
+ * counts are the approximate per-CPU ones, so df never has to
+ * visit every CPU.
  */
 
 int ux_statfs(struct dentry *dentry, struct kstatfs *buf)
@@ -279,12 +493,14 @@ int ux_statfs(struct dentry *dentry, struct kstatfs *buf)
 	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
 
 	buf->f_type = UX_MAGIC;
-	buf->f_bsize = UX_BSIZE;
-	buf->f_blocks = UX_MAXBLOCKS;
-	buf->f_bfree = usb->s_nbfree;
-	buf->f_bavail = usb->s_nbfree;
-	buf->f_files = UX_MAXFILES;
-	buf->f_ffree = usb->s_nifree;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = usb->s_nblocks;
+	buf->f_bfree = max_t(s64, 0,
+			     percpu_counter_read_positive(&fs->u_bfree) -
+			     percpu_counter_read_positive(&fs->u_dirty));
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = usb->s_ninodes;
+	buf->f_ffree = percpu_counter_read_positive(&fs->u_ifree);
 	buf->f_fsid.val[0] = (u32)id;
 	buf->f_fsid.val[1] = (u32)(id >> 32);
 	buf->f_namelen = UX_NAMELEN;
@@ -292,25 +508,68 @@ int ux_statfs(struct dentry *dentry, struct kstatfs *buf)
 }
 
 /*
- * This function is called to write the superblock to disk. We
- * simply mark it dirty and then set the s_dirt field of the
- * in-core superblock to 0 to prevent further unnecessary calls.
+ * Copy the free counts into the superblock and mark it dirty.
+ * Allocation only touches the per-CPU counters, so this is the
+ * one place the superblock buffer is written, from sync_fs,
+ * freeze and unmount.
  */
 
 void ux_write_super(struct super_block *sb)
 {
 	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
 	struct buffer_head *bh = fs->u_sbh;
+	handle_t *handle;
 
-	if (!(sb->s_flags & SB_RDONLY)) {
-		mark_buffer_dirty(bh);
+	if (sb_rdonly(sb)) {
+		return;
+	}
+
+	handle = ux_journal_start(sb, 1, 0);
+	if (IS_ERR(handle)) {
+		return;
+	}
+	if (!ux_journal_get_write_access(bh)) {
+		lock_buffer(bh);
+		usb->s_nifree = percpu_counter_sum_positive(&fs->u_ifree);
+		usb->s_nbfree = percpu_counter_sum_positive(&fs->u_bfree);
+		unlock_buffer(bh);
+		ux_journal_dirty(bh);
+		ux_stat_inc(sb, UX_STAT_SB_DIRTY);
 	}
+	ux_journal_stop(handle);
+}
+
+/*
+ * Freezing also stops new transactions and empties the
+ * journal, so a snapshot of the device needs no recovery.
+ */
+
+static int ux_freeze_fs(struct super_block *sb)
+{
+	int error;
+
+	error = ux_sync_fs(sb, 1);
+	if (error) {
+		return error;
+	}
+	return ux_journal_lock(sb);
+}
+
+static int ux_unfreeze_fs(struct super_block *sb)
+{
+	ux_journal_unlock(sb);
+	return 0;
 }
 
 static const struct super_operations ux_sops = {
+	.dirty_inode	= ux_dirty_inode,
 	.write_inode	= ux_write_inode,
 	.evict_inode	= ux_evict_inode,
 	.put_super	= ux_put_super,
+	.sync_fs	= ux_sync_fs,
+	.freeze_fs	= ux_freeze_fs,
+	.unfreeze_fs	= ux_unfreeze_fs,
 	.statfs		= ux_statfs,
 };
 
@@ -320,9 +579,17 @@ static int ux_read_super(struct super_block *sb, void *data, int silent)
 	struct ux_superblock *usb = NULL;
 	struct ux_fs *fs = NULL;
 	struct inode *inode = NULL;
+	unsigned int bsize;
+	int alloc = 0;
 	int ret = -EINVAL;
 
-	if (!sb_set_blocksize(sb, UX_BSIZE)) {
+	/*
+	 * The superblock lives at the start of the device, so
+	 * read it with the smallest block size and then switch
+	 * to the one recorded by mkfs.
+	 */
+
+	if (!sb_set_blocksize(sb, UX_MIN_BSIZE)) {
 		goto out;
 	}
 
@@ -334,7 +601,41 @@ static int ux_read_super(struct super_block *sb, void *data, int silent)
 	if (usb->s_magic != UX_MAGIC) {
 		goto out;
 	}
+
+	bsize = usb->s_bsize;
+	if (bsize < UX_MIN_BSIZE || bsize > UX_MAX_BSIZE ||
+	    !is_power_of_2(bsize)) {
+		goto out;
+	}
+	if (bsize != sb->s_blocksize) {
+		brelse(bh);
+		bh = NULL;
+		if (!sb_set_blocksize(sb, bsize)) {
+			if (!silent) {
+				printk(KERN_ERR "uxfs: unsupported block "
+				       "size %u\n", bsize);
+			}
+			goto out;
+		}
+		bh = sb_bread(sb, 0);
+		if (!bh)
+			goto out;
+		usb = (struct ux_superblock *)bh->b_data;
+		if (usb->s_magic != UX_MAGIC) {
+			goto out;
+		}
+	}
 	if (usb->s_mod == UX_FSDIRTY) {
+		if (!silent) {
+			printk(KERN_ERR "uxfs: filesystem was not cleanly "
+			       "unmounted, run fsck.uxfs\n");
+		}
+		goto out;
+	}
+	if (!ux_check_geometry(sb, usb)) {
+		if (!silent) {
+			printk(KERN_ERR "uxfs: bad filesystem geometry\n");
+		}
 		goto out;
 	}
 
@@ -343,7 +644,7 @@ static int ux_read_super(struct super_block *sb, void *data, int silent)
 	 *  be dirty and write it back to disk.
 	 */
 
-	fs = kmalloc(sizeof(struct ux_fs), GFP_KERNEL);
+	fs = kzalloc(sizeof(struct ux_fs), GFP_KERNEL);
 	if (!fs) {
 		ret = -ENOMEM;
 		goto out;
@@ -352,7 +653,50 @@ static int ux_read_super(struct super_block *sb, void *data, int silent)
 	fs->u_sbh = bh;
 	sb->s_fs_info = fs;
 
+	ret = ux_stats_register(sb);
+	if (ret) {
+		goto out;
+	}
+
+	/*
+	 * Replay the journal before anything else is read, so
+	 * the bitmaps and inodes are those of the last commit.
+	 */
+
+	ret = ux_journal_load(sb);
+	if (ret) {
+		goto out;
+	}
+
+	/*
+	 * The allocation bitmaps stay pinned for the life
+	 * of the mount.
+	 */
+
+	ret = -EIO;
+	fs->u_imap = ux_get_bitmap(sb, usb->s_imap_start, usb->s_imap_blocks);
+	if (!fs->u_imap) {
+		goto out;
+	}
+	fs->u_bmap = ux_get_bitmap(sb, usb->s_bmap_start, usb->s_bmap_blocks);
+	if (!fs->u_bmap) {
+		goto out;
+	}
+
+	ret = ux_alloc_init(sb);
+	if (ret) {
+		goto out;
+	}
+	alloc = 1;
+
+	ret = -ENOMEM;
+	fs->u_acl_cache = mb_cache_create(UX_ACL_CACHE_BITS);
+	if (!fs->u_acl_cache) {
+		goto out;
+	}
+
 	sb->s_magic = UX_MAGIC;
+	sb->s_maxbytes = U32_MAX;
 	sb->s_op = &ux_sops;
 	sb->s_xattr = ux_xattr_handlers;
 	sb->s_flags = (sb->s_flags & ~SB_POSIXACL) | SB_POSIXACL;
@@ -370,12 +714,38 @@ static int ux_read_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	/*
+	 * Without a journal a crash can leave the filesystem
+	 * inconsistent, so it is marked dirty until it is
+	 * unmounted and must be checked by fsck.uxfs otherwise.
+	 */
+
+	if (!fs->u_journal && !sb_rdonly(sb)) {
+		usb->s_mod = UX_FSDIRTY;
+	}
 	ux_write_super(sb);
+	if (!fs->u_journal && !sb_rdonly(sb)) {
+		sync_dirty_buffer(bh);
+	}
+	ux_lazyinit_start(sb);
 	
 	return 0;
 
 out:
+	if (fs) {
+		ux_journal_destroy(sb);
+		if (alloc) {
+			ux_alloc_destroy(sb);
+		}
+		ux_put_bitmap(fs->u_imap, usb->s_imap_blocks);
+		ux_put_bitmap(fs->u_bmap, usb->s_bmap_blocks);
+		if (fs->u_acl_cache) {
+			mb_cache_destroy(fs->u_acl_cache);
+		}
+		ux_stats_unregister(sb);
+	}
 	kfree(fs);
+	sb->s_fs_info = NULL;
 	brelse(bh);
 
 	return ret;
@@ -397,12 +767,24 @@ static struct file_system_type ux_fs_type = {
 
 static int __init init_uxfs(void)
 {
-	return register_filesystem(&ux_fs_type);
+	int error;
+
+	BUILD_BUG_ON(sizeof(struct ux_inode) != UX_INODE_SIZE);
+	error = ux_stats_init();
+	if (error) {
+		return error;
+	}
+	error = register_filesystem(&ux_fs_type);
+	if (error) {
+		ux_stats_exit();
+	}
+	return error;
 }
 
 static void __exit exit_uxfs(void)
 {
 	unregister_filesystem(&ux_fs_type);
+	ux_stats_exit();
 }
 
 MODULE_LICENSE("GPL");
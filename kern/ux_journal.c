@@ -0,0 +1,269 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- ux_journal.c ----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/sched.h>
+#include "ux_fs.h"
+#include "ux_journal.h"
+
+/*
+ * Metadata journaling. mkfs sets aside s_journal_blocks blocks
+ * at s_journal_start for a jbd2 journal. Every change to the
+ * superblock, the bitmaps, the inode table, directory, extent
+ * and ACL blocks is made inside a jbd2 handle, and jbd2 batches
+ * the handles of many operations into one commit. At mount any
+ * committed transactions are replayed, which takes time in
+ * proportion to the journal, not the filesystem.
+ *
+ * File data is not journaled. A crash may leave recently
+ * allocated blocks holding whatever they held before.
+ *
+ * Handles are started only at the top of each operation and
+ * found again through journal_current_handle(), so the code
+ * that changes a buffer does not need to be passed one. On a
+ * filesystem without a journal every helper here falls back to
+ * plain buffer writeback.
+ */
+
+int ux_journal_load(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_superblock *usb = fs->u_sb;
+	journal_t *journal;
+	int error;
+
+	if (!usb->s_journal_blocks) {
+		return 0;
+	}
+
+	journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev,
+					usb->s_journal_start,
+					usb->s_journal_blocks,
+					sb->s_blocksize);
+	if (!journal) {
+		return -ENOMEM;
+	}
+	journal->j_private = sb;
+
+	error = jbd2_journal_load(journal);
+	if (error) {
+		printk(KERN_ERR "uxfs: cannot load journal (%d)\n", error);
+		jbd2_journal_destroy(journal);
+		return error;
+	}
+
+	fs->u_journal = journal;
+	return 0;
+}
+
+void ux_journal_destroy(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	if (fs->u_journal) {
+		jbd2_journal_destroy(fs->u_journal);
+		fs->u_journal = NULL;
+	}
+}
+
+/*
+ * Commit the running transaction, waiting for it to reach the
+ * disk if "wait" is set.
+ */
+
+int ux_journal_commit(struct super_block *sb, int wait)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	tid_t target;
+
+	if (!fs->u_journal) {
+		return 0;
+	}
+	if (jbd2_journal_start_commit(fs->u_journal, &target) && wait) {
+		return jbd2_log_wait_commit(fs->u_journal, target);
+	}
+	return 0;
+}
+
+/*
+ * Hold off new handles and flush the journal, for freezing.
+ */
+
+int ux_journal_lock(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	int error;
+
+	if (!fs->u_journal) {
+		return 0;
+	}
+	jbd2_journal_lock_updates(fs->u_journal);
+	error = jbd2_journal_flush(fs->u_journal);
+	if (error) {
+		jbd2_journal_unlock_updates(fs->u_journal);
+	}
+	return error;
+}
+
+void ux_journal_unlock(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	if (fs->u_journal) {
+		jbd2_journal_unlock_updates(fs->u_journal);
+	}
+}
+
+/*
+ * Start a handle with room for "nblocks" metadata blocks and
+ * "nrevoke" freed metadata blocks. Inside another handle this
+ * just takes another reference to it. Returns NULL if there is
+ * no journal.
+ */
+
+handle_t *ux_journal_start(struct super_block *sb, int nblocks, int nrevoke)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	journal_t *journal = fs->u_journal;
+
+	if (!journal) {
+		return NULL;
+	}
+
+	nblocks = min(nblocks, journal->j_max_transaction_buffers);
+	return jbd2__journal_start(journal, nblocks, 0, nrevoke, GFP_NOFS,
+				   0, 0);
+}
+
+int ux_journal_stop(handle_t *handle)
+{
+	if (!handle) {
+		return 0;
+	}
+	return jbd2_journal_stop(handle);
+}
+
+/*
+ * Make sure the current handle has room for "nblocks" more
+ * blocks and "nrevoke" more revokes, extending it or, failing
+ * that, committing what has been done so far and carrying on
+ * in a new transaction. Only for callers that are between
+ * self-contained steps.
+ *
+ * Handles are always started before ui_extent_lock is taken. A
+ * restart waits for the commit, which may in turn wait for a
+ * handle whose owner wants the lock, so a caller holding it
+ * passes it as "sem" and it is dropped for the restart. The
+ * return is then 1, and the caller must look again at anything
+ * the lock protects.
+ */
+
+int ux_journal_ensure(int nblocks, int nrevoke, struct rw_semaphore *sem)
+{
+	handle_t *handle = journal_current_handle();
+	journal_t *journal;
+	int error;
+
+	if (!handle || (jbd2_handle_buffer_credits(handle) >= nblocks &&
+			handle->h_revoke_credits >= nrevoke)) {
+		return 0;
+	}
+	journal = handle->h_transaction->t_journal;
+	nblocks = min(nblocks, journal->j_max_transaction_buffers);
+	if (!jbd2_journal_extend(handle, nblocks, nrevoke)) {
+		return 0;
+	}
+	if (!sem) {
+		return jbd2__journal_restart(handle, nblocks, nrevoke,
+					     GFP_NOFS);
+	}
+
+	up_write(sem);
+	error = jbd2__journal_restart(handle, nblocks, nrevoke, GFP_NOFS);
+	down_write(sem);
+	return error ? error : 1;
+}
+
+/*
+ * Call before changing a metadata buffer.
+ */
+
+int ux_journal_get_write_access(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle) {
+		return 0;
+	}
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/*
+ * Call once a metadata buffer has been changed, in place of
+ * mark_buffer_dirty().
+ */
+
+void ux_journal_dirty(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+	int error;
+
+	if (!handle) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+
+	error = jbd2_journal_dirty_metadata(handle, bh);
+	if (error) {
+		printk(KERN_ERR "uxfs: cannot journal block %llu (%d)\n",
+		       (unsigned long long)bh->b_blocknr, error);
+	}
+}
+
+/*
+ * A metadata block is being freed. Its buffer, if the caller
+ * has one, is dropped as bforget() would, and the journal is
+ * told not to replay older copies of the block over whatever
+ * it is reused for.
+ */
+
+void ux_journal_forget(struct super_block *sb, struct buffer_head *bh,
+		       __u32 blk)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle) {
+		bforget(bh);
+		return;
+	}
+	jbd2_journal_revoke(handle, blk, bh);
+}
+
+/*
+ * Credits to start a truncate of "inode" with. ux_extent_truncate()
+ * asks for more before each extent it frees, so this only needs
+ * to cover the first one.
+ */
+
+int ux_truncate_credits(struct inode *inode)
+{
+	return UX_TRUNCATE_CREDITS;
+}
+
+/*
+ * Revokes to start a truncate of "inode" with: the extent
+ * blocks on one path and, for a directory, the blocks of the
+ * extent freed first, which are at most all it holds.
+ */
+
+int ux_truncate_revokes(struct inode *inode)
+{
+	int nrevoke = UX_EXTENT_MAX_DEPTH + 1;
+
+	if (S_ISDIR(inode->i_mode)) {
+		nrevoke += UX_I(inode)->ui_inode.i_blocks;
+	}
+	return nrevoke;
+}
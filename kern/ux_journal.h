@@ -0,0 +1,37 @@
+#include <linux/jbd2.h>
+
+/*
+ * Journal credits, in blocks, reserved by each kind of
+ * transaction. UX_ALLOC_CREDITS covers allocating one extent:
+ * two bitmap blocks and the inode, and at each level of the
+ * extent tree the block on the path plus, should it split, a
+ * new block and its bitmap block. UX_TRUNCATE_CREDITS covers
+ * one step of a truncate, which frees one extent and the extent
+ * blocks it leaves empty; the caller adds a bitmap block for
+ * every UX_BITS_PER_BLOCK blocks freed. UX_NS_CREDITS covers
+ * any directory operation, including indexing the directory or
+ * splitting a leaf and every level of its index above it, each
+ * of which allocates a block, and writing an ACL block for a
+ * new inode.
+ */
+
+#define UX_ALLOC_CREDITS	(3 + 3 * (UX_EXTENT_MAX_DEPTH + 1))
+#define UX_TRUNCATE_CREDITS	(3 + 2 * (UX_EXTENT_MAX_DEPTH + 1))
+#define UX_NS_CREDITS		(4 * UX_DIR_LINEAR_MAX + 20 + \
+				 (UX_DX_MAX_LEVELS + 2) * (UX_ALLOC_CREDITS + 2))
+#define UX_INODE_CREDITS	1
+
+extern int ux_journal_load(struct super_block *);
+extern void ux_journal_destroy(struct super_block *);
+extern int ux_journal_commit(struct super_block *, int);
+extern handle_t *ux_journal_start(struct super_block *, int, int);
+extern int ux_journal_stop(handle_t *);
+extern int ux_journal_ensure(int, int, struct rw_semaphore *);
+extern int ux_journal_get_write_access(struct buffer_head *);
+extern void ux_journal_dirty(struct buffer_head *);
+extern void ux_journal_forget(struct super_block *, struct buffer_head *,
+			      __u32);
+extern int ux_journal_lock(struct super_block *);
+extern void ux_journal_unlock(struct super_block *);
+extern int ux_truncate_credits(struct inode *);
+extern int ux_truncate_revokes(struct inode *);
@@ -0,0 +1,217 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- ux_stats.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include "ux_fs.h"
+
+/*
+ * Every mount gets a directory /sys/fs/uxfs/<dev>, named after
+ * the block device, with one read-only file per counter and
+ * per histogram. A counter file holds a single number; a
+ * histogram file holds UX_HIST_BUCKETS numbers on one line,
+ * lowest bucket first. All of them count from the mount and
+ * are summed over the CPUs as they are read, so two files read
+ * one after the other need not agree exactly.
+ */
+
+static struct kset *ux_kset;
+
+struct ux_kobj
+{
+	struct kobject uk_kobj;
+	struct ux_fs *uk_fs;
+};
+
+struct ux_attr
+{
+	struct attribute attr;
+	int hist;		/* st_hist rather than st_count */
+	int index;
+};
+
+#define UX_STAT_ATTR(_name, _index)					\
+static struct ux_attr ux_attr_##_name = {				\
+	.attr	= { .name = __stringify(_name), .mode = 0444 },		\
+	.hist	= 0,							\
+	.index	= _index,						\
+}
+
+#define UX_HIST_ATTR(_name, _index)					\
+static struct ux_attr ux_attr_##_name = {				\
+	.attr	= { .name = __stringify(_name), .mode = 0444 },		\
+	.hist	= 1,							\
+	.index	= _index,						\
+}
+
+UX_STAT_ATTR(lookups, UX_STAT_LOOKUP);
+UX_STAT_ATTR(lookup_misses, UX_STAT_LOOKUP_MISS);
+UX_STAT_ATTR(lookup_blocks, UX_STAT_LOOKUP_BLOCKS);
+UX_STAT_ATTR(inode_allocs, UX_STAT_INODE_ALLOC);
+UX_STAT_ATTR(block_allocs, UX_STAT_BLOCK_ALLOC);
+UX_STAT_ATTR(alloc_groups, UX_STAT_ALLOC_GROUPS);
+UX_STAT_ATTR(alloc_failures, UX_STAT_ALLOC_FAIL);
+UX_STAT_ATTR(sb_dirties, UX_STAT_SB_DIRTY);
+UX_STAT_ATTR(inode_reads, UX_STAT_INODE_READ);
+UX_STAT_ATTR(inode_writes, UX_STAT_INODE_WRITE);
+UX_STAT_ATTR(acl_block_reads, UX_STAT_ACL_BLOCK_READ);
+UX_STAT_ATTR(map_reads, UX_STAT_MAP_READ);
+UX_STAT_ATTR(map_creates, UX_STAT_MAP_CREATE);
+UX_HIST_ATTR(lookup_us_hist, UX_HIST_LOOKUP);
+UX_HIST_ATTR(create_us_hist, UX_HIST_CREATE);
+UX_HIST_ATTR(remove_us_hist, UX_HIST_REMOVE);
+UX_HIST_ATTR(lookup_blocks_hist, UX_HIST_LOOKUP_BLOCKS);
+
+static struct attribute *ux_stats_attrs[] = {
+	&ux_attr_lookups.attr,
+	&ux_attr_lookup_misses.attr,
+	&ux_attr_lookup_blocks.attr,
+	&ux_attr_inode_allocs.attr,
+	&ux_attr_block_allocs.attr,
+	&ux_attr_alloc_groups.attr,
+	&ux_attr_alloc_failures.attr,
+	&ux_attr_sb_dirties.attr,
+	&ux_attr_inode_reads.attr,
+	&ux_attr_inode_writes.attr,
+	&ux_attr_acl_block_reads.attr,
+	&ux_attr_map_reads.attr,
+	&ux_attr_map_creates.attr,
+	&ux_attr_lookup_us_hist.attr,
+	&ux_attr_create_us_hist.attr,
+	&ux_attr_remove_us_hist.attr,
+	&ux_attr_lookup_blocks_hist.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ux_stats);
+
+/*
+ * Latencies are kept in units of 1024 ns, lookup block counts
+ * in blocks.
+ */
+
+static const int ux_hist_shift[UX_HIST_NR] = {
+	[UX_HIST_LOOKUP]	= 10,
+	[UX_HIST_CREATE]	= 10,
+	[UX_HIST_REMOVE]	= 10,
+	[UX_HIST_LOOKUP_BLOCKS]	= 0,
+};
+
+void ux_hist_add(struct super_block *sb, int hist, u64 value)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	int bucket;
+
+	bucket = min(fls64(value >> ux_hist_shift[hist]), UX_HIST_BUCKETS - 1);
+	this_cpu_inc(fs->u_stats->st_hist[hist][bucket]);
+}
+
+static ssize_t ux_stats_show(struct kobject *kobj, struct attribute *attr,
+			     char *buf)
+{
+	struct ux_fs *fs = container_of(kobj, struct ux_kobj, uk_kobj)->uk_fs;
+	struct ux_attr *ua = container_of(attr, struct ux_attr, attr);
+	struct ux_stats *st;
+	ssize_t len = 0;
+	u64 sum;
+	int cpu, i;
+
+	if (!ua->hist) {
+		sum = 0;
+		for_each_possible_cpu(cpu) {
+			st = per_cpu_ptr(fs->u_stats, cpu);
+			sum += st->st_count[ua->index];
+		}
+		return sysfs_emit(buf, "%llu\n", sum);
+	}
+	for (i = 0; i < UX_HIST_BUCKETS; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu) {
+			st = per_cpu_ptr(fs->u_stats, cpu);
+			sum += st->st_hist[ua->index][i];
+		}
+		len += sysfs_emit_at(buf, len, "%llu%c", sum,
+				     i == UX_HIST_BUCKETS - 1 ? '\n' : ' ');
+	}
+	return len;
+}
+
+static const struct sysfs_ops ux_stats_ops = {
+	.show	= ux_stats_show,
+};
+
+static void ux_stats_release(struct kobject *kobj)
+{
+	kfree(container_of(kobj, struct ux_kobj, uk_kobj));
+}
+
+static struct kobj_type ux_stats_ktype = {
+	.default_groups	= ux_stats_groups,
+	.sysfs_ops	= &ux_stats_ops,
+	.release	= ux_stats_release,
+};
+
+/*
+ * Called early in ux_read_super(), before anything that counts.
+ * The counters live in the ux_fs; the kobject only points at
+ * them, and kobject_del() waits for readers to finish, so they
+ * can be freed at unmount even if someone still holds the
+ * kobject.
+ */
+
+int ux_stats_register(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+	struct ux_kobj *uk;
+	int error;
+
+	fs->u_stats = alloc_percpu(struct ux_stats);
+	if (!fs->u_stats) {
+		return -ENOMEM;
+	}
+	uk = kzalloc(sizeof(struct ux_kobj), GFP_KERNEL);
+	if (!uk) {
+		free_percpu(fs->u_stats);
+		fs->u_stats = NULL;
+		return -ENOMEM;
+	}
+	uk->uk_fs = fs;
+	uk->uk_kobj.kset = ux_kset;
+	error = kobject_init_and_add(&uk->uk_kobj, &ux_stats_ktype, NULL,
+				     "%s", sb->s_id);
+	if (error) {
+		kobject_put(&uk->uk_kobj);
+		free_percpu(fs->u_stats);
+		fs->u_stats = NULL;
+		return error;
+	}
+	fs->u_kobj = &uk->uk_kobj;
+	return 0;
+}
+
+void ux_stats_unregister(struct super_block *sb)
+{
+	struct ux_fs *fs = (struct ux_fs *)sb->s_fs_info;
+
+	if (fs->u_kobj) {
+		kobject_del(fs->u_kobj);
+		kobject_put(fs->u_kobj);
+		fs->u_kobj = NULL;
+	}
+	free_percpu(fs->u_stats);
+	fs->u_stats = NULL;
+}
+
+int ux_stats_init(void)
+{
+	ux_kset = kset_create_and_add("uxfs", NULL, fs_kobj);
+	return ux_kset ? 0 : -ENOMEM;
+}
+
+void ux_stats_exit(void)
+{
+	kset_unregister(ux_kset);
+}
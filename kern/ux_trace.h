@@ -0,0 +1,269 @@
+/*
+ * Tracepoints on the uxfs hot paths, in the style of
+ * include/trace/events. They show up under events/uxfs in
+ * tracefs and can be used from perf and bpftrace as
+ * uxfs:<event>. ux_inode.c defines CREATE_TRACE_POINTS and so
+ * instantiates them; every other file only includes this.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uxfs
+
+#if !defined(_UX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * A name lookup in a directory: how many directory blocks were
+ * read, whether the index was used, and the inode found, or 0
+ * on a miss.
+ */
+
+TRACE_EVENT(uxfs_find_entry,
+	TP_PROTO(struct inode *dip, const char *name, int blocks,
+		 int indexed, int ino),
+
+	TP_ARGS(dip, name, blocks, indexed, ino),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__string(name, name)
+		__field(int, blocks)
+		__field(int, indexed)
+		__field(int, ino)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dip->i_sb->s_dev;
+		__entry->dir = dip->i_ino;
+		__assign_str(name, name);
+		__entry->blocks = blocks;
+		__entry->indexed = indexed;
+		__entry->ino = ino;
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s blocks %d indexed %d ino %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->dir, __get_str(name),
+		  __entry->blocks, __entry->indexed, __entry->ino)
+);
+
+/*
+ * An inode or data block allocation: the goal (or -1 for none),
+ * the number of bits wanted, how many groups were searched, and
+ * the first bit and number of bits claimed. A failed allocation
+ * has got 0.
+ */
+
+TRACE_EVENT(uxfs_bitmap_alloc,
+	TP_PROTO(struct super_block *sb, int inode, unsigned long goal,
+		 unsigned long want, unsigned int groups, unsigned long bit,
+		 unsigned long got),
+
+	TP_ARGS(sb, inode, goal, want, groups, bit, got),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, inode)
+		__field(unsigned long, goal)
+		__field(unsigned long, want)
+		__field(unsigned int, groups)
+		__field(unsigned long, bit)
+		__field(unsigned long, got)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->inode = inode;
+		__entry->goal = goal;
+		__entry->want = want;
+		__entry->groups = groups;
+		__entry->bit = bit;
+		__entry->got = got;
+	),
+
+	TP_printk("dev %d,%d %s goal %ld want %lu groups %u bit %lu got %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->inode ? "inode" : "block", (long)__entry->goal,
+		  __entry->want, __entry->groups, __entry->bit, __entry->got)
+);
+
+/*
+ * A mapping of logical to physical blocks, made for iomap or
+ * for writeback. pblk is 0 for a hole or delayed allocation;
+ * "type" is the IOMAP_* type reported and "flags" the IOMAP_*
+ * flags of the request, IOMAP_WRITE among them.
+ */
+
+DECLARE_EVENT_CLASS(uxfs_map_class,
+	TP_PROTO(struct inode *inode, __u32 lblk, __u32 pblk, __u32 len,
+		 unsigned int flags, int type, int error),
+
+	TP_ARGS(inode, lblk, pblk, len, flags, type, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(__u32, lblk)
+		__field(__u32, pblk)
+		__field(__u32, len)
+		__field(unsigned int, flags)
+		__field(int, type)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->flags = flags;
+		__entry->type = type;
+		__entry->error = error;
+	),
+
+	TP_printk("dev %d,%d ino %lu lblk %u pblk %u len %u flags 0x%x "
+		  "type %d error %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->lblk, __entry->pblk,
+		  __entry->len, __entry->flags, __entry->type, __entry->error)
+);
+
+DEFINE_EVENT(uxfs_map_class, uxfs_iomap_begin,
+	TP_PROTO(struct inode *inode, __u32 lblk, __u32 pblk, __u32 len,
+		 unsigned int flags, int type, int error),
+	TP_ARGS(inode, lblk, pblk, len, flags, type, error)
+);
+
+DEFINE_EVENT(uxfs_map_class, uxfs_map_blocks,
+	TP_PROTO(struct inode *inode, __u32 lblk, __u32 pblk, __u32 len,
+		 unsigned int flags, int type, int error),
+	TP_ARGS(inode, lblk, pblk, len, flags, type, error)
+);
+
+/*
+ * An inode read from or written to its inode table block.
+ */
+
+DECLARE_EVENT_CLASS(uxfs_inode_class,
+	TP_PROTO(struct super_block *sb, unsigned long ino, sector_t block,
+		 int error),
+
+	TP_ARGS(sb, ino, block, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, block)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->block = block;
+		__entry->error = error;
+	),
+
+	TP_printk("dev %d,%d ino %lu block %llu error %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->block, __entry->error)
+);
+
+DEFINE_EVENT(uxfs_inode_class, uxfs_iget,
+	TP_PROTO(struct super_block *sb, unsigned long ino, sector_t block,
+		 int error),
+	TP_ARGS(sb, ino, block, error)
+);
+
+DEFINE_EVENT(uxfs_inode_class, uxfs_write_inode,
+	TP_PROTO(struct super_block *sb, unsigned long ino, sector_t block,
+		 int error),
+	TP_ARGS(sb, ino, block, error)
+);
+
+/*
+ * ACLs decoded from an inode's record (acl_load) or encoded and
+ * stored (acl_store). "blk" is the shared ACL block, or 0 for a
+ * record held in the inode, and "size" the record's length.
+ * A load gives the ACL_TYPE_* asked for, or both when ux_iget()
+ * decodes an inline record. A store also gives the block the
+ * inode used before.
+ */
+
+TRACE_EVENT(uxfs_acl_load,
+	TP_PROTO(struct inode *inode, int type, __u32 blk, size_t size,
+		 int error),
+
+	TP_ARGS(inode, type, blk, size, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(int, type)
+		__field(__u32, blk)
+		__field(size_t, size)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->type = type;
+		__entry->blk = blk;
+		__entry->size = size;
+		__entry->error = error;
+	),
+
+	TP_printk("dev %d,%d ino %lu type 0x%x blk %u size %zu error %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->type, __entry->blk,
+		  __entry->size, __entry->error)
+);
+
+TRACE_EVENT(uxfs_acl_store,
+	TP_PROTO(struct inode *inode, __u32 old, __u32 blk, size_t size,
+		 int error),
+
+	TP_ARGS(inode, old, blk, size, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(__u32, old)
+		__field(__u32, blk)
+		__field(size_t, size)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->old = old;
+		__entry->blk = blk;
+		__entry->size = size;
+		__entry->error = error;
+	),
+
+	TP_printk("dev %d,%d ino %lu old %u blk %u size %zu error %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->old, __entry->blk,
+		  __entry->size, __entry->error)
+);
+
+#endif /* _UX_TRACE_H */
+
+/*
+ * The module is built out of tree, so define_trace.h has to be
+ * told where to find this file; the Makefile puts the source
+ * directory on the include path.
+ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ux_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,188 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- dirindex.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Exercise the hashed directory index through libuxfs. Creates
+ * "count" files in a new directory "d" of the image, enough to
+ * push the index several levels deep, and checks that every
+ * name can be looked up and that readdir returns each of them
+ * exactly once. It then unlinks every other name and checks
+ * both again. Exits non-zero on the first mismatch; run
+ * fsck.uxfs -n over the image afterwards to check the rest.
+ *
+ * usage: dirindex image count
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cmds/libuxfs.h"
+
+static __u32            *inos;          /* inode of each name, 0 once gone */
+static unsigned char    *seen;
+static unsigned long    count;
+static int              bad;
+
+static void
+name_of(unsigned long i, char *name)
+{
+        snprintf(name, UX_NAMELEN + 1, "entry-%lu", i);
+}
+
+static int
+check_filldir(void *arg, const char *name, __u32 ino, int type, off_t pos)
+{
+        unsigned long           i;
+        char                    *end;
+
+        (void)arg;
+        (void)type;
+        (void)pos;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+                return 0;
+        }
+        if (strncmp(name, "entry-", 6) != 0) {
+                fprintf(stderr, "dirindex: readdir returned \"%s\"\n", name);
+                bad = 1;
+                return 1;
+        }
+        i = strtoul(name + 6, &end, 10);
+        if (*end || i >= count || inos[i] != ino || seen[i]) {
+                fprintf(stderr, "dirindex: readdir returned \"%s\" -> %u "
+                        "unexpectedly\n", name, ino);
+                bad = 1;
+                return 1;
+        }
+        seen[i] = 1;
+        return 0;
+}
+
+/*
+ * Check lookups and readdir against inos[].
+ */
+
+static int
+check(struct ux_fs *fs, struct ux_inode_info *dip, const char *when)
+{
+        char                    name[UX_NAMELEN + 1];
+        unsigned long           i;
+        __u32                   ino;
+        int                     error;
+
+        for (i = 0; i < count; i++) {
+                name_of(i, name);
+                ino = ux_find_entry(fs, dip, name);
+                if (ino != inos[i]) {
+                        fprintf(stderr, "dirindex: %s: \"%s\" is %u, "
+                                "should be %u\n", when, name, ino, inos[i]);
+                        return -1;
+                }
+        }
+
+        memset(seen, 0, count);
+        error = ux_readdir(fs, dip, 0, check_filldir, NULL);
+        if (error || bad) {
+                fprintf(stderr, "dirindex: %s: readdir failed (%d)\n",
+                        when, error);
+                return -1;
+        }
+        for (i = 0; i < count; i++) {
+                if (inos[i] && !seen[i]) {
+                        fprintf(stderr, "dirindex: %s: readdir missed "
+                                "entry-%lu\n", when, i);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct ux_inode_info    *root, *dip, *ip;
+        char                    name[UX_NAMELEN + 1];
+        struct ux_dx_root       *dr;
+        struct ux_buf           *bp;
+        struct ux_fs            *fs;
+        unsigned long           i;
+        int                     error, levels = -1;
+
+        if (argc != 3) {
+                fprintf(stderr, "usage: dirindex image count\n");
+                return 2;
+        }
+        count = strtoul(argv[2], NULL, 0);
+        inos = calloc(count, sizeof(__u32));
+        seen = malloc(count);
+        if (!inos || !seen) {
+                fprintf(stderr, "dirindex: Out of memory\n");
+                return 1;
+        }
+
+        fs = ux_fs_open(argv[1], 0, 0, &error);
+        if (!fs) {
+                fprintf(stderr, "dirindex: cannot open %s (%d)\n",
+                        argv[1], error);
+                return 1;
+        }
+        pthread_mutex_lock(&fs->u_lock);
+        error = ux_iget(fs, UX_ROOT_INO, &root);
+        if (!error) {
+                error = ux_mkdir(fs, root, "d", S_IFDIR | 0755, 0, 0, &dip);
+        }
+        if (error) {
+                fprintf(stderr, "dirindex: cannot make d (%d)\n", error);
+                return 1;
+        }
+
+        for (i = 0; i < count; i++) {
+                name_of(i, name);
+                error = ux_create(fs, dip, name, S_IFREG | 0644, 0, 0, &ip);
+                if (error) {
+                        fprintf(stderr, "dirindex: create \"%s\": %d\n",
+                                name, error);
+                        return 1;
+                }
+                inos[i] = ip->ui_ino;
+                ux_iput(fs, ip);
+        }
+        if (check(fs, dip, "after create") < 0) {
+                return 1;
+        }
+
+        for (i = 0; i < count; i += 2) {
+                name_of(i, name);
+                error = ux_unlink(fs, dip, name);
+                if (error) {
+                        fprintf(stderr, "dirindex: unlink \"%s\": %d\n",
+                                name, error);
+                        return 1;
+                }
+                inos[i] = 0;
+        }
+        if (check(fs, dip, "after unlink") < 0) {
+                return 1;
+        }
+
+        if (dip->ui_inode.i_flags & UX_INDEX_FL) {
+                bp = ux_bread(fs, ux_extent_bmap(fs, dip, 0), &error);
+                if (bp) {
+                        dr = (struct ux_dx_root *)bp->b_data;
+                        levels = dr->dr_levels;
+                        ux_brelse(fs, bp);
+                }
+        }
+        printf("dirindex: %lu entries in %u blocks, %d levels of index "
+               "nodes\n", count, dip->ui_inode.i_blocks, levels);
+
+        ux_iput(fs, dip);
+        ux_iput(fs, root);
+        pthread_mutex_unlock(&fs->u_lock);
+        error = ux_fs_close(fs);
+        if (error) {
+                fprintf(stderr, "dirindex: close failed (%d)\n", error);
+                return 1;
+        }
+        return 0;
+}